@@ -8,7 +8,7 @@
  * Software Foundation; either version 2 of the License, or (at your option)
  * any later version.  See COPYING for more details.
  */
-#define APIVERSION "1.8"
+#define APIVERSION "1.9"
 
 #ifdef WIN32
 # define  _WINSOCK_DEPRECATED_NO_WARNINGS
@@ -135,11 +135,14 @@ static void gpustatus(int thr_id)
 		card = device_name[gpuid];
 
 		snprintf(buf, sizeof(buf), "GPU=%d;BUS=%hd;CARD=%s;TEMP=%.1f;"
-			"POWER=%u;FAN=%hu;RPM=%hu;FREQ=%d;KHS=%.2f;HWF=%d;I=%.1f;THR=%u|",
+			"POWER=%u;FAN=%hu;RPM=%hu;FREQ=%d;KHS=%.2f;KHSEWMA=%.2f;HWF=%d;I=%.1f;THR=%u;"
+			"JSW=%u;JSWMS=%u;JSWAVG=%.1f|",
 			gpuid, cgpu->gpu_bus, card, cgpu->gpu_temp,
 			cgpu->gpu_power, cgpu->gpu_fan, cgpu->gpu_fan_rpm,
-			cgpu->gpu_clock, cgpu->khashes,
-			cgpu->hw_errors, cgpu->intensity, cgpu->throughput);
+			cgpu->gpu_clock, cgpu->khashes, stats_get_ewma(thr_id, 0.0) / 1000.0,
+			cgpu->hw_errors, cgpu->intensity, cgpu->throughput,
+			cgpu->job_switches, cgpu->job_switch_ms,
+			cgpu->job_switches ? (double) cgpu->job_switch_ms_total / cgpu->job_switches : 0.0);
 
 		// append to buffer for multi gpus
 		strcat(buffer, buf);
@@ -224,13 +227,14 @@ static char *getpoolnfo(char *params)
 	}
 
 	snprintf(s, MYBUFSIZ, "POOL=%s;ALGO=%s;URL=%s;USER=%s;SOLV=%d;ACC=%d;REJ=%d;STALE=%u;H=%u;JOB=%s;DIFF=%.6f;"
-		"BEST=%.6f;N2SZ=%d;N2=%s;PING=%u;DISCO=%u;WAIT=%u;UPTIME=%u;LAST=%u|",
+		"BEST=%.6f;N2SZ=%d;N2=%s;PING=%u;DISCO=%u;WAIT=%u;UPTIME=%u;LAST=%u;DECODE=%.2f|",
 		strlen(p->name) ? p->name : p->short_url, algo_names[p->algo],
 		p->url, p->type & POOL_STRATUM ? p->user : "",
 		p->solved_count, p->accepted_count, p->rejected_count, p->stales_count,
 		stratum.job.height, jobid, stratum_diff, p->best_share,
 		(int) stratum.xnonce2_size, extra, stratum.answer_msec,
-		p->disconnects, p->wait_time, p->work_time, last_share);
+		p->disconnects, p->wait_time, p->work_time, last_share,
+		p->type & POOL_STRATUM ? 0. : gbt_decode_ms);
 
 	return s;
 }
@@ -381,16 +385,43 @@ static char *getscanlog(char *params)
  */
 static char *getmeminfo(char *params)
 {
-	uint64_t smem, hmem, totmem;
-	uint32_t srec, hrec;
+	uint64_t smem, hmem, amem, totmem;
+	uint32_t srec, hrec, achunks, aused, ahuge;
 
 	stats_getmeminfo(&smem, &srec);
 	hashlog_getmeminfo(&hmem, &hrec);
-	totmem = smem + hmem;
+	mtp_arena_getmeminfo(&amem, &achunks, &aused, &ahuge);
+	totmem = smem + hmem + amem;
 
 	*buffer = '\0';
-	sprintf(buffer, "STATS=%u;HASHLOG=%u;MEM=%lu|",
-		srec, hrec, totmem);
+	sprintf(buffer, "STATS=%u;HASHLOG=%u;MEM=%lu|"
+		"ARENA=%u;ARENAUSED=%u;ARENAHUGE=%u;ARENAMEM=%lu|",
+		srec, hrec, totmem, achunks, aused, ahuge, amem);
+
+	return buffer;
+}
+
+/**
+ * Thread queues: entries waiting, highest depth and average time in queue
+ */
+static char *getqueues(char *params)
+{
+	static const char *names[] = { "workio", "longpoll", "stratum", "api", "submit" };
+	// the submit threads share the queue of the first one
+	int count = submit_thr_id >= 0 ? submit_thr_id + 1 : opt_n_threads + 4;
+	char *s = buffer;
+
+	*buffer = '\0';
+	for (int i = 0; i < count && (s - buffer) < MYBUFSIZ - 160; i++) {
+		struct tq_stats st;
+		if (!thr_info[i].q)
+			continue;
+		tq_getstats(thr_info[i].q, &st);
+		s += sprintf(s, "THR=%d;NAME=%s;DEPTH=%u;MAXDEPTH=%u;SIZE=%u;PUSHED=%llu;WAIT=%.3f|",
+			i, i < opt_n_threads ? "gpu" : names[i - opt_n_threads],
+			st.depth, st.max_depth, st.size, (unsigned long long) st.pushed,
+			st.popped ? (double) st.wait_us / st.popped / 1000. : 0.0);
+	}
 
 	return buffer;
 }
@@ -476,6 +507,7 @@ struct CMDS {
 	{ "histo",   gethistory },
 	{ "hwinfo",  gethwinfos },
 	{ "meminfo", getmeminfo },
+	{ "queues",  getqueues },
 	{ "scanlog", getscanlog },
 
 	/* remote functions */
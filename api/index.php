@@ -56,6 +56,9 @@ function translateField($key)
 	$intl['TS'] = 'Last update';
 	$intl['THR'] = 'Throughput';
 	$intl['WAIT'] = 'Wait time';
+	$intl['JSW'] = 'Job switches';
+	$intl['JSWMS'] = 'Switch dead time (ms)';
+	$intl['JSWAVG'] = 'Avg. dead time (ms)';
 
 	$intl['H'] = 'Bloc height';
 	$intl['I'] = 'Intensity';
@@ -87,6 +87,24 @@ int ablake2b_long(void * pout, size_t outlen, const void * in, size_t inlen);
 
 
 int ablake2b_long2(void * pout, size_t outlen, const void * in, size_t inlen);
+
+/* Fixed size 4-round API (Merkle tree nodes): 32 bytes in, 16 bytes out */
+void blake2b4r_32to16(void *out, const void *in);
+/* 2 (SSE2) or 4 (AVX2) contiguous inputs at once, x86_64 only */
+void blake2b4r_32to16_x2(void *out, const void *in);
+void blake2b4r_32to16_x4(void *out, const void *in);
+/* n contiguous inputs, using the widest lanes the cpu supports */
+void blake2b4r_32to16_n(void *out, const void *in, size_t n);
+/* lane width picked by the _n functions (1, 2 or 4) */
+int blake2b4r_lanes(void);
+/* 4 rounds, 1024 bytes in (an Argon2 block), 16 bytes out (Merkle tree leaves) */
+void blake2b4r_1024to16(void *out, const void *in);
+/* 2 or 4 blocks at once, x86_64 only, outputs are contiguous */
+void blake2b4r_1024to16_x2(void *out, const void *const in[2]);
+void blake2b4r_1024to16_x4(void *out, const void *const in[4]);
+void blake2b4r_1024to16_n(void *out, const void *const *in, size_t n);
+/* 12 rounds, Blake2b-256 of y (32 bytes) followed by block (1024 bytes) */
+void blake2b_1056to32(void *out, const void *y, const void *block);
 /* Simple API */
 int blake2b(void *out, size_t outlen, const void *in, size_t inlen,
             const void *key, size_t keylen);
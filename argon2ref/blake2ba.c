@@ -850,4 +850,399 @@ fail:
 }
 
 
-//#undef TRY
\ No newline at end of file
+//#undef TRY
+/*
+ * Fixed size Blake2b used by MTP
+ *
+ * 4 rounds, 32 bytes in, 16 bytes out (Merkle tree nodes): the message only
+ * has 4 non-zero words and the counter/flags are known, so the whole hash is
+ * a single compression without any state bookkeeping.
+ * 4 rounds, 1024 bytes in, 16 bytes out (Merkle tree leaves, one per block).
+ * 12 rounds, 32 + 1024 bytes in, 32 bytes out (the Y[j] chain of the solver).
+ * The multi-lane versions keep word i of 2 (SSE2) or 4 (AVX2) independent
+ * messages in one register.
+ */
+
+/* IV[0] xored with the parameter block: digest 16, fanout 1, depth 1 */
+#define B4R_H0_32TO16 (UINT64_C(0x6a09e667f3bcc908) ^ UINT64_C(0x01010010))
+
+#define B4R_G(r, i, a, b, c, d) \
+    do { \
+        a = ADD(ADD(a, b), m[ablake2b_sigma[r][2 * i + 0]]); \
+        d = ROR32(XOR(d, a)); \
+        c = ADD(c, d); \
+        b = ROR24(XOR(b, c)); \
+        a = ADD(ADD(a, b), m[ablake2b_sigma[r][2 * i + 1]]); \
+        d = ROR16(XOR(d, a)); \
+        c = ADD(c, d); \
+        b = ROR63(XOR(b, c)); \
+    } while ((void)0, 0)
+
+#define B4R_ROUND(r) \
+    do { \
+        B4R_G(r, 0, v[0], v[4], v[8], v[12]); \
+        B4R_G(r, 1, v[1], v[5], v[9], v[13]); \
+        B4R_G(r, 2, v[2], v[6], v[10], v[14]); \
+        B4R_G(r, 3, v[3], v[7], v[11], v[15]); \
+        B4R_G(r, 4, v[0], v[5], v[10], v[15]); \
+        B4R_G(r, 5, v[1], v[6], v[11], v[12]); \
+        B4R_G(r, 6, v[2], v[7], v[8], v[13]); \
+        B4R_G(r, 7, v[3], v[4], v[9], v[14]); \
+    } while ((void)0, 0)
+
+/* v[] setup shared by all lane widths, m[0..3] being loaded by the caller */
+#define B4R_INIT_32TO16() \
+    do { \
+        int k; \
+        for (k = 4; k < 16; k++) m[k] = SET1(0); \
+        v[0] = SET1(B4R_H0_32TO16); \
+        for (k = 1; k < 8; k++) v[k] = SET1(ablake2b_IV[k]); \
+        for (k = 0; k < 4; k++) v[8 + k] = SET1(ablake2b_IV[k]); \
+        v[12] = SET1(ablake2b_IV[4] ^ 32); \
+        v[13] = SET1(ablake2b_IV[5]); \
+        v[14] = SET1(~ablake2b_IV[6]); \
+        v[15] = SET1(ablake2b_IV[7]); \
+    } while ((void)0, 0)
+
+/* 4-round compression of m[] into the chain value h[], t bytes hashed so far */
+#define B4R_COMPRESS(t, last) \
+    do { \
+        int k; \
+        for (k = 0; k < 8; k++) v[k] = h[k]; \
+        for (k = 0; k < 4; k++) v[8 + k] = SET1(ablake2b_IV[k]); \
+        v[12] = SET1(ablake2b_IV[4] ^ (t)); \
+        v[13] = SET1(ablake2b_IV[5]); \
+        v[14] = SET1((last) ? ~ablake2b_IV[6] : ablake2b_IV[6]); \
+        v[15] = SET1(ablake2b_IV[7]); \
+        B4R_ROUND(0); \
+        B4R_ROUND(1); \
+        B4R_ROUND(2); \
+        B4R_ROUND(3); \
+        for (k = 0; k < 8; k++) h[k] = XOR(h[k], XOR(v[k], v[k + 8])); \
+    } while ((void)0, 0)
+
+#define B4R_INIT_1024TO16() \
+    do { \
+        int k; \
+        h[0] = SET1(B4R_H0_32TO16); \
+        for (k = 1; k < 8; k++) h[k] = SET1(ablake2b_IV[k]); \
+    } while ((void)0, 0)
+
+#define ADD(a, b) ((a) + (b))
+#define XOR(a, b) ((a) ^ (b))
+#define ROR32(x) rotr64(x, 32)
+#define ROR24(x) rotr64(x, 24)
+#define ROR16(x) rotr64(x, 16)
+#define ROR63(x) rotr64(x, 63)
+#define SET1(x) ((uint64_t)(x))
+
+void blake2b4r_32to16(void *out, const void *in)
+{
+    const uint8_t *pin = (const uint8_t *)in;
+    uint8_t *pout = (uint8_t *)out;
+    uint64_t m[16], v[16];
+
+    m[0] = load64(pin + 0);
+    m[1] = load64(pin + 8);
+    m[2] = load64(pin + 16);
+    m[3] = load64(pin + 24);
+    B4R_INIT_32TO16();
+
+    B4R_ROUND(0);
+    B4R_ROUND(1);
+    B4R_ROUND(2);
+    B4R_ROUND(3);
+
+    store64(pout + 0, B4R_H0_32TO16 ^ v[0] ^ v[8]);
+    store64(pout + 8, ablake2b_IV[1] ^ v[1] ^ v[9]);
+}
+
+void blake2b4r_1024to16(void *out, const void *in)
+{
+    const uint8_t *pin = (const uint8_t *)in;
+    uint8_t *pout = (uint8_t *)out;
+    ablake2b_state S;
+    int b;
+
+    ablake2b_init(&S, 16);
+    for (b = 0; b < 8; b++) {
+        ablake2b_increment_counter(&S, ablake2b_BLOCKBYTES);
+        if (b == 7)
+            ablake2b_set_lastblock(&S);
+        ablake2b4rounds_compress(&S, pin + ablake2b_BLOCKBYTES * b);
+    }
+
+    store64(pout + 0, S.h[0]);
+    store64(pout + 8, S.h[1]);
+}
+
+void blake2b_1056to32(void *out, const void *y, const void *block)
+{
+    const uint8_t *pblock = (const uint8_t *)block;
+    uint8_t *pout = (uint8_t *)out;
+    uint8_t buf[ablake2b_BLOCKBYTES];
+    ablake2b_state S;
+    int b;
+
+    ablake2b_init(&S, 32);
+
+    /* the 32 bytes of y shift the block by a quarter of a message block */
+    memcpy(buf, y, 32);
+    memcpy(buf + 32, pblock, ablake2b_BLOCKBYTES - 32);
+    ablake2b_increment_counter(&S, ablake2b_BLOCKBYTES);
+    ablake2b_compress(&S, buf);
+    for (b = 1; b < 8; b++) {
+        ablake2b_increment_counter(&S, ablake2b_BLOCKBYTES);
+        ablake2b_compress(&S, pblock + ablake2b_BLOCKBYTES * b - 32);
+    }
+
+    memcpy(buf, pblock + 1024 - 32, 32);
+    memset(buf + 32, 0, ablake2b_BLOCKBYTES - 32);
+    ablake2b_increment_counter(&S, 32);
+    ablake2b_set_lastblock(&S);
+    ablake2b_compress(&S, buf);
+
+    for (b = 0; b < 4; b++)
+        store64(pout + 8 * b, S.h[b]);
+}
+
+#undef ADD
+#undef XOR
+#undef ROR32
+#undef ROR24
+#undef ROR16
+#undef ROR63
+#undef SET1
+
+#if defined(__x86_64__) || defined(_M_X64)
+
+#define ADD(a, b) _mm_add_epi64(a, b)
+#define XOR(a, b) _mm_xor_si128(a, b)
+#define ROR32(x) _mm_shuffle_epi32(x, _MM_SHUFFLE(2, 3, 0, 1))
+#define ROR24(x) _mm_xor_si128(_mm_srli_epi64(x, 24), _mm_slli_epi64(x, 40))
+#define ROR16(x) _mm_xor_si128(_mm_srli_epi64(x, 16), _mm_slli_epi64(x, 48))
+#define ROR63(x) _mm_xor_si128(_mm_srli_epi64(x, 63), _mm_add_epi64(x, x))
+#define SET1(x) _mm_set1_epi64x((int64_t)(x))
+
+void blake2b4r_32to16_x2(void *out, const void *in)
+{
+    const uint8_t *pin = (const uint8_t *)in;
+    uint8_t *pout = (uint8_t *)out;
+    __m128i m[16], v[16];
+    int k;
+
+    for (k = 0; k < 4; k++)
+        m[k] = _mm_set_epi64x((int64_t)load64(pin + 32 + 8 * k),
+            (int64_t)load64(pin + 8 * k));
+    B4R_INIT_32TO16();
+
+    B4R_ROUND(0);
+    B4R_ROUND(1);
+    B4R_ROUND(2);
+    B4R_ROUND(3);
+
+    {
+        const __m128i h0 = XOR(SET1(B4R_H0_32TO16), XOR(v[0], v[8]));
+        const __m128i h1 = XOR(SET1(ablake2b_IV[1]), XOR(v[1], v[9]));
+        _mm_storeu_si128((__m128i *)(pout + 0), _mm_unpacklo_epi64(h0, h1));
+        _mm_storeu_si128((__m128i *)(pout + 16), _mm_unpackhi_epi64(h0, h1));
+    }
+}
+
+void blake2b4r_1024to16_x2(void *out, const void *const in[2])
+{
+    const uint8_t *p0 = (const uint8_t *)in[0];
+    const uint8_t *p1 = (const uint8_t *)in[1];
+    uint8_t *pout = (uint8_t *)out;
+    __m128i h[8], m[16], v[16];
+    int b, k;
+
+    B4R_INIT_1024TO16();
+    for (b = 0; b < 8; b++) {
+        for (k = 0; k < 16; k++)
+            m[k] = _mm_set_epi64x((int64_t)load64(p1 + 8 * k), (int64_t)load64(p0 + 8 * k));
+        B4R_COMPRESS(ablake2b_BLOCKBYTES * (b + 1), b == 7);
+        p0 += ablake2b_BLOCKBYTES;
+        p1 += ablake2b_BLOCKBYTES;
+    }
+
+    _mm_storeu_si128((__m128i *)(pout + 0), _mm_unpacklo_epi64(h[0], h[1]));
+    _mm_storeu_si128((__m128i *)(pout + 16), _mm_unpackhi_epi64(h[0], h[1]));
+}
+
+#undef ADD
+#undef XOR
+#undef ROR32
+#undef ROR24
+#undef ROR16
+#undef ROR63
+#undef SET1
+
+#if defined(__GNUC__) || defined(__clang__)
+#define B4R_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define B4R_TARGET_AVX2
+#endif
+
+#define ADD(a, b) _mm256_add_epi64(a, b)
+#define XOR(a, b) _mm256_xor_si256(a, b)
+#define ROR32(x) _mm256_shuffle_epi32(x, _MM_SHUFFLE(2, 3, 0, 1))
+#define ROR24(x) _mm256_shuffle_epi8(x, r24)
+#define ROR16(x) _mm256_shuffle_epi8(x, r16)
+#define ROR63(x) _mm256_xor_si256(_mm256_srli_epi64(x, 63), _mm256_add_epi64(x, x))
+#define SET1(x) _mm256_set1_epi64x((int64_t)(x))
+
+B4R_TARGET_AVX2 void blake2b4r_32to16_x4(void *out, const void *in)
+{
+    const uint8_t *pin = (const uint8_t *)in;
+    uint8_t *pout = (uint8_t *)out;
+    const __m256i r16 = _mm256_setr_epi8(
+        2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9,
+        2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9);
+    const __m256i r24 = _mm256_setr_epi8(
+        3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10,
+        3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10);
+    __m256i m[16], v[16];
+    int k;
+
+    for (k = 0; k < 4; k++)
+        m[k] = _mm256_set_epi64x((int64_t)load64(pin + 96 + 8 * k),
+            (int64_t)load64(pin + 64 + 8 * k),
+            (int64_t)load64(pin + 32 + 8 * k),
+            (int64_t)load64(pin + 8 * k));
+    B4R_INIT_32TO16();
+
+    B4R_ROUND(0);
+    B4R_ROUND(1);
+    B4R_ROUND(2);
+    B4R_ROUND(3);
+
+    {
+        const __m256i h0 = XOR(SET1(B4R_H0_32TO16), XOR(v[0], v[8]));
+        const __m256i h1 = XOR(SET1(ablake2b_IV[1]), XOR(v[1], v[9]));
+        /* lanes 0/2 and 1/3 come out of the unpacks, fix the order */
+        const __m256i lo = _mm256_unpacklo_epi64(h0, h1);
+        const __m256i hi = _mm256_unpackhi_epi64(h0, h1);
+        _mm256_storeu_si256((__m256i *)(pout + 0), _mm256_permute2x128_si256(lo, hi, 0x20));
+        _mm256_storeu_si256((__m256i *)(pout + 32), _mm256_permute2x128_si256(lo, hi, 0x31));
+    }
+}
+
+B4R_TARGET_AVX2 void blake2b4r_1024to16_x4(void *out, const void *const in[4])
+{
+    const uint8_t *p0 = (const uint8_t *)in[0];
+    const uint8_t *p1 = (const uint8_t *)in[1];
+    const uint8_t *p2 = (const uint8_t *)in[2];
+    const uint8_t *p3 = (const uint8_t *)in[3];
+    uint8_t *pout = (uint8_t *)out;
+    const __m256i r16 = _mm256_setr_epi8(
+        2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9,
+        2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9);
+    const __m256i r24 = _mm256_setr_epi8(
+        3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10,
+        3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10);
+    __m256i h[8], m[16], v[16];
+    int b, k;
+
+    B4R_INIT_1024TO16();
+    for (b = 0; b < 8; b++) {
+        for (k = 0; k < 16; k++)
+            m[k] = _mm256_set_epi64x((int64_t)load64(p3 + 8 * k), (int64_t)load64(p2 + 8 * k),
+                (int64_t)load64(p1 + 8 * k), (int64_t)load64(p0 + 8 * k));
+        B4R_COMPRESS(ablake2b_BLOCKBYTES * (b + 1), b == 7);
+        p0 += ablake2b_BLOCKBYTES;
+        p1 += ablake2b_BLOCKBYTES;
+        p2 += ablake2b_BLOCKBYTES;
+        p3 += ablake2b_BLOCKBYTES;
+    }
+
+    {
+        const __m256i lo = _mm256_unpacklo_epi64(h[0], h[1]);
+        const __m256i hi = _mm256_unpackhi_epi64(h[0], h[1]);
+        _mm256_storeu_si256((__m256i *)(pout + 0), _mm256_permute2x128_si256(lo, hi, 0x20));
+        _mm256_storeu_si256((__m256i *)(pout + 32), _mm256_permute2x128_si256(lo, hi, 0x31));
+    }
+}
+
+#undef ADD
+#undef XOR
+#undef ROR32
+#undef ROR24
+#undef ROR16
+#undef ROR63
+#undef SET1
+
+static int blake2b_cpu_has_avx2(void)
+{
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    /* OSXSAVE and AVX, then the OS must save the ymm registers */
+    if ((info[2] & (1 << 27)) == 0 || (info[2] & (1 << 28)) == 0)
+        return 0;
+    if ((_xgetbv(0) & 6) != 6)
+        return 0;
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#elif defined(__GNUC__) || defined(__clang__)
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#else
+    return 0;
+#endif
+}
+
+#endif /* x86_64 */
+
+#undef B4R_INIT_1024TO16
+#undef B4R_COMPRESS
+#undef B4R_INIT_32TO16
+#undef B4R_ROUND
+#undef B4R_G
+
+int blake2b4r_lanes(void)
+{
+#if defined(__x86_64__) || defined(_M_X64)
+    static int lanes = 0;
+    if (!lanes)
+        lanes = blake2b_cpu_has_avx2() ? 4 : 2;
+    return lanes;
+#else
+    return 1;
+#endif
+}
+
+void blake2b4r_32to16_n(void *out, const void *in, size_t n)
+{
+    const uint8_t *pin = (const uint8_t *)in;
+    uint8_t *pout = (uint8_t *)out;
+    size_t i = 0;
+
+#if defined(__x86_64__) || defined(_M_X64)
+    if (blake2b4r_lanes() == 4) {
+        for (; i + 4 <= n; i += 4)
+            blake2b4r_32to16_x4(pout + 16 * i, pin + 32 * i);
+    }
+    for (; i + 2 <= n; i += 2)
+        blake2b4r_32to16_x2(pout + 16 * i, pin + 32 * i);
+#endif
+    for (; i < n; i++)
+        blake2b4r_32to16(pout + 16 * i, pin + 32 * i);
+}
+
+void blake2b4r_1024to16_n(void *out, const void *const *in, size_t n)
+{
+    uint8_t *pout = (uint8_t *)out;
+    size_t i = 0;
+
+#if defined(__x86_64__) || defined(_M_X64)
+    if (blake2b4r_lanes() == 4) {
+        for (; i + 4 <= n; i += 4)
+            blake2b4r_1024to16_x4(pout + 16 * i, in + i);
+    }
+    for (; i + 2 <= n; i += 2)
+        blake2b4r_1024to16_x2(pout + 16 * i, in + i);
+#endif
+    for (; i < n; i++)
+        blake2b4r_1024to16(pout + 16 * i, in[i]);
+}
@@ -280,6 +280,18 @@ static void *fill_segment_thr(void *thread_data)
     return 0;
 }
 
+#ifdef _WIN32
+static unsigned __stdcall fill_segment_mtp_thr(void *thread_data)
+#else
+static void *fill_segment_mtp_thr(void *thread_data)
+#endif
+{
+    argon2_thread_data *my_data = thread_data;
+    fill_segment_mtp(my_data->instance_ptr, my_data->pos);
+    argon2_thread_exit();
+    return 0;
+}
+
 /* Multi-threaded version for p > 1 case */
 static int fill_memory_blocks_mt(argon2_instance_t *instance) {
     uint32_t r, s;
@@ -422,7 +434,7 @@ int fill_memory_blocks_mtp(argon2_instance_t *instance) {
 				position.index = 0;
 				thr_data[l].instance_ptr = instance; /* preparing the thread input */
 				memcpy(&(thr_data[l].pos), &position, sizeof(argon2_position_t));
-				if (argon2_thread_create(&thread[l], &fill_segment_thr, (void *)&thr_data[l])) {
+				if (argon2_thread_create(&thread[l], &fill_segment_mtp_thr, (void *)&thr_data[l])) {
 					rc = ARGON2_THREAD_FAIL;
 					goto fail;
 				}
@@ -231,6 +231,10 @@ void finalize(const argon2_context *context, argon2_instance_t *instance);
 void fill_segment(const argon2_instance_t *instance,
                   argon2_position_t position);
 
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
 /*
  * Function that fills the entire memory t_cost times based on the first two
  * blocks in each lane
@@ -239,8 +243,35 @@ void fill_segment(const argon2_instance_t *instance,
  */
 int fill_memory_blocks(argon2_instance_t *instance);
 
+/*
+ * Function that fills the MTP memory (first pass of argon2d with the block
+ * index and header mixed in, as the gpu does) with the SIMD blocks of opt.c,
+ * one thread per lane up to @instance->threads
+ * @param instance Pointer to the current instance, memory holds all the blocks
+ * @return ARGON2_OK if successful
+ */
 int fill_memory_blocks_mtp(argon2_instance_t *instance);
 
+/*
+ * SIMD MTP version of fill_segment
+ */
+void fill_segment_mtp(const argon2_instance_t *instance,
+                      argon2_position_t position);
+
+/*
+ * Function that computes a single MTP block from its previous and reference
+ * blocks (first pass)
+ * @param block_header The 8 words of the instance block header
+ * @param ref_index Absolute index of @ref_block
+ */
+void fill_block_mtp(const block *prev_block, const block *ref_block,
+                    block *next_block, const uint32_t block_header[8],
+                    uint32_t ref_index);
+
+#if defined(__cplusplus)
+}
+#endif
+
 
 
 #endif
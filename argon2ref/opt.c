@@ -0,0 +1,371 @@
+/*
+ * Argon2 reference source code package - reference C implementations
+ *
+ * Copyright 2015
+ * Daniel Dinu, Dmitry Khovratovich, Jean-Philippe Aumasson, and Samuel Neves
+ *
+ * You may use this work under the terms of a Creative Commons CC0 1.0
+ * License/Waiver or the Apache Public License 2.0, at your option. The terms of
+ * these licenses can be found at:
+ *
+ * - CC0 1.0 Universal : http://creativecommons.org/publicdomain/zero/1.0
+ * - Apache 2.0        : http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * You should have received a copy of both of these licenses along with this
+ * software. If not, they may be obtained at the above URLs.
+ */
+
+/*
+ * SIMD version of the MTP memory fill: the same blocks as ref.c
+ * fill_segment (and the gpu), with the previous block kept in registers
+ * from one block to the next.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "argon2ref/argon2.h"
+#include "argon2ref/core.h"
+#include "argon2ref/blake2.h"
+
+#include "argon2ref/blamka-round-opt.h"
+#include "argon2ref/blake2-impl.h"
+
+#if defined(__x86_64__) || defined(_M_X64)
+#include <immintrin.h>
+#define FILL_HAVE_AVX2 1
+#endif
+
+#define ARGON2_HWORDS_IN_BLOCK (ARGON2_BLOCK_SIZE / 32)
+
+/*
+ * state holds the previous block on input and the new block on output.
+ * Before the rounds, word 14 gets the reference block index and words
+ * 16..19 the block header, the xor keeps the untouched ref ^ prev.
+ */
+static void fill_block_sse(__m128i *state, const block *ref_block,
+                           block *next_block, int with_xor,
+                           const uint32_t *block_header, uint32_t ref_index) {
+    __m128i block_XY[ARGON2_OWORDS_IN_BLOCK];
+    uint64_t index = (uint64_t)ref_index << 32;
+    unsigned int i;
+
+    if (with_xor) {
+        for (i = 0; i < ARGON2_OWORDS_IN_BLOCK; i++) {
+            state[i] = _mm_xor_si128(
+                state[i], _mm_loadu_si128((const __m128i *)ref_block->v + i));
+            block_XY[i] = _mm_xor_si128(
+                state[i], _mm_loadu_si128((const __m128i *)next_block->v + i));
+        }
+    } else {
+        for (i = 0; i < ARGON2_OWORDS_IN_BLOCK; i++) {
+            block_XY[i] = state[i] = _mm_xor_si128(
+                state[i], _mm_loadu_si128((const __m128i *)ref_block->v + i));
+        }
+    }
+
+    memcpy(&state[7], &index, sizeof(uint64_t));
+    memcpy(&state[8], block_header, 2 * sizeof(__m128i));
+
+    for (i = 0; i < 8; ++i) {
+        BLAKE2_ROUND(state[8 * i + 0], state[8 * i + 1], state[8 * i + 2],
+                     state[8 * i + 3], state[8 * i + 4], state[8 * i + 5],
+                     state[8 * i + 6], state[8 * i + 7]);
+    }
+
+    for (i = 0; i < 8; ++i) {
+        BLAKE2_ROUND(state[8 * 0 + i], state[8 * 1 + i], state[8 * 2 + i],
+                     state[8 * 3 + i], state[8 * 4 + i], state[8 * 5 + i],
+                     state[8 * 6 + i], state[8 * 7 + i]);
+    }
+
+    for (i = 0; i < ARGON2_OWORDS_IN_BLOCK; i++) {
+        state[i] = _mm_xor_si128(state[i], block_XY[i]);
+        _mm_storeu_si128((__m128i *)next_block->v + i, state[i]);
+    }
+}
+
+#ifdef FILL_HAVE_AVX2
+
+#if defined(__GNUC__) || defined(__clang__)
+#define FILL_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define FILL_TARGET_AVX2
+#endif
+
+#define ROTR32(x) _mm256_shuffle_epi32(x, _MM_SHUFFLE(2, 3, 0, 1))
+#define ROTR24(x) _mm256_shuffle_epi8(x, rot24)
+#define ROTR16(x) _mm256_shuffle_epi8(x, rot16)
+#define ROTR63(x) _mm256_xor_si256(_mm256_srli_epi64(x, 63), _mm256_add_epi64(x, x))
+
+#define BLAMKA(x, y) \
+    _mm256_add_epi64(_mm256_add_epi64(x, y), \
+        _mm256_add_epi64(_mm256_mul_epu32(x, y), _mm256_mul_epu32(x, y)))
+
+#define G1_AVX2(A0, A1, B0, B1, C0, C1, D0, D1)                                \
+    do {                                                                       \
+        A0 = BLAMKA(A0, B0);                                                   \
+        A1 = BLAMKA(A1, B1);                                                   \
+        D0 = ROTR32(_mm256_xor_si256(D0, A0));                                 \
+        D1 = ROTR32(_mm256_xor_si256(D1, A1));                                 \
+        C0 = BLAMKA(C0, D0);                                                   \
+        C1 = BLAMKA(C1, D1);                                                   \
+        B0 = ROTR24(_mm256_xor_si256(B0, C0));                                 \
+        B1 = ROTR24(_mm256_xor_si256(B1, C1));                                 \
+    } while ((void)0, 0)
+
+#define G2_AVX2(A0, A1, B0, B1, C0, C1, D0, D1)                                \
+    do {                                                                       \
+        A0 = BLAMKA(A0, B0);                                                   \
+        A1 = BLAMKA(A1, B1);                                                   \
+        D0 = ROTR16(_mm256_xor_si256(D0, A0));                                 \
+        D1 = ROTR16(_mm256_xor_si256(D1, A1));                                 \
+        C0 = BLAMKA(C0, D0);                                                   \
+        C1 = BLAMKA(C1, D1);                                                   \
+        B0 = ROTR63(_mm256_xor_si256(B0, C0));                                 \
+        B1 = ROTR63(_mm256_xor_si256(B1, C1));                                 \
+    } while ((void)0, 0)
+
+/* two independent rounds, each register holds one full row of 4 words */
+#define DIAGONALIZE_1(A0, B0, C0, D0, A1, B1, C1, D1)                          \
+    do {                                                                       \
+        B0 = _mm256_permute4x64_epi64(B0, _MM_SHUFFLE(0, 3, 2, 1));            \
+        C0 = _mm256_permute4x64_epi64(C0, _MM_SHUFFLE(1, 0, 3, 2));            \
+        D0 = _mm256_permute4x64_epi64(D0, _MM_SHUFFLE(2, 1, 0, 3));            \
+        B1 = _mm256_permute4x64_epi64(B1, _MM_SHUFFLE(0, 3, 2, 1));            \
+        C1 = _mm256_permute4x64_epi64(C1, _MM_SHUFFLE(1, 0, 3, 2));            \
+        D1 = _mm256_permute4x64_epi64(D1, _MM_SHUFFLE(2, 1, 0, 3));            \
+    } while ((void)0, 0)
+
+#define UNDIAGONALIZE_1(A0, B0, C0, D0, A1, B1, C1, D1)                        \
+    do {                                                                       \
+        B0 = _mm256_permute4x64_epi64(B0, _MM_SHUFFLE(2, 1, 0, 3));            \
+        C0 = _mm256_permute4x64_epi64(C0, _MM_SHUFFLE(1, 0, 3, 2));            \
+        D0 = _mm256_permute4x64_epi64(D0, _MM_SHUFFLE(0, 3, 2, 1));            \
+        B1 = _mm256_permute4x64_epi64(B1, _MM_SHUFFLE(2, 1, 0, 3));            \
+        C1 = _mm256_permute4x64_epi64(C1, _MM_SHUFFLE(1, 0, 3, 2));            \
+        D1 = _mm256_permute4x64_epi64(D1, _MM_SHUFFLE(0, 3, 2, 1));            \
+    } while ((void)0, 0)
+
+/* two rounds sharing registers, the low and high halves belong to each one */
+#define DIAGONALIZE_2(A0, A1, B0, B1, C0, C1, D0, D1)                          \
+    do {                                                                       \
+        __m256i t0 = _mm256_blend_epi32(B0, B1, 0xCC);                         \
+        __m256i t1 = _mm256_blend_epi32(B0, B1, 0x33);                         \
+        B1 = _mm256_permute4x64_epi64(t0, _MM_SHUFFLE(2, 3, 0, 1));            \
+        B0 = _mm256_permute4x64_epi64(t1, _MM_SHUFFLE(2, 3, 0, 1));            \
+        t0 = C0;                                                               \
+        C0 = C1;                                                               \
+        C1 = t0;                                                               \
+        t0 = _mm256_blend_epi32(D0, D1, 0xCC);                                 \
+        t1 = _mm256_blend_epi32(D0, D1, 0x33);                                 \
+        D0 = _mm256_permute4x64_epi64(t0, _MM_SHUFFLE(2, 3, 0, 1));            \
+        D1 = _mm256_permute4x64_epi64(t1, _MM_SHUFFLE(2, 3, 0, 1));            \
+    } while ((void)0, 0)
+
+#define UNDIAGONALIZE_2(A0, A1, B0, B1, C0, C1, D0, D1)                        \
+    do {                                                                       \
+        __m256i t0 = _mm256_blend_epi32(B0, B1, 0xCC);                         \
+        __m256i t1 = _mm256_blend_epi32(B0, B1, 0x33);                         \
+        B0 = _mm256_permute4x64_epi64(t0, _MM_SHUFFLE(2, 3, 0, 1));            \
+        B1 = _mm256_permute4x64_epi64(t1, _MM_SHUFFLE(2, 3, 0, 1));            \
+        t0 = C0;                                                               \
+        C0 = C1;                                                               \
+        C1 = t0;                                                               \
+        t0 = _mm256_blend_epi32(D0, D1, 0x33);                                 \
+        t1 = _mm256_blend_epi32(D0, D1, 0xCC);                                 \
+        D0 = _mm256_permute4x64_epi64(t0, _MM_SHUFFLE(2, 3, 0, 1));            \
+        D1 = _mm256_permute4x64_epi64(t1, _MM_SHUFFLE(2, 3, 0, 1));            \
+    } while ((void)0, 0)
+
+#define BLAKE2_ROUND_1(A0, A1, B0, B1, C0, C1, D0, D1)                         \
+    do {                                                                       \
+        G1_AVX2(A0, A1, B0, B1, C0, C1, D0, D1);                               \
+        G2_AVX2(A0, A1, B0, B1, C0, C1, D0, D1);                               \
+        DIAGONALIZE_1(A0, B0, C0, D0, A1, B1, C1, D1);                         \
+        G1_AVX2(A0, A1, B0, B1, C0, C1, D0, D1);                               \
+        G2_AVX2(A0, A1, B0, B1, C0, C1, D0, D1);                               \
+        UNDIAGONALIZE_1(A0, B0, C0, D0, A1, B1, C1, D1);                       \
+    } while ((void)0, 0)
+
+#define BLAKE2_ROUND_2(A0, A1, B0, B1, C0, C1, D0, D1)                         \
+    do {                                                                       \
+        G1_AVX2(A0, A1, B0, B1, C0, C1, D0, D1);                               \
+        G2_AVX2(A0, A1, B0, B1, C0, C1, D0, D1);                               \
+        DIAGONALIZE_2(A0, A1, B0, B1, C0, C1, D0, D1);                         \
+        G1_AVX2(A0, A1, B0, B1, C0, C1, D0, D1);                               \
+        G2_AVX2(A0, A1, B0, B1, C0, C1, D0, D1);                               \
+        UNDIAGONALIZE_2(A0, A1, B0, B1, C0, C1, D0, D1);                       \
+    } while ((void)0, 0)
+
+FILL_TARGET_AVX2 static void fill_block_avx2(__m256i *state,
+                                             const block *ref_block,
+                                             block *next_block, int with_xor,
+                                             const uint32_t *block_header,
+                                             uint32_t ref_index) {
+    const __m256i rot16 = _mm256_setr_epi8(
+        2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9,
+        2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9);
+    const __m256i rot24 = _mm256_setr_epi8(
+        3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10,
+        3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10);
+    __m256i block_XY[ARGON2_HWORDS_IN_BLOCK];
+    uint64_t index = (uint64_t)ref_index << 32;
+    unsigned int i;
+
+    if (with_xor) {
+        for (i = 0; i < ARGON2_HWORDS_IN_BLOCK; i++) {
+            state[i] = _mm256_xor_si256(
+                state[i], _mm256_loadu_si256((const __m256i *)ref_block->v + i));
+            block_XY[i] = _mm256_xor_si256(
+                state[i], _mm256_loadu_si256((const __m256i *)next_block->v + i));
+        }
+    } else {
+        for (i = 0; i < ARGON2_HWORDS_IN_BLOCK; i++) {
+            block_XY[i] = state[i] = _mm256_xor_si256(
+                state[i], _mm256_loadu_si256((const __m256i *)ref_block->v + i));
+        }
+    }
+
+    memcpy((uint64_t *)&state[3] + 2, &index, sizeof(uint64_t));
+    memcpy(&state[4], block_header, sizeof(__m256i));
+
+    for (i = 0; i < 4; ++i) {
+        BLAKE2_ROUND_1(state[8 * i + 0], state[8 * i + 4], state[8 * i + 1],
+                       state[8 * i + 5], state[8 * i + 2], state[8 * i + 6],
+                       state[8 * i + 3], state[8 * i + 7]);
+    }
+
+    for (i = 0; i < 4; ++i) {
+        BLAKE2_ROUND_2(state[0 + i], state[4 + i], state[8 + i], state[12 + i],
+                       state[16 + i], state[20 + i], state[24 + i],
+                       state[28 + i]);
+    }
+
+    for (i = 0; i < ARGON2_HWORDS_IN_BLOCK; i++) {
+        state[i] = _mm256_xor_si256(state[i], block_XY[i]);
+        _mm256_storeu_si256((__m256i *)next_block->v + i, state[i]);
+    }
+}
+
+#undef BLAKE2_ROUND_2
+#undef BLAKE2_ROUND_1
+#undef UNDIAGONALIZE_2
+#undef DIAGONALIZE_2
+#undef UNDIAGONALIZE_1
+#undef DIAGONALIZE_1
+#undef G2_AVX2
+#undef G1_AVX2
+#undef BLAMKA
+#undef ROTR63
+#undef ROTR16
+#undef ROTR24
+#undef ROTR32
+
+#endif /* FILL_HAVE_AVX2 */
+
+void fill_block_mtp(const block *prev_block, const block *ref_block,
+                    block *next_block, const uint32_t block_header[8],
+                    uint32_t ref_index) {
+    __m128i state[ARGON2_OWORDS_IN_BLOCK];
+    unsigned int i;
+
+    for (i = 0; i < ARGON2_OWORDS_IN_BLOCK; i++)
+        state[i] = _mm_loadu_si128((const __m128i *)prev_block->v + i);
+    fill_block_sse(state, ref_block, next_block, 0, block_header, ref_index);
+}
+
+/* same cpu check as the blake2b lanes */
+static int fill_use_avx2(void) {
+#ifdef FILL_HAVE_AVX2
+    return blake2b4r_lanes() == 4;
+#else
+    return 0;
+#endif
+}
+
+/* the segment loop of ref.c fill_segment, argon2d addressing only */
+#define FILL_SEGMENT_LOOP(load_state, fill)                                    \
+    do {                                                                       \
+        load_state;                                                            \
+        for (i = starting_index; i < instance->segment_length;                 \
+             ++i, ++curr_offset, ++prev_offset) {                              \
+            if (curr_offset % instance->lane_length == 1) {                    \
+                prev_offset = curr_offset - 1;                                 \
+            }                                                                  \
+            pseudo_rand = instance->memory[prev_offset].v[0];                  \
+            ref_lane = ((pseudo_rand >> 32)) % instance->lanes;                \
+            if ((position.pass == 0) && (position.slice == 0)) {               \
+                ref_lane = position.lane;                                      \
+            }                                                                  \
+            position.index = i;                                                \
+            ref_index = index_alpha(instance, &position,                       \
+                                    pseudo_rand & 0xFFFFFFFF,                  \
+                                    ref_lane == position.lane);                \
+            ref_block = instance->lane_length * ref_lane + ref_index;          \
+            curr_block = instance->memory + curr_offset;                       \
+            fill;                                                              \
+            if (ARGON2_VERSION_10 != instance->version &&                      \
+                0 == position.pass) {                                          \
+                curr_block->ref_block = ref_block;                             \
+                curr_block->prev_block = prev_offset | ref_block << 32;        \
+            }                                                                  \
+        }                                                                      \
+    } while ((void)0, 0)
+
+void fill_segment_mtp(const argon2_instance_t *instance,
+                      argon2_position_t position) {
+    block *curr_block = NULL;
+    uint64_t pseudo_rand, ref_index, ref_lane, ref_block;
+    uint32_t prev_offset, curr_offset;
+    uint32_t starting_index;
+    uint32_t i;
+    int with_xor;
+
+    if (instance == NULL) {
+        return;
+    }
+
+    starting_index = 0;
+
+    if ((0 == position.pass) && (0 == position.slice)) {
+        starting_index = 2; /* we have already generated the first two blocks */
+    }
+
+    /* Offset of the current block */
+    curr_offset = position.lane * instance->lane_length +
+                  position.slice * instance->segment_length + starting_index;
+
+    if (0 == curr_offset % instance->lane_length) {
+        /* Last block in this lane */
+        prev_offset = curr_offset + instance->lane_length - 1;
+    } else {
+        /* Previous block */
+        prev_offset = curr_offset - 1;
+    }
+
+    with_xor = ARGON2_VERSION_10 != instance->version && 0 != position.pass;
+
+#ifdef FILL_HAVE_AVX2
+    if (fill_use_avx2()) {
+        __m256i state[ARGON2_HWORDS_IN_BLOCK];
+        FILL_SEGMENT_LOOP(
+            memcpy(state, instance->memory[prev_offset].v, ARGON2_BLOCK_SIZE),
+            fill_block_avx2(state, instance->memory + ref_block, curr_block,
+                            with_xor, instance->block_header,
+                            (uint32_t)ref_block));
+        return;
+    }
+#endif
+    {
+        __m128i state[ARGON2_OWORDS_IN_BLOCK];
+        FILL_SEGMENT_LOOP(
+            memcpy(state, instance->memory[prev_offset].v, ARGON2_BLOCK_SIZE),
+            fill_block_sse(state, instance->memory + ref_block, curr_block,
+                           with_xor, instance->block_header,
+                           (uint32_t)ref_block));
+    }
+}
+
+#undef FILL_SEGMENT_LOOP
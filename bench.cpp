@@ -5,6 +5,23 @@
  */
 
 #include <unistd.h>
+#ifndef WIN32
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#define CLOSESOCKET close
+#else
+#define CLOSESOCKET closesocket
+#endif
+
+// before miner.h and its min/max macros
+#include "merkletree/merkle-tree.hpp"
+#include "merkletree/mtp.h"
+#include "argon2ref/blake2.h"
+#include "sph/sph_x4.h"
+extern "C" {
+#include "lyra2/Lyra2.h"
+}
 
 #include "miner.h"
 #include "algos.h"
@@ -86,6 +103,9 @@ void algo_free_all(int thr_id)
 	//free_sha256d(thr_id);
 //	free_scrypt(thr_id);
 //	free_scrypt_jane(thr_id);
+
+	// cpu hashes scratch buffers
+	cpu_scratch_free();
 }
 
 // benchmark all algos (called once per mining thread)
@@ -207,3 +227,996 @@ void bench_display_results()
 		}
 	}
 }
+
+/**
+ * CPU side micro benchmarks (--cpu-bench=NAME), no gpu required
+ */
+
+static const char *cpu_bench_arg = NULL;
+
+static double cpu_bench_ms(struct timeval *start)
+{
+	struct timeval now, diff;
+	gettimeofday(&now, NULL);
+	timeval_subtract(&diff, &now, start);
+	return 1e3 * diff.tv_sec + 1e-3 * diff.tv_usec;
+}
+
+// the NAME:ARG count, def if not set or not positive
+static int cpu_bench_count(int def)
+{
+	int n = cpu_bench_arg ? atoi(cpu_bench_arg) : def;
+	return n > 0 ? n : def;
+}
+
+// MTP job switch: layers built over the 4M leaves copied back from the gpu
+static bool cpu_bench_mtp_tree()
+{
+	const size_t size = (size_t) MERKLE_TREE_ELEMENT_COUNT * MERKLE_TREE_ELEMENT_SIZE_B;
+	const int loops = 5;
+	uint32_t *leaves = (uint32_t*) malloc(size);
+	if (!leaves) {
+		applog(LOG_ERR, "mtp-tree: unable to allocate %u MB", (uint32_t) (size >> 20));
+		return false;
+	}
+	for (size_t i = 0; i < size / 4; i++)
+		leaves[i] = (uint32_t) rand() ^ ((uint32_t) rand() << 16);
+
+	const unsigned threads[2] = { 1, MerkleTree::getBuildThreads() };
+	for (int n = 0; n < 2; n++) {
+		if (n && threads[n] == threads[0])
+			break;
+		MerkleTree::setBuildThreads(threads[n]);
+		double best = 0., total = 0.;
+		for (int i = 0; i < loops; i++) {
+			struct timeval start;
+			gettimeofday(&start, NULL);
+			MerkleTree tree((uint8_t*) leaves, true);
+			double ms = cpu_bench_ms(&start);
+			if (!i || ms < best) best = ms;
+			total += ms;
+		}
+		applog(LOG_INFO, "mtp-tree: %u thread(s), %d blake2b lanes: %.1f ms per job (best %.1f ms)",
+			threads[n], blake2b4r_lanes(), total / loops, best);
+	}
+	MerkleTree::setBuildThreads(0);
+	free(leaves);
+	return true;
+}
+
+// host block source filling each block from its index, stands for the 4GB of gpu memory
+static void cpu_bench_mtp_gather(const mtp_block_source *src, const uint32_t *index, int count, block *out)
+{
+	for (int i = 0; i < count; i++) {
+		uint64_t x = index[i];
+		for (int k = 0; k < ARGON2_QWORDS_IN_BLOCK; k++) {
+			x += 0x9E3779B97F4A7C15ULL;
+			out[i].v[k] = x ^ (x >> 31);
+		}
+	}
+}
+
+// MTP share: the 64 rounds of the solver, block gathers and proofs
+static bool cpu_bench_mtp_solver()
+{
+	const size_t size = (size_t) MERKLE_TREE_ELEMENT_COUNT * MERKLE_TREE_ELEMENT_SIZE_B;
+	const int loops = 200;
+	uint32_t *leaves = (uint32_t*) malloc(size);
+	blockS *blocks = (blockS*) malloc(sizeof(blockS) * MTP_L_MAX * 2);
+	uint8_t *proofs = (uint8_t*) malloc(MERKLE_TREE_PROOF_SIZE_B * MTP_L_MAX * 3);
+	if (!leaves || !blocks || !proofs) {
+		applog(LOG_ERR, "mtp-solver: unable to allocate %u MB", (uint32_t) (size >> 20));
+		free(leaves); free(blocks); free(proofs);
+		return false;
+	}
+	for (size_t i = 0; i < size / 4; i++)
+		leaves[i] = (uint32_t) rand() ^ ((uint32_t) rand() << 16);
+	MerkleTree tree((uint8_t*) leaves, true);
+	MerkleTree::Buffer root = tree.getRoot();
+
+	argon2_context context;
+	memset(&context, 0, sizeof(context));
+	context.m_cost = MERKLE_TREE_ELEMENT_COUNT;
+	context.lanes = 4;
+	argon2_instance_t instance;
+	memset(&instance, 0, sizeof(instance));
+	instance.memory_blocks = context.m_cost;
+	instance.lanes = context.lanes;
+	instance.lane_length = context.m_cost / context.lanes;
+	instance.segment_length = instance.lane_length / ARGON2_SYNC_POINTS;
+	instance.context_ptr = &context;
+
+	mtp_block_source src = mtp_host_blocks(NULL);
+	src.gather = cpu_bench_mtp_gather;
+
+	uint32_t input[20];
+	for (int i = 0; i < 20; i++)
+		input[i] = (uint32_t) rand();
+	uint256 target;
+	memset(target.begin(), 0xff, 32);
+	uint8_t hash[32];
+
+	int found = 0;
+	struct timeval start;
+	gettimeofday(&start, NULL);
+	for (int n = 0; n < loops; n++)
+		found += mtp_solver_blocks(&src, 64, (uint32_t) n, &instance, blocks, proofs,
+			&root[0], hash, tree, input, target);
+	double ms = cpu_bench_ms(&start);
+	applog(LOG_INFO, "mtp-solver: %.1f us per share (%d/%d solved)", 1e3 * ms / loops, found, loops);
+
+	free(proofs);
+	free(blocks);
+	free(leaves);
+	return true;
+}
+
+// MTP argon2d fill on the cpu (gpu-less reference), on a quarter GB memory
+static bool cpu_bench_mtp_fill()
+{
+	const uint32_t lanes = 4, m_cost = 1U << 18;
+	const size_t size = (size_t) m_cost * sizeof(block);
+	block first[lanes * 2];
+	block *ref = (block*) malloc(size);
+	if (!ref) {
+		applog(LOG_ERR, "mtp-fill: unable to allocate %u MB", (uint32_t) (size >> 20));
+		return false;
+	}
+	for (size_t i = 0; i < sizeof(first) / 4; i++)
+		((uint32_t*) first)[i] = (uint32_t) rand() ^ ((uint32_t) rand() << 16);
+
+	argon2_instance_t instance;
+	memset(&instance, 0, sizeof(instance));
+	instance.version = ARGON2_VERSION_13;
+	instance.passes = 1;
+	instance.memory_blocks = m_cost;
+	instance.lanes = lanes;
+	instance.lane_length = m_cost / lanes;
+	instance.segment_length = instance.lane_length / ARGON2_SYNC_POINTS;
+	instance.type = Argon2_d;
+	for (int i = 0; i < 8; i++)
+		instance.block_header[i] = (uint32_t) rand();
+
+	// portable reference fill, single thread
+	for (uint32_t l = 0; l < lanes; l++) {
+		ref[l * instance.lane_length + 0] = first[l * 2 + 0];
+		ref[l * instance.lane_length + 1] = first[l * 2 + 1];
+	}
+	instance.memory = ref;
+	instance.threads = 1;
+	struct timeval start;
+	gettimeofday(&start, NULL);
+	fill_memory_blocks(&instance);
+	double ms = cpu_bench_ms(&start);
+	applog(LOG_INFO, "mtp-fill: reference, 1 thread: %.1f ms (%.1f MB/s)", ms, (size >> 20) * 1e3 / ms);
+
+	instance.memory = first;
+	bool valid = true;
+	const uint32_t threads[2] = { 1, lanes };
+	for (int n = 0; n < 2; n++) {
+		gettimeofday(&start, NULL);
+		block *memory = mtp_cpu_memory(&instance, threads[n]);
+		ms = cpu_bench_ms(&start);
+		if (!memory) {
+			applog(LOG_ERR, "mtp-fill: unable to allocate %u MB", (uint32_t) (size >> 20));
+			valid = false;
+			break;
+		}
+		bool same = !memcmp(memory, ref, size);
+		applog(LOG_INFO, "mtp-fill: %s, %u thread(s): %.1f ms (%.1f MB/s)%s",
+			blake2b4r_lanes() == 4 ? "avx2" : "sse", threads[n], ms, (size >> 20) * 1e3 / ms,
+			same ? "" : ", MISMATCH");
+		valid = valid && same;
+		free(memory);
+	}
+	free(ref);
+	return valid;
+}
+
+// MTP share encoding: jansson tree + bos_serialize / sprintf hex against the direct encoders
+static bool cpu_bench_mtp_submit()
+{
+	const int loops = 200;
+	const uint32_t mtp_l = MTP_Lmax;
+	struct mtp *mtp = (struct mtp*) malloc(sizeof(struct mtp));
+	char *hex = (char*) malloc(2 * sizeof(struct mtp) + 1);
+	if (!mtp || !hex) {
+		applog(LOG_ERR, "mtp-submit: unable to allocate %u KB", (uint32_t) (sizeof(struct mtp) >> 10));
+		free(mtp); free(hex);
+		return false;
+	}
+	for (size_t i = 0; i < sizeof(struct mtp); i++)
+		((uchar*) mtp)[i] = (uchar) rand();
+	uchar job_id[4], xnonce2[8];
+	uint32_t ntime = (uint32_t) rand(), nonce = (uint32_t) rand(), data[21];
+	for (int i = 0; i < 4; i++) job_id[i] = (uchar) rand();
+	for (int i = 0; i < 8; i++) xnonce2[i] = (uchar) rand();
+	for (int i = 0; i < 21; i++) data[i] = (uint32_t) rand();
+	const char *user = "bench.worker";
+	struct submit_buf buf = { 0 };
+	bool valid = true;
+
+	struct timeval start;
+	gettimeofday(&start, NULL);
+	for (int n = 0; n < loops; n++) {
+		json_t *obj = json_object();
+		json_t *arr = json_array();
+		// request ids 4, 1024 and 262144 take the three unsigned widths
+		uint32_t id = 4U << (8 * (n % 3));
+		json_object_set_new(obj, "id", json_integer(id));
+		json_object_set_new(obj, "method", json_string("mining.submit"));
+		json_array_append_new(arr, json_string(user));
+		json_array_append_new(arr, json_bytes(job_id, 4));
+		json_array_append_new(arr, json_bytes(xnonce2, 8));
+		json_array_append_new(arr, json_bytes((uchar*) &ntime, 4));
+		json_array_append_new(arr, json_bytes((uchar*) &nonce, 4));
+		json_array_append_new(arr, json_bytes(mtp->MerkleRoot, 16));
+		json_array_append_new(arr, json_bytes((uchar*) mtp->nBlockMTP, mtp_l * 2 * 128 * 8));
+		json_array_append_new(arr, json_bytes(mtp->nProofMTP, mtp_l * 3 * 353));
+		json_object_set_new(obj, "params", arr);
+		json_error_t err;
+		bos_t *serialized = bos_serialize(obj, &err);
+		if (n < 3) {
+			mtp_submit_bos(&buf, id, user, job_id, xnonce2, ntime, nonce, mtp, mtp_l);
+			valid = valid && serialized && serialized->size == buf.size && !memcmp(serialized->data, buf.data, buf.size);
+		}
+		if (serialized) bos_free(serialized);
+		json_decref(obj);
+	}
+	double ms = cpu_bench_ms(&start);
+	gettimeofday(&start, NULL);
+	for (int n = 0; n < loops; n++)
+		mtp_submit_bos(&buf, 4, user, job_id, xnonce2, ntime, nonce, mtp, mtp_l);
+	double ms2 = cpu_bench_ms(&start);
+	applog(LOG_INFO, "mtp-submit: stratum %u KB, json %.1f us, direct %.1f us per share%s",
+		(uint32_t) (buf.size >> 10), 1e3 * ms / loops, 1e3 * ms2 / loops, valid ? "" : ", MISMATCH");
+
+	const size_t len = 84 + 32 + 64 + 16 + mtp_l * 2 * 128 * 8 + mtp_l * 3 * 353;
+	const uchar *bytes = (const uchar*) mtp->nBlockMTP;
+	gettimeofday(&start, NULL);
+	for (int n = 0; n < loops; n++) {
+		for (size_t i = 0; i < len; i++)
+			sprintf(&hex[2 * i], "%02x", bytes[i % sizeof(mtp->nBlockMTP)]);
+	}
+	ms = cpu_bench_ms(&start);
+	gettimeofday(&start, NULL);
+	for (int n = 0; n < loops; n++)
+		mtp_submit_gbt(&buf, data, mtp, mtp_l, "", NULL);
+	ms2 = cpu_bench_ms(&start);
+	applog(LOG_INFO, "mtp-submit: submitblock %u KB, sprintf %.1f us, direct %.1f us per block",
+		(uint32_t) (buf.size >> 10), 1e3 * ms / loops, 1e3 * ms2 / loops);
+
+	submit_buf_free(&buf);
+	free(hex);
+	free(mtp);
+	return valid;
+}
+
+// stratum work generation: merkle root for each new xnonce2, full coinbase
+// sha256d against the cached coinbase midstate
+static void merkle_fold(const struct stratum_job *job, uchar *merkle_root)
+{
+	for (int i = 0; i < job->merkle_count; i++) {
+		memcpy(merkle_root + 32, job->merkle[i], 32);
+		sha256d(merkle_root, merkle_root, 64);
+	}
+}
+
+static bool cpu_bench_stratum_headers()
+{
+	const int loops = 200000;
+	const size_t coinb1_size = 180, xnonce1_size = 4, xnonce2_size = 8, coinb2_size = 90;
+	struct stratum_job job;
+	memset(&job, 0, sizeof(job));
+	job.coinbase_size = coinb1_size + xnonce1_size + xnonce2_size + coinb2_size;
+	job.coinbase = (uchar*) malloc(job.coinbase_size);
+	job.xnonce2 = job.coinbase + coinb1_size + xnonce1_size;
+	for (size_t i = 0; i < job.coinbase_size; i++)
+		job.coinbase[i] = (uchar) rand();
+	job.merkle_count = 12;
+	job.merkle = (uchar**) malloc(job.merkle_count * sizeof(uchar*));
+	for (int i = 0; i < job.merkle_count; i++) {
+		job.merkle[i] = (uchar*) malloc(32);
+		for (int k = 0; k < 32; k++) job.merkle[i][k] = (uchar) rand();
+	}
+
+	uchar root[64], check[64];
+	bool valid = true;
+	struct timeval start;
+	gettimeofday(&start, NULL);
+	for (int n = 0; n < loops; n++) {
+		for (size_t i = 0; i < xnonce2_size && !++job.xnonce2[i]; i++);
+		sha256d(root, job.coinbase, (int) job.coinbase_size);
+		merkle_fold(&job, root);
+	}
+	double ms = cpu_bench_ms(&start);
+	gettimeofday(&start, NULL);
+	for (int n = 0; n < loops; n++) {
+		for (size_t i = 0; i < xnonce2_size && !++job.xnonce2[i]; i++);
+		stratum_coinbase_hash(&job, root);
+		merkle_fold(&job, root);
+		if (!(n & 0xfff)) {
+			sha256d(check, job.coinbase, (int) job.coinbase_size);
+			merkle_fold(&job, check);
+			valid = valid && !memcmp(root, check, 32);
+		}
+	}
+	double ms2 = cpu_bench_ms(&start);
+	applog(LOG_INFO, "stratum-headers: %u branches, full coinbase %.0f, midstate %.0f headers/s%s",
+		(uint32_t) job.merkle_count, 1e3 * loops / ms, 1e3 * loops / ms2, valid ? "" : ", MISMATCH");
+
+	for (int i = 0; i < job.merkle_count; i++)
+		free(job.merkle[i]);
+	free(job.merkle);
+	free(job.coinbase);
+	return valid;
+}
+
+// gbt merkle root of a TXS transactions template: one sha256d per node against
+// the 4-way sha256d fold shared by the openmp threads
+static bool cpu_bench_gbt_merkle()
+{
+	const int loops = 20;
+	int count = 1 + cpu_bench_count(4000);
+	uchar (*leaves)[32] = (uchar (*)[32]) malloc((count + 1) * 32);
+	uchar (*tree)[32] = (uchar (*)[32]) malloc((count + 1) * 32);
+	for (int i = 0; i < count; i++)
+		for (int k = 0; k < 32; k++) leaves[i][k] = (uchar) rand();
+
+	uchar check[32];
+	struct timeval start;
+	gettimeofday(&start, NULL);
+	for (int l = 0; l < loops; l++) {
+		memcpy(tree, leaves, count * 32);
+		int n = count;
+		while (n > 1) {
+			if (n % 2) {
+				memcpy(tree[n], tree[n - 1], 32);
+				++n;
+			}
+			n /= 2;
+			for (int i = 0; i < n; i++)
+				sha256d(tree[i], tree[2 * i], 64);
+		}
+	}
+	double ms = cpu_bench_ms(&start);
+	memcpy(check, tree[0], 32);
+	gettimeofday(&start, NULL);
+	for (int l = 0; l < loops; l++) {
+		memcpy(tree, leaves, count * 32);
+		merkle_tree_root(tree, count);
+	}
+	double ms2 = cpu_bench_ms(&start);
+	bool valid = !memcmp(check, tree[0], 32);
+	applog(LOG_INFO, "gbt-merkle: %d leaves, sha256d %.2f ms, 4-way %.2f ms per root%s",
+		count, ms / loops, ms2 / loops, valid ? "" : ", MISMATCH");
+
+	free(tree);
+	free(leaves);
+	return valid;
+}
+
+// thread queue stress: producers push numbered entries, consumers pop them
+// in batches, each entry must come out exactly once
+struct tq_bench {
+	struct thread_q *q;
+	uint32_t per_producer;
+	int producer;
+	uint64_t popped;
+	uint64_t sum;
+};
+
+static void *tq_bench_producer(void *userdata)
+{
+	struct tq_bench *tb = (struct tq_bench*) userdata;
+	uintptr_t base = (uintptr_t) tb->producer * tb->per_producer;
+	for (uint32_t i = 0; i < tb->per_producer; i++) {
+		if (!tq_push(tb->q, (void*) (base + i + 1)))
+			break;
+	}
+	return NULL;
+}
+
+static void *tq_bench_consumer(void *userdata)
+{
+	struct tq_bench *tb = (struct tq_bench*) userdata;
+	void *items[16];
+	int count;
+	while ((count = tq_pop_batch(tb->q, items, ARRAY_SIZE(items), NULL)) > 0) {
+		for (int i = 0; i < count; i++) {
+			tb->sum += (uintptr_t) items[i];
+			tb->popped++;
+		}
+	}
+	return NULL;
+}
+
+static bool cpu_bench_thread_queue()
+{
+	const int producers = 4, consumers = 2;
+	uint32_t millions = (uint32_t) cpu_bench_count(4);
+	const uint32_t per_producer = millions * 1000000 / producers;
+	const uint64_t total = (uint64_t) per_producer * producers;
+
+	struct thread_q *q = tq_new();
+	struct tq_bench prod[producers], cons[consumers];
+	pthread_t prod_thr[producers], cons_thr[consumers];
+	memset(prod, 0, sizeof(prod));
+	memset(cons, 0, sizeof(cons));
+
+	struct timeval start;
+	gettimeofday(&start, NULL);
+	for (int i = 0; i < consumers; i++) {
+		cons[i].q = q;
+		pthread_create(&cons_thr[i], NULL, tq_bench_consumer, &cons[i]);
+	}
+	for (int i = 0; i < producers; i++) {
+		prod[i].q = q;
+		prod[i].producer = i;
+		prod[i].per_producer = per_producer;
+		pthread_create(&prod_thr[i], NULL, tq_bench_producer, &prod[i]);
+	}
+	for (int i = 0; i < producers; i++)
+		pthread_join(prod_thr[i], NULL);
+	// the consumers stop once the queue is drained and frozen
+	struct tq_stats st;
+	do {
+		usleep(1000);
+		tq_getstats(q, &st);
+	} while (st.depth);
+	tq_freeze(q);
+	for (int i = 0; i < consumers; i++)
+		pthread_join(cons_thr[i], NULL);
+	double ms = cpu_bench_ms(&start);
+
+	uint64_t popped = 0, sum = 0;
+	for (int i = 0; i < consumers; i++) {
+		popped += cons[i].popped;
+		sum += cons[i].sum;
+	}
+	tq_getstats(q, &st);
+	bool valid = popped == total && sum == total * (total + 1) / 2;
+	applog(LOG_INFO, "thread-queue: %d producers, %d consumers, %.1fM entries in %.0f ms (%.2fM/s)%s",
+		producers, consumers, total / 1e6, ms, total / ms / 1e3, valid ? "" : ", MISMATCH");
+	applog(LOG_INFO, "thread-queue: max depth %u/%u, %.1f us average wait",
+		st.max_depth, st.size, st.popped ? (double) st.wait_us / st.popped : 0.0);
+	tq_free(q);
+	return valid;
+}
+
+// hashlog: miner threads checking and storing their shares while the jobs
+// rotate, then the dedup lookup cost against a filled job
+#define HASHLOG_BENCH_THREADS 4
+#define HASHLOG_BENCH_PER_JOB 1000
+
+struct hashlog_bench {
+	int thr;
+	uint32_t shares;
+	uint32_t dups;
+};
+
+static inline uint32_t hashlog_bench_nonce(uint32_t share, int thr)
+{
+	// odd, so distinct and never 0
+	return ((share * HASHLOG_BENCH_THREADS + thr) * 2 + 1) * 0x9E3779B1U;
+}
+
+static void *hashlog_bench_thread(void *userdata)
+{
+	struct hashlog_bench *hb = (struct hashlog_bench*) userdata;
+	struct work work;
+	memset(&work, 0, sizeof(work));
+	for (uint32_t i = 0; i < hb->shares; i++) {
+		uint32_t nonce = hashlog_bench_nonce(i, hb->thr);
+		sprintf(work.job_id, "%x", i / HASHLOG_BENCH_PER_JOB + 1);
+		work.scanned_from = nonce & ~0xffffU;
+		work.scanned_to = nonce;
+		if (hashlog_already_submittted(work.job_id, nonce))
+			hb->dups++;
+		hashlog_remember_submit(&work, nonce);
+		if (i % 16 == 0)
+			hashlog_remember_scan_range(&work);
+	}
+	return NULL;
+}
+
+static bool cpu_bench_hashlog()
+{
+	uint32_t shares = (uint32_t) cpu_bench_count(200000);
+	const uint32_t per_thread = shares / HASHLOG_BENCH_THREADS;
+	const uint32_t jobs = (per_thread + HASHLOG_BENCH_PER_JOB - 1) / HASHLOG_BENCH_PER_JOB;
+
+	struct hashlog_bench hb[HASHLOG_BENCH_THREADS];
+	pthread_t thr[HASHLOG_BENCH_THREADS];
+	memset(hb, 0, sizeof(hb));
+	hashlog_purge_all();
+
+	struct timeval start;
+	gettimeofday(&start, NULL);
+	for (int t = 0; t < HASHLOG_BENCH_THREADS; t++) {
+		hb[t].thr = t;
+		hb[t].shares = per_thread;
+		pthread_create(&thr[t], NULL, hashlog_bench_thread, &hb[t]);
+	}
+	for (int t = 0; t < HASHLOG_BENCH_THREADS; t++)
+		pthread_join(thr[t], NULL);
+	double ms = cpu_bench_ms(&start);
+
+	uint32_t dups = 0;
+	for (int t = 0; t < HASHLOG_BENCH_THREADS; t++)
+		dups += hb[t].dups;
+
+	// the shares of the last job must all be known, other nonces not
+	char jobid[16];
+	const uint32_t first = (jobs - 1) * HASHLOG_BENCH_PER_JOB;
+	const uint32_t known = per_thread - first;
+	const uint32_t loops = 1000000 / known + 1;
+	uint32_t missed = 0, found = 0;
+	sprintf(jobid, "%x", jobs);
+	gettimeofday(&start, NULL);
+	for (uint32_t l = 0; l < loops; l++) {
+		for (uint32_t i = first; i < per_thread; i++) {
+			if (!hashlog_already_submittted(jobid, hashlog_bench_nonce(i, l % HASHLOG_BENCH_THREADS)))
+				missed++;
+			if (hashlog_already_submittted(jobid, hashlog_bench_nonce(i + per_thread, 0)))
+				found++;
+		}
+	}
+	double ms2 = cpu_bench_ms(&start);
+	const double checks = 2.0 * loops * known;
+
+	uint64_t mem;
+	uint32_t records;
+	hashlog_getmeminfo(&mem, &records);
+	bool valid = !dups && !missed && !found && hashlog_get_last_sent(jobid) != 0;
+	applog(LOG_INFO, "hashlog: %u shares on %u jobs by %d threads in %.0f ms (%.2f us/share)%s",
+		per_thread * HASHLOG_BENCH_THREADS, jobs, HASHLOG_BENCH_THREADS, ms,
+		ms * 1e3 / (per_thread * HASHLOG_BENCH_THREADS), valid ? "" : ", MISMATCH");
+	applog(LOG_INFO, "hashlog: dedup check %.0f ns, %u records kept, %u KB",
+		ms2 * 1e6 / checks, records, (uint32_t) (mem / 1024));
+	hashlog_purge_all();
+	return valid;
+}
+
+// loopback pool sending a bos stream to the stratum receive path, first message
+// by message (latency until the job is parsed), then all at once (throughput)
+struct replay_pool {
+	curl_socket_t listener;
+	const uchar *stream;
+	size_t size;
+	int count;
+	uint32_t *offsets;
+	struct timeval *sent;
+	volatile int handled;
+};
+
+static void *replay_pool_thread(void *userdata)
+{
+	struct replay_pool *rp = (struct replay_pool*) userdata;
+	curl_socket_t sock = accept(rp->listener, NULL, NULL);
+	if (sock == (curl_socket_t) -1)
+		return NULL;
+	for (int i = 0; i < rp->count; i++) {
+		uint32_t size = bos_sizeof(rp->stream + rp->offsets[i]);
+		gettimeofday(&rp->sent[i], NULL);
+		send(sock, (const char*) rp->stream + rp->offsets[i], size, 0);
+		for (int w = 0; rp->handled <= i && w < 100000; w++)
+			usleep(50);
+	}
+	gettimeofday(&rp->sent[rp->count], NULL);
+	for (size_t sent = 0; sent < rp->size; ) {
+		int n = send(sock, (const char*) rp->stream + sent, (int) (rp->size - sent), 0);
+		if (n <= 0) break;
+		sent += n;
+	}
+	for (int w = 0; rp->handled < 2 * rp->count && w < 100000; w++)
+		usleep(50);
+	CLOSESOCKET(sock);
+	return NULL;
+}
+
+// mining.notify messages shaped like the mtp pool ones
+static uchar* replay_notify_stream(int count, size_t *size)
+{
+	uchar *stream = NULL;
+	*size = 0;
+	for (int n = 0; n < count; n++) {
+		uchar data[256];
+		for (int i = 0; i < 256; i++)
+			data[i] = (uchar) rand();
+		json_t *params = json_array();
+		json_t *merkle = json_array();
+		json_array_append_new(params, json_bytes((uchar*) &n, 4));
+		json_array_append_new(params, json_bytes(data, 32));
+		json_array_append_new(params, json_bytes(data, 192));
+		json_array_append_new(params, json_bytes(data + 192, 64));
+		for (int i = 0; i < 12; i++)
+			json_array_append_new(merkle, json_bytes(data + 8 * i, 32));
+		json_array_append_new(params, merkle);
+		json_array_append_new(params, json_bytes(data + 100, 4));
+		json_array_append_new(params, json_bytes(data + 104, 4));
+		json_array_append_new(params, json_bytes(data + 108, 4));
+		json_array_append_new(params, json_boolean(n % 10 == 0));
+		json_t *obj = json_object();
+		json_object_set_new(obj, "id", json_null());
+		json_object_set_new(obj, "method", json_string("mining.notify"));
+		json_object_set_new(obj, "params", params);
+		json_error_t err;
+		bos_t *msg = bos_serialize(obj, &err);
+		json_decref(obj);
+		if (!msg) continue;
+		stream = (uchar*) realloc(stream, *size + msg->size);
+		memcpy(stream + *size, msg->data, msg->size);
+		*size += msg->size;
+		bos_free(msg);
+	}
+	return stream;
+}
+
+// --cpu-bench stratum-replay[:file saved with --protocol-capture]
+static bool cpu_bench_stratum_replay()
+{
+	struct replay_pool rp;
+	memset(&rp, 0, sizeof(rp));
+	if (cpu_bench_arg) {
+		FILE *fp = fopen(cpu_bench_arg, "rb");
+		if (!fp) {
+			applog(LOG_ERR, "stratum-replay: unable to open %s", cpu_bench_arg);
+			return false;
+		}
+		fseek(fp, 0, SEEK_END);
+		rp.size = (size_t) ftell(fp);
+		fseek(fp, 0, SEEK_SET);
+		uchar *stream = (uchar*) malloc(rp.size + 1);
+		if (stream && fread(stream, 1, rp.size, fp) != rp.size)
+			rp.size = 0;
+		fclose(fp);
+		rp.stream = stream;
+	} else {
+		rp.stream = replay_notify_stream(1000, &rp.size);
+	}
+	// split the stream, a capture may end in the middle of a message
+	rp.offsets = (uint32_t*) malloc(sizeof(uint32_t) * (rp.size / 5 + 1));
+	for (size_t pos = 0; rp.stream && pos + 4 <= rp.size; rp.count++) {
+		uint32_t size = bos_sizeof(rp.stream + pos);
+		if (size <= 4 || pos + size > rp.size) break;
+		rp.offsets[rp.count] = (uint32_t) pos;
+		pos += size;
+	}
+	if (!rp.count) {
+		applog(LOG_ERR, "stratum-replay: no message to replay");
+		free((void*) rp.stream); free(rp.offsets);
+		return false;
+	}
+	rp.size = rp.offsets[rp.count - 1] + bos_sizeof(rp.stream + rp.offsets[rp.count - 1]);
+	rp.sent = (struct timeval*) calloc(rp.count + 1, sizeof(struct timeval));
+
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof(addr);
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	rp.listener = socket(AF_INET, SOCK_STREAM, 0);
+	if (rp.listener == (curl_socket_t) -1 || bind(rp.listener, (struct sockaddr*) &addr, sizeof(addr)) ||
+		listen(rp.listener, 1) || getsockname(rp.listener, (struct sockaddr*) &addr, &addrlen)) {
+		applog(LOG_ERR, "stratum-replay: unable to listen on the loopback");
+		if (rp.listener != (curl_socket_t) -1) CLOSESOCKET(rp.listener);
+		free((void*) rp.stream); free(rp.offsets); free(rp.sent);
+		return false;
+	}
+	pthread_t pool_thr;
+	pthread_create(&pool_thr, NULL, replay_pool_thread, &rp);
+
+	struct stratum_ctx ctx;
+	memset(&ctx, 0, sizeof(ctx));
+	char url[64];
+	sprintf(url, "stratum+tcp://127.0.0.1:%u", (uint32_t) ntohs(addr.sin_port));
+	ctx.xnonce1_size = 4;
+	ctx.xnonce1 = (uchar*) calloc(1, ctx.xnonce1_size);
+	ctx.xnonce2_size = 8;
+
+	double lat_min = 0., lat_max = 0., lat_total = 0., burst_ms = 0.;
+	int jobs = 0;
+	if (stratum_connect(&ctx, url)) {
+		while (rp.handled < 2 * rp.count) {
+			const char *frame = stratum_recv_bos(&ctx, 10);
+			if (!frame)
+				break;
+			json_error_t err;
+			json_t *obj = NULL;
+			if (stratum_handle_notify_bos(&ctx, frame))
+				jobs++;
+			else
+				obj = bos_deserialize(frame, &err);
+			stratum_consume_bos(&ctx, frame);
+			if (obj) {
+				json_t *msg = recode_message(obj);
+				if (stratum_handle_method_bos_json(&ctx, msg))
+					jobs++;
+				json_decref(obj);
+				json_decref(msg);
+			}
+			int n = rp.handled;
+			if (n < rp.count) {
+				double ms = cpu_bench_ms(&rp.sent[n]);
+				if (!n || ms < lat_min) lat_min = ms;
+				if (ms > lat_max) lat_max = ms;
+				lat_total += ms;
+			} else if (n == 2 * rp.count - 1) {
+				burst_ms = cpu_bench_ms(&rp.sent[rp.count]);
+			}
+			rp.handled = n + 1;
+		}
+		stratum_disconnect(&ctx);
+	}
+	// unblock the pool thread if the client failed
+	rp.handled = 2 * rp.count;
+	pthread_join(pool_thr, NULL);
+	CLOSESOCKET(rp.listener);
+
+	if (burst_ms > 0.) {
+		applog(LOG_INFO, "stratum-replay: %d messages (%d handled), %u KB", rp.count, jobs / 2,
+			(uint32_t) (rp.size >> 10));
+		applog(LOG_INFO, "stratum-replay: notify to job %.1f us avg, %.1f min, %.1f max",
+			1e3 * lat_total / rp.count, 1e3 * lat_min, 1e3 * lat_max);
+		applog(LOG_INFO, "stratum-replay: burst of %d messages in %.2f ms (%.1f MB/s)", rp.count,
+			burst_ms, (double) rp.size / burst_ms / 1e3);
+	} else {
+		applog(LOG_ERR, "stratum-replay: the replay was interrupted");
+	}
+
+	free(ctx.xnonce1);
+	free(ctx.sockbuf);
+	free(ctx.url);
+	free(ctx.curl_url);
+	free((void*) rp.stream);
+	free(rp.offsets);
+	free(rp.sent);
+	return burst_ms > 0.;
+}
+
+// cpu hashes of n nonces of a fixed header, the reference and the checked
+// outputs (8 words per nonce), shared by verify, scratch and lyra2
+struct bench_hashes {
+	int n;
+	uint32_t _ALIGN(64) header[20];
+	uint32_t *nonces;
+	uint32_t *ref;
+	uint32_t *out;
+};
+
+static void bench_hashes_init(struct bench_hashes *bh, int def_count)
+{
+	bh->n = cpu_bench_count(def_count);
+	bh->nonces = (uint32_t*) malloc(bh->n * sizeof(uint32_t));
+	bh->ref = (uint32_t*) malloc(bh->n * 8 * sizeof(uint32_t));
+	bh->out = (uint32_t*) malloc(bh->n * 8 * sizeof(uint32_t));
+	for (int i = 0; i < 20; i++)
+		bh->header[i] = 0x9E3779B9U * (i + 1);
+	for (int i = 0; i < bh->n; i++)
+		bh->nonces[i] = 0x85EBCA6BU * (i + 1);
+}
+
+static void bench_hashes_free(struct bench_hashes *bh)
+{
+	free(bh->nonces);
+	free(bh->ref);
+	free(bh->out);
+}
+
+// ms to hash the nonces one by one loops times, before (if set) is called before each hash
+static double bench_hashes_run(const struct bench_hashes *bh, void (*hash)(void *output, const void *input),
+	uint32_t *out, int loops, void (*before)(void))
+{
+	uint32_t _ALIGN(64) endiandata[20];
+	struct timeval start;
+
+	for (int i = 0; i < 20; i++)
+		be32enc(&endiandata[i], bh->header[i]);
+	gettimeofday(&start, NULL);
+	for (int l = 0; l < loops; l++) {
+		for (int i = 0; i < bh->n; i++) {
+			if (before)
+				before();
+			be32enc(&endiandata[19], bh->nonces[i]);
+			hash(&out[i * 8], endiandata);
+		}
+	}
+	return cpu_bench_ms(&start);
+}
+
+// ms to hash the nonces with verify_batch loops times
+static double bench_hashes_batch(const struct bench_hashes *bh, int algo, uint32_t *out, int loops)
+{
+	struct timeval start;
+
+	memset(out, 0, bh->n * 8 * sizeof(uint32_t));
+	gettimeofday(&start, NULL);
+	for (int l = 0; l < loops; l++)
+		verify_batch(algo, bh->header, bh->nonces, bh->n, out);
+	return cpu_bench_ms(&start);
+}
+
+static bool bench_hashes_match(const struct bench_hashes *bh)
+{
+	return !memcmp(bh->out, bh->ref, bh->n * 8 * sizeof(uint32_t));
+}
+
+// "N/s what, N/s what2 (xR)" of two timings of the same hashes
+static const char* bench_rates(char *buf, size_t size, double hashes,
+	const char *what, double ms, const char *what2, double ms2)
+{
+	snprintf(buf, size, "%.0f/s %s, %.0f/s %s (x%.2f)", 1e3 * hashes / ms, what,
+		1e3 * hashes / ms2, what2, ms / ms2);
+	return buf;
+}
+
+// verify: the batched cpu check of the X chains against their xNNhash
+// function, one nonce at a time then n at once
+static bool cpu_bench_verify()
+{
+	static const struct {
+		int algo;
+		void (*hash)(void *output, const void *input);
+	} chains[] = {
+		{ ALGO_X11, x11hash },
+		{ ALGO_X13, x13hash },
+		{ ALGO_X14, x14hash },
+		{ ALGO_X15, x15hash },
+		{ ALGO_X17, x17hash },
+	};
+	struct bench_hashes bh;
+	bool valid = true;
+	char rates[128];
+
+	bench_hashes_init(&bh, 64);
+	applog(LOG_INFO, "verify: %d nonces, %d lanes", bh.n, sph_x4_lanes());
+	for (size_t c = 0; c < ARRAY_SIZE(chains); c++) {
+		const int loops = max(1, 4096 / bh.n);
+		double ms = bench_hashes_run(&bh, chains[c].hash, bh.ref, loops, NULL);
+		double ms2 = bench_hashes_batch(&bh, chains[c].algo, bh.out, loops);
+		bool same = bench_hashes_match(&bh);
+		applog(LOG_INFO, "verify: %s %s%s", algo_names[chains[c].algo],
+			bench_rates(rates, sizeof(rates), (double) loops * bh.n, "scalar", ms, "batched", ms2),
+			same ? "" : ", MISMATCH");
+		valid = valid && same;
+	}
+	bench_hashes_free(&bh);
+	return valid;
+}
+
+static void scratch_neoscrypt(void *output, const void *input)
+{
+	neoscrypt((uchar*) output, (const uchar*) input, 0x80000620U);
+}
+
+// scratch: the cpu hashes with an allocation per hash (as before the thread
+// scratch buffers) then with the buffers kept, both hashes must match
+static bool cpu_bench_scratch()
+{
+	static const struct {
+		const char *name;
+		void (*hash)(void *output, const void *input);
+	} hashes[] = {
+		{ "lyra2", lyra2re_hash },
+		{ "lyra2v2", lyra2v2_hash },
+		{ "lyra2z", lyra2Z_hash },
+		{ "neoscrypt", scratch_neoscrypt },
+	};
+	struct bench_hashes bh;
+	bool valid = true;
+	char rates[128];
+
+	bench_hashes_init(&bh, 256);
+	for (size_t h = 0; h < ARRAY_SIZE(hashes); h++) {
+		uint64_t mem;
+		uint32_t buffers;
+
+		double ms = bench_hashes_run(&bh, hashes[h].hash, bh.ref, 1, cpu_scratch_free);
+		double ms2 = bench_hashes_run(&bh, hashes[h].hash, bh.out, 1, NULL);
+		bool same = bench_hashes_match(&bh);
+
+		cpu_scratch_getmeminfo(&mem, &buffers);
+		applog(LOG_INFO, "scratch: %s %s, %u KB in %u buffers%s", hashes[h].name,
+			bench_rates(rates, sizeof(rates), bh.n, "allocated", ms, "reused", ms2),
+			(uint32_t) (mem >> 10), buffers, same ? "" : ", MISMATCH");
+		valid = valid && same;
+	}
+	cpu_scratch_free();
+	bench_hashes_free(&bh);
+	return valid;
+}
+
+// lyra2: the cpu hashes with the scalar sponge, the AVX2 one and (lyra2v2,
+// lyra2z) the 4 lanes LYRA2 of verify_batch, all outputs must match
+static bool cpu_bench_lyra2()
+{
+	static const struct {
+		int algo;
+		void (*hash)(void *output, const void *input);
+		bool batched;
+	} hashes[] = {
+		{ ALGO_LYRA2, lyra2re_hash },
+		{ ALGO_LYRA2v2, lyra2v2_hash, true },
+		{ ALGO_LYRA2Z, lyra2Z_hash, true },
+	};
+	struct bench_hashes bh;
+	bool valid = true;
+	char rates[128], rates2[128];
+
+	bench_hashes_init(&bh, 1024);
+	applog(LOG_INFO, "lyra2: %d hashes, %d lanes", bh.n, lyra2_simd_lanes());
+	for (size_t h = 0; h < ARRAY_SIZE(hashes); h++) {
+		lyra2_simd = 0;
+		double ms = bench_hashes_run(&bh, hashes[h].hash, bh.ref, 1, NULL);
+		lyra2_simd = -1;
+		double ms2 = bench_hashes_run(&bh, hashes[h].hash, bh.out, 1, NULL);
+		bool same = bench_hashes_match(&bh);
+		bench_rates(rates, sizeof(rates), bh.n, "scalar", ms, "simd", ms2);
+
+		rates2[0] = '\0';
+		if (hashes[h].batched) {
+			double ms3 = bench_hashes_batch(&bh, hashes[h].algo, bh.out, 1);
+			same = same && bench_hashes_match(&bh);
+			snprintf(rates2, sizeof(rates2), ", %.0f/s batched (x%.2f)", 1e3 * bh.n / ms3, ms / ms3);
+		}
+		applog(LOG_INFO, "lyra2: %s %s%s%s", algo_names[hashes[h].algo], rates, rates2,
+			same ? "" : ", MISMATCH");
+		valid = valid && same;
+	}
+	bench_hashes_free(&bh);
+	return valid;
+}
+
+static const struct {
+	const char *name;
+	bool (*run)();
+} cpu_benchs[] = {
+	{ "mtp-tree", cpu_bench_mtp_tree },
+	{ "mtp-solver", cpu_bench_mtp_solver },
+	{ "mtp-fill", cpu_bench_mtp_fill },
+	{ "mtp-submit", cpu_bench_mtp_submit },
+	{ "stratum-headers", cpu_bench_stratum_headers },
+	{ "gbt-merkle", cpu_bench_gbt_merkle },
+	{ "stratum-replay", cpu_bench_stratum_replay },
+	{ "thread-queue", cpu_bench_thread_queue },
+	{ "hashlog", cpu_bench_hashlog },
+	{ "verify", cpu_bench_verify },
+	{ "scratch", cpu_bench_scratch },
+	{ "lyra2", cpu_bench_lyra2 },
+};
+
+/* run the NAME (or all) cpu benchmark, false if one of its checks failed */
+bool cpu_bench(const char *arg)
+{
+	const int count = (int) (sizeof(cpu_benchs) / sizeof(cpu_benchs[0]));
+	bool valid = true;
+	char name[64];
+	// NAME[:ARG]
+	snprintf(name, sizeof(name), "%s", arg);
+	char *sep = strchr(name, ':');
+	if (sep) {
+		*sep = '\0';
+		cpu_bench_arg = arg + (sep - name) + 1;
+	}
+	for (int i = 0; i < count; i++) {
+		if (!strcasecmp(name, cpu_benchs[i].name) || !strcasecmp(name, "all")) {
+			applog(LOG_BLUE, "CPU benchmark %s...", cpu_benchs[i].name);
+			if (!cpu_benchs[i].run()) {
+				applog(LOG_ERR, "CPU benchmark %s failed", cpu_benchs[i].name);
+				valid = false;
+			}
+			if (strcasecmp(name, "all")) return valid;
+		}
+	}
+	if (strcasecmp(name, "all")) {
+		char list[256] = { 0 };
+		for (int i = 0; i < count; i++) {
+			strcat(list, " ");
+			strcat(list, cpu_benchs[i].name);
+		}
+		applog(LOG_ERR, "Unknown cpu benchmark %s, available ones:%s all", name, list);
+		return false;
+	}
+	return valid;
+}
@@ -21,6 +21,10 @@
 #include <sys/time.h>
 #include <time.h>
 #include <signal.h>
+#include <stddef.h>
+#include <atomic>
+#include <string>
+#include <unordered_map>
 
 #include <curl/curl.h>
 #include <openssl/sha.h>
@@ -112,6 +116,7 @@ bool opt_quiet = false;
 int opt_maxlograte = 3;
 static int opt_retries = -1;
 static int opt_fail_pause = 2;
+static int opt_submit_threads = 2;
 int opt_time_limit = -1;
 int opt_shares_limit = -1;
 time_t firstwork_time = 0;
@@ -129,6 +134,8 @@ static double opt_difficulty = 1.;
 bool opt_extranonce = true;
 bool opt_trust_pool = false;
 uint16_t opt_vote = 9999;
+bool opt_cpu_mining = false;
+int opt_cpu_threads = 0;
 int num_cpus;
 int active_gpus;
 char * device_name[MAX_GPUS];
@@ -190,6 +197,7 @@ struct thr_api *thr_api;
 int longpoll_thr_id = -1;
 int stratum_thr_id = -1;
 int api_thr_id = -1;
+int submit_thr_id = -1;
 bool stratum_need_reset = false;
 volatile bool abort_flag = false;
 struct work_restart *work_restart = NULL;
@@ -295,13 +303,15 @@ Options:\n\
   -r, --retries=N       number of times to retry if a network call fails\n\
                           (default: retry indefinitely)\n\
   -R, --retry-pause=N   time to pause between retries, in seconds (default: 30)\n\
+      --submit-threads=N  threads sending getwork/gbt solutions, 0 to send\n\
+                          them from the workio thread (default: 2)\n\
       --shares-limit    maximum shares [s] to mine before exiting the program.\n\
       --time-limit      maximum time [s] to mine before exiting the program.\n\
   -T, --timeout=N       network timeout, in seconds (default: 300)\n\
   -s, --scantime=N      upper bound on time spent scanning current work when\n\
                           long polling is unavailable, in seconds (default: 10)\n\
   -n, --ndevs           list cuda devices\n\
-  -N, --statsavg        number of samples used to compute hashrate (default: 30)\n\
+  -N, --statsavg        number of samples used to compute hashrate (default: 30, max: 256)\n\
       --no-gbt          disable getblocktemplate support (height check in solo)\n\
       --coinbase-addr=ADDR  payout address for solo mining\n\
       --coinbase-sig=TEXT  data to insert in the coinbase when possible\n\
@@ -313,6 +323,8 @@ Options:\n\
       --no-color        disable colored output\n\
   -D, --debug           enable debug output\n\
   -P, --protocol-dump   verbose dump of protocol-level activities\n\
+      --protocol-capture=FILE  save the raw stratum stream received (replay it\n\
+                        with --cpu-bench stratum-replay:FILE)\n\
       --cpu-affinity    set process affinity to cpu core(s), mask 0x3 for cores 0 and 1\n\
       --cpu-priority    set process priority (default: 3) 0 idle, 2 normal to 5 highest\n\
   -b, --api-bind=port   IP:port for the miner API (default: 127.0.0.1:4068), 0 disabled\n\
@@ -345,6 +357,9 @@ Options:\n\
   -B, --background      run the miner in the background\n\
       --benchmark       run in offline benchmark mode\n\
       --cputest         debug hashes from cpu algorithms\n\
+      --cpu-bench=NAME[:ARG] run a cpu micro benchmark (NAME or all) and exit\n\
+      --cpu             mine on the cpu cores, without cuda device\n\
+      --cpu-threads=N   number of cpu worker threads (default: cpu cores)\n\
   -c, --config=FILE     load a JSON-format configuration file\n\
   -V, --version         display version information and exit\n\
   -h, --help            display this help text and exit\n\
@@ -365,6 +380,9 @@ struct option options[] = {
 	{ "cert", 1, NULL, 1001 },
 	{ "config", 1, NULL, 'c' },
 	{ "cputest", 0, NULL, 1006 },
+	{ "cpu-bench", 1, NULL, 1026 },
+	{ "cpu", 0, NULL, 1029 },
+	{ "cpu-threads", 1, NULL, 1031 },
 	{ "no-getwork", 0, NULL, 1010 },
 	{ "coinbase-addr", 1, NULL, 1016 },
 	{ "coinbase-sig", 1, NULL, 1015 },
@@ -401,10 +419,12 @@ struct option options[] = {
 	{ "pool-max-rate", 1, NULL, 1162 }, // pool
 	{ "pool-disabled", 1, NULL, 1199 }, // pool
 	{ "protocol-dump", 0, NULL, 'P' },
+	{ "protocol-capture", 1, NULL, 1027 },
 	{ "proxy", 1, NULL, 'x' },
 	{ "quiet", 0, NULL, 'q' },
 	{ "retries", 1, NULL, 'r' },
 	{ "retry-pause", 1, NULL, 'R' },
+	{ "submit-threads", 1, NULL, 1028 },
 	{ "scantime", 1, NULL, 's' },
 	{ "show-diff", 0, NULL, 1013 },
 	{ "hide-diff", 0, NULL, 1014 },
@@ -458,6 +478,12 @@ Scrypt specific options:\n\
 struct work _ALIGN(64) g_work;
 volatile time_t g_work_time;
 pthread_mutex_t g_work_lock;
+
+// read only copies of g_work for the miner threads, see work_publish()
+static struct work *work_slots;
+static int work_slot_count;
+static std::atomic<int> work_current(0); // slot + 1, 0 until the first work
+static std::atomic<int> *work_hazard;    // slot + 1 read by each miner thread
 static char *lp_id;
 
 // get const array size (defined in ccminer.cpp)
@@ -482,43 +508,64 @@ static inline void drop_policy(void) {
 #endif
 }
 
-static void affine_to_cpu_mask(int id, unsigned long mask) {
+void affine_to_cpu_mask(int id, unsigned long mask) {
 	cpu_set_t set;
 	CPU_ZERO(&set);
-	for (uint8_t i = 0; i < num_cpus; i++) {
+	for (int i = 0; i < num_cpus && i < (int) (sizeof(mask) * 8); i++) {
 		// cpu mask
 		if (mask & (1UL<<i)) { CPU_SET(i, &set); }
 	}
 	if (id == -1) {
 		// process affinity
-		sched_setaffinity(0, sizeof(&set), &set);
+		sched_setaffinity(0, sizeof(set), &set);
 	} else {
-		// thread only
-		pthread_setaffinity_np(thr_info[id].pth, sizeof(&set), &set);
+		// calling thread only (miner or cpu worker)
+		pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
 	}
 }
+// calling thread on a single cpu, any index (no mask width limit)
+void affine_to_cpu(int cpu) {
+	cpu_set_t set;
+	if (cpu >= CPU_SETSIZE)
+		return;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
 #elif defined(__FreeBSD__) /* FreeBSD specific policy and affinity management */
 #include <sys/cpuset.h>
 static inline void drop_policy(void) { }
-static void affine_to_cpu_mask(int id, unsigned long mask) {
+void affine_to_cpu_mask(int id, unsigned long mask) {
 	cpuset_t set;
 	CPU_ZERO(&set);
-	for (uint8_t i = 0; i < num_cpus; i++) {
+	for (int i = 0; i < num_cpus && i < (int) (sizeof(mask) * 8); i++) {
 		if (mask & (1UL<<i)) CPU_SET(i, &set);
 	}
 	cpuset_setaffinity(CPU_LEVEL_WHICH, CPU_WHICH_TID, -1, sizeof(cpuset_t), &set);
 }
+void affine_to_cpu(int cpu) {
+	cpuset_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	cpuset_setaffinity(CPU_LEVEL_WHICH, CPU_WHICH_TID, -1, sizeof(cpuset_t), &set);
+}
 #elif defined(WIN32) /* Windows */
 static inline void drop_policy(void) { }
-static void affine_to_cpu_mask(int id, unsigned long mask) {
+void affine_to_cpu_mask(int id, unsigned long mask) {
 	if (id == -1)
 		SetProcessAffinityMask(GetCurrentProcess(), mask);
 	else
 		SetThreadAffinityMask(GetCurrentThread(), mask);
 }
+void affine_to_cpu(int cpu) {
+	// the cpus past the first processor group are left to the scheduler
+	if (cpu < (int) (sizeof(DWORD_PTR) * 8))
+		SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR) 1 << cpu);
+}
 #else /* Martians */
 static inline void drop_policy(void) { }
-static void affine_to_cpu_mask(int id, uint8_t mask) { }
+void affine_to_cpu_mask(int id, unsigned long mask) { }
+void affine_to_cpu(int cpu) { }
 #endif
 
 static bool get_blocktemplate(CURL *curl, struct work *work);
@@ -538,6 +585,7 @@ void proper_exit(int reason)
 		return;
 
 	abort_flag = true;
+	stratum_wakeup();
 	usleep(200 * 1000);
 	cuda_shutdown();
 
@@ -747,6 +795,60 @@ static bool work_decode(const json_t *val, struct work *work)
 #define YAY "yay!!!"
 #define BOO "booooo"
 
+/* stratum shares waiting for their answer, indexed by request id */
+#define SUBMIT_INFLIGHT 64
+#define SUBMIT_FIRST_ID 16
+
+struct submit_entry {
+	uint32_t id;
+	int pooln;
+	double sharediff;
+	struct timeval tv_sent;
+};
+
+static struct submit_entry submits[SUBMIT_INFLIGHT];
+static uint32_t submit_next_id = SUBMIT_FIRST_ID;
+static pthread_mutex_t submit_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// remember a share before it is sent, returns the request id to use
+static uint32_t submit_track(int pooln, double sharediff)
+{
+	struct submit_entry *e;
+	uint32_t id;
+
+	pthread_mutex_lock(&submit_lock);
+	id = submit_next_id++;
+	if (!submit_next_id)
+		submit_next_id = SUBMIT_FIRST_ID;
+	// a share still unanswered SUBMIT_INFLIGHT submits later is lost
+	e = &submits[id % SUBMIT_INFLIGHT];
+	e->id = id;
+	e->pooln = pooln;
+	e->sharediff = sharediff;
+	gettimeofday(&e->tv_sent, NULL);
+	pthread_mutex_unlock(&submit_lock);
+
+	return id;
+}
+
+// find the share answered by request id and release its entry
+static bool submit_answer(uint32_t id, struct submit_entry *share)
+{
+	struct submit_entry *e;
+	bool found;
+
+	pthread_mutex_lock(&submit_lock);
+	e = &submits[id % SUBMIT_INFLIGHT];
+	found = (id >= SUBMIT_FIRST_ID && e->id == id);
+	if (found) {
+		memcpy(share, e, sizeof(*share));
+		e->id = 0;
+	}
+	pthread_mutex_unlock(&submit_lock);
+
+	return found;
+}
+
 int share_result(int result, int pooln, double sharediff, const char *reason)
 {
 	const char *flag;
@@ -755,11 +857,13 @@ int share_result(int result, int pooln, double sharediff, const char *reason)
 	double hashrate = 0.;
 	struct pool_infos *p = &pools[pooln];
 
+	unsigned long accepted, total;
+
+	// answers can come from the stratum thread and the submit threads
 	pthread_mutex_lock(&stats_lock);
 	for (int i = 0; i < opt_n_threads; i++) {
 		hashrate += stats_get_speed(i, thr_hashrates[i]);
 	}
-	pthread_mutex_unlock(&stats_lock);
 
 	result ? p->accepted_count++ : p->rejected_count++;
 
@@ -767,29 +871,33 @@ int share_result(int result, int pooln, double sharediff, const char *reason)
 	if (sharediff > p->best_share)
 		p->best_share = sharediff;
 
+	if (net_diff && sharediff >= net_diff)
+		p->solved_count++;
+
+	accepted = p->accepted_count;
+	total = p->accepted_count + p->rejected_count;
+	pthread_mutex_unlock(&stats_lock);
+
 	global_hashrate = llround(hashrate);
 
 	format_hashrate(hashrate, s);
 	if (opt_showdiff)
 		sprintf(suppl, "diff %.3f", sharediff);
 	else // accepted percent
-		sprintf(suppl, "%.2f%%", 100. * p->accepted_count / (p->accepted_count + p->rejected_count));
+		sprintf(suppl, "%.2f%%", 100. * accepted / total);
 
 	if (!net_diff || sharediff < net_diff) {
 		flag = use_colors ?
 			(result ? CL_GRN YES : CL_RED BOO)
 		:	(result ? "(" YES ")" : "(" BOO ")");
 	} else {
-		p->solved_count++;
 		flag = use_colors ?
 			(result ? CL_GRN YAY : CL_RED BOO)
 		:	(result ? "(" YAY ")" : "(" BOO ")");
 	}
 
 	applog(LOG_NOTICE, "accepted: %lu/%lu (%s), %s %s",
-			p->accepted_count,
-			p->accepted_count + p->rejected_count,
-			suppl, s, flag);
+			accepted, total, suppl, s, flag);
 	if (reason) {
 		applog(LOG_WARNING, "reject reason: %s", reason);
 		if (!check_dups && strncasecmp(reason, "duplicate", 9) == 0) {
@@ -851,7 +959,7 @@ static bool submit_upstream_work(CURL *curl, struct work *work)
 */
 	if (pool->type & POOL_STRATUM) {
 		uint32_t sent = 0;
-		uint32_t ntime, nonce;
+		uint32_t ntime, nonce, submit_id;
 		char *ntimestr, *noncestr, *xnonce2str, *nvotestr;
 		uint16_t nvote = 0;
 
@@ -931,6 +1039,7 @@ static bool submit_upstream_work(CURL *curl, struct work *work)
 
 		// store to keep/display the solved ratio/diff
 		stratum.sharediff = work->sharediff[idnonce];
+		submit_id = submit_track(work->pooln, stratum.sharediff);
 
 		if (net_diff && stratum.sharediff > net_diff && (opt_debug || opt_debug_diff))
 			applog(LOG_INFO, "share diff: %.5f, possible block found!!!",
@@ -942,13 +1051,13 @@ static bool submit_upstream_work(CURL *curl, struct work *work)
 		if (opt_vote) { // ALGO_HEAVY ALGO_DECRED
 			nvotestr = bin2hex((const uchar*)(&nvote), 2);
 			sprintf(s, "{\"method\": \"mining.submit\", \"params\": ["
-					"\"%s\", \"%s\", \"%s\", \"%s\", \"%s\", \"%s\"], \"id\":%d}",
-					pool->user, work->job_id + 8, xnonce2str, ntimestr, noncestr, nvotestr, 10+idnonce);
+					"\"%s\", \"%s\", \"%s\", \"%s\", \"%s\", \"%s\"], \"id\":%u}",
+					pool->user, work->job_id + 8, xnonce2str, ntimestr, noncestr, nvotestr, submit_id);
 			free(nvotestr);
 		} else {
 			sprintf(s, "{\"method\": \"mining.submit\", \"params\": ["
-					"\"%s\", \"%s\", \"%s\", \"%s\", \"%s\"], \"id\":%d}",
-					pool->user, work->job_id + 8, xnonce2str, ntimestr, noncestr, 10+idnonce);
+					"\"%s\", \"%s\", \"%s\", \"%s\", \"%s\"], \"id\":%u}",
+					pool->user, work->job_id + 8, xnonce2str, ntimestr, noncestr, submit_id);
 		}
 		free(xnonce2str);
 		free(ntimestr);
@@ -1083,6 +1192,9 @@ static bool submit_upstream_work(CURL *curl, struct work *work)
 	return true;
 }
 
+// kept between the shares encoded by a workio or submit thread
+static __thread struct submit_buf mtp_submit = { 0 };
+
 static bool submit_upstream_work_mtp(CURL *curl, struct work *work, struct mtp *mtp)
 {
 //	restart_threads();
@@ -1094,155 +1206,51 @@ static bool submit_upstream_work_mtp(CURL *curl, struct work *work, struct mtp *
 	bool stale_work = false;
 	int idnonce = 0;
 
-	uint32_t SizeMerkleRoot = 16;
-	uint32_t SizeReserved = 64;
-	uint32_t SizeMtpHash = 32;
-	uint32_t SizeBlockMTP = MTPC_L *2*128*8;
-	uint32_t SizeProofMTP = MTPC_L *3*353;
 //printf("rpc user %s\n",rpc_user);
 	
-		if (pool->type & POOL_STRATUM) {
-
-			uint32_t sent = 0;
-			uint32_t ntime, nonce;
-			char *ntimestr, *noncestr, *xnonce2str, *nvotestr;
-
-			le32enc(&ntime, work->data[17]);
-			le32enc(&nonce, work->data[19]);
-			char *sobid = (char*)malloc(9);
-			sprintf(sobid,"%s",work->job_id+8);
-
-		json_t *MyObject = json_object();
-		json_t *json_arr = json_array();
-		json_object_set(MyObject, "id", json_integer(4));
-		json_object_set(MyObject, "method", json_string("mining.submit"));
-
-		json_array_append(json_arr, json_string(rpc_user));
-
-		int Err = 0;
-	
-		uchar hexjob_id[4]; // = (uchar*)malloc(4);
-		hex2bin((uchar*)&hexjob_id, sobid, 4);
-//		printf("the submitted job id = %s \n",sobid);
-		free(sobid);
-
-		json_array_append(json_arr, json_bytes((uchar*)&hexjob_id, 4));		
-		json_array_append(json_arr, json_bytes(work->xnonce2, sizeof(uint64_t)));
-		json_array_append(json_arr, json_bytes((uchar*)&ntime, sizeof(uint32_t)));
-		json_array_append(json_arr, json_bytes((uchar*)&nonce, sizeof(uint32_t)));
-		json_array_append(json_arr, json_bytes(mtp->MerkleRoot, SizeMerkleRoot));
-		json_array_append(json_arr, json_bytes((uchar*)mtp->nBlockMTP, SizeBlockMTP));
-		json_array_append(json_arr, json_bytes(mtp->nProofMTP, SizeProofMTP));
-
-		json_object_set(MyObject, "params", json_arr);
+	if (pool->type & POOL_STRATUM) {
+		uint32_t ntime, nonce;
+		uchar hexjob_id[4];
 
-		json_error_t *boserror = (json_error_t *)malloc(sizeof(json_error_t));
-		bos_t *serialized = bos_serialize(MyObject, boserror);
+		le32enc(&ntime, work->data[17]);
+		le32enc(&nonce, work->data[19]);
+		hex2bin(hexjob_id, work->job_id + 8, 4);
 
 		stratum.sharediff = work->sharediff[0];
+		uint32_t submit_id = submit_track(work->pooln, stratum.sharediff);
 
-		if (unlikely(!stratum_send_line_bos(&stratum, serialized))) {
-			applog(LOG_ERR, "submit_upstream_work stratum_send_line failed");
-			free(boserror);
-			json_decref(MyObject);
-			bos_free(serialized);
+		if (!mtp_submit_bos(&mtp_submit, submit_id, rpc_user, hexjob_id, work->xnonce2, ntime, nonce, mtp, MTPC_L)) {
+			applog(LOG_ERR, "submit_upstream_work unable to encode the share");
 			return false;
 		}
-		free(boserror);
-		json_decref(MyObject);
-		bos_free(serialized);
-		//		stratum_recv_line_compact(&stratum);
+		bos_t frame = { mtp_submit.data, (uint32_t) mtp_submit.size };
 
-//		free(mtp);
+		if (unlikely(!stratum_send_line_bos(&stratum, &frame))) {
+			applog(LOG_ERR, "submit_upstream_work stratum_send_line failed");
+			return false;
+		}
 		return true;
-
 	}
 	else if (work->txs) { /* gbt */
+		char *params = NULL;
 
-
-
-
-	int data_size = 84;
-//	int data_size = 128;
-	int adata_sz = data_size / sizeof(uint32_t);
-
-	char *proofmtp_str = (char*)malloc(2*SizeProofMTP+1);
-	char *blockmtp_str = (char*)malloc(2*SizeBlockMTP+1);
-	char *merkleroot_str = (char*)malloc(2*SizeMerkleRoot+1);
-	char *mtphashvalue_str = (char*)malloc(2 * SizeMtpHash + 1);
-	char *mtpreserved_str = (char*)malloc(2*SizeReserved+1);
-
-	for (uint32_t i = 0; i < SizeMerkleRoot; i++)
-	{
-		sprintf(&merkleroot_str[2*i], "%02x", mtp->MerkleRoot[i]);
-	}
-
-	for (uint32_t i = 0; i < SizeMtpHash; i++)
-	{
-		sprintf(&mtphashvalue_str[2 * i], "%02x", mtp->mtpHashValue[i]);
-	}
-
-
-	for (uint32_t i = 0; i < SizeReserved; i++)
-	{
-		sprintf(&mtpreserved_str[2 * i], "%02x", 0);
-	}
-
-
-	for (uint32_t i = 0; i < MTPC_L *2; i++)
-	{
-		for (uint32_t j = 0; j < 1024; j++)
-			sprintf(&blockmtp_str[2*(j + 1024*i)], "%02x", ((uchar*)mtp->nBlockMTP[i])[j]);
-	}
-
-
-	
-	for (int i = 0;i< SizeProofMTP;i++)
-	sprintf(&proofmtp_str[2*i],"%02x",mtp->nProofMTP[i]);
-
-
-
-		char data_str[2 * sizeof(work->data) + 1];
-		char data_check[2* sizeof(work->data)+1];
-		char *req;
-	
 		for (int i = 0; i < ARRAY_SIZE(work->data); i++)
 			le32enc(work->data + i, work->data[i]);
 
-		dbin2hex(data_str, (unsigned char *)work->data, 84);
-		
-		for (int i=0;i<84;i++)
-		sprintf(&data_check[2*i],"%02x",((uint8_t*)work->data)[i]);
-		
-
 		if (work->workid) {
-			char *params;
 			val = json_object();
 			json_object_set_new(val, "workid", json_string(work->workid));
 			params = json_dumps(val, 0);
 			json_decref(val);
-
-			req = (char*)malloc(128 + 2 * 84 + strlen(work->txs) + strlen(params) + strlen(mtphashvalue_str) 
-									+ strlen(mtpreserved_str)  + strlen(merkleroot_str)+ strlen(proofmtp_str) + strlen(blockmtp_str));
-			sprintf(req,
-				"{\"method\": \"submitblock\", \"params\": [\"%s%s%s%s%s%s%s\", %s], \"id\":4}\r\n",
-				data_str, mtphashvalue_str, mtpreserved_str, merkleroot_str, blockmtp_str, proofmtp_str, work->txs, params);
-			free(params);
-
 		}
-		else {
-			req = (char*)malloc(128 + 2 * 84 + strlen(work->txs) + strlen(mtphashvalue_str) + strlen(mtpreserved_str)  
-											 + strlen(merkleroot_str) + strlen(proofmtp_str) + strlen(blockmtp_str) );
-			sprintf(req,
-				"{\"method\": \"submitblock\", \"params\": [\"%s%s%s%s%s%s%s\"], \"id\":4}\r\n",
-				data_str, mtphashvalue_str, mtpreserved_str, merkleroot_str, blockmtp_str, proofmtp_str, work->txs);
-		}
-
-//		val = json_rpc_call(curl, rpc_url, rpc_userpass, req, NULL, 0);
-//		printf("work->txs=%s\n",work->txs);
-		val = json_rpc_call_pool(curl, pool, req, false, false, NULL);
-//		printf("not submitting block\n");
-		free(req);
+		bool encoded = mtp_submit_gbt(&mtp_submit, work->data, mtp, MTPC_L, work->txs, params);
+		free(params);
+		if (!encoded) {
+			applog(LOG_ERR, "submit_upstream_work unable to encode the block");
+			return false;
+		}
+
+		val = json_rpc_call_pool(curl, pool, (const char*) mtp_submit.data, false, false, NULL);
 		if (unlikely(!val)) {
 			applog(LOG_ERR, "submit_upstream_work json_rpc_call failed");
 			return false;
@@ -1268,11 +1276,6 @@ static bool submit_upstream_work_mtp(CURL *curl, struct work *work, struct mtp *
 			share_result(json_is_null(res), work->pooln, work->sharediff[0], json_string_value(res));
 
 		json_decref(val);
-		free(proofmtp_str); 
-		free(blockmtp_str); 
-		free(merkleroot_str);
-		free(mtpreserved_str);
-		free(mtphashvalue_str);
 	}
 //free(proof_str);
 
@@ -1292,11 +1295,6 @@ static bool submit_upstream_work_mtptcr(CURL *curl, struct work *work, struct mt
 	bool stale_work = false;
 	int idnonce = 0;
 
-	uint32_t SizeMerkleRoot = 16;
-	uint32_t SizeReserved = 64;
-	uint32_t SizeMtpHash = 32;
-	uint32_t SizeBlockMTP = MTPC_L * 2 * 128 * 8;
-	uint32_t SizeProofMTP = MTPC_L * 3 * 353;
 	//printf("rpc user %s\n",rpc_user);
 
 
@@ -1304,147 +1302,48 @@ static bool submit_upstream_work_mtptcr(CURL *curl, struct work *work, struct mt
 
 
 	if (pool->type & POOL_STRATUM) {
-
-		uint32_t sent = 0;
 		uint32_t ntime, nonce;
-		char *ntimestr, *noncestr, *xnonce2str, *nvotestr;
+		uchar hexjob_id[4];
 
 		le32enc(&ntime, work->data[17]);
 		le32enc(&nonce, work->data[19]);
-		char *sobid = (char*)malloc(9);
-		sprintf(sobid, "%s", work->job_id + 8);
-
-		json_t *MyObject = json_object();
-		json_t *json_arr = json_array();
-		json_object_set(MyObject, "id", json_integer(4));
-		json_object_set(MyObject, "method", json_string("mining.submit"));
-
-		json_array_append(json_arr, json_string(rpc_user));
-
-		int Err = 0;
-
-		uchar hexjob_id[4]; // = (uchar*)malloc(4);
-		hex2bin((uchar*)&hexjob_id, sobid, 4);
-		//		printf("the submitted job id = %s \n",sobid);
-		free(sobid);
-
-		json_array_append(json_arr, json_bytes((uchar*)&hexjob_id, 4));
-		json_array_append(json_arr, json_bytes(work->xnonce2, sizeof(uint64_t)));
-		json_array_append(json_arr, json_bytes((uchar*)&ntime, sizeof(uint32_t)));
-		json_array_append(json_arr, json_bytes((uchar*)&nonce, sizeof(uint32_t)));
-		json_array_append(json_arr, json_bytes(mtp->MerkleRoot, SizeMerkleRoot));
-		json_array_append(json_arr, json_bytes((uchar*)mtp->nBlockMTP, SizeBlockMTP));
-		json_array_append(json_arr, json_bytes(mtp->nProofMTP, SizeProofMTP));
-
-		json_object_set(MyObject, "params", json_arr);
-
-		json_error_t *boserror = (json_error_t *)malloc(sizeof(json_error_t));
-		bos_t *serialized = bos_serialize(MyObject, boserror);
+		hex2bin(hexjob_id, work->job_id + 8, 4);
 
 		stratum.sharediff = work->sharediff[0];
+		uint32_t submit_id = submit_track(work->pooln, stratum.sharediff);
 
-		if (unlikely(!stratum_send_line_bos(&stratum, serialized))) {
-			applog(LOG_ERR, "submit_upstream_work stratum_send_line failed");
-			free(boserror);
-			json_decref(MyObject);
-			bos_free(serialized);
+		if (!mtp_submit_bos(&mtp_submit, submit_id, rpc_user, hexjob_id, work->xnonce2, ntime, nonce, mtp, MTPC_L)) {
+			applog(LOG_ERR, "submit_upstream_work unable to encode the share");
 			return false;
 		}
-		free(boserror);
-		json_decref(MyObject);
-		bos_free(serialized);
-		//		stratum_recv_line_compact(&stratum);
+		bos_t frame = { mtp_submit.data, (uint32_t) mtp_submit.size };
 
-		//		free(mtp);
+		if (unlikely(!stratum_send_line_bos(&stratum, &frame))) {
+			applog(LOG_ERR, "submit_upstream_work stratum_send_line failed");
+			return false;
+		}
 		return true;
-
 	}
 	else if (work->txs) { /* gbt */
-
-
-
-
-		int data_size = 84;
-		//	int data_size = 128;
-		int adata_sz = data_size / sizeof(uint32_t);
-
-		char *proofmtp_str = (char*)malloc(2 * SizeProofMTP + 1);
-		char *blockmtp_str = (char*)malloc(2 * SizeBlockMTP + 1);
-		char *merkleroot_str = (char*)malloc(2 * SizeMerkleRoot + 1);
-		char *mtphashvalue_str = (char*)malloc(2 * SizeMtpHash + 1);
-		char *mtpreserved_str = (char*)malloc(2 * SizeReserved + 1);
-
-		for (uint32_t i = 0; i < SizeMerkleRoot; i++)
-		{
-			sprintf(&merkleroot_str[2 * i], "%02x", mtp->MerkleRoot[i]);
-		}
-
-		for (uint32_t i = 0; i < SizeMtpHash; i++)
-		{
-			sprintf(&mtphashvalue_str[2 * i], "%02x", mtp->mtpHashValue[i]);
-		}
-
-
-		for (uint32_t i = 0; i < SizeReserved; i++)
-		{
-			sprintf(&mtpreserved_str[2 * i], "%02x", 0);
-		}
-
-
-		for (uint32_t i = 0; i < MTPC_L * 2; i++)
-		{
-			for (uint32_t j = 0; j < 1024; j++)
-				sprintf(&blockmtp_str[2 * (j + 1024 * i)], "%02x", ((uchar*)mtp->nBlockMTP[i])[j]);
-		}
-
-
-
-		for (int i = 0; i< SizeProofMTP; i++)
-			sprintf(&proofmtp_str[2 * i], "%02x", mtp->nProofMTP[i]);
-
-
-
-		char data_str[2 * sizeof(work->data) + 1];
-		char data_check[2 * sizeof(work->data) + 1];
-		char *req;
+		char *params = NULL;
 
 		for (int i = 0; i < ARRAY_SIZE(work->data); i++)
 			le32enc(work->data + i, work->data[i]);
 
-		dbin2hex(data_str, (unsigned char *)work->data, 84);
-
-		for (int i = 0; i<84; i++)
-			sprintf(&data_check[2 * i], "%02x", ((uint8_t*)work->data)[i]);
-
-
 		if (work->workid) {
-			char *params;
 			val = json_object();
 			json_object_set_new(val, "workid", json_string(work->workid));
 			params = json_dumps(val, 0);
 			json_decref(val);
-
-			req = (char*)malloc(128 + 2 * 84 + strlen(work->txs) + strlen(params) + strlen(mtphashvalue_str)
-				+ strlen(mtpreserved_str) + strlen(merkleroot_str) + strlen(proofmtp_str) + strlen(blockmtp_str));
-			sprintf(req,
-				"{\"method\": \"submitblock\", \"params\": [\"%s%s%s%s%s%s%s\", %s], \"id\":4}\r\n",
-				data_str, mtphashvalue_str, mtpreserved_str, merkleroot_str, blockmtp_str, proofmtp_str, work->txs, params);
-			free(params);
-
 		}
-		else {
-			req = (char*)malloc(128 + 2 * 84 + strlen(work->txs) + strlen(mtphashvalue_str) + strlen(mtpreserved_str)
-				+ strlen(merkleroot_str) + strlen(proofmtp_str) + strlen(blockmtp_str));
-			sprintf(req,
-				"{\"method\": \"submitblock\", \"params\": [\"%s%s%s%s%s%s%s\"], \"id\":4}\r\n",
-				data_str, mtphashvalue_str, mtpreserved_str, merkleroot_str, blockmtp_str, proofmtp_str, work->txs);
-		}
-
-		//		val = json_rpc_call(curl, rpc_url, rpc_userpass, req, NULL, 0);
-		//		printf("work->txs=%s\n",work->txs);
-		val = json_rpc_call_pool(curl, pool, req, false, false, NULL);
-		//		printf("not submitting block\n");
-		free(req);
+		bool encoded = mtp_submit_gbt(&mtp_submit, work->data, mtp, MTPC_L, work->txs, params);
+		free(params);
+		if (!encoded) {
+			applog(LOG_ERR, "submit_upstream_work unable to encode the block");
+			return false;
+		}
+
+		val = json_rpc_call_pool(curl, pool, (const char*) mtp_submit.data, false, false, NULL);
 		if (unlikely(!val)) {
 			applog(LOG_ERR, "submit_upstream_work json_rpc_call failed");
 			return false;
@@ -1470,11 +1369,6 @@ static bool submit_upstream_work_mtptcr(CURL *curl, struct work *work, struct mt
 			share_result(json_is_null(res), work->pooln, work->sharediff[0], json_string_value(res));
 
 		json_decref(val);
-		free(proofmtp_str);
-		free(blockmtp_str);
-		free(merkleroot_str);
-		free(mtpreserved_str);
-		free(mtphashvalue_str);
 	}
 	//free(proof_str);
 
@@ -1486,6 +1380,223 @@ static bool submit_upstream_work_mtptcr(CURL *curl, struct work *work, struct mt
 
 #define BLOCK_VERSION_CURRENT 3
 // to fix
+/* sha256d of the template transactions, most of them stay in the next templates */
+struct gbt_txid {
+	uchar hash[32];
+	int size;
+	uint32_t seen;
+};
+
+/* packed coinbase output of a payee, base58 decoded once */
+#define GBT_PAYEES 16
+struct gbt_payee {
+	std::string address;
+	int64_t amount;
+	uchar data[64];
+	int size;
+};
+
+/* what the next template can reuse from the previous ones, gbt_lock held */
+static struct gbt_template {
+	uint32_t seq;
+	std::unordered_map<std::string, struct gbt_txid> txids;
+	// transactions of the last template, their hex and the coinbase branch
+	int tx_count;
+	int tx_alloc;
+	uchar (*tx_hashes)[32];
+	uchar (*tree)[32];
+	char *txs_hex;
+	size_t txs_hex_len;
+	size_t txs_hex_alloc;
+	uchar branch[32][32];
+	int branch_count;
+	bool tx_changed;
+	struct gbt_payee payees[GBT_PAYEES];
+	int payee_next;
+	uchar *cbtx;
+	size_t cbtx_alloc;
+	uchar *tx;
+	size_t tx_buf_alloc;
+} gbt_tpl;
+
+static pthread_mutex_t gbt_lock = PTHREAD_MUTEX_INITIALIZER;
+double gbt_decode_ms = 0.;
+
+/* hash the template transactions into hashes[], only the transactions new
+ * in this template are decoded */
+static bool gbt_hash_transactions(const json_t *txa, int tx_count, uchar (*hashes)[32])
+{
+	struct gbt_template *tpl = &gbt_tpl;
+	const uint32_t seq = ++tpl->seq;
+	bool rc = true;
+
+	for (int i = 0; i < tx_count; i++) {
+		const json_t *tmp = json_array_get(txa, i);
+		const char *tx_hex = json_string_value(json_object_get(tmp, "data"));
+		if (!tx_hex) {
+			rc = false;
+			break;
+		}
+		const int tx_size = (int) (strlen(tx_hex) / 2);
+
+		// "hash" includes the witness data, "txid" is the only one of old nodes
+		const char *key = json_string_value(json_object_get(tmp, "hash"));
+		if (!key)
+			key = json_string_value(json_object_get(tmp, "txid"));
+
+		auto it = key ? tpl->txids.find(key) : tpl->txids.end();
+		if (it != tpl->txids.end() && it->second.size == tx_size) {
+			memcpy(hashes[i], it->second.hash, 32);
+			it->second.seen = seq;
+		} else {
+			if (tpl->tx_buf_alloc < (size_t) tx_size) {
+				free(tpl->tx);
+				tpl->tx_buf_alloc = tx_size;
+				tpl->tx = (uchar*) malloc(tpl->tx_buf_alloc);
+			}
+			if (!tpl->tx || !hex2bin(tpl->tx, tx_hex, tx_size)) {
+				rc = false;
+				break;
+			}
+			sha256d(hashes[i], tpl->tx, tx_size);
+			if (key) {
+				struct gbt_txid &entry = tpl->txids[key];
+				memcpy(entry.hash, hashes[i], 32);
+				entry.size = tx_size;
+				entry.seen = seq;
+			}
+		}
+	}
+
+	// forget the transactions mined or dropped from the mempool
+	for (auto it = tpl->txids.begin(); rc && it != tpl->txids.end();) {
+		if (it->second.seen != seq)
+			it = tpl->txids.erase(it);
+		else
+			++it;
+	}
+
+	return rc;
+}
+
+/* work->txs and merkle root of a template, the transactions hex and the merkle
+ * branch of the coinbase are only rebuilt when the transactions changed */
+static bool gbt_template_txs(struct work *work, const json_t *txa, int tx_count,
+	const uchar *cbtx, int cbtx_size, bool submit_coinbase, uchar *merkle_root)
+{
+	struct gbt_template *tpl = &gbt_tpl;
+	uchar txc_vi[9], node[64];
+	int i, n;
+
+	if (tpl->tx_alloc < tx_count + 2) {
+		tpl->tx_alloc = tx_count + 2;
+		free(tpl->tx_hashes);
+		free(tpl->tree);
+		tpl->tx_hashes = (uchar (*)[32]) malloc(tpl->tx_alloc * 32);
+		tpl->tree = (uchar (*)[32]) malloc(tpl->tx_alloc * 32);
+		tpl->tx_count = -1;
+		if (!tpl->tx_hashes || !tpl->tree) {
+			tpl->tx_alloc = 0;
+			return false;
+		}
+	}
+
+	// leaf 0 is the coinbase, only its branch is kept
+	if (!gbt_hash_transactions(txa, tx_count, tpl->tree + 1))
+		return false;
+
+	tpl->tx_changed = tx_count != tpl->tx_count ||
+		memcmp(tpl->tree + 1, tpl->tx_hashes, tx_count * 32);
+	if (tpl->tx_changed) {
+		size_t len = 0;
+		for (i = 0; i < tx_count; i++)
+			len += 2 * (strlen(json_string_value(json_object_get(json_array_get(txa, i), "data"))) / 2);
+		if (tpl->txs_hex_alloc < len + 1) {
+			free(tpl->txs_hex);
+			tpl->txs_hex_alloc = len + 1;
+			tpl->txs_hex = (char*) malloc(tpl->txs_hex_alloc);
+			if (!tpl->txs_hex) {
+				tpl->txs_hex_alloc = 0;
+				tpl->tx_count = -1;
+				return false;
+			}
+		}
+		tpl->txs_hex_len = 0;
+		for (i = 0; i < tx_count; i++) {
+			const char *tx_hex = json_string_value(json_object_get(json_array_get(txa, i), "data"));
+			const size_t hex_len = 2 * (strlen(tx_hex) / 2);
+			memcpy(tpl->txs_hex + tpl->txs_hex_len, tx_hex, hex_len);
+			tpl->txs_hex_len += hex_len;
+		}
+		tpl->txs_hex[tpl->txs_hex_len] = '\0';
+
+		memcpy(tpl->tx_hashes, tpl->tree + 1, tx_count * 32);
+		tpl->tx_count = tx_count;
+		memset(tpl->tree[0], 0, 32);
+		tpl->branch_count = merkle_tree_branch(tpl->branch, tpl->tree, 1 + tx_count);
+	}
+
+	sha256d(node, cbtx, cbtx_size);
+	for (i = 0; i < tpl->branch_count; i++) {
+		memcpy(node + 32, tpl->branch[i], 32);
+		sha256d(node, node, 64);
+	}
+	memcpy(merkle_root, node, 32);
+
+	n = varint_encode(txc_vi, 1 + tx_count);
+	work->txs = (char*) malloc(2 * (n + cbtx_size) + (submit_coinbase ? 0 : tpl->txs_hex_len) + 1);
+	if (!work->txs)
+		return false;
+	dbin2hex(work->txs, txc_vi, n);
+	dbin2hex(work->txs + 2 * n, cbtx, cbtx_size);
+	if (!submit_coinbase)
+		memcpy(work->txs + 2 * (n + cbtx_size), tpl->txs_hex, tpl->txs_hex_len + 1);
+
+	return true;
+}
+
+/* coinbase output paying amount to a base58 address, same bytes as
+ * job_pack_tx() + hex2bin(), returns its size */
+static int gbt_payee_output(uchar *out, const char *address, int64_t amount)
+{
+	struct gbt_template *tpl = &gbt_tpl;
+	struct gbt_payee *payee;
+	char script_payee[1024];
+	char packed[128] = { 0 };
+
+	for (int i = 0; i < GBT_PAYEES; i++) {
+		payee = &tpl->payees[i];
+		if (payee->size && payee->amount == amount && payee->address == address) {
+			memcpy(out, payee->data, payee->size);
+			return payee->size;
+		}
+	}
+
+	base58_decode(address, script_payee);
+	job_pack_tx(packed, amount, script_payee);
+
+	payee = &tpl->payees[tpl->payee_next];
+	tpl->payee_next = (tpl->payee_next + 1) % GBT_PAYEES;
+	payee->address = address;
+	payee->amount = amount;
+	payee->size = (int) (strlen(packed) / 2);
+	hex2bin(payee->data, packed, payee->size);
+	memcpy(out, payee->data, payee->size);
+	return payee->size;
+}
+
+/* coinbase buffer kept between the templates */
+static uchar *gbt_coinbase_buffer(size_t size)
+{
+	struct gbt_template *tpl = &gbt_tpl;
+	if (tpl->cbtx_alloc < size) {
+		free(tpl->cbtx);
+		tpl->cbtx = (uchar*) malloc(size);
+		tpl->cbtx_alloc = tpl->cbtx ? size : 0;
+	}
+	return tpl->cbtx;
+}
+
 static bool gbt_work_decode(const json_t *val, struct work *work)
 {
 	int i, n;
@@ -1494,9 +1605,8 @@ static bool gbt_work_decode(const json_t *val, struct work *work)
 	uint32_t target[8];
 	int cbtx_size;
 	uchar *cbtx = NULL;
-	int tx_count, tx_size;
-	uchar txc_vi[9];
-	uchar(*merkle_tree)[32] = NULL;
+	int tx_count;
+	uchar merkle_root[32];
 	bool coinbase_append = false;
 	bool submit_coinbase = false;
 	bool version_force = false;
@@ -1575,16 +1685,6 @@ static bool gbt_work_decode(const json_t *val, struct work *work)
 		goto out;
 	}
 	tx_count = (int)json_array_size(txa);
-	tx_size = 0;
-	for (i = 0; i < tx_count; i++) {
-		const json_t *tx = json_array_get(txa, i);
-		const char *tx_hex = json_string_value(json_object_get(tx, "data"));
-		if (!tx_hex) {
-			applog(LOG_ERR, "JSON invalid transactions");
-			goto out;
-		}
-		tx_size += (int)(strlen(tx_hex) / 2);
-	}
 
 	// build coinbase transaction 
 	tmp = json_object_get(val, "coinbasetxn");
@@ -1592,7 +1692,7 @@ static bool gbt_work_decode(const json_t *val, struct work *work)
 //printf("printf coinbase txn\n");
 		const char *cbtx_hex = json_string_value(json_object_get(tmp, "data"));
 		cbtx_size = cbtx_hex ? (int)strlen(cbtx_hex) / 2 : 0;
-		cbtx = (uchar*)malloc(cbtx_size + 100);
+		cbtx = gbt_coinbase_buffer(cbtx_size + 100);
 		if (cbtx_size < 60 || !hex2bin(cbtx, cbtx_hex, cbtx_size)) {
 			applog(LOG_ERR, "JSON invalid coinbasetxn");
 			goto out;
@@ -1615,7 +1715,7 @@ static bool gbt_work_decode(const json_t *val, struct work *work)
 			goto out;
 		}
 		cbvalue = (int64_t)(json_is_integer(tmp) ? json_integer_value(tmp) : json_number_value(tmp));
-		cbtx = (uchar*)malloc(256);
+		cbtx = gbt_coinbase_buffer(256);
 		le32enc((uint32_t *)cbtx, 1); // version /
 		cbtx[4] = 1; // in-counter /
 		memset(cbtx + 5, 0x00, 32); // prev txout hash /
@@ -1690,43 +1790,9 @@ static bool gbt_work_decode(const json_t *val, struct work *work)
 		}
 	}
 
-	n = varint_encode(txc_vi, 1 + tx_count);
-	work->txs = (char*)malloc(2 * (n + cbtx_size + tx_size) + 1);
-	dbin2hex(work->txs, txc_vi, n);
-	dbin2hex(work->txs + 2 * n, cbtx, cbtx_size);
-
-	// generate merkle root 
-	merkle_tree = (uchar(*)[32]) calloc(((1 + tx_count + 1) & ~1), 32);
-
-
-
-
-	sha256d(merkle_tree[0], cbtx, cbtx_size);
-
-
-	for (i = 0; i < tx_count; i++) {
-		tmp = json_array_get(txa, i);
-		const char *tx_hex = json_string_value(json_object_get(tmp, "data"));
-		const int tx_size = tx_hex ? (int)(strlen(tx_hex) / 2) : 0;
-		unsigned char *tx = (uchar*)malloc(tx_size);
-		if (!tx_hex || !hex2bin(tx, tx_hex, tx_size)) {
-			applog(LOG_ERR, "JSON invalid transactions");
-			free(tx);
-			goto out;
-		}
-		sha256d(merkle_tree[1 + i], tx, tx_size);
-		if (!submit_coinbase)
-			strcat(work->txs, tx_hex);
-	}
-	n = 1 + tx_count;
-	while (n > 1) {
-		if (n % 2) {
-			memcpy(merkle_tree[n], merkle_tree[n - 1], 32);
-			++n;
-		}
-		n /= 2;
-		for (i = 0; i < n; i++)
-			sha256d(merkle_tree[i], merkle_tree[2 * i], 64);
+	if (!gbt_template_txs(work, txa, tx_count, cbtx, cbtx_size, submit_coinbase, merkle_root)) {
+		applog(LOG_ERR, "JSON invalid transactions");
+		goto out;
 	}
 
 	// assemble block header 
@@ -1734,7 +1800,7 @@ static bool gbt_work_decode(const json_t *val, struct work *work)
 	for (i = 0; i < 8; i++)
 		work->data[8 - i] = le32dec(prevhash + i);
 	for (i = 0; i < 8; i++)
-		work->data[9 + i] = be32dec((uint32_t *)merkle_tree[0] + i);
+		work->data[9 + i] = be32dec((uint32_t *)merkle_root + i);
 	work->data[17] = swab32(curtime);
 	work->data[18] = le32dec(&bits);
 	memset(work->data + 19, 0x00, 52);
@@ -1774,8 +1840,6 @@ out:
 		}
 	}
 
-	free(merkle_tree);
-	free(cbtx);
 	return rc;
 }
 
@@ -1792,9 +1856,8 @@ static bool gbt_work_decode_mtp(const json_t *val, struct work *work)
 	uchar *cbtx = NULL;
 	int32_t mtpVersion = 0x1000;
 
-	int tx_count, tx_size;
-	uchar txc_vi[9];
-	uchar(*merkle_tree)[32] = NULL;
+	int tx_count;
+	uchar merkle_root[32];
 	bool coinbase_append = false;
 	bool submit_coinbase = false;
 	bool version_force = false;
@@ -1892,23 +1955,13 @@ static bool gbt_work_decode_mtp(const json_t *val, struct work *work)
 		goto out;
 	}
 	tx_count = (int)json_array_size(txa);
-	tx_size = 0;
-	for (i = 0; i < tx_count; i++) {
-		const json_t *tx = json_array_get(txa, i);
-		const char *tx_hex = json_string_value(json_object_get(tx, "data"));
-		if (!tx_hex) {
-			applog(LOG_ERR, "JSON invalid transactions");
-			goto out;
-		}
-		tx_size += (int)(strlen(tx_hex) / 2);
-	}
 
 	// build coinbase transaction 
 	tmp = json_object_get(val, "coinbasetxn");
 	if (tmp) {
 		const char *cbtx_hex = json_string_value(json_object_get(tmp, "data"));
 		cbtx_size = cbtx_hex ? (int)strlen(cbtx_hex) / 2 : 0;
-		cbtx = (uchar*)malloc(cbtx_size + 100);
+		cbtx = gbt_coinbase_buffer(cbtx_size + 100);
 		if (cbtx_size < 60 || !hex2bin(cbtx, cbtx_hex, cbtx_size)) {
 			applog(LOG_ERR, "JSON invalid coinbasetxn");
 			goto out;
@@ -1945,7 +1998,7 @@ static bool gbt_work_decode_mtp(const json_t *val, struct work *work)
 		}
 
 		cbvalue = (int64_t)(json_is_integer(tmp) ? json_integer_value(tmp) : json_number_value(tmp));
-		cbtx = (uchar*)malloc(256*256);
+		cbtx = gbt_coinbase_buffer(256*256);
 		le32enc((uint32_t *)cbtx, 1); // version /
 		cbtx[4] = 1; // in-counter /
 		memset(cbtx + 5, 0x00, 32); // prev txout hash /
@@ -1979,87 +2032,25 @@ static bool gbt_work_decode_mtp(const json_t *val, struct work *work)
 //		cbtx_size += (int)pk_null_size;
 
 		/// append here dev fee and masternode payment ////
-		/*   test */
-		char coinb0[90] = { 0 };
-		char coinb1[74] = { 0 };
-		char coinb2[74] = { 0 };
-		char coinb3[74] = { 0 };
-		char coinb4[74] = { 0 };
-		char coinb5[74] = { 0 };
-		char coinb6[74] = { 0 };
-		char coinb7[90] = { 0 };
-		char script_payee[1024];
-
-
-		  // for mainnet
-
-		base58_decode("aCAgTPgtYcA4EysU4UKC86EQd5cTtHtCcr", script_payee);
-		job_pack_tx(coinb1, 50000000, script_payee);
-
-		base58_decode("aHu897ivzmeFuLNB6956X6gyGeVNHUBRgD", script_payee);
-		job_pack_tx(coinb2, 50000000, script_payee);
-
-		base58_decode("aQ18FBVFtnueucZKeVg4srhmzbpAeb1KoN", script_payee);
-		job_pack_tx(coinb3, 50000000, script_payee);
-
-		base58_decode("a1HwTdCmQV3NspP2QqCGpehoFpi8NY4Zg3", script_payee);
-		job_pack_tx(coinb4, 150000000, script_payee);
-
-		base58_decode("a1kCCGddf5pMXSipLVD9hBG2MGGVNaJ15U", script_payee);
-		job_pack_tx(coinb5, 50000000, script_payee);
-
-/*		
-		// for testnet with znode payment
-		base58_decode("TDk19wPKYq91i18qmY6U9FeTdTxwPeSveo", script_payee);
-		job_pack_tx(coinb1, 50000000, script_payee);
-
-		base58_decode("TWZZcDGkNixTAMtRBqzZkkMHbq1G6vUTk5", script_payee);
-		job_pack_tx(coinb2, 50000000, script_payee);
-
-		base58_decode("TRZTFdNCKCKbLMQV8cZDkQN9Vwuuq4gDzT", script_payee);
-		job_pack_tx(coinb3, 50000000, script_payee);
-
-		base58_decode("TG2ruj59E5b1u9G3F7HQVs6pCcVDBxrQve", script_payee);
-		job_pack_tx(coinb4, 150000000, script_payee);
-
-		base58_decode("TCsTzQZKVn4fao8jDmB9zQBk9YQNEZ3XfS", script_payee);
-		job_pack_tx(coinb5, 50000000, script_payee);
-*/		
-	
-		if (mpay && json_integer_value(mnamount)!=0) {
-		base58_decode((char*)json_string_value(mnaddy), script_payee);
-//		memcpy(script_payee, json_string_value(mnscript),strlen(json_string_value(mnscript)));
-		job_pack_tx(coinb6, json_integer_value(mnamount), script_payee);
-		}
-
+		// for mainnet
+		cbtx_size += gbt_payee_output(cbtx + cbtx_size, "aCAgTPgtYcA4EysU4UKC86EQd5cTtHtCcr", 50000000);
+		cbtx_size += gbt_payee_output(cbtx + cbtx_size, "aHu897ivzmeFuLNB6956X6gyGeVNHUBRgD", 50000000);
+		cbtx_size += gbt_payee_output(cbtx + cbtx_size, "aQ18FBVFtnueucZKeVg4srhmzbpAeb1KoN", 50000000);
+		cbtx_size += gbt_payee_output(cbtx + cbtx_size, "a1HwTdCmQV3NspP2QqCGpehoFpi8NY4Zg3", 150000000);
+		cbtx_size += gbt_payee_output(cbtx + cbtx_size, "a1kCCGddf5pMXSipLVD9hBG2MGGVNaJ15U", 50000000);
 /*
-		"payee": "TQd92H738k7QpEpYPrEFrHDoawsJjW4XhT",
-			"script" : "76a914a0be3efc7cec6597a0c1c01037fc19e99c7b707f88ac",
-			"amount" : 750000000
+		// for testnet with znode payment
+		cbtx_size += gbt_payee_output(cbtx + cbtx_size, "TDk19wPKYq91i18qmY6U9FeTdTxwPeSveo", 50000000);
+		cbtx_size += gbt_payee_output(cbtx + cbtx_size, "TWZZcDGkNixTAMtRBqzZkkMHbq1G6vUTk5", 50000000);
+		cbtx_size += gbt_payee_output(cbtx + cbtx_size, "TRZTFdNCKCKbLMQV8cZDkQN9Vwuuq4gDzT", 50000000);
+		cbtx_size += gbt_payee_output(cbtx + cbtx_size, "TG2ruj59E5b1u9G3F7HQVs6pCcVDBxrQve", 150000000);
+		cbtx_size += gbt_payee_output(cbtx + cbtx_size, "TCsTzQZKVn4fao8jDmB9zQBk9YQNEZ3XfS", 50000000);
 */
+		if (mpay && json_integer_value(mnamount) != 0 && json_string_value(mnaddy))
+			cbtx_size += gbt_payee_output(cbtx + cbtx_size, json_string_value(mnaddy), json_integer_value(mnamount));
 
-		strcat(coinb7, "00000000"); // locktime
-
-		hex2bin(cbtx + cbtx_size, coinb1, strlen(coinb1));
-		cbtx_size = cbtx_size + (int)((strlen(coinb1)) / 2);
-
-		hex2bin(cbtx + cbtx_size, coinb2, strlen(coinb2));
-		cbtx_size = cbtx_size + (int)((strlen(coinb2)) / 2);
-
-		hex2bin(cbtx + cbtx_size, coinb3, strlen(coinb3));
-		cbtx_size = cbtx_size + (int)((strlen(coinb3)) / 2);
-
-		hex2bin(cbtx + cbtx_size, coinb4, strlen(coinb4));
-		cbtx_size = cbtx_size + (int)((strlen(coinb4)) / 2);
-
-		hex2bin(cbtx + cbtx_size, coinb5, strlen(coinb5));
-		cbtx_size = cbtx_size + (int)((strlen(coinb5)) / 2);
-
-		hex2bin(cbtx + cbtx_size, coinb6, strlen(coinb6));
-		cbtx_size = cbtx_size + (int)((strlen(coinb6)) / 2);
-		
-		hex2bin(cbtx + cbtx_size, coinb7, strlen(coinb7));
-		cbtx_size = cbtx_size + (int)((strlen(coinb7)) / 2);
+		le32enc((uint32_t *)(cbtx + cbtx_size), 0); // locktime
+		cbtx_size += 4;
 		coinbase_append = true;
 	}
 	if (coinbase_append) {
@@ -2109,39 +2100,9 @@ static bool gbt_work_decode_mtp(const json_t *val, struct work *work)
 		}
 	}
 
-	n = varint_encode(txc_vi, 1 + tx_count);
-	work->txs = (char*)malloc(2 * (n + cbtx_size + tx_size) + 1);
-	dbin2hex(work->txs, txc_vi, n);
-	dbin2hex(work->txs + 2 * n, cbtx, cbtx_size);
-
-	// generate merkle root 
-	merkle_tree = (uchar(*)[32]) calloc(((1 + tx_count + 1) & ~1), 32);
-
-	sha256d(merkle_tree[0], cbtx, cbtx_size);
-
-	for (i = 0; i < tx_count; i++) {
-		tmp = json_array_get(txa, i);
-		const char *tx_hex = json_string_value(json_object_get(tmp, "data"));
-		const int tx_size = tx_hex ? (int)(strlen(tx_hex) / 2) : 0;
-		unsigned char *tx = (uchar*)malloc(tx_size);
-		if (!tx_hex || !hex2bin(tx, tx_hex, tx_size)) {
-			applog(LOG_ERR, "JSON invalid transactions");
-			free(tx);
-			goto out;
-		}
-		sha256d(merkle_tree[1 + i], tx, tx_size);
-		if (!submit_coinbase)
-			strcat(work->txs, tx_hex);
-	}
-	n = 1 + tx_count;
-	while (n > 1) {
-		if (n % 2) {
-			memcpy(merkle_tree[n], merkle_tree[n - 1], 32);
-			++n;
-		}
-		n /= 2;
-		for (i = 0; i < n; i++)
-			sha256d(merkle_tree[i], merkle_tree[2 * i], 64);
+	if (!gbt_template_txs(work, txa, tx_count, cbtx, cbtx_size, submit_coinbase, merkle_root)) {
+		applog(LOG_ERR, "JSON invalid transactions");
+		goto out;
 	}
 
 	// assemble block header 
@@ -2149,7 +2110,7 @@ static bool gbt_work_decode_mtp(const json_t *val, struct work *work)
 	for (i = 0; i < 8; i++)
 		work->data[8 - i] = be32dec(prevhash + i);
 	for (i = 0; i < 8; i++)
-		work->data[9 + i] = le32dec((uint32_t *)merkle_tree[0] + i);
+		work->data[9 + i] = le32dec((uint32_t *)merkle_root + i);
 	work->data[17] = (curtime);
 	work->data[18] = be32dec(&bits);
 	memset(work->data + 19, 0x00, 52);
@@ -2197,8 +2158,6 @@ out:
 		}
 	}
 
-	free(merkle_tree);
-	free(cbtx);
 	return rc;
 }
 
@@ -2226,9 +2185,8 @@ static bool gbt_work_decode_mtptcr(const json_t *val, struct work *work)
 	const int rewardsStage5Start = 2520000;
 	const int rewardsStage6Start = 3366000;
 	const int64_t devfi = 500000;
-	int tx_count, tx_size;
-	uchar txc_vi[9];
-	uchar(*merkle_tree)[32] = NULL;
+	int tx_count;
+	uchar merkle_root[32];
 	bool coinbase_append = false;
 	bool submit_coinbase = false;
 	bool version_force = false;
@@ -2330,23 +2288,13 @@ static bool gbt_work_decode_mtptcr(const json_t *val, struct work *work)
 		goto out;
 	}
 	tx_count = (int)json_array_size(txa);
-	tx_size = 0;
-	for (i = 0; i < tx_count; i++) {
-		const json_t *tx = json_array_get(txa, i);
-		const char *tx_hex = json_string_value(json_object_get(tx, "data"));
-		if (!tx_hex) {
-			applog(LOG_ERR, "JSON invalid transactions");
-			goto out;
-		}
-		tx_size += (int)(strlen(tx_hex) / 2);
-	}
 
 	// build coinbase transaction 
 	tmp = json_object_get(val, "coinbasetxn");
 	if (tmp) {
 		const char *cbtx_hex = json_string_value(json_object_get(tmp, "data"));
 		cbtx_size = cbtx_hex ? (int)strlen(cbtx_hex) / 2 : 0;
-		cbtx = (uchar*)malloc(cbtx_size + 100);
+		cbtx = gbt_coinbase_buffer(cbtx_size + 100);
 		if (cbtx_size < 60 || !hex2bin(cbtx, cbtx_hex, cbtx_size)) {
 			applog(LOG_ERR, "JSON invalid coinbasetxn");
 			goto out;
@@ -2413,7 +2361,7 @@ static bool gbt_work_decode_mtptcr(const json_t *val, struct work *work)
 
 		cbvalue = (int64_t)(json_is_integer(tmp) ? json_integer_value(tmp) : json_number_value(tmp));
 		cbvalue = (uint32_t)cbvalue - (uint32_t)devf4;
-		cbtx = (uchar*)malloc(256 * 256);
+		cbtx = gbt_coinbase_buffer(256 * 256);
 //		le32enc((uint32_t *)cbtx, 1); // version /
 		be32enc((uint32_t*)cbtx, 0x03000500); // version from tecra wallet 1.7
 		cbtx[4] = 1; // in-counter /
@@ -2448,60 +2396,17 @@ static bool gbt_work_decode_mtptcr(const json_t *val, struct work *work)
 		//		cbtx_size += (int)pk_null_size;
 
 		/// append here dev fee and masternode payment ////
-		/*   test */
-		char coinb0[90] = { 0 };
-		char coinb1[74] = { 0 };
-		char coinb2[74] = { 0 };
-		char coinb3[74] = { 0 };
-		char coinb4[74] = { 0 };
-		char coinb5[74] = { 0 };
-		char coinb6[74] = { 0 };
-		char coinb7[90] = { 0 };
-		char script_payee[1024];
-
-
 		// for mainnet
+		cbtx_size += gbt_payee_output(cbtx + cbtx_size, "TC4frBMpSm2PF2FuUNqJ3qicn4EHL59ejL", devf1);
+		cbtx_size += gbt_payee_output(cbtx + cbtx_size, "TNTkzXXJf8Yw3W1i29iQQgcxVfc3JicS2s", devf2);
+		cbtx_size += gbt_payee_output(cbtx + cbtx_size, "TD6A1JC3jUT91riUxpQpMQZJVBa4xU2vQC", devf3);
+		cbtx_size += gbt_payee_output(cbtx + cbtx_size, "TLddkwY6hmSpB2y8aBNyDkDDDh9ohhaoRG", devf4);
 
-		base58_decode("TC4frBMpSm2PF2FuUNqJ3qicn4EHL59ejL", script_payee);
-		job_pack_tx(coinb1, devf1, script_payee);
-
-		base58_decode("TNTkzXXJf8Yw3W1i29iQQgcxVfc3JicS2s", script_payee);
-		job_pack_tx(coinb2, devf2, script_payee);
-
-		base58_decode("TD6A1JC3jUT91riUxpQpMQZJVBa4xU2vQC", script_payee);
-		job_pack_tx(coinb3, devf3, script_payee);
-
-		base58_decode("TLddkwY6hmSpB2y8aBNyDkDDDh9ohhaoRG", script_payee);
-		job_pack_tx(coinb4, devf4, script_payee);
-
-		if (json_integer_value(mnamount) != 0) {
-			base58_decode((char*)json_string_value(mnaddy), script_payee);
-			//		memcpy(script_payee, json_string_value(mnscript),strlen(json_string_value(mnscript)));
-			job_pack_tx(coinb6, json_integer_value(mnamount), script_payee);
-		}
-
-		strcat(coinb7, "00000000"); // locktime
+		if (json_integer_value(mnamount) != 0 && json_string_value(mnaddy))
+			cbtx_size += gbt_payee_output(cbtx + cbtx_size, json_string_value(mnaddy), json_integer_value(mnamount));
 
-		hex2bin(cbtx + cbtx_size, coinb1, strlen(coinb1));
-		cbtx_size = cbtx_size + (int)((strlen(coinb1)) / 2);
-
-		hex2bin(cbtx + cbtx_size, coinb2, strlen(coinb2));
-		cbtx_size = cbtx_size + (int)((strlen(coinb2)) / 2);
-
-		hex2bin(cbtx + cbtx_size, coinb3, strlen(coinb3));
-		cbtx_size = cbtx_size + (int)((strlen(coinb3)) / 2);
-
-		hex2bin(cbtx + cbtx_size, coinb4, strlen(coinb4));
-		cbtx_size = cbtx_size + (int)((strlen(coinb4)) / 2);
-
-		//		hex2bin(cbtx + cbtx_size, coinb5, strlen(coinb5));
-		//		cbtx_size = cbtx_size + (int)((strlen(coinb5)) / 2);
-
-		hex2bin(cbtx + cbtx_size, coinb6, strlen(coinb6));
-		cbtx_size = cbtx_size + (int)((strlen(coinb6)) / 2);
-
-		hex2bin(cbtx + cbtx_size, coinb7, strlen(coinb7));
-		cbtx_size = cbtx_size + (int)((strlen(coinb7)) / 2);
+		le32enc((uint32_t *)(cbtx + cbtx_size), 0); // locktime
+		cbtx_size += 4;
 
 		hex2bin(cbtx + cbtx_size, coinbase_payload, myobj_len);
 		cbtx_size = cbtx_size + (int)(myobj_len / 2);
@@ -2555,40 +2460,10 @@ static bool gbt_work_decode_mtptcr(const json_t *val, struct work *work)
 			cbtx_size += n;
 		}
 	}
-	printf("cbtx %s \n", cbtx);
-	n = varint_encode(txc_vi, 1 + tx_count);
-	work->txs = (char*)malloc(2 * (n + cbtx_size + tx_size) + 1);
-	dbin2hex(work->txs, txc_vi, n);
-	dbin2hex(work->txs + 2 * n, cbtx, cbtx_size);
-
-	// generate merkle root 
-	merkle_tree = (uchar(*)[32]) calloc(((1 + tx_count + 1) & ~1), 32);
-
-	sha256d(merkle_tree[0], cbtx, cbtx_size);
-
-	for (i = 0; i < tx_count; i++) {
-		tmp = json_array_get(txa, i);
-		const char *tx_hex = json_string_value(json_object_get(tmp, "data"));
-		const int tx_size = tx_hex ? (int)(strlen(tx_hex) / 2) : 0;
-		unsigned char *tx = (uchar*)malloc(tx_size);
-		if (!tx_hex || !hex2bin(tx, tx_hex, tx_size)) {
-			applog(LOG_ERR, "JSON invalid transactions");
-			free(tx);
-			goto out;
-		}
-		sha256d(merkle_tree[1 + i], tx, tx_size);
-		if (!submit_coinbase)
-			strcat(work->txs, tx_hex);
-	}
-	n = 1 + tx_count;
-	while (n > 1) {
-		if (n % 2) {
-			memcpy(merkle_tree[n], merkle_tree[n - 1], 32);
-			++n;
-		}
-		n /= 2;
-		for (i = 0; i < n; i++)
-			sha256d(merkle_tree[i], merkle_tree[2 * i], 64);
+//	printf("cbtx %s \n", cbtx);
+	if (!gbt_template_txs(work, txa, tx_count, cbtx, cbtx_size, submit_coinbase, merkle_root)) {
+		applog(LOG_ERR, "JSON invalid transactions");
+		goto out;
 	}
 
 	// assemble block header 
@@ -2596,7 +2471,7 @@ static bool gbt_work_decode_mtptcr(const json_t *val, struct work *work)
 	for (i = 0; i < 8; i++)
 		work->data[8 - i] = be32dec(prevhash + i);
 	for (i = 0; i < 8; i++)
-		work->data[9 + i] = le32dec((uint32_t *)merkle_tree[0] + i);
+		work->data[9 + i] = le32dec((uint32_t *)merkle_root + i);
 	work->data[17] = (curtime);
 	work->data[18] = be32dec(&bits);
 	memset(work->data + 19, 0x00, 52);
@@ -2644,8 +2519,6 @@ out:
 		}
 	}
 
-	free(merkle_tree);
-	free(cbtx);
 	return rc;
 }
 
@@ -2675,9 +2548,8 @@ static bool gbt_work_decode_mtptcr_testnet(const json_t *val, struct work *work)
 	const int rewardsStage6Start = 3366000;
 
 	const int64_t devfi = 500000;
-	int tx_count, tx_size;
-	uchar txc_vi[9];
-	uchar(*merkle_tree)[32] = NULL;
+	int tx_count;
+	uchar merkle_root[32];
 	bool coinbase_append = false;
 	bool submit_coinbase = false;
 	bool version_force = false;
@@ -2786,23 +2658,13 @@ static bool gbt_work_decode_mtptcr_testnet(const json_t *val, struct work *work)
 		goto out;
 	}
 	tx_count = (int)json_array_size(txa);
-	tx_size = 0;
-	for (i = 0; i < tx_count; i++) {
-		const json_t *tx = json_array_get(txa, i);
-		const char *tx_hex = json_string_value(json_object_get(tx, "data"));
-		if (!tx_hex) {
-			applog(LOG_ERR, "JSON invalid transactions");
-			goto out;
-		}
-		tx_size += (int)(strlen(tx_hex) / 2);
-	}
 
 	// build coinbase transaction 
 	tmp = json_object_get(val, "coinbasetxn");
 	if (tmp) {
 		const char *cbtx_hex = json_string_value(json_object_get(tmp, "data"));
 		cbtx_size = cbtx_hex ? (int)strlen(cbtx_hex) / 2 : 0;
-		cbtx = (uchar*)malloc(cbtx_size + 100);
+		cbtx = gbt_coinbase_buffer(cbtx_size + 100);
 		if (cbtx_size < 60 || !hex2bin(cbtx, cbtx_hex, cbtx_size)) {
 			applog(LOG_ERR, "JSON invalid coinbasetxn");
 			goto out;
@@ -2885,7 +2747,7 @@ static bool gbt_work_decode_mtptcr_testnet(const json_t *val, struct work *work)
 		cbvalue = (int64_t)(json_is_integer(tmp) ? json_integer_value(tmp) : json_number_value(tmp));
 		
 		cbvalue = /*(uint32_t)*/ cbvalue + /*(uint32_t)*/devf4;
-		cbtx = (uchar*)malloc(256 * 256);
+		cbtx = gbt_coinbase_buffer(256 * 256);
 		be32enc((uint32_t *)cbtx, 0x03000500); // version /
 //		((uint32_t*)cbtx)[0]  = 0x03000500;
 		cbtx[4] = 1; // in-counter /
@@ -3033,39 +2895,9 @@ static bool gbt_work_decode_mtptcr_testnet(const json_t *val, struct work *work)
 		}
 	}
 //	printf("cbtx %s \n", cbtx);
-	n = varint_encode(txc_vi, 1 + tx_count);
-	work->txs = (char*)malloc(2 * (n + cbtx_size + tx_size) + 1);
-	dbin2hex(work->txs, txc_vi, n);
-	dbin2hex(work->txs + 2 * n, cbtx, cbtx_size);
-//	printf("cbtx %s \n", work->txs);
-	// generate merkle root 
-	merkle_tree = (uchar(*)[32]) calloc(((1 + tx_count + 1) & ~1), 32);
-
-	sha256d(merkle_tree[0], cbtx, cbtx_size);
-
-	for (i = 0; i < tx_count; i++) {
-		tmp = json_array_get(txa, i);
-		const char *tx_hex = json_string_value(json_object_get(tmp, "data"));
-		const int tx_size = tx_hex ? (int)(strlen(tx_hex) / 2) : 0;
-		unsigned char *tx = (uchar*)malloc(tx_size);
-		if (!tx_hex || !hex2bin(tx, tx_hex, tx_size)) {
-			applog(LOG_ERR, "JSON invalid transactions");
-			free(tx);
-			goto out;
-		}
-		sha256d(merkle_tree[1 + i], tx, tx_size);
-		if (!submit_coinbase)
-			strcat(work->txs, tx_hex);
-	}
-	n = 1 + tx_count;
-	while (n > 1) {
-		if (n % 2) {
-			memcpy(merkle_tree[n], merkle_tree[n - 1], 32);
-			++n;
-		}
-		n /= 2;
-		for (i = 0; i < n; i++)
-			sha256d(merkle_tree[i], merkle_tree[2 * i], 64);
+	if (!gbt_template_txs(work, txa, tx_count, cbtx, cbtx_size, submit_coinbase, merkle_root)) {
+		applog(LOG_ERR, "JSON invalid transactions");
+		goto out;
 	}
 
 	// assemble block header 
@@ -3073,7 +2905,7 @@ static bool gbt_work_decode_mtptcr_testnet(const json_t *val, struct work *work)
 	for (i = 0; i < 8; i++)
 		work->data[8 - i] = be32dec(prevhash + i);
 	for (i = 0; i < 8; i++)
-		work->data[9 + i] = le32dec((uint32_t *)merkle_tree[0] + i);
+		work->data[9 + i] = le32dec((uint32_t *)merkle_root + i);
 	work->data[17] = (curtime);
 	work->data[18] = be32dec(&bits);
 	memset(work->data + 19, 0x00, 52);
@@ -3121,8 +2953,6 @@ out:
 		}
 	}
 
-	free(merkle_tree);
-	free(cbtx);
 	return rc;
 }
 
@@ -3256,6 +3086,36 @@ static bool get_mininginfo(CURL *curl, struct work *work)
 static const char *json_rpc_getwork =
 	"{\"method\":\"getwork\",\"params\":[],\"id\":0}\r\n";
 
+/* decode a getblocktemplate answer, the decoders share the template state */
+static bool gbt_template_decode(const json_t *val, struct work *work)
+{
+	struct timeval tv_start, tv_end, diff;
+	bool rc;
+
+	gettimeofday(&tv_start, NULL);
+	pthread_mutex_lock(&gbt_lock);
+	gbt_tpl.tx_changed = false;
+	if (opt_algo == ALGO_MTP)
+		rc = gbt_work_decode_mtp(val, work);
+	else if (opt_algo == ALGO_MTPTCR)
+		rc = gbt_work_decode_mtptcr(val, work);
+	else
+		rc = gbt_work_decode(val, work);
+	const bool tx_changed = gbt_tpl.tx_changed;
+	const int tx_count = gbt_tpl.tx_count;
+	pthread_mutex_unlock(&gbt_lock);
+	gettimeofday(&tv_end, NULL);
+
+	timeval_subtract(&diff, &tv_end, &tv_start);
+	gbt_decode_ms = (1000.0 * diff.tv_sec) + (0.001 * diff.tv_usec);
+	if (opt_protocol && rc) {
+		applog(LOG_DEBUG, "template decoded in %.2f ms, %d transactions%s",
+			gbt_decode_ms, tx_count, tx_changed ? "" : " (unchanged)");
+	}
+
+	return rc;
+}
+
 static bool get_upstream_work(CURL *curl, struct work *work)
 {
 	bool rc = false;
@@ -3312,12 +3172,7 @@ start:
 		return false;
 
 	if (have_gbt) {
-		if (opt_algo == ALGO_MTP)
-			rc = gbt_work_decode_mtp(json_object_get(val, "result"), work);
-		else if (opt_algo == ALGO_MTPTCR)
-			rc = gbt_work_decode_mtptcr(json_object_get(val, "result"), work);
-		else 
-			rc = gbt_work_decode(json_object_get(val, "result"), work);
+		rc = gbt_template_decode(json_object_get(val, "result"), work);
 
 		if (!have_gbt) {
 			json_decref(val);
@@ -3501,45 +3356,58 @@ static void *workio_thread(void *userdata)
 	}
 
 	while (ok && !abort_flag) {
-		struct workio_cmd *wc;
+		struct workio_cmd *cmds[16];
+		int count;
 
-		/* wait for workio_cmd sent to us, on our queue */
-		wc = (struct workio_cmd *)tq_pop(mythr->q, NULL);
-		if (!wc) {
+		/* wait for workio_cmds sent to us, on our queue */
+		count = tq_pop_batch(mythr->q, (void**) cmds, ARRAY_SIZE(cmds), NULL);
+		if (!count) {
 			ok = false;
 			break;
 		}
 
-		/* process workio_cmd */
-		switch (wc->cmd) {
-		case WC_GET_WORK:
-			ok = workio_get_work(wc, curl);
-			break;
-		case WC_SUBMIT_WORK:
-			if (opt_led_mode == LED_MODE_SHARES)
-				gpu_led_on(device_map[wc->thr->id]);
-			ok = workio_submit_work(wc, curl);
-			if (opt_led_mode == LED_MODE_SHARES)
-				gpu_led_off(device_map[wc->thr->id]);
-			break;
-		case WC_ABORT:
-		default:		/* should never happen */
-			ok = false;
-			break;
-		}
+		for (int n = 0; n < count; n++) {
+			struct workio_cmd *wc = cmds[n];
+			if (!wc || !ok) {
+				/* the thread stops, drop the rest of the batch */
+				ok = false;
+				if (wc)
+					workio_cmd_free(wc);
+				continue;
+			}
 
-		if (!ok /*&& num_pools > 1 && opt_pool_failover*/) {
-//			if (opt_debug_threads)
-				applog(LOG_DEBUG, "%s died, failover", __func__);
-		if (num_pools>1)
-			ok = pool_switch_next(-1);
-		else
-			ok = pool_retry(0);
+			/* process workio_cmd */
+			switch (wc->cmd) {
+			case WC_GET_WORK:
+				ok = workio_get_work(wc, curl);
+				break;
+			case WC_SUBMIT_WORK:
+				if (opt_led_mode == LED_MODE_SHARES)
+					gpu_led_on(device_map[wc->thr->id]);
+				ok = workio_submit_work(wc, curl);
+				if (opt_led_mode == LED_MODE_SHARES)
+					gpu_led_off(device_map[wc->thr->id]);
+				break;
+			case WC_ABORT:
+			default:		/* should never happen */
+				ok = false;
+				break;
+			}
+
+			if (!ok /*&& num_pools > 1 && opt_pool_failover*/) {
+	//			if (opt_debug_threads)
+					applog(LOG_DEBUG, "%s died, failover", __func__);
+			if (num_pools>1)
+				ok = pool_switch_next(-1);
+			else
+				ok = pool_retry(0);
 		
-			tq_push(wc->thr->q, NULL); // get_work() will return false
-		}
+				// get_work() will return false, nothing pops it in stratum mode
+				tq_push_nowait(wc->thr->q, NULL);
+			}
 
-		workio_cmd_free(wc);
+			workio_cmd_free(wc);
+		}
 	}
 
 	if (opt_debug_threads)
@@ -3597,6 +3465,14 @@ bool get_work(struct thr_info *thr, struct work *work)
 	return true;
 }
 
+// getwork/gbt solutions wait for the curl answer, they are sent by the submit threads
+static struct thread_q *submit_queue(int pooln)
+{
+	if (submit_thr_id < 0 || (pools[pooln].type & POOL_STRATUM))
+		return thr_info[work_thr_id].q;
+	return thr_info[submit_thr_id].q;
+}
+
 static bool submit_work(struct thr_info *thr, const struct work *work_in)
 {
 	struct workio_cmd *wc;
@@ -3614,8 +3490,8 @@ static bool submit_work(struct thr_info *thr, const struct work *work_in)
 	memcpy(wc->u.work, work_in, sizeof(struct work));
 	wc->pooln = work_in->pooln;
 
-	/* send solution to workio thread */
-	if (!tq_push(thr_info[work_thr_id].q, wc))
+	/* send solution to workio or submit thread */
+	if (!tq_push(submit_queue(wc->pooln), wc))
 		goto err_out;
 
 	return true;
@@ -3656,8 +3532,8 @@ static bool submit_work_mtp(struct thr_info *thr, const struct work *work_in, co
 
 	wc->pooln = work_in->pooln;
 
-	/* send solution to workio thread */
-	if (!tq_push(thr_info[work_thr_id].q, wc))
+	/* send solution to workio or submit thread */
+	if (!tq_push(submit_queue(wc->pooln), wc))
 		goto err_out;
 
 	return true;
@@ -3812,7 +3688,8 @@ static bool stratum_gen_work(struct stratum_ctx *sctx, struct work *work)
 			break;
 		case ALGO_WHIRLPOOL:
 		default:
-			sha256d(merkle_root, sctx->job.coinbase, (int)sctx->job.coinbase_size);
+			// only the coinbase tail from xnonce2 is hashed again
+			stratum_coinbase_hash(&sctx->job, merkle_root);
 	}
 
 	for (i = 0; i < sctx->job.merkle_count; i++) {
@@ -3972,6 +3849,47 @@ static bool stratum_gen_work(struct stratum_ctx *sctx, struct work *work)
 	return true;
 }
 
+// struct work without the unused pok transactions (4 x 16KB)
+static inline void work_copy(struct work *dest, const struct work *src)
+{
+	uint32_t txs = min(src->tx_count, (uint32_t) POK_MAX_TXS);
+	memcpy(dest, src, offsetof(struct work, txspok) + txs * sizeof(struct tx));
+}
+
+/* copy g_work to a slot no miner thread is reading and make it the current
+ * one, the caller holds g_work_lock so there is only one writer at a time */
+static void work_publish()
+{
+	int cur = work_current.load();
+	for (int n = 1; n <= work_slot_count; n++) {
+		bool used = (n == cur);
+		for (int i = 0; i < opt_n_threads && !used; i++)
+			used = (work_hazard[i].load() == n);
+		if (!used) {
+			work_copy(&work_slots[n - 1], &g_work);
+			work_current.store(n);
+			return;
+		}
+	}
+}
+
+/* last published work, it is not modified until work_release() */
+static const struct work* work_acquire(int thr_id)
+{
+	int n, cur = work_current.load();
+	do {
+		n = cur;
+		work_hazard[thr_id].store(n);
+		cur = work_current.load();
+	} while (cur != n);
+	return n ? &work_slots[n - 1] : NULL;
+}
+
+static void work_release(int thr_id)
+{
+	work_hazard[thr_id].store(0);
+}
+
 void restart_threads(void)
 {
 	if (opt_debug && !opt_quiet)
@@ -4151,6 +4069,8 @@ static void *miner_thread(void *userdata)
 
 
 		uint32_t *nonceptr = (uint32_t*) (((char*)work.data) + wcmplen);
+		const struct work *pub = &g_work;
+		bool locked = true;
 
 		if (have_stratum) {
 			uint32_t sleeptime = 0;
@@ -4172,7 +4092,6 @@ static void *miner_thread(void *userdata)
 				nonceptr = (uint32_t*) (((char*)work.data) + 76);
 			else 
 				nonceptr = (uint32_t*)(((char*)work.data) + wcmplen);
-			pthread_mutex_lock(&g_work_lock);
 			extrajob |= work_done;
 
 			regen = (nonceptr[0] >= end_nonce);
@@ -4183,12 +4102,27 @@ static void *miner_thread(void *userdata)
 				regen = ((nonceptr[1] & 0xFF00) >= 0xF000);
 			}
 			regen = regen || extrajob;
+			// mtp scans ask for the next extranonce once their range is done
+			if (opt_algo == ALGO_MTP || opt_algo == ALGO_MTPTCR)
+				regen = regen || stratum.job.IncXtra;
+
+			// nothing to build, follow the work published by the stratum thread
+			if (!regen && opt_algo != ALGO_SIA) {
+				pub = work_acquire(thr_id);
+				if (pub && !strncmp(stratum.job.job_id, pub->job_id + 8, sizeof(pub->job_id) - 8))
+					locked = false;
+				else
+					work_release(thr_id);
+			}
+			if (locked) {
+			pub = &g_work;
+			pthread_mutex_lock(&g_work_lock);
 			if (!regen)
 			if (strncmp(stratum.job.job_id, g_work.job_id + 8, sizeof(g_work.job_id) - 8) != 0)
 			{
 				regen = true;
 			}
-			if (regen || opt_algo == ALGO_MTP || opt_algo == ALGO_MTPTCR) {
+			if (regen) {
 				
 
 				work_done = false;
@@ -4197,6 +4131,8 @@ static void *miner_thread(void *userdata)
 				if (stratum_gen_work_m7(&stratum, &g_work)) g_work_time = time(NULL);}
 			else {
 				if (stratum_gen_work(&stratum, &g_work)) g_work_time = time(NULL);}
+				work_publish();
+			}
 			}
 		} else {
 			uint32_t secs = 0;
@@ -4222,15 +4158,15 @@ static void *miner_thread(void *userdata)
 			}
 		}
 
-		if (!opt_benchmark && (g_work.height != work.height || memcmp(work.target, g_work.target, sizeof(work.target))))
+		if (!opt_benchmark && (pub->height != work.height || memcmp(work.target, pub->target, sizeof(work.target))))
 		{
 			if (opt_debug) {
-				uint64_t target64 = g_work.target[7] * 0x100000000ULL + g_work.target[6];
-				applog(LOG_DEBUG, "job %s target change: %llx (%.1f)", g_work.job_id, target64, g_work.targetdiff);
+				uint64_t target64 = pub->target[7] * 0x100000000ULL + pub->target[6];
+				applog(LOG_DEBUG, "job %s target change: %llx (%.1f)", pub->job_id, target64, pub->targetdiff);
 			}
-			memcpy(work.target, g_work.target, sizeof(work.target));
-			work.targetdiff = g_work.targetdiff;
-			work.height = g_work.height;
+			memcpy(work.target, pub->target, sizeof(work.target));
+			work.targetdiff = pub->targetdiff;
+			work.height = pub->height;
 			//nonceptr[0] = (UINT32_MAX / opt_n_threads) * thr_id; // 0 if single thr
 		}
 
@@ -4240,21 +4176,21 @@ static void *miner_thread(void *userdata)
 			wcmplen -= 4;
 		}
 
-		if (memcmp(&work.data[wcmpoft], &g_work.data[wcmpoft], wcmplen - 8)) {
+		if (memcmp(&work.data[wcmpoft], &pub->data[wcmpoft], wcmplen - 8)) {
 			#if 0
 			if (opt_debug) {
 				for (int n=0; n <= (wcmplen-8); n+=8) {
-					if (memcmp(work.data + n, g_work.data + n, 8)) {
-						applog(LOG_DEBUG, "job %s work updated at offset %d:", g_work.job_id, n);
+					if (memcmp(work.data + n, pub->data + n, 8)) {
+						applog(LOG_DEBUG, "job %s work updated at offset %d:", pub->job_id, n);
 						applog_hash((uchar*) &work.data[n]);
-						applog_compare_hash((uchar*) &g_work.data[n], (uchar*) &work.data[n]);
+						applog_compare_hash((uchar*) &pub->data[n], (uchar*) &work.data[n]);
 					}
 				}
 			}
 			#endif
 
 
-			memcpy(&work, &g_work, sizeof(struct work));
+			work_copy(&work, pub);
 
 			nonceptr[0] = (UINT32_MAX / opt_n_threads) * thr_id; // 0 if single thr
 		
@@ -4264,7 +4200,7 @@ static void *miner_thread(void *userdata)
 		}
 		if (opt_algo == ALGO_DECRED) {
 			// suprnova job_id check without data/target/height change...
-			if (check_stratum_jobs && strcmp(work.job_id, g_work.job_id)) {
+			if (check_stratum_jobs && strcmp(work.job_id, pub->job_id)) {
 				pthread_mutex_unlock(&g_work_lock);
 				continue;
 			}
@@ -4278,7 +4214,7 @@ static void *miner_thread(void *userdata)
 
 		} else if (opt_algo == ALGO_SIA) {
 			// suprnova job_id check without data/target/height change...
-			if (have_stratum && strcmp(work.job_id, g_work.job_id)) {
+			if (have_stratum && strcmp(work.job_id, pub->job_id)) {
 				pthread_mutex_unlock(&g_work_lock);
 				work_done = true;
 				continue;
@@ -4293,7 +4229,10 @@ static void *miner_thread(void *userdata)
 			nonceptr[-1] += 1;
 		}
 
-		pthread_mutex_unlock(&g_work_lock);
+		if (locked)
+			pthread_mutex_unlock(&g_work_lock);
+		else
+			work_release(thr_id);
 
 		// --benchmark [-a all]
 		if (opt_benchmark && bench_algo >= 0) {
@@ -4533,14 +4472,16 @@ printf("coming here opt_shares_limit firstwork_time=%d\n",firstwork_time);
 		gettimeofday(&tv_start, NULL);
 
 		// check (and reset) previous errors
-		cudaError_t err = cudaGetLastError();
+		cudaError_t err = opt_cpu_mining ? cudaSuccess : cudaGetLastError();
 		if (err != cudaSuccess && !opt_quiet)
 			gpulog(LOG_WARNING, thr_id, "%s", cudaGetErrorString(err));
 
 //		memcpy(work.job_id,g_work.job_id,128);
 
 		/* scan nonces for a proof-of-work hash */
-		switch (opt_algo) {
+		if (opt_cpu_mining)
+			rc = scanhash_cpu(thr_id, &work, max_nonce, &hashes_done);
+		else switch (opt_algo) {
 
 		case ALGO_BLAKECOIN:
 			rc = scanhash_blake256(thr_id, &work, max_nonce, &hashes_done, 8);
@@ -4993,16 +4934,10 @@ longpoll_retry:
 			//submit_old = soval ? json_is_true(soval) : false;
 			pthread_mutex_lock(&g_work_lock);
 			start_job_id = g_work.job_id ? strdup(g_work.job_id) : NULL;
-			if (have_gbt) 
-			{
-					if (opt_algo == ALGO_MTP) 
-						rc = gbt_work_decode_mtp(json_object_get(val, "result"), &g_work);
-					else if (opt_algo == ALGO_MTPTCR)
-						rc = gbt_work_decode_mtptcr(json_object_get(val, "result"), &g_work);
-					else
-						rc = gbt_work_decode(json_object_get(val, "result"), &g_work);
-			} else 
-			rc = work_decode(json_object_get(val, "result"), &g_work);
+			if (have_gbt)
+				rc = gbt_template_decode(json_object_get(val, "result"), &g_work);
+			else
+				rc = work_decode(json_object_get(val, "result"), &g_work);
 
 			if (rc) {
 //				bool newblock = g_work.job_id && strcmp(start_job_id, g_work.job_id);
@@ -5063,11 +4998,35 @@ need_reinit:
 	goto wait_lp_url;
 }
 
+// account a submit answer to the share it refers to
+static void stratum_share_answer(uint32_t id, bool valid, const char *reason)
+{
+	struct submit_entry share;
+	struct timeval tv_answer, diff;
+	double sharediff = stratum.sharediff;
+	int pooln = stratum.pooln;
+
+	gettimeofday(&tv_answer, NULL);
+	if (submit_answer(id, &share)) {
+		timeval_subtract(&diff, &tv_answer, &share.tv_sent);
+		sharediff = share.sharediff;
+		pooln = share.pooln;
+	} else {
+		// unknown id, the pool reuses an old request id or answers too late
+		timeval_subtract(&diff, &tv_answer, &stratum.tv_submit);
+	}
+	// store time required to the pool to answer to a submit
+	stratum.answer_msec = (1000 * diff.tv_sec) + (uint32_t) (0.001 * diff.tv_usec);
+	if (opt_debug)
+		applog(LOG_DEBUG, "share %u answered in %u ms", id, stratum.answer_msec);
+
+	share_result(valid, pooln, sharediff, reason);
+}
+
 static bool stratum_handle_response(char *buf)
 {
 	json_t *val, *err_val, *res_val, *id_val;
 	json_error_t err;
-	struct timeval tv_answer, diff;
 	int num = 0;
 	bool ret = false;
 
@@ -5090,15 +5049,7 @@ static bool stratum_handle_response(char *buf)
 	if (num < 4)
 		goto out;
 
-	// todo: use request id to index nonce diff data
-	// num = num % 10;
-
-	gettimeofday(&tv_answer, NULL);
-	timeval_subtract(&diff, &tv_answer, &stratum.tv_submit);
-	// store time required to the pool to answer to a submit
-	stratum.answer_msec = (1000 * diff.tv_sec) + (uint32_t) (0.001 * diff.tv_usec);
-
-	share_result(json_is_true(res_val), stratum.pooln, stratum.sharediff,
+	stratum_share_answer((uint32_t) num, json_is_true(res_val),
 		err_val ? json_string_value(json_array_get(err_val, 1)) : NULL);
 
 	ret = true;
@@ -5112,14 +5063,8 @@ out:
 
 static bool stratum_handle_response_json(json_t *val)
 {
-
-
-	struct timeval tv_answer, diff;
-	int num = 0;
 	json_t *err_val, *res_val, *id_val;
-	json_error_t err;
 	bool ret = false;
-	bool valid = false;
 
 	res_val = json_object_get(val, "result");
 	err_val = json_object_get(val, "error");
@@ -5129,20 +5074,12 @@ static bool stratum_handle_response_json(json_t *val)
 		goto out;
 
 	// ignore late login answers
+	if (json_integer_value(id_val) < 4)
+		goto out;
 
-		if (!res_val || json_integer_value(id_val) < 4)
-			goto out;
-
-		gettimeofday(&tv_answer, NULL);
-		timeval_subtract(&diff, &tv_answer, &stratum.tv_submit);
-		// store time required to the pool to answer to a submit
-		stratum.answer_msec = (1000 * diff.tv_sec) + (uint32_t)(0.001 * diff.tv_usec);
-
-		valid = json_is_true(res_val);
-
-//		printf("err_val %s",json_dumps(err_val,0));
-		share_result(valid, stratum.pooln, stratum.sharediff, err_val ? json_string_value(json_array_get(err_val, 1)) : NULL);
-
+//	printf("err_val %s",json_dumps(err_val,0));
+	stratum_share_answer((uint32_t) json_integer_value(id_val), json_is_true(res_val),
+		err_val ? json_string_value(json_array_get(err_val, 1)) : NULL);
 
 	ret = true;
 
@@ -5161,6 +5098,7 @@ static void *stratum_thread(void *userdata)
 	struct pool_infos *pool;
 	stratum_ctx *ctx = &stratum;
 	int pooln, switchn;
+	uint32_t work_target_gen = 0; // mtp target of the published work
 	char *s;
 
 wait_stratum_url:
@@ -5205,6 +5143,7 @@ wait_stratum_url:
 			pthread_mutex_lock(&g_work_lock);
 			g_work_time = 0;
 			g_work.data[0] = 0;
+			work_publish();
 			pthread_mutex_unlock(&g_work_lock);
 			restart_threads();
 
@@ -5280,6 +5219,8 @@ wait_stratum_url:
 				if (stratum_gen_work_m7(&stratum, &g_work))	g_work_time = time(NULL);
 			else 
 				if (stratum_gen_work(&stratum, &g_work)) g_work_time = time(NULL);
+			work_publish();
+			work_target_gen = stratum.target_gen;
 			
 			if (stratum.job.clean) {
 
@@ -5303,6 +5244,16 @@ wait_stratum_url:
 			}
 			pthread_mutex_unlock(&g_work_lock);
 		}
+
+		// mtp works take their target from mining.set_target, not from the job
+		if ((opt_algo == ALGO_MTP || opt_algo == ALGO_MTPTCR) && stratum.job.job_id &&
+		    g_work_time && work_target_gen != stratum.target_gen) {
+			pthread_mutex_lock(&g_work_lock);
+			if (stratum_gen_work(&stratum, &g_work)) g_work_time = time(NULL);
+			work_publish();
+			work_target_gen = stratum.target_gen;
+			pthread_mutex_unlock(&g_work_lock);
+		}
 		
 		// check we are on the right pool
 		if (switchn != pool_switch_count) goto pool_switched;
@@ -5316,39 +5267,33 @@ wait_stratum_url:
 			if (opt_algo == ALGO_MTP || opt_algo == ALGO_MTPTCR)
 			{
 
-		//json_t *MyObject = json_object();
 				if (switchn != pool_switch_count) goto pool_switched;
-		uint32_t bossize = 0;
-		bool isok = false;
-
-		stratum_bos_fillbuffer(ctx);
-		json_error_t *boserror = (json_error_t *)malloc(sizeof(json_error_t));
-		do {
-			
-			//json_t *MyObject2 = json_object();
-		if (bos_sizeof(ctx->sockbuf) > 100000) break;
-		if (bos_sizeof(ctx->sockbuf)==0) break; 
-//			printf("bossize %d bos_sizeof %d\n",bossize, bos_sizeof(ctx->sockbuf + bossize));
-			json_t *MyObject2 = bos_deserialize(ctx->sockbuf, boserror);
-//			bossize += bos_sizeof(ctx->sockbuf + bossize);
-			json_t *MyObject = recode_message(MyObject2);
-			isok = stratum_handle_method_bos_json(ctx, MyObject);
-			json_decref(MyObject2);
-			if (!isok) { // is an answer upon share submission
-				stratum_handle_response_json(MyObject);
-				
-			}
-			json_decref(MyObject);
-			stratum_bos_resizebuffer(ctx);
-
-		} while (ctx->sum_bossize!=0 /*bossize != ctx->sockbuf_bossize*/  && switchn == pool_switch_count);
-
-		free(boserror);
-//		ctx->sockbuf[0] = '\0';
-//		ctx->sum_bossize = 0;
-//		ctx->sockbuf_bossize = 0;
-//		ctx->sockbuf = (char*)realloc(ctx->sockbuf, ctx->sockbuf_bossize +1);
-//		ctx->sockbuf[0] = '\0';
+				const char *frame = stratum_recv_bos(ctx, opt_timeout);
+				if (!frame) {
+					stratum_disconnect(&stratum);
+					if (!opt_quiet && !pool_on_hold)
+						applog(LOG_WARNING, "Stratum connection interrupted");
+					continue;
+				}
+				json_error_t boserror;
+				do {
+					// job notifications are read in place, the rest goes through json
+					if (stratum_handle_notify_bos(ctx, frame)) {
+						stratum_consume_bos(ctx, frame);
+						continue;
+					}
+					json_t *MyObject2 = bos_deserialize(frame, &boserror);
+					stratum_consume_bos(ctx, frame);
+					if (!MyObject2)
+						continue;
+					json_t *MyObject = recode_message(MyObject2);
+					bool isok = stratum_handle_method_bos_json(ctx, MyObject);
+					json_decref(MyObject2);
+					if (!isok) // is an answer upon share submission
+						stratum_handle_response_json(MyObject);
+					json_decref(MyObject);
+				// then the other messages already received
+				} while (switchn == pool_switch_count && (frame = stratum_recv_bos(ctx, 0)));
 			} else {
 		
 			s = stratum_recv_line(&stratum);
@@ -5657,6 +5602,12 @@ void parse_arg(int key, char *arg)
 			show_usage_and_exit(1);
 		opt_fail_pause = v;
 		break;
+	case 1028: /* --submit-threads */
+		v = atoi(arg);
+		if (v < 0 || v > 16)	/* sanity check */
+			show_usage_and_exit(1);
+		opt_submit_threads = v;
+		break;
 	case 's':
 		v = atoi(arg);
 		if (v < 1 || v > 9999)	/* sanity check */
@@ -5914,6 +5865,24 @@ void parse_arg(int key, char *arg)
 		print_hash_tests();
 		proper_exit(EXIT_CODE_OK);
 		break;
+	case 1027: /* --protocol-capture */
+		if (!stratum_capture_open(arg)) {
+			applog(LOG_ERR, "Unable to create %s", arg);
+			proper_exit(EXIT_CODE_USAGE);
+		}
+		break;
+	case 1026: /* --cpu-bench */
+		proper_exit(cpu_bench(arg) ? EXIT_CODE_OK : EXIT_CODE_CPU_BENCH);
+		break;
+	case 1029: /* --cpu */
+		opt_cpu_mining = true;
+		break;
+	case 1031: /* --cpu-threads */
+		v = atoi(arg);
+		if (v < 1 || v > 1024)	/* sanity check */
+			show_usage_and_exit(1);
+		opt_cpu_threads = v;
+		break;
 	case 1003:
 		want_longpoll = false;
 		break;
@@ -6299,11 +6268,17 @@ int main(int argc, char *argv[])
 	if (num_cpus < 1)
 		num_cpus = 1;
 
+	// cpu mining needs no cuda driver, check it before the devices
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--cpu"))
+			opt_cpu_mining = true;
+	}
+
 	// number of gpus
-	active_gpus = cuda_num_devices();
+	active_gpus = opt_cpu_mining ? 0 : cuda_num_devices();
 
 	for (i = 0; i < MAX_GPUS; i++) {
-		device_map[i] = i % active_gpus;
+		device_map[i] = i % max(1, active_gpus);
 		device_name[i] = NULL;
 		device_config[i] = NULL;
 		device_backoff[i] = is_windows() ? 12 : 2;
@@ -6316,7 +6291,8 @@ int main(int argc, char *argv[])
 		device_led[i] = -1;
 	}
 
-	cuda_devicenames();
+	if (!opt_cpu_mining)
+		cuda_devicenames();
 
 	/* parse command line */
 	parse_cmdline(argc, argv);
@@ -6447,17 +6423,26 @@ int main(int argc, char *argv[])
 			applog(LOG_DEBUG, "Binding process to cpu mask %x", opt_affinity);
 		affine_to_cpu_mask(-1, (unsigned long)opt_affinity);
 	}
-	if (active_gpus == 0) {
-		applog(LOG_ERR, "No CUDA devices found! terminating.");
-		exit(1);
-	}
-	if (!opt_n_threads)
-		opt_n_threads = active_gpus;
-	else if (active_gpus > opt_n_threads)
-		active_gpus = opt_n_threads;
+	if (opt_cpu_mining) {
+		// one miner thread, the nonces are split on the cpu workers
+		opt_n_threads = 1;
+		device_name[0] = strdup("CPU");
+		if (!opt_cpu_threads)
+			opt_cpu_threads = num_cpus;
+		applog(LOG_INFO, "CPU mining on %d thread%s", opt_cpu_threads, opt_cpu_threads > 1 ? "s" : "");
+	} else {
+		if (active_gpus == 0) {
+			applog(LOG_ERR, "No CUDA devices found! terminating.");
+			exit(1);
+		}
+		if (!opt_n_threads)
+			opt_n_threads = active_gpus;
+		else if (active_gpus > opt_n_threads)
+			active_gpus = opt_n_threads;
 
-	// generally doesn't work well...
-	gpu_threads = max(gpu_threads, opt_n_threads / active_gpus);
+		// generally doesn't work well...
+		gpu_threads = max(gpu_threads, opt_n_threads / active_gpus);
+	}
 
 	if (opt_benchmark && opt_algo == ALGO_AUTO) {
 		bench_init(opt_n_threads);
@@ -6476,10 +6461,17 @@ int main(int argc, char *argv[])
 	if (!work_restart)
 		return EXIT_CODE_SW_INIT_ERROR;
 
-	thr_info = (struct thr_info *)calloc(opt_n_threads + 4, sizeof(*thr));
+	thr_info = (struct thr_info *)calloc(opt_n_threads + 4 + opt_submit_threads, sizeof(*thr));
 	if (!thr_info)
 		return EXIT_CODE_SW_INIT_ERROR;
 
+	// one slot per miner thread reading, the current one and the next
+	work_slot_count = opt_n_threads + 2;
+	work_slots = (struct work *)calloc(work_slot_count, sizeof(struct work));
+	work_hazard = new std::atomic<int>[opt_n_threads]();
+	if (!work_slots)
+		return EXIT_CODE_SW_INIT_ERROR;
+
 	/* longpoll thread */
 	longpoll_thr_id = opt_n_threads + 1;
 	thr = &thr_info[longpoll_thr_id];
@@ -6524,6 +6516,22 @@ int main(int argc, char *argv[])
 		return EXIT_CODE_SW_INIT_ERROR;
 	}
 
+	/* submit threads, sharing one queue */
+	if (opt_submit_threads > 0)
+		submit_thr_id = opt_n_threads + 4;
+	for (i = 0; i < opt_submit_threads; i++) {
+		thr = &thr_info[submit_thr_id + i];
+		thr->id = submit_thr_id + i;
+		thr->q = i ? thr_info[submit_thr_id].q : tq_new();
+		if (!thr->q)
+			return EXIT_CODE_SW_INIT_ERROR;
+
+		if (unlikely(pthread_create(&thr->pth, NULL, workio_thread, thr))) {
+			applog(LOG_ERR, "submit thread create failed");
+			return EXIT_CODE_SW_INIT_ERROR;
+		}
+	}
+
 	/* real start of the stratum work */
 	if (want_stratum && have_stratum) {
 		tq_push(thr_info[stratum_thr_id].q, strdup(rpc_url));
@@ -6532,7 +6540,7 @@ int main(int argc, char *argv[])
 #ifdef USE_WRAPNVML
 #if defined(__linux__) || defined(_WIN64)
 	/* nvml is currently not the best choice on Windows (only in x64) */
-	hnvml = nvml_create();
+	hnvml = opt_cpu_mining ? NULL : nvml_create();
 	if (hnvml) {
 		bool gpu_reinit = (opt_cudaschedule >= 0); //false
 		cuda_devicenames(); // refresh gpu vendor name
@@ -6565,7 +6573,7 @@ int main(int argc, char *argv[])
 		applog(LOG_INFO, "GPU monitoring is not available.");
 
 	// force reinit to set default device flags
-	if (opt_cudaschedule >= 0 && !hnvml) {
+	if (opt_cudaschedule >= 0 && !hnvml && !opt_cpu_mining) {
 		for (int n=0; n < active_gpus; n++) {
 			cuda_reset_device(n, NULL);
 		}
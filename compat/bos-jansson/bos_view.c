@@ -0,0 +1,269 @@
+/*
+* Bos-Jansson in place reader: a message is checked once, then its values
+* are read where they are, strings and bytes are not copied.
+*
+* Bos-Jansson is free software; you can redistribute it and/or modify
+* it under the terms of the MIT license. See LICENSE for details.
+*/
+
+#include "jansson_private.h"
+
+#include <ctype.h>
+#include <string.h>
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+
+#include "bosjansson.h"
+
+/* nesting allowed in a message */
+#define BOS_VIEW_DEPTH 32
+
+/* width of the fixed size types, BOS_NULL to BOS_DOUBLE */
+static const uint8_t fixed_width[] = { 0, 1, 1, 2, 4, 8, 1, 2, 4, 8, 4, 8 };
+
+static const unsigned char *read_uvarint(const unsigned char *p, const unsigned char *limit, uint32_t *value) {
+
+	uint64_t le64;
+	uint32_t le32;
+	uint16_t le16;
+
+	if (p >= limit)
+		return NULL;
+
+	switch (*p) {
+	case 0xFF:
+		if (limit - p < 9)
+			return NULL;
+		memcpy(&le64, p + 1, sizeof(uint64_t));
+		if (le64 > 0xFFFFFFFF)
+			return NULL;
+		*value = (uint32_t)le64;
+		return p + 9;
+
+	case 0xFE:
+		if (limit - p < 5)
+			return NULL;
+		memcpy(&le32, p + 1, sizeof(uint32_t));
+		*value = le32;
+		return p + 5;
+
+	case 0xFD:
+		if (limit - p < 3)
+			return NULL;
+		memcpy(&le16, p + 1, sizeof(uint16_t));
+		*value = le16;
+		return p + 3;
+
+	default:
+		*value = *p;
+		return p + 1;
+	}
+}
+
+static int read_view(bos_view_t *view, const unsigned char *p, const unsigned char *limit) {
+
+	if (p >= limit || *p > BOS_OBJ)
+		return 0;
+
+	view->type = (bos_data_type)*p++;
+	view->limit = limit;
+
+	if (view->type <= BOS_DOUBLE) {
+		view->size = fixed_width[view->type];
+	}
+	else {
+		p = read_uvarint(p, limit, &view->size);
+		if (p == NULL)
+			return 0;
+	}
+	view->data = p;
+
+	/* entries of arrays and objects are checked when they are reached */
+	if (view->type < BOS_ARRAY && (size_t)(limit - p) < view->size)
+		return 0;
+
+	return 1;
+}
+
+static int read_entry(bos_view_t *entry, const unsigned char *p, int in_object, uint32_t left, const unsigned char *limit) {
+
+	entry->key = NULL;
+	entry->key_len = 0;
+
+	if (in_object) {
+		p = read_uvarint(p, limit, &entry->key_len);
+		if (p == NULL || (size_t)(limit - p) < entry->key_len)
+			return 0;
+		entry->key = (const char *)p;
+		p += entry->key_len;
+	}
+
+	if (!read_view(entry, p, limit))
+		return 0;
+
+	entry->left = left;
+	return 1;
+}
+
+/* first byte after the value, NULL if it does not fit in the message */
+static const unsigned char *skip_view(const bos_view_t *view, int depth) {
+
+	const unsigned char *p = view->data;
+	bos_view_t entry;
+	uint32_t i;
+
+	if (view->type < BOS_ARRAY)
+		return p + view->size;
+
+	if (depth > BOS_VIEW_DEPTH)
+		return NULL;
+
+	for (i = 0; i < view->size; ++i) {
+		if (!read_entry(&entry, p, view->type == BOS_OBJ, 0, view->limit))
+			return NULL;
+		p = skip_view(&entry, depth + 1);
+		if (p == NULL)
+			return NULL;
+	}
+
+	return p;
+}
+
+int bos_view_init(bos_view_t *root, const void *data, size_t size) {
+
+	const unsigned char *p = (const unsigned char *)data;
+	uint32_t data_size;
+
+	if (data == NULL || size < 5)
+		return 0;
+
+	memcpy(&data_size, p, sizeof(uint32_t));
+	if (data_size < 5 || size < data_size)
+		return 0;
+
+	if (!read_entry(root, p + 4, 0, 0, p + data_size))
+		return 0;
+
+	/* the whole message is checked here, the accessors can then trust it */
+	return skip_view(root, 0) != NULL;
+}
+
+int bos_view_first(const bos_view_t *container, bos_view_t *entry) {
+
+	if ((container->type != BOS_ARRAY && container->type != BOS_OBJ) || !container->size)
+		return 0;
+
+	return read_entry(entry, container->data, container->type == BOS_OBJ,
+		container->size - 1, container->limit);
+}
+
+int bos_view_next(bos_view_t *entry) {
+
+	const unsigned char *p;
+
+	if (!entry->left)
+		return 0;
+
+	p = skip_view(entry, 0);
+	if (p == NULL)
+		return 0;
+
+	return read_entry(entry, p, entry->key != NULL, entry->left - 1, entry->limit);
+}
+
+int bos_view_get(const bos_view_t *object, const char *key, bos_view_t *value) {
+
+	size_t len = strlen(key);
+	int found;
+
+	if (object->type != BOS_OBJ)
+		return 0;
+
+	for (found = bos_view_first(object, value); found; found = bos_view_next(value)) {
+		if (value->key_len == len && !memcmp(value->key, key, len))
+			return 1;
+	}
+
+	return 0;
+}
+
+int bos_view_index(const bos_view_t *array, uint32_t index, bos_view_t *entry) {
+
+	if (array->type != BOS_ARRAY || index >= array->size)
+		return 0;
+
+	if (!bos_view_first(array, entry))
+		return 0;
+
+	while (index--) {
+		if (!bos_view_next(entry))
+			return 0;
+	}
+
+	return 1;
+}
+
+int bos_view_streq(const bos_view_t *view, const char *str) {
+
+	size_t len = strlen(str);
+
+	return view->type == BOS_STRING && view->size == len && !memcmp(view->data, str, len);
+}
+
+int bos_view_strcaseeq(const bos_view_t *view, const char *str) {
+
+	size_t i, len = strlen(str);
+
+	if (view->type != BOS_STRING || view->size != len)
+		return 0;
+	for (i = 0; i < len; i++) {
+		if (tolower((unsigned char) view->data[i]) != tolower((unsigned char) str[i]))
+			return 0;
+	}
+	return 1;
+}
+
+int bos_view_is_true(const bos_view_t *view) {
+
+	return view->type == BOS_BOOL && view->data[0] != 0;
+}
+
+json_int_t bos_view_integer(const bos_view_t *view) {
+
+	int8_t i8;
+	int16_t i16;
+	int32_t i32;
+	int64_t i64;
+	uint16_t u16;
+	uint32_t u32;
+	uint64_t u64;
+
+	switch (view->type) {
+	case BOS_INT8:
+		memcpy(&i8, view->data, sizeof(int8_t));
+		return (json_int_t)i8;
+	case BOS_INT16:
+		memcpy(&i16, view->data, sizeof(int16_t));
+		return (json_int_t)i16;
+	case BOS_INT32:
+		memcpy(&i32, view->data, sizeof(int32_t));
+		return (json_int_t)i32;
+	case BOS_INT64:
+		memcpy(&i64, view->data, sizeof(int64_t));
+		return (json_int_t)i64;
+	case BOS_UINT8:
+		return (json_int_t)view->data[0];
+	case BOS_UINT16:
+		memcpy(&u16, view->data, sizeof(uint16_t));
+		return (json_int_t)u16;
+	case BOS_UINT32:
+		memcpy(&u32, view->data, sizeof(uint32_t));
+		return (json_int_t)u32;
+	case BOS_UINT64:
+		memcpy(&u64, view->data, sizeof(uint64_t));
+		return (json_int_t)u64;
+	default:
+		return 0;
+	}
+}
@@ -69,6 +69,36 @@ typedef struct bos_t {
     uint32_t size;
 } bos_t;
 
+typedef enum {
+    BOS_NULL   = 0x00,
+    BOS_BOOL   = 0x01,
+    BOS_INT8   = 0x02,
+    BOS_INT16  = 0x03,
+    BOS_INT32  = 0x04,
+    BOS_INT64  = 0x05,
+    BOS_UINT8  = 0x06,
+    BOS_UINT16 = 0x07,
+    BOS_UINT32 = 0x08,
+    BOS_UINT64 = 0x09,
+    BOS_FLOAT  = 0x0A,
+    BOS_DOUBLE = 0x0B,
+    BOS_STRING = 0x0C,
+    BOS_BYTES  = 0x0D,
+    BOS_ARRAY  = 0x0E,
+    BOS_OBJ    = 0x0F
+} bos_data_type;
+
+/* a value inside a serialized bos message, read in place */
+typedef struct bos_view_t {
+    bos_data_type type;
+    const unsigned char *data;  /* number, string chars, bytes or first entry */
+    uint32_t size;              /* payload bytes, or entries of an array/object */
+    const char *key;            /* object member name, not zero terminated */
+    uint32_t key_len;
+    uint32_t left;              /* entries after this one in its container */
+    const unsigned char *limit; /* end of the message */
+} bos_view_t;
+
 #ifndef JANSSON_USING_CMAKE /* disabled if using cmake */
 #if JSON_INTEGER_IS_LONG_LONG
 #ifdef _WIN32
@@ -331,6 +361,18 @@ json_t *bos_deserialize(const void *data, json_error_t *error) JANSSON_ATTRS(war
 bos_t *bos_serialize(json_t *value, json_error_t *error) JANSSON_ATTRS(warn_unused_result);
 void bos_free(bos_t *ptr);
 
+/* bos in place reading, string and bytes payloads point into the message */
+
+int bos_view_init(bos_view_t *root, const void *data, size_t size);
+int bos_view_first(const bos_view_t *container, bos_view_t *entry);
+int bos_view_next(bos_view_t *entry);
+int bos_view_get(const bos_view_t *object, const char *key, bos_view_t *value);
+int bos_view_index(const bos_view_t *array, uint32_t index, bos_view_t *entry);
+int bos_view_streq(const bos_view_t *view, const char *str);
+int bos_view_strcaseeq(const bos_view_t *view, const char *str);
+int bos_view_is_true(const bos_view_t *view);
+json_int_t bos_view_integer(const bos_view_t *view);
+
 /* decoding */
 
 #define JSON_REJECT_DUPLICATES  0x1
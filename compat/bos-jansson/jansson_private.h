@@ -38,25 +38,6 @@
 #define TRUE 1;
 #define FALSE 0;
 
-typedef enum {
-    BOS_NULL   = 0x00,
-    BOS_BOOL   = 0x01,
-    BOS_INT8   = 0x02,
-    BOS_INT16  = 0x03,
-    BOS_INT32  = 0x04,
-    BOS_INT64  = 0x05,
-    BOS_UINT8  = 0x06,
-    BOS_UINT16 = 0x07,
-    BOS_UINT32 = 0x08,
-    BOS_UINT64 = 0x09,
-    BOS_FLOAT  = 0x0A,
-    BOS_DOUBLE = 0x0B,
-    BOS_STRING = 0x0C,
-    BOS_BYTES  = 0x0D,
-    BOS_ARRAY  = 0x0E,
-    BOS_OBJ    = 0x0F
-} bos_data_type;
-
 typedef struct {
     json_t json;
     hashtable_t hashtable;
@@ -0,0 +1,324 @@
+/**
+ * CPU backend (--cpu)
+ *
+ * The miner thread scans its nonce range with a pool of workers, one per core
+ * (--cpu-threads). Each worker owns a part of the range, hashes it by small
+ * batches and, once done, steals the upper half of the biggest range left.
+ * The algos are the cpu hash functions used to check the gpu results.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+
+#include "miner.h"
+#include "algos.h"
+
+// nonces taken at once, a steal leaves at least this to its victim
+#define CPU_BATCH 64
+
+static const struct {
+	int algo;
+	void (*hash)(void *output, const void *input);
+	bool batched; // verify_batch has the chain
+} cpu_algos[] = {
+	{ ALGO_C11, c11hash },
+	{ ALGO_DEEP, deephash },
+	{ ALGO_FRESH, fresh_hash },
+	{ ALGO_LYRA2, lyra2re_hash },
+	{ ALGO_LYRA2v2, lyra2v2_hash, true },
+	{ ALGO_LYRA2Z, lyra2Z_hash, true },
+	{ ALGO_NIST5, nist5hash },
+	{ ALGO_PENTABLAKE, pentablakehash },
+	{ ALGO_QUARK, quarkhash },
+	{ ALGO_QUBIT, qubithash },
+	{ ALGO_S3, s3hash },
+	{ ALGO_SIB, sibhash },
+	{ ALGO_SKEIN, skeincoinhash },
+	{ ALGO_SKEIN2, skein2hash },
+	{ ALGO_VELTOR, veltorhash },
+	{ ALGO_WHIRLCOIN, wcoinhash },
+	{ ALGO_WHIRLPOOL, wcoinhash },
+	{ ALGO_X11, x11hash, true },
+	{ ALGO_X13, x13hash, true },
+	{ ALGO_X14, x14hash, true },
+	{ ALGO_X15, x15hash, true },
+	{ ALGO_X17, x17hash, true },
+};
+
+struct cpu_worker {
+	// next nonce << 32 | end, taken by the owner and shrunk by the thieves
+	std::atomic<uint64_t> range;
+	pthread_t pth;
+	int id;
+	uint32_t gen;
+	uint64_t hashes;
+	char padding[64];
+};
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t start;
+	pthread_cond_t done;
+	struct cpu_worker *workers;
+	int count;
+	int running;
+	uint32_t gen;
+
+	// current scan
+	int thr_id;
+	int algo;
+	void (*hash)(void *output, const void *input);
+	bool batched;
+	uint32_t data[20];
+	uint32_t target[8];
+	std::atomic<bool> stop;
+	int found;
+	uint32_t nonces[2];
+	uint32_t hashes[2][8];
+} pool;
+
+static inline uint64_t range_pack(uint32_t next, uint32_t end)
+{
+	return ((uint64_t) next << 32) | end;
+}
+
+/* next batch of the worker range, false once empty */
+static bool range_take(struct cpu_worker *w, uint32_t *first, uint32_t *count)
+{
+	uint64_t cur = w->range.load(std::memory_order_relaxed);
+	for (;;) {
+		uint32_t next = (uint32_t) (cur >> 32), end = (uint32_t) cur;
+		if (next >= end)
+			return false;
+		uint32_t n = min((uint32_t) CPU_BATCH, end - next);
+		if (w->range.compare_exchange_weak(cur, range_pack(next + n, end))) {
+			*first = next;
+			*count = n;
+			return true;
+		}
+	}
+}
+
+/* move the upper half of the biggest range left to the worker */
+static bool range_steal(struct cpu_worker *w)
+{
+	for (;;) {
+		struct cpu_worker *victim = NULL;
+		uint64_t best = 0;
+		uint32_t left = 0;
+		for (int i = 0; i < pool.count; i++) {
+			uint64_t cur = pool.workers[i].range.load(std::memory_order_relaxed);
+			uint32_t size = (uint32_t) cur - min((uint32_t) cur, (uint32_t) (cur >> 32));
+			if (&pool.workers[i] != w && size > left) {
+				victim = &pool.workers[i];
+				best = cur;
+				left = size;
+			}
+		}
+		if (!victim || left < 2 * CPU_BATCH)
+			return false;
+
+		uint32_t next = (uint32_t) (best >> 32), end = (uint32_t) best;
+		uint32_t mid = next + left / 2;
+		if (victim->range.compare_exchange_strong(best, range_pack(next, mid))) {
+			w->range.store(range_pack(mid, end), std::memory_order_relaxed);
+			return true;
+		}
+	}
+}
+
+static void found_nonce(uint32_t nonce, const uint32_t *hash)
+{
+	pthread_mutex_lock(&pool.lock);
+	if (pool.found < 2) {
+		pool.nonces[pool.found] = nonce;
+		memcpy(pool.hashes[pool.found], hash, 32);
+		pool.found++;
+	}
+	pthread_mutex_unlock(&pool.lock);
+	pool.stop.store(true);
+}
+
+static void scan_batch(uint32_t *endiandata, uint32_t first, uint32_t count)
+{
+	uint32_t _ALIGN(64) vhash[CPU_BATCH][8];
+	uint32_t nonces[CPU_BATCH];
+
+	if (count == 0)
+		return;
+
+	for (uint32_t n = 0; n < count; n++)
+		nonces[n] = first + n;
+
+	if (pool.batched) {
+		verify_batch(pool.algo, pool.data, nonces, (int) count, vhash[0]);
+	} else {
+		for (uint32_t n = 0; n < count; n++) {
+			be32enc(&endiandata[19], nonces[n]);
+			pool.hash(vhash[n], endiandata);
+		}
+	}
+
+	for (uint32_t n = 0; n < count; n++) {
+		if (vhash[n][7] <= pool.target[7] && fulltest(vhash[n], pool.target))
+			found_nonce(nonces[n], vhash[n]);
+	}
+}
+
+static void *cpu_worker_thread(void *userdata)
+{
+	struct cpu_worker *w = (struct cpu_worker *) userdata;
+	uint32_t _ALIGN(64) endiandata[20];
+
+	// one core per worker, in the --cpu-affinity mask if set
+	if (num_cpus > 1) {
+		int cpu = w->id % num_cpus;
+		if (opt_affinity != -1L) {
+			int bits = 0;
+			for (int i = 0; i < num_cpus && i < 64; i++)
+				bits += (opt_affinity >> i) & 1;
+			for (int i = 0, n = w->id % max(1, bits); i < num_cpus && i < 64; i++) {
+				if (((opt_affinity >> i) & 1) && n-- == 0) {
+					cpu = i;
+					break;
+				}
+			}
+		}
+		affine_to_cpu(cpu);
+	}
+
+	pthread_mutex_lock(&pool.lock);
+	for (;;) {
+		while (w->gen == pool.gen && !abort_flag)
+			pthread_cond_wait(&pool.start, &pool.lock);
+		// woken by the abort only, this worker is not counted in pool.running
+		if (w->gen == pool.gen)
+			break;
+		w->gen = pool.gen;
+		pthread_mutex_unlock(&pool.lock);
+
+		for (int k = 0; k < 20; k++)
+			be32enc(&endiandata[k], pool.data[k]);
+
+		uint32_t first, count;
+		while (!pool.stop.load(std::memory_order_relaxed)) {
+			if (!range_take(w, &first, &count) && !(range_steal(w) && range_take(w, &first, &count)))
+				break;
+			scan_batch(endiandata, first, count);
+			w->hashes += count;
+			if (work_restart[pool.thr_id].restart || abort_flag)
+				pool.stop.store(true);
+		}
+
+		pthread_mutex_lock(&pool.lock);
+		if (--pool.running == 0)
+			pthread_cond_signal(&pool.done);
+	}
+	pthread_mutex_unlock(&pool.lock);
+	return NULL;
+}
+
+static bool cpu_pool_init(int thr_id)
+{
+	pool.count = opt_cpu_threads > 0 ? opt_cpu_threads : num_cpus;
+	pool.workers = new cpu_worker[pool.count];
+	pool.thr_id = thr_id;
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.start, NULL);
+	pthread_cond_init(&pool.done, NULL);
+
+	for (int i = 0; i < pool.count; i++) {
+		struct cpu_worker *w = &pool.workers[i];
+		w->id = i;
+		w->gen = 0;
+		w->hashes = 0;
+		w->range.store(0);
+		if (pthread_create(&w->pth, NULL, cpu_worker_thread, w)) {
+			applog(LOG_ERR, "cpu worker %d create failed", i);
+			return false;
+		}
+	}
+	applog(LOG_INFO, "CPU: %d worker thread%s started", pool.count, pool.count > 1 ? "s" : "");
+	return true;
+}
+
+/**
+ * The cpu scanhash, same contract as the gpu ones: pdata[19] (and pdata[21])
+ * set to the found nonces, or to max_nonce when the range is done
+ */
+int scanhash_cpu(int thr_id, struct work *work, uint32_t max_nonce, unsigned long *hashes_done)
+{
+	uint32_t *pdata = work->data;
+	uint32_t *ptarget = work->target;
+	const uint32_t first_nonce = pdata[19];
+	static bool init = false;
+	int a;
+
+	*hashes_done = 0;
+	for (a = 0; a < (int) ARRAY_SIZE(cpu_algos); a++)
+		if (cpu_algos[a].algo == opt_algo)
+			break;
+	if (a == (int) ARRAY_SIZE(cpu_algos)) {
+		applog(LOG_ERR, "CPU: %s is not supported", algo_names[opt_algo]);
+		abort_flag = true;
+		return -1;
+	}
+
+	if (!init) {
+		if (!cpu_pool_init(thr_id)) {
+			abort_flag = true;
+			return -1;
+		}
+		init = true;
+	}
+
+	if (opt_benchmark)
+		ptarget[7] = 0x00ff;
+
+	if (first_nonce >= max_nonce)
+		return 0;
+
+	pthread_mutex_lock(&pool.lock);
+	pool.algo = opt_algo;
+	pool.hash = cpu_algos[a].hash;
+	pool.batched = cpu_algos[a].batched;
+	memcpy(pool.data, pdata, sizeof(pool.data));
+	memcpy(pool.target, ptarget, sizeof(pool.target));
+	pool.found = 0;
+	pool.stop.store(false);
+
+	// contiguous nonce ranges, the workers balance them by stealing
+	const uint32_t span = (max_nonce - first_nonce) / pool.count;
+	for (int i = 0; i < pool.count; i++) {
+		struct cpu_worker *w = &pool.workers[i];
+		uint32_t from = first_nonce + span * i;
+		uint32_t to = (i == pool.count - 1) ? max_nonce : from + span;
+		w->range.store(range_pack(from, to));
+		w->hashes = 0;
+	}
+	pool.running = pool.count;
+	pool.gen++;
+	pthread_cond_broadcast(&pool.start);
+	while (pool.running > 0)
+		pthread_cond_wait(&pool.done, &pool.lock);
+
+	for (int i = 0; i < pool.count; i++)
+		*hashes_done += (unsigned long) pool.workers[i].hashes;
+	const int found = pool.found;
+	pthread_mutex_unlock(&pool.lock);
+
+	if (found) {
+		work_set_target_ratio(work, pool.hashes[0]);
+		if (found > 1) {
+			if (bn_hash_target_ratio(pool.hashes[1], ptarget) > work->shareratio[0])
+				work_set_target_ratio(work, pool.hashes[1]);
+			pdata[21] = work->nonces[1] = pool.nonces[1];
+		}
+		pdata[19] = work->nonces[0] = pool.nonces[0];
+		return found;
+	}
+
+	// the stolen ranges are not contiguous, a restart drops the whole range
+	pdata[19] = max_nonce;
+	return 0;
+}
@@ -40,6 +40,15 @@ __constant__ uint4 Elements[1];
 //uint8 * GYLocal[16];
 /*__device__*/ uint32_t *Header[MAX_GPUS];
 /*__device__*/ uint2 *buffer_a[MAX_GPUS];
+// solver block gather: device and pinned host staging of MTP_GATHER_MAX blocks
+// second block/tree set, filled for the next job while the current one is mined
+static uint4 *HBlockNext[MAX_GPUS];
+static uint32_t *HeaderNext[MAX_GPUS];
+static uint2 *buffer_aNext[MAX_GPUS];
+
+#define MTP_GATHER_MAX 64 // same as merkletree/mtp.h
+static uint4 *d_Gather[MAX_GPUS];
+static uint4 *h_Gather[MAX_GPUS];
 
 #define ARGON2_SYNC_POINTS 4 
 #define argon_outlen 32
@@ -969,7 +978,55 @@ void mtp_cpu_init(int thr_id, uint32_t threads)
 	CUDA_SAFE_CALL(cudaMallocHost(&h_MinNonces[thr_id], sizeof(uint32_t)));
 	CUDA_SAFE_CALL(cudaMalloc(&Header[thr_id], sizeof(uint32_t) * 8));
 	CUDA_SAFE_CALL(cudaMalloc(&buffer_a[thr_id], 4194304 * 64));
+	CUDA_SAFE_CALL(cudaMalloc(&d_Gather[thr_id], MTP_GATHER_MAX * 1024));
+	CUDA_SAFE_CALL(cudaMallocHost(&h_Gather[thr_id], MTP_GATHER_MAX * 1024));
+
+}
+
+__host__
+void mtp_cpu_free_next(int thr_id)
+{
+	cudaFree(HBlockNext[thr_id]);
+	cudaFree(HeaderNext[thr_id]);
+	cudaFree(buffer_aNext[thr_id]);
+	HBlockNext[thr_id] = NULL;
+	HeaderNext[thr_id] = NULL;
+	buffer_aNext[thr_id] = NULL;
+}
+
+__host__
+bool mtp_cpu_init_next(int thr_id)
+{
+	size_t freeMem, totalMem;
+	size_t need = 256 * argon_memcost * sizeof(uint32_t) + 4194304 * 64;
+
+	// only double buffer when the second set fits with some headroom left
+	if (cudaMemGetInfo(&freeMem, &totalMem) != cudaSuccess || freeMem < need + (need >> 4))
+		return false;
+	if (cudaMalloc((void**)&HBlockNext[thr_id], 256 * argon_memcost * sizeof(uint32_t)) != cudaSuccess ||
+		cudaMalloc(&HeaderNext[thr_id], sizeof(uint32_t) * 8) != cudaSuccess ||
+		cudaMalloc(&buffer_aNext[thr_id], 4194304 * 64) != cudaSuccess) {
+		cudaGetLastError();
+		mtp_cpu_free_next(thr_id);
+		return false;
+	}
+	return true;
+}
 
+// make the prepared set the active one, the previous job's set becomes the next target
+__host__
+void mtp_swap_next(int thr_id)
+{
+	uint4 *b = HBlock[thr_id];
+	uint32_t *h = Header[thr_id];
+	uint2 *t = buffer_a[thr_id];
+
+	HBlock[thr_id] = HBlockNext[thr_id];
+	Header[thr_id] = HeaderNext[thr_id];
+	buffer_a[thr_id] = buffer_aNext[thr_id];
+	HBlockNext[thr_id] = b;
+	HeaderNext[thr_id] = h;
+	buffer_aNext[thr_id] = t;
 }
 
 __host__
@@ -1797,6 +1854,10 @@ __host__ void get_tree(int thr_id, uint8_t* d, cudaStream_t s0) {
 	CUDA_SAFE_CALL(cudaMemcpyAsync(d, buffer_a[thr_id], sizeof(uint2) * 2 * 1048576 * 4, cudaMemcpyDeviceToHost, s0));
 }
 
+__host__ void get_tree_next(int thr_id, uint8_t* d, cudaStream_t s0) {
+	CUDA_SAFE_CALL(cudaMemcpyAsync(d, buffer_aNext[thr_id], sizeof(uint2) * 2 * 1048576 * 4, cudaMemcpyDeviceToHost, s0));
+}
+
 __host__ uint8_t* get_tree2(int thr_id) {
 	uint8_t *d; 
 	CUDA_SAFE_CALL(cudaMallocHost(&d, sizeof(uint2) * 2 * 1048576 * 4));
@@ -1830,6 +1891,33 @@ __host__ void get_block_test(int thr_id, void* d, uint32_t index, cudaStream_t s
 
 
 }
+typedef struct { uint32_t index[MTP_GATHER_MAX]; } mtp_gather_list;
+
+// one cuda block per argon2 block, its 64 uint4 are spread over the 8 slices of HBlock
+__global__ void mtp_gather(const uint4 * __restrict__ GBlock, uint4 * __restrict__ out, const mtp_gather_list list)
+{
+	const uint32_t index = list.index[blockIdx.x];
+	const uint32_t slice = threadIdx.x >> 3;
+	const uint32_t word = threadIdx.x & 7;
+
+	out[blockIdx.x * 64 + threadIdx.x] = GBlock[index * 8 + slice * argon_memcost * 8 + word];
+}
+
+// gathers count (<= MTP_GATHER_MAX) blocks in a single device to host copy,
+// returns the pinned staging area holding them back to back
+__host__ const uint64_t* get_blocks_batch(int thr_id, const uint32_t *index, int count, cudaStream_t s0) {
+
+	mtp_gather_list list;
+	for (int i = 0; i < count; i++)
+		list.index[i] = index[i];
+
+	mtp_gather <<< count, 64, 0, s0 >>> (HBlock[thr_id], d_Gather[thr_id], list);
+	cudaMemcpyAsync(h_Gather[thr_id], d_Gather[thr_id], count * 1024, cudaMemcpyDeviceToHost, s0);
+	cudaStreamSynchronize(s0);
+
+	return (const uint64_t*)h_Gather[thr_id];
+}
+
 __host__ void mtp_i_cpu(int thr_id, uint32_t *block_header, cudaStream_t s0) {
 
 //	cudaSetDevice(device_map[thr_id]);
@@ -1864,10 +1952,10 @@ __host__ void mtp_i_cpu(int thr_id, uint32_t *block_header, cudaStream_t s0) {
 }
 
 
-__host__ void mtp_i_cpu2(int thr_id, uint32_t *block_header, cudaStream_t s0) {
+static void mtp_i_cpu2_set(int thr_id, uint4 *blocks, uint32_t *header, uint2 *tree, uint32_t *block_header, cudaStream_t s0) {
 
 //	cudaSetDevice(device_map[thr_id]);
-	cudaError_t err = cudaMemcpyAsync(Header[thr_id], block_header, 8 * sizeof(uint32_t), cudaMemcpyHostToDevice,s0);
+	cudaError_t err = cudaMemcpyAsync(header, block_header, 8 * sizeof(uint32_t), cudaMemcpyHostToDevice,s0);
 	if (err != cudaSuccess)
 	{
 		printf("mtp_i_cpu2 %s\n", cudaGetErrorName(err));
@@ -1880,23 +1968,31 @@ __host__ void mtp_i_cpu2(int thr_id, uint32_t *block_header, cudaStream_t s0) {
 	//        for(int i=0;i<4;i++)
 	//                mtp_i << <grid, block>> >(HBlock[thr_id],Header[thr_id],i);
 
-	mtp_i2<0> << <grid, block, thr_id, s0 >> >((uint4*)HBlock[thr_id], Header[thr_id]);
+	mtp_i2<0> << <grid, block, thr_id, s0 >> >(blocks, header);
 	cudaStreamSynchronize(s0);
-	mtp_i2<1> << <grid, block, thr_id, s0 >> >((uint4*)HBlock[thr_id], Header[thr_id]);
+	mtp_i2<1> << <grid, block, thr_id, s0 >> >(blocks, header);
 	cudaStreamSynchronize(s0);
-	mtp_i2<2> << <grid, block, thr_id, s0 >> >((uint4*)HBlock[thr_id], Header[thr_id]);
+	mtp_i2<2> << <grid, block, thr_id, s0 >> >(blocks, header);
 	cudaStreamSynchronize(s0);
-	mtp_i2<3> << <grid, block, thr_id, s0 >> >((uint4*)HBlock[thr_id], Header[thr_id]);
+	mtp_i2<3> << <grid, block, thr_id, s0 >> >(blocks, header);
 	cudaStreamSynchronize(s0);
 
 	tpb = 256;
 	dim3 grid2(1048576 * 4 / tpb);
 	dim3 block2(tpb);
-	mtp_fc2 << <grid2, block2, thr_id, s0 >> >(1048576 * 4, (uint4*)HBlock[thr_id], buffer_a[thr_id]);
+	mtp_fc2 << <grid2, block2, thr_id, s0 >> >(1048576 * 4, blocks, tree);
 	cudaStreamSynchronize(s0);
 
 }
 
+__host__ void mtp_i_cpu2(int thr_id, uint32_t *block_header, cudaStream_t s0) {
+	mtp_i_cpu2_set(thr_id, HBlock[thr_id], Header[thr_id], buffer_a[thr_id], block_header, s0);
+}
+
+__host__ void mtp_i_cpu2_next(int thr_id, uint32_t *block_header, cudaStream_t s0) {
+	mtp_i_cpu2_set(thr_id, HBlockNext[thr_id], HeaderNext[thr_id], buffer_aNext[thr_id], block_header, s0);
+}
+
 
 
 __host__
@@ -1917,7 +2013,7 @@ void mtp_fill_1b(int thr_id, uint64_t *Block, uint32_t block_nr)
 }
 
 __host__
-void mtp_fill_1c(int thr_id, uint64_t *Block, uint32_t block_nr, cudaStream_t s0)
+static void mtp_fill_1c_set(uint4 *blocks, uint64_t *Block, uint32_t block_nr, cudaStream_t s0)
 {
 //	cudaSetDevice(device_map[thr_id]);
 	//	uint4 *Blockptr = &HBlock[thr_id][block_nr * 64];
@@ -1925,7 +2021,7 @@ void mtp_fill_1c(int thr_id, uint64_t *Block, uint32_t block_nr, cudaStream_t s0
 	//subdivide blocks in 8 units of 128
 	cudaError_t err = cudaSuccess;
 	for (int i = 0; i<8; i++) {
-		uint4 *Blockptr = &HBlock[thr_id][block_nr * 8 + i*argon_memcost * 8];
+		uint4 *Blockptr = &blocks[block_nr * 8 + i*argon_memcost * 8];
 		err = cudaMemcpyAsync(Blockptr, Block + 16 * i, 32 * sizeof(uint32_t), cudaMemcpyHostToDevice,s0);
 	}
 	if (err != cudaSuccess)
@@ -1937,6 +2033,18 @@ void mtp_fill_1c(int thr_id, uint64_t *Block, uint32_t block_nr, cudaStream_t s0
 
 }
 
+__host__
+void mtp_fill_1c(int thr_id, uint64_t *Block, uint32_t block_nr, cudaStream_t s0)
+{
+	mtp_fill_1c_set(HBlock[thr_id], Block, block_nr, s0);
+}
+
+__host__
+void mtp_fill_1c_next(int thr_id, uint64_t *Block, uint32_t block_nr, cudaStream_t s0)
+{
+	mtp_fill_1c_set(HBlockNext[thr_id], Block, block_nr, s0);
+}
+
 __host__
 void mtp_fill_1c_old(int thr_id, uint64_t *Block, uint32_t block_nr)
 {
@@ -30,7 +30,7 @@ static uint32_t JobId[MAX_GPUS] = {0};
 static uint64_t XtraNonce2[MAX_GPUS] = {0};
 static bool fillGpu[MAX_GPUS] = {false};
 //static  MerkleTree::Elements TheElements;
-static  MerkleTree *ordered_tree[MAX_GPUS];
+static  MerkleTree ordered_tree[MAX_GPUS];
 static  unsigned char TheMerkleRoot[MAX_GPUS][16];
 static  argon2_context context[MAX_GPUS];
 static argon2_instance_t instance[MAX_GPUS];
@@ -111,7 +111,8 @@ if (JobId[thr_id] != work->data[16] || XtraNonce2[thr_id] != ((uint64_t*)work->x
 
 	if (JobId[thr_id] != 0) {
 		free_memory(&context[thr_id], (unsigned char *)instance[thr_id].memory, instance[thr_id].memory_blocks, sizeof(block));
-		ordered_tree[thr_id]->Destructor();
+		// release the previous layers before the new tree is built
+		ordered_tree[thr_id] = MerkleTree();
 //		CUDA_SAFE_CALL(cudaFreeHost(dx[thr_id]));
 	}
 //	printf("allocate memory for merkletree stuff \n");
@@ -136,11 +137,11 @@ argon2_ctx_from_mtp(&context[thr_id], &instance[thr_id]);
 
 	cudaStreamSynchronize(s0);
 
-	ordered_tree[thr_id] = new MerkleTree(dx[thr_id], true);
+	ordered_tree[thr_id] = MerkleTree(dx[thr_id], true);
  
 	JobId[thr_id] = work->data[16];
 	XtraNonce2[thr_id] = ((uint64_t*)work->xnonce2)[0];
-	MerkleTree::Buffer root = ordered_tree[thr_id]->getRoot();
+	MerkleTree::Buffer root = ordered_tree[thr_id].getRoot();
 
 	std::copy(root.begin(), root.end(), TheMerkleRoot[thr_id]);
 
@@ -175,14 +176,15 @@ argon2_ctx_from_mtp(&context[thr_id], &instance[thr_id]);
 			blockS nBlockMTP[MTP_L *2] = {0};
 			unsigned char nProofMTP[MTP_L * 3 * 353 ] = {0};
 
-			uint32_t is_sol = mtptcr_solver(thr_id,foundNonce, &instance[thr_id], nBlockMTP,nProofMTP, TheMerkleRoot[thr_id], mtpHashValue, *ordered_tree[thr_id], endiandata,TheUint256Target[0],s0);
+			uint32_t is_sol = mtptcr_solver(thr_id,foundNonce, &instance[thr_id], nBlockMTP,nProofMTP, TheMerkleRoot[thr_id], mtpHashValue, ordered_tree[thr_id], endiandata,TheUint256Target[0],s0);
 
 			if (JobId[thr_id] != work->data[16] || XtraNonce2[thr_id] != ((uint64_t*)work->xnonce2)[0])
 				return 0; // if work has changed stop and go back to the initialization
 
 
 			
-			if (is_sol==1 /*&& fulltest(vhash64, ptarget)*/) {
+			if (is_sol==1 && mtp_verify_share(MTP_L, foundNonce, &instance[thr_id], nBlockMTP, nProofMTP,
+				TheMerkleRoot[thr_id], mtpHashValue, endiandata, TheUint256Target[0])) {
 
 				int res = 1;
 				work_set_target_ratio(work, (uint32_t*)mtpHashValue);
@@ -301,7 +303,8 @@ extern "C" int scanhash_mtptcr_solo(int nthreads, int thr_id, struct work* work,
 		if (JobId[thr_id] != 0) {
 
 			free_memory(&context[thr_id], (unsigned char *)instance[thr_id].memory, instance[thr_id].memory_blocks, sizeof(block));
-			ordered_tree[thr_id]->Destructor();
+			// release the previous layers before the new tree is built
+			ordered_tree[thr_id] = MerkleTree();
 
 		}
 
@@ -327,11 +330,11 @@ extern "C" int scanhash_mtptcr_solo(int nthreads, int thr_id, struct work* work,
 		//	printf("Step 2 : Compute the root Φ of the Merkle hash tree \n");
 		//  sleep(10);
 
-		ordered_tree[thr_id] = new MerkleTree(dx[thr_id], true);
+		ordered_tree[thr_id] = MerkleTree(dx[thr_id], true);
 
 		JobId[thr_id] = work->data[17];
 		XtraNonce2[thr_id] = ((uint64_t*)work->xnonce2)[0];
-		MerkleTree::Buffer root = ordered_tree[thr_id]->getRoot();
+		MerkleTree::Buffer root = ordered_tree[thr_id].getRoot();
 
 		std::copy(root.begin(), root.end(), TheMerkleRoot[thr_id]);
 
@@ -364,9 +367,10 @@ extern "C" int scanhash_mtptcr_solo(int nthreads, int thr_id, struct work* work,
 			blockS nBlockMTP[MTP_L * 2] = { 0 };
 			unsigned char nProofMTP[MTP_L * 3 * 353] = { 0 };
 
-			uint32_t is_sol = mtptcr_solver(thr_id, foundNonce, &instance[thr_id], nBlockMTP, nProofMTP, TheMerkleRoot[thr_id], mtpHashValue, *ordered_tree[thr_id], endiandata, TheUint256Target[0],s0);
+			uint32_t is_sol = mtptcr_solver(thr_id, foundNonce, &instance[thr_id], nBlockMTP, nProofMTP, TheMerkleRoot[thr_id], mtpHashValue, ordered_tree[thr_id], endiandata, TheUint256Target[0],s0);
 
-			if (is_sol == 1 /*&& fulltest(vhash64, ptarget)*/) {
+			if (is_sol == 1 && mtp_verify_share(MTP_L, foundNonce, &instance[thr_id], nBlockMTP, nProofMTP,
+				TheMerkleRoot[thr_id], mtpHashValue, endiandata, TheUint256Target[0])) {
 
 
 				int res = 1;
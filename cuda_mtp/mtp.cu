@@ -16,6 +16,12 @@ extern uint32_t get_tpb_mtp(int thr_id);
 extern void mtp_fill_1c(int thr_id, uint64_t *Block, uint32_t block_nr, cudaStream_t s0);
 extern void mtp_i_cpu2(int thr_id, uint32_t *block_header, cudaStream_t s0);
 void get_tree(int thr_id, uint8_t* d, cudaStream_t s0);
+extern bool mtp_cpu_init_next(int thr_id);
+extern void mtp_cpu_free_next(int thr_id);
+extern void mtp_swap_next(int thr_id);
+extern void mtp_fill_1c_next(int thr_id, uint64_t *Block, uint32_t block_nr, cudaStream_t s0);
+extern void mtp_i_cpu2_next(int thr_id, uint32_t *block_header, cudaStream_t s0);
+void get_tree_next(int thr_id, uint8_t* d, cudaStream_t s0);
 
 #define HASHLEN 32
 #define SALTLEN 16
@@ -25,21 +31,223 @@ static const uint8_t MTP_L = 64;
 
 static bool init[MAX_GPUS] = { 0 };
 static __thread uint32_t throughput = 0;
+static __thread cudaStream_t s0 = NULL;
 static uint32_t JobId[MAX_GPUS] = {0};
 static uint64_t XtraNonce2[MAX_GPUS] = {0};
 static bool fillGpu[MAX_GPUS] = {false};
 //static  MerkleTree::Elements TheElements;
-static  MerkleTree *ordered_tree[MAX_GPUS];
+static  MerkleTree ordered_tree[MAX_GPUS];
 static  unsigned char TheMerkleRoot[MAX_GPUS][16];
 static  argon2_context context[MAX_GPUS];
 static argon2_instance_t instance[MAX_GPUS];
 static uint8_t *dx[MAX_GPUS];
+static struct work ActiveWork[MAX_GPUS];
 //static pthread_mutex_t work_lock = PTHREAD_MUTEX_INITIALIZER;
 //static pthread_barrier_t barrier;
 //static pthread_rwlock_t rwlock = PTHREAD_RWLOCK_INITIALIZER;
 
 //static std::vector<uint8_t*> MEM[MAX_GPUS];
 
+/*
+ * Next job preparation: when the gpu has room for a second block/tree set,
+ * a new job is filled and its merkle tree built by a preparer thread while
+ * the previous job keeps hashing, then both sets are swapped.
+ */
+enum {
+	MTP_PREP_IDLE = 0,
+	MTP_PREP_BUSY,
+	MTP_PREP_READY
+};
+
+struct mtp_job_prep {
+	pthread_t pth;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int thr_id;
+	int state;
+	cudaStream_t stream;
+	uint32_t job_id;
+	uint64_t xnonce2;
+	uint32_t endiandata[20];
+	argon2_context context;
+	argon2_instance_t instance;
+	MerkleTree tree;
+	unsigned char root[16];
+	uint8_t *dx;
+};
+
+static mtp_job_prep *job_prep[MAX_GPUS];
+
+// fill the first blocks of each lane, let the gpu fill the rest and build the tree
+static void mtp_build_job(int thr_id, bool next, const uint32_t *endiandata, argon2_context *ctx,
+	argon2_instance_t *inst, MerkleTree &tree, unsigned char *root, uint8_t *d, cudaStream_t s)
+{
+	*ctx = init_argon2d_param((const char*)endiandata);
+	argon2_ctx_from_mtp(ctx, inst);
+
+	for (int l = 0; l < 4; l++) {
+		for (int b = 0; b < 2; b++) {
+			if (next)
+				mtp_fill_1c_next(thr_id, inst->memory[2 * l + b].v, l * 1048576 + b, s);
+			else
+				mtp_fill_1c(thr_id, inst->memory[2 * l + b].v, l * 1048576 + b, s);
+		}
+	}
+
+	if (next) {
+		mtp_i_cpu2_next(thr_id, inst->block_header, s);
+		get_tree_next(thr_id, d, s);
+	} else {
+		mtp_i_cpu2(thr_id, inst->block_header, s);
+		get_tree(thr_id, d, s);
+	}
+	cudaStreamSynchronize(s);
+
+	tree = MerkleTree(d, true);
+	MerkleTree::Buffer r = tree.getRoot();
+	std::copy(r.begin(), r.end(), root);
+}
+
+static void *mtp_prep_thread(void *arg)
+{
+	mtp_job_prep *p = (mtp_job_prep*) arg;
+
+	cudaSetDevice(device_map[p->thr_id]);
+	cudaStreamCreateWithFlags(&p->stream, cudaStreamNonBlocking);
+
+	pthread_mutex_lock(&p->lock);
+	for (;;) {
+		while (p->state != MTP_PREP_BUSY)
+			pthread_cond_wait(&p->cond, &p->lock);
+		pthread_mutex_unlock(&p->lock);
+
+		mtp_build_job(p->thr_id, true, p->endiandata, &p->context, &p->instance,
+			p->tree, p->root, p->dx, p->stream);
+
+		pthread_mutex_lock(&p->lock);
+		p->state = MTP_PREP_READY;
+		pthread_cond_broadcast(&p->cond);
+	}
+	return NULL;
+}
+
+static mtp_job_prep* mtp_prep_create(int thr_id)
+{
+	mtp_job_prep *p;
+
+	if (!mtp_cpu_init_next(thr_id))
+		return NULL;
+
+	p = new mtp_job_prep();
+	p->thr_id = thr_id;
+	p->state = MTP_PREP_IDLE;
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->cond, NULL);
+	if (cudaMallocHost(&p->dx, sizeof(uint2) * 2 * 1048576 * 4) != cudaSuccess) {
+		cudaGetLastError();
+		p->dx = NULL;
+		gpulog(LOG_WARNING, thr_id, "unable to allocate the job preparer buffer");
+	} else if (!pthread_create(&p->pth, NULL, mtp_prep_thread, p)) {
+		return p;
+	} else {
+		gpulog(LOG_WARNING, thr_id, "unable to start the job preparer thread");
+	}
+
+	cudaFreeHost(p->dx);
+	pthread_cond_destroy(&p->cond);
+	pthread_mutex_destroy(&p->lock);
+	delete p;
+	mtp_cpu_free_next(thr_id);
+	return NULL;
+}
+
+static bool mtp_prep_has(const mtp_job_prep *p, uint32_t job_id, uint64_t xnonce2)
+{
+	return p->state != MTP_PREP_IDLE && p->job_id == job_id && p->xnonce2 == xnonce2;
+}
+
+// queue the work job on an idle preparer, the lock must be held
+static void mtp_prep_post(mtp_job_prep *p, const struct work *work)
+{
+	if (p->state == MTP_PREP_READY) {
+		// superseded before it was used
+		free_memory(&p->context, (unsigned char *)p->instance.memory, p->instance.memory_blocks, sizeof(block));
+		p->tree = MerkleTree();
+	}
+	memcpy(p->endiandata, work->data, sizeof(p->endiandata));
+	p->endiandata[19] = work->data[20]; // mtp version
+	p->job_id = work->data[16];
+	p->xnonce2 = ((uint64_t*)work->xnonce2)[0];
+	p->state = MTP_PREP_BUSY;
+	pthread_cond_broadcast(&p->cond);
+}
+
+// true while the new job is prepared and the shares of the active one remain valid
+static bool mtp_prep_keep_active(int thr_id, const struct work *work)
+{
+	mtp_job_prep *p = job_prep[thr_id];
+	uint32_t job_id = work->data[16];
+	uint64_t xnonce2 = ((uint64_t*)work->xnonce2)[0];
+	bool keep;
+
+	if (JobId[thr_id] == job_id && XtraNonce2[thr_id] == xnonce2)
+		return false;
+
+	pthread_mutex_lock(&p->lock);
+	if (!mtp_prep_has(p, job_id, xnonce2) && p->state != MTP_PREP_BUSY)
+		mtp_prep_post(p, work);
+	keep = JobId[thr_id] != 0 && ActiveWork[thr_id].height == work->height &&
+		ActiveWork[thr_id].pooln == work->pooln &&
+		!(mtp_prep_has(p, job_id, xnonce2) && p->state == MTP_PREP_READY);
+	pthread_mutex_unlock(&p->lock);
+
+	return keep;
+}
+
+// wait for the prepared job if needed, then make it the active one
+static void mtp_prep_take(int thr_id, const struct work *work)
+{
+	mtp_job_prep *p = job_prep[thr_id];
+	uint32_t job_id = work->data[16];
+	uint64_t xnonce2 = ((uint64_t*)work->xnonce2)[0];
+
+	pthread_mutex_lock(&p->lock);
+	while (!(mtp_prep_has(p, job_id, xnonce2) && p->state == MTP_PREP_READY)) {
+		if (p->state != MTP_PREP_BUSY)
+			mtp_prep_post(p, work);
+		else
+			pthread_cond_wait(&p->cond, &p->lock);
+	}
+
+	mtp_swap_next(thr_id);
+	std::swap(context[thr_id], p->context);
+	std::swap(instance[thr_id], p->instance);
+	std::swap(ordered_tree[thr_id], p->tree);
+	std::swap(dx[thr_id], p->dx);
+	memcpy(TheMerkleRoot[thr_id], p->root, sizeof(TheMerkleRoot[thr_id]));
+
+	// the previous job's set is now the preparer's target
+	if (JobId[thr_id] != 0)
+		free_memory(&p->context, (unsigned char *)p->instance.memory, p->instance.memory_blocks, sizeof(block));
+	p->tree = MerkleTree();
+	p->state = MTP_PREP_IDLE;
+	pthread_mutex_unlock(&p->lock);
+}
+
+static void mtp_job_switch_time(int thr_id, struct timeval *tv_start)
+{
+	struct cgpu_info *gpu = &thr_info[thr_id].gpu;
+	struct timeval tv_end, diff;
+
+	gettimeofday(&tv_end, NULL);
+	timeval_subtract(&diff, &tv_end, tv_start);
+	gpu->job_switch_ms = (uint32_t) (diff.tv_sec * 1000 + diff.tv_usec / 1000);
+	gpu->job_switch_ms_total += gpu->job_switch_ms;
+	gpu->job_switches++;
+	if (opt_debug)
+		gpulog(LOG_DEBUG, thr_id, "job switch dead time %u ms", gpu->job_switch_ms);
+}
+
 extern "C" int scanhash_mtp(int nthreads,int thr_id, struct work* work, uint32_t max_nonce, unsigned long *hashes_done, struct mtp* mtp, struct stratum_ctx *sctx)
 {
 
@@ -48,16 +256,10 @@ extern "C" int scanhash_mtp(int nthreads,int thr_id, struct work* work, uint32_t
 //if (JobId==0)
 //	pthread_barrier_init(&barrier, NULL, nthreads);
 
-	cudaStream_t s0;
 	uint32_t *pdata = work->data;
 	uint32_t *ptarget = work->target;
 
 
-	const uint32_t first_nonce = pdata[19];
-	int real_maxnonce = UINT32_MAX / nthreads * (thr_id + 1);
-	if (opt_benchmark)
-		ptarget[7] = 0x00ff;
-
 		uint32_t diff = 5;
 		uint32_t TheNonce;
 
@@ -89,11 +291,23 @@ extern "C" int scanhash_mtp(int nthreads,int thr_id, struct work* work, uint32_t
 		throughput2intensity(throughput), throughput, props.multiProcessorCount);
 		mtp_cpu_init(thr_id, throughput);
 		cudaMallocHost(&dx[thr_id], sizeof(uint2) * 2 * 1048576 * 4);
+		job_prep[thr_id] = mtp_prep_create(thr_id);
+		if (job_prep[thr_id])
+			gpulog(LOG_INFO, thr_id, "New jobs are prepared while mining");
 //		cudaProfilerStop();
 		init[thr_id] = true;
 
 	}
 
+	// continue the active job (and its nonce range) until the next one is ready
+	if (job_prep[thr_id] && mtp_prep_keep_active(thr_id, work))
+		memcpy(work, &ActiveWork[thr_id], sizeof(struct work));
+
+	const uint32_t first_nonce = pdata[19];
+	int real_maxnonce = UINT32_MAX / nthreads * (thr_id + 1);
+	if (opt_benchmark)
+		ptarget[7] = 0x00ff;
+
 	uint32_t _ALIGN(128) endiandata[20];
 	((uint32_t*)pdata)[19] = (pdata[20]); //*/0x00100000; // mtp version not the actual nonce
 
@@ -104,45 +318,30 @@ extern "C" int scanhash_mtp(int nthreads,int thr_id, struct work* work, uint32_t
 if (JobId[thr_id] != work->data[16] || XtraNonce2[thr_id] != ((uint64_t*)work->xnonce2)[0]) {
 //printf("reinit mtp gpu work->data[16]=%08x JobId = %08x \n", work->data[16], JobId[thr_id]);
 
-	if (JobId[thr_id] != 0) {
+	struct timeval tv_switch;
+	gettimeofday(&tv_switch, NULL);
 
-		free_memory(&context[thr_id], (unsigned char *)instance[thr_id].memory, instance[thr_id].memory_blocks, sizeof(block));
-		ordered_tree[thr_id]->Destructor();
-//		delete  ordered_tree[thr_id];
-
-	}
-
- 
-//	cudaProfilerStop();
-context[thr_id] = init_argon2d_param((const char*)endiandata);
+	if (job_prep[thr_id]) {
+		mtp_prep_take(thr_id, work);
+	} else {
+		if (JobId[thr_id] != 0) {
 
-argon2_ctx_from_mtp(&context[thr_id], &instance[thr_id]);
-	mtp_fill_1c(thr_id, instance[thr_id].memory[0 + 0].v, 0 + 0,s0);
-	mtp_fill_1c(thr_id, instance[thr_id].memory[0 + 1].v, 0 + 1,s0);
-	mtp_fill_1c(thr_id, instance[thr_id].memory[2 + 0].v, 1048576 + 0,s0);
-	mtp_fill_1c(thr_id, instance[thr_id].memory[2 + 1].v, 1048576 + 1,s0);
-	mtp_fill_1c(thr_id, instance[thr_id].memory[4 + 0].v, 2097152 + 0,s0);
-	mtp_fill_1c(thr_id, instance[thr_id].memory[4 + 1].v, 2097152 + 1,s0);
-	mtp_fill_1c(thr_id, instance[thr_id].memory[6 + 0].v, 3145728 + 0,s0);
-	mtp_fill_1c(thr_id, instance[thr_id].memory[6 + 1].v, 3145728 + 1,s0);
+			free_memory(&context[thr_id], (unsigned char *)instance[thr_id].memory, instance[thr_id].memory_blocks, sizeof(block));
+			// release the previous layers before the new tree is built
+			ordered_tree[thr_id] = MerkleTree();
 
-	mtp_i_cpu2(thr_id, instance[thr_id].block_header,s0);
+		}
 
-	get_tree(thr_id,dx[thr_id],s0);
+		mtp_build_job(thr_id, false, endiandata, &context[thr_id], &instance[thr_id],
+			ordered_tree[thr_id], TheMerkleRoot[thr_id], dx[thr_id], s0);
+	}
 
-	cudaStreamSynchronize(s0);
-//  sleep(10);
+	mtp_setBlockTarget(thr_id, endiandata, ptarget, &TheMerkleRoot[thr_id],s0);
 
-	ordered_tree[thr_id] = new MerkleTree(dx[thr_id], true);
- 
+	if (JobId[thr_id] != 0)
+		mtp_job_switch_time(thr_id, &tv_switch);
 	JobId[thr_id] = work->data[16];
 	XtraNonce2[thr_id] = ((uint64_t*)work->xnonce2)[0];
-	MerkleTree::Buffer root = ordered_tree[thr_id]->getRoot();
-
-	std::copy(root.begin(), root.end(), TheMerkleRoot[thr_id]);
-
-	mtp_setBlockTarget(thr_id, endiandata, ptarget, &TheMerkleRoot[thr_id],s0);
-	root.resize(0);
 }
 
 
@@ -172,9 +371,10 @@ argon2_ctx_from_mtp(&context[thr_id], &instance[thr_id]);
 			blockS nBlockMTP[MTP_L *2] = {0};
 			unsigned char nProofMTP[MTP_L * 3 * 353 ] = {0};
 
-			uint32_t is_sol = mtp_solver(thr_id,foundNonce, &instance[thr_id], nBlockMTP,nProofMTP, TheMerkleRoot[thr_id], mtpHashValue, *ordered_tree[thr_id], endiandata,TheUint256Target[0],s0);
+			uint32_t is_sol = mtp_solver(thr_id,foundNonce, &instance[thr_id], nBlockMTP,nProofMTP, TheMerkleRoot[thr_id], mtpHashValue, ordered_tree[thr_id], endiandata,TheUint256Target[0],s0);
 
-			if (is_sol==1 /*&& fulltest(vhash64, ptarget)*/) {
+			if (is_sol==1 && mtp_verify_share(MTP_L, foundNonce, &instance[thr_id], nBlockMTP, nProofMTP,
+				TheMerkleRoot[thr_id], mtpHashValue, endiandata, TheUint256Target[0])) {
 
 				int res = 1;
 				work_set_target_ratio(work, (uint32_t*)mtpHashValue);
@@ -196,6 +396,8 @@ argon2_ctx_from_mtp(&context[thr_id], &instance[thr_id]);
 
 				memcpy(mtp->nProofMTP, nProofMTP, sizeof(unsigned char)* MTP_L * 3 * 353);
 
+				memcpy(&ActiveWork[thr_id], work, sizeof(struct work));
+				ActiveWork[thr_id].data[19] = first_nonce + throughput;
 				return res;
 
 			} else {
@@ -223,6 +425,7 @@ argon2_ctx_from_mtp(&context[thr_id], &instance[thr_id]);
 TheEnd:
 //		sctx->job.IncXtra = true;
 		*hashes_done = pdata[19] - first_nonce;
+		memcpy(&ActiveWork[thr_id], work, sizeof(struct work));
 
 	return 0;
 }
@@ -232,7 +435,6 @@ extern "C" int scanhash_mtp_solo(int nthreads, int thr_id, struct work* work, ui
 
 	unsigned char mtpHashValue[32];
 	struct timeval tv_start, tv_end, hdiff;
-	cudaStream_t s0;
 	
 	
 	//if (JobId==0)
@@ -298,7 +500,8 @@ extern "C" int scanhash_mtp_solo(int nthreads, int thr_id, struct work* work, ui
 		if (JobId[thr_id] != 0) {
 
 			free_memory(&context[thr_id], (unsigned char *)instance[thr_id].memory, instance[thr_id].memory_blocks, sizeof(block));
-			ordered_tree[thr_id]->Destructor();
+			// release the previous layers before the new tree is built
+			ordered_tree[thr_id] = MerkleTree();
 
 		}
 
@@ -322,11 +525,11 @@ extern "C" int scanhash_mtp_solo(int nthreads, int thr_id, struct work* work, ui
 		//	printf("Step 2 : Compute the root Φ of the Merkle hash tree \n");
 		//  sleep(10);
 		cudaStreamSynchronize(s0);
-		ordered_tree[thr_id] = new MerkleTree(dx[thr_id], true);
+		ordered_tree[thr_id] = MerkleTree(dx[thr_id], true);
 
 		JobId[thr_id] = work->data[17];
 		XtraNonce2[thr_id] = ((uint64_t*)work->xnonce2)[0];
-		MerkleTree::Buffer root = ordered_tree[thr_id]->getRoot();
+		MerkleTree::Buffer root = ordered_tree[thr_id].getRoot();
 
 		std::copy(root.begin(), root.end(), TheMerkleRoot[thr_id]);
 
@@ -359,9 +562,10 @@ extern "C" int scanhash_mtp_solo(int nthreads, int thr_id, struct work* work, ui
 			blockS nBlockMTP[MTP_L * 2] = { 0 };
 			unsigned char nProofMTP[MTP_L * 3 * 353] = { 0 };
 
-			uint32_t is_sol = mtp_solver(thr_id, foundNonce, &instance[thr_id], nBlockMTP, nProofMTP, TheMerkleRoot[thr_id], mtpHashValue, *ordered_tree[thr_id], endiandata, TheUint256Target[0],s0);
+			uint32_t is_sol = mtp_solver(thr_id, foundNonce, &instance[thr_id], nBlockMTP, nProofMTP, TheMerkleRoot[thr_id], mtpHashValue, ordered_tree[thr_id], endiandata, TheUint256Target[0],s0);
 
-			if (is_sol == 1 /*&& fulltest(vhash64, ptarget)*/) {
+			if (is_sol == 1 && mtp_verify_share(MTP_L, foundNonce, &instance[thr_id], nBlockMTP, nProofMTP,
+				TheMerkleRoot[thr_id], mtpHashValue, endiandata, TheUint256Target[0])) {
 
 
 				int res = 1;
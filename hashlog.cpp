@@ -8,12 +8,11 @@
  */
 #include <stdlib.h>
 #include <memory.h>
-#include <map>
+#include <vector>
+#include <algorithm>
 
 #include "miner.h"
 
-#define HI_DWORD(u64) ((uint32_t) (u64 >> 32))
-#define LO_DWORD(u64) ((uint32_t) u64)
 #define MK_HI64(u32) (0x100000000ULL * u32)
 
 /* from miner.h
@@ -32,18 +31,172 @@ struct hashlog_data {
 };
 */
 
-static std::map<uint64_t, hashlog_data> tlastshares;
+/**
+ * Records are grouped by job, each job has its own open addressing table of
+ * submitted nonces plus its scanned range and the aggregates of all its
+ * records, so the lookups do not scan the other jobs. Jobs are spread on
+ * shards with their own lock, a full shard evicts its oldest job.
+ */
+#define HASHLOG_SHARDS 16
+#define HASHLOG_SHARD_JOBS 8
+#define HASHLOG_MIN_SLOTS 64
+
+struct hashlog_job {
+	uint32_t gen;        // 0 if the slot is free
+	uint32_t njobid;
+	uint32_t tm_last;    // last submit or scan update
+	uint32_t last_sent;  // max submitted nonce
+	uint32_t range_from; // min/max of all the records
+	uint32_t range_to;
+	hashlog_data range;  // scanned range (nonce 0)
+	hashlog_data *slots; // submitted nonces, tm_add is 0 if free
+	uint32_t mask;
+	uint32_t count;
+};
+
+struct hashlog_shard {
+	pthread_mutex_t lock;
+	uint32_t gen;
+	struct hashlog_job jobs[HASHLOG_SHARD_JOBS];
+};
+
+static struct hashlog_shard shards[HASHLOG_SHARDS];
+static pthread_once_t shards_once = PTHREAD_ONCE_INIT;
 
 #define LOG_PURGE_TIMEOUT 5*60
 
 /**
  * str hex to uint32
  */
-static uint64_t hextouint(char* jobid)
+static uint32_t hextouint(char* jobid)
 {
 	char *ptr;
 	/* dont use strtoull(), only since VS2013 */
-	return (uint64_t) strtoul(jobid, &ptr, 16);
+	return (uint32_t) strtoul(jobid, &ptr, 16);
+}
+
+static void hashlog_init(void)
+{
+	for (int i = 0; i < HASHLOG_SHARDS; i++)
+		pthread_mutex_init(&shards[i].lock, NULL);
+}
+
+/**
+ * Lock and return the shard of a job
+ */
+static struct hashlog_shard* shard_lock(uint32_t njobid)
+{
+	struct hashlog_shard *shard;
+	pthread_once(&shards_once, hashlog_init);
+	shard = &shards[(njobid * 0x9E3779B1U) >> 28];
+	pthread_mutex_lock(&shard->lock);
+	return shard;
+}
+
+static void job_free(struct hashlog_job *job)
+{
+	free(job->slots);
+	memset(job, 0, sizeof(*job));
+}
+
+static uint32_t job_records(const struct hashlog_job *job)
+{
+	return job->count + (job->range.tm_add ? 1 : 0);
+}
+
+/**
+ * Search a job in its shard, create it if required (evicting the oldest one)
+ */
+static struct hashlog_job* job_get(struct hashlog_shard *shard, uint32_t njobid, bool create)
+{
+	struct hashlog_job *job = NULL;
+	for (int i = 0; i < HASHLOG_SHARD_JOBS; i++) {
+		struct hashlog_job *j = &shard->jobs[i];
+		if (j->gen && j->njobid == njobid)
+			return j;
+		if (!job || j->gen < job->gen)
+			job = j;
+	}
+	if (!create)
+		return NULL;
+
+	if (job->gen) {
+		if (opt_debug)
+			applog(LOG_DEBUG, "hashlog: evict job %x, %u records", job->njobid, job_records(job));
+		job_free(job);
+	}
+	job->gen = ++shard->gen;
+	job->njobid = njobid;
+	return job;
+}
+
+static inline uint32_t slot_hash(uint32_t nonce)
+{
+	uint32_t h = nonce * 0x9E3779B1U;
+	return h ^ (h >> 15);
+}
+
+static hashlog_data* job_find(const struct hashlog_job *job, uint32_t nonce)
+{
+	if (!job->slots)
+		return NULL;
+	for (uint32_t i = slot_hash(nonce) & job->mask;; i = (i + 1) & job->mask) {
+		hashlog_data *slot = &job->slots[i];
+		if (!slot->tm_add)
+			return NULL;
+		if (slot->nonce == nonce)
+			return slot;
+	}
+}
+
+/**
+ * Slot of a nonce, the table is kept under 3/4 full
+ */
+static hashlog_data* job_insert(struct hashlog_job *job, uint32_t nonce)
+{
+	hashlog_data *slot;
+
+	if (!job->slots || (job->count + 1) * 4 > (job->mask + 1) * 3) {
+		uint32_t size = job->slots ? (job->mask + 1) * 2 : HASHLOG_MIN_SLOTS;
+		hashlog_data *old = job->slots;
+		uint32_t old_size = old ? job->mask + 1 : 0;
+		job->slots = (hashlog_data*) calloc(size, sizeof(hashlog_data));
+		if (!job->slots) {
+			job->slots = old;
+			return NULL;
+		}
+		job->mask = size - 1;
+		for (uint32_t n = 0; n < old_size; n++) {
+			if (!old[n].tm_add)
+				continue;
+			uint32_t i = slot_hash(old[n].nonce) & job->mask;
+			while (job->slots[i].tm_add)
+				i = (i + 1) & job->mask;
+			job->slots[i] = old[n];
+		}
+		free(old);
+	}
+
+	uint32_t i = slot_hash(nonce) & job->mask;
+	while (job->slots[i].tm_add && job->slots[i].nonce != nonce)
+		i = (i + 1) & job->mask;
+	slot = &job->slots[i];
+	if (!slot->tm_add)
+		job->count++;
+	return slot;
+}
+
+/**
+ * Fold a record in the job range
+ */
+static void job_range_add(struct hashlog_job *job, uint32_t from, uint32_t to)
+{
+	if (to == 0)
+		return;
+	if (job->range_to == 0 || from < job->range_from)
+		job->range_from = from;
+	if (to > job->range_to)
+		job->range_to = to;
 }
 
 /**
@@ -52,16 +205,21 @@ static uint64_t hextouint(char* jobid)
 uint32_t hashlog_already_submittted(char* jobid, uint32_t nonce)
 {
 	uint32_t ret = 0;
-	uint64_t njobid = hextouint(jobid);
-	uint64_t key = (njobid << 32) + nonce;
+	uint32_t njobid = hextouint(jobid);
 
 	if (nonce == 0) {
 		// search last submitted nonce for job
-		ret = hashlog_get_last_sent(jobid);
-	} else if (tlastshares.find(key) != tlastshares.end()) {
-		hashlog_data data = tlastshares[key];
-		ret = data.tm_sent;
+		return hashlog_get_last_sent(jobid);
 	}
+
+	struct hashlog_shard *shard = shard_lock(njobid);
+	struct hashlog_job *job = job_get(shard, njobid, false);
+	if (job) {
+		hashlog_data *data = job_find(job, nonce);
+		if (data)
+			ret = data->tm_sent;
+	}
+	pthread_mutex_unlock(&shard->lock);
 	return ret;
 }
 /**
@@ -69,19 +227,29 @@ uint32_t hashlog_already_submittted(char* jobid, uint32_t nonce)
  */
 void hashlog_remember_submit(struct work* work, uint32_t nonce)
 {
-	uint64_t njobid = hextouint(work->job_id);
-	uint64_t key = (njobid << 32) + nonce;
-	hashlog_data data;
-
-	memset(&data, 0, sizeof(data));
-	data.scanned_from = work->scanned_from;
-	data.scanned_to = nonce;
-	data.height = work->height;
-	data.njobid = (uint32_t) njobid;
-	data.tm_add = data.tm_upd = data.tm_sent = (uint32_t) time(NULL);
-	data.npool = (uint8_t) cur_pooln;
-	data.pool_type = pools[cur_pooln].type;
-	tlastshares[key] = data;
+	uint32_t njobid = hextouint(work->job_id);
+	uint32_t now = (uint32_t) time(NULL);
+
+	struct hashlog_shard *shard = shard_lock(njobid);
+	struct hashlog_job *job = job_get(shard, njobid, true);
+	hashlog_data *data = job_insert(job, nonce);
+	if (data) {
+		memset(data, 0, sizeof(*data));
+		data->scanned_from = work->scanned_from;
+		data->scanned_to = nonce;
+		data->height = work->height;
+		data->njobid = njobid;
+		data->nonce = nonce;
+		data->tm_add = data->tm_upd = data->tm_sent = now;
+		data->npool = (uint8_t) cur_pooln;
+		data->pool_type = pools[cur_pooln].type;
+
+		job_range_add(job, data->scanned_from, data->scanned_to);
+		if (nonce > job->last_sent)
+			job->last_sent = nonce;
+	}
+	job->tm_last = now;
+	pthread_mutex_unlock(&shard->lock);
 }
 
 /**
@@ -89,24 +257,25 @@ void hashlog_remember_submit(struct work* work, uint32_t nonce)
  */
 void hashlog_remember_scan_range(struct work* work)
 {
-	uint64_t njobid = hextouint(work->job_id);
-	uint64_t key = (njobid << 32);
-	uint64_t range = hashlog_get_scan_range(work->job_id);
-	hashlog_data data;
+	uint32_t njobid = hextouint(work->job_id);
+	uint32_t now = (uint32_t) time(NULL);
+
+	struct hashlog_shard *shard = shard_lock(njobid);
+	struct hashlog_job *job = job_get(shard, njobid, true);
 
 	// global scan range of a job
-	data = tlastshares[key];
-	if (range == 0) {
+	hashlog_data data = job->range;
+	if (job->range_to == 0) {
 		memset(&data, 0, sizeof(data));
-		data.njobid = (uint32_t) njobid;
 	} else {
-		// get min and max from all sent records
-		data.scanned_from = LO_DWORD(range);
-		data.scanned_to   = HI_DWORD(range);
+		// min and max from all sent records
+		data.scanned_from = job->range_from;
+		data.scanned_to   = job->range_to;
 	}
+	data.njobid = njobid;
 
 	if (data.tm_add == 0)
-		data.tm_add = (uint32_t) time(NULL);
+		data.tm_add = now;
 
 	data.last_from = work->scanned_from;
 
@@ -119,9 +288,12 @@ void hashlog_remember_scan_range(struct work* work)
 			data.scanned_from = work->scanned_from;
 	}
 
-	data.tm_upd = (uint32_t) time(NULL);
+	data.tm_upd = now;
 
-	tlastshares[key] = data;
+	job->range = data;
+	job_range_add(job, data.scanned_from, data.scanned_to);
+	job->tm_last = now;
+	pthread_mutex_unlock(&shard->lock);
 /* 	applog(LOG_BLUE, "job %s range : %x %x -> %x %x", jobid,
 		scanned_from, scanned_to, data.scanned_from, data.scanned_to); */
 }
@@ -133,25 +305,15 @@ void hashlog_remember_scan_range(struct work* work)
 uint64_t hashlog_get_scan_range(char* jobid)
 {
 	uint64_t ret = 0;
-	uint64_t njobid = hextouint(jobid);
-	uint64_t keypfx = (njobid << 32);
-	uint64_t keymsk = (0xffffffffULL << 32);
-	hashlog_data data;
-
-	data.scanned_from = 0;
-	data.scanned_to = 0;
-	std::map<uint64_t, hashlog_data>::iterator i = tlastshares.begin();
-	while (i != tlastshares.end()) {
-		if ((keymsk & i->first) == keypfx && i->second.scanned_to > ret) {
-			if (i->second.scanned_to > data.scanned_to)
-				data.scanned_to = i->second.scanned_to;
-			if (i->second.scanned_from < data.scanned_from || data.scanned_from == 0)
-				data.scanned_from = i->second.scanned_from;
-		}
-		i++;
+	uint32_t njobid = hextouint(jobid);
+
+	struct hashlog_shard *shard = shard_lock(njobid);
+	struct hashlog_job *job = job_get(shard, njobid, false);
+	if (job && job->range_to) {
+		ret = job->range_from;
+		ret += MK_HI64(job->range_to);
 	}
-	ret = data.scanned_from;
-	ret += MK_HI64(data.scanned_to);
+	pthread_mutex_unlock(&shard->lock);
 	return ret;
 }
 
@@ -162,34 +324,56 @@ uint64_t hashlog_get_scan_range(char* jobid)
 uint32_t hashlog_get_last_sent(char* jobid)
 {
 	uint32_t nonce = 0;
-	uint64_t njobid = hextouint(jobid);
-	uint64_t keypfx = (njobid << 32);
-	std::map<uint64_t, hashlog_data>::iterator i = tlastshares.begin();
-	while (i != tlastshares.end()) {
-		if ((keypfx & i->first) == keypfx && i->second.tm_sent > 0) {
-			nonce = LO_DWORD(i->first);
-		}
-		i++;
-	}
+	uint32_t njobid = hextouint(jobid);
+
+	struct hashlog_shard *shard = shard_lock(njobid);
+	struct hashlog_job *job = job_get(shard, njobid, false);
+	if (job)
+		nonce = job->last_sent;
+	pthread_mutex_unlock(&shard->lock);
 	return nonce;
 }
 
+static bool history_cmp(const hashlog_data &a, const hashlog_data &b)
+{
+	if (a.njobid != b.njobid)
+		return a.njobid > b.njobid;
+	return a.nonce > b.nonce;
+}
+
 /**
- * Export data for api calls
+ * Export data for api calls (last jobs and nonces first)
  */
 int hashlog_get_history(struct hashlog_data *data, int max_records)
 {
-	int records = 0;
-
-	std::map<uint64_t, hashlog_data>::reverse_iterator it = tlastshares.rbegin();
-	while (it != tlastshares.rend() && records < max_records) {
-		memcpy(&data[records], &(it->second), sizeof(struct hashlog_data));
-		data[records].nonce = LO_DWORD(it->first);
-		data[records].njobid = (uint32_t) HI_DWORD(it->first);
-		records++;
-		++it;
+	std::vector<hashlog_data> records;
+
+	pthread_once(&shards_once, hashlog_init);
+	for (int s = 0; s < HASHLOG_SHARDS; s++) {
+		struct hashlog_shard *shard = &shards[s];
+		pthread_mutex_lock(&shard->lock);
+		for (int j = 0; j < HASHLOG_SHARD_JOBS; j++) {
+			struct hashlog_job *job = &shard->jobs[j];
+			if (!job->gen)
+				continue;
+			if (job->range.tm_add) {
+				records.push_back(job->range);
+				records.back().njobid = job->njobid;
+				records.back().nonce = 0;
+			}
+			for (uint32_t i = 0; job->slots && i <= job->mask; i++) {
+				if (job->slots[i].tm_add)
+					records.push_back(job->slots[i]);
+			}
+		}
+		pthread_mutex_unlock(&shard->lock);
 	}
-	return records;
+
+	int count = min((int) records.size(), max_records);
+	std::partial_sort(records.begin(), records.begin() + count, records.end(), history_cmp);
+	for (int i = 0; i < count; i++)
+		memcpy(&data[i], &records[i], sizeof(struct hashlog_data));
+	return count;
 }
 
 /**
@@ -197,41 +381,48 @@ int hashlog_get_history(struct hashlog_data *data, int max_records)
  */
 void hashlog_purge_job(char* jobid)
 {
-	int deleted = 0;
-	uint64_t njobid = hextouint(jobid);
-	uint64_t keypfx = (njobid << 32);
-	uint32_t sz = (uint32_t) tlastshares.size();
-	std::map<uint64_t, hashlog_data>::iterator i = tlastshares.begin();
-	while (i != tlastshares.end()) {
-		if ((keypfx & i->first) == keypfx) {
-			deleted++;
-			tlastshares.erase(i++);
-		}
-		else ++i;
+	uint32_t deleted = 0;
+	uint32_t njobid = hextouint(jobid);
+
+	struct hashlog_shard *shard = shard_lock(njobid);
+	struct hashlog_job *job = job_get(shard, njobid, false);
+	if (job) {
+		deleted = job_records(job);
+		job_free(job);
 	}
+	pthread_mutex_unlock(&shard->lock);
+
 	if (opt_debug && deleted) {
-		applog(LOG_DEBUG, "hashlog: purge job %s, del %d/%d", jobid, deleted, sz);
+		applog(LOG_DEBUG, "hashlog: purge job %s, del %u", jobid, deleted);
 	}
 }
 
 /**
- * Remove old entries to reduce memory usage
+ * Remove the jobs without recent activity to reduce memory usage
  */
 void hashlog_purge_old(void)
 {
-	int deleted = 0;
+	uint32_t deleted = 0, sz = 0;
 	uint32_t now = (uint32_t) time(NULL);
-	uint32_t sz = (uint32_t) tlastshares.size();
-	std::map<uint64_t, hashlog_data>::iterator i = tlastshares.begin();
-	while (i != tlastshares.end()) {
-		if ((now - i->second.tm_sent) > LOG_PURGE_TIMEOUT) {
-			deleted++;
-			tlastshares.erase(i++);
+
+	pthread_once(&shards_once, hashlog_init);
+	for (int s = 0; s < HASHLOG_SHARDS; s++) {
+		struct hashlog_shard *shard = &shards[s];
+		pthread_mutex_lock(&shard->lock);
+		for (int j = 0; j < HASHLOG_SHARD_JOBS; j++) {
+			struct hashlog_job *job = &shard->jobs[j];
+			if (!job->gen)
+				continue;
+			sz += job_records(job);
+			if ((now - job->tm_last) > LOG_PURGE_TIMEOUT) {
+				deleted += job_records(job);
+				job_free(job);
+			}
 		}
-		else ++i;
+		pthread_mutex_unlock(&shard->lock);
 	}
 	if (opt_debug && deleted) {
-		applog(LOG_DEBUG, "hashlog: %d/%d purged", deleted, sz);
+		applog(LOG_DEBUG, "hashlog: %u/%u purged", deleted, sz);
 	}
 }
 
@@ -240,7 +431,14 @@ void hashlog_purge_old(void)
  */
 void hashlog_purge_all(void)
 {
-	tlastshares.clear();
+	pthread_once(&shards_once, hashlog_init);
+	for (int s = 0; s < HASHLOG_SHARDS; s++) {
+		struct hashlog_shard *shard = &shards[s];
+		pthread_mutex_lock(&shard->lock);
+		for (int j = 0; j < HASHLOG_SHARD_JOBS; j++)
+			job_free(&shard->jobs[j]);
+		pthread_mutex_unlock(&shard->lock);
+	}
 }
 
 /**
@@ -248,8 +446,21 @@ void hashlog_purge_all(void)
  */
 void hashlog_getmeminfo(uint64_t *mem, uint32_t *records)
 {
-	(*records) = (uint32_t) tlastshares.size();
-	(*mem) = (*records) * sizeof(hashlog_data);
+	(*records) = 0;
+	(*mem) = sizeof(shards);
+
+	pthread_once(&shards_once, hashlog_init);
+	for (int s = 0; s < HASHLOG_SHARDS; s++) {
+		struct hashlog_shard *shard = &shards[s];
+		pthread_mutex_lock(&shard->lock);
+		for (int j = 0; j < HASHLOG_SHARD_JOBS; j++) {
+			struct hashlog_job *job = &shard->jobs[j];
+			(*records) += job_records(job);
+			if (job->slots)
+				(*mem) += (uint64_t) (job->mask + 1) * sizeof(hashlog_data);
+		}
+		pthread_mutex_unlock(&shard->lock);
+	}
 }
 
 /**
@@ -258,19 +469,18 @@ void hashlog_getmeminfo(uint64_t *mem, uint32_t *records)
 void hashlog_dump_job(char* jobid)
 {
 	if (opt_debug) {
-		uint64_t njobid = hextouint(jobid);
-		uint64_t keypfx = (njobid << 32);
-		// uint32_t sz = tlastshares.size();
-		std::map<uint64_t, hashlog_data>::iterator i = tlastshares.begin();
-		while (i != tlastshares.end()) {
-			if ((keypfx & i->first) == keypfx) {
-				if (i->first != keypfx)
-					applog(LOG_DEBUG, CL_YLW "job %s, found %08x ", jobid, LO_DWORD(i->first));
-				else
-					applog(LOG_DEBUG, CL_YLW "job %s(%u) range done: %08x-%08x", jobid,
-						i->second.height, i->second.scanned_from, i->second.scanned_to);
+		uint32_t njobid = hextouint(jobid);
+		struct hashlog_shard *shard = shard_lock(njobid);
+		struct hashlog_job *job = job_get(shard, njobid, false);
+		if (job) {
+			for (uint32_t i = 0; job->slots && i <= job->mask; i++) {
+				if (job->slots[i].tm_add)
+					applog(LOG_DEBUG, CL_YLW "job %s, found %08x ", jobid, job->slots[i].nonce);
 			}
-			i++;
+			if (job->range.tm_add)
+				applog(LOG_DEBUG, CL_YLW "job %s(%u) range done: %08x-%08x", jobid,
+					job->range.height, job->range.scanned_from, job->range.scanned_to);
 		}
+		pthread_mutex_unlock(&shard->lock);
 	}
 }
@@ -25,6 +25,8 @@
 #include "Lyra2.h"
 #include "Sponge.h"
 
+#include "scratch.h"
+
 /**
  * Executes Lyra2 based on the G function from Blake2b. This version supports salts and passwords
  * whose combined length is smaller than the size of the memory matrix, (i.e., (nRows x nCols x b) bits,
@@ -66,15 +68,15 @@ int LYRA2(void *K, int64_t kLen, const void *pwd, int32_t pwdlen, const void *sa
 	// for Lyra2REv2, nCols = 4, v1 was using 8
 	const int64_t BLOCK_LEN = BLOCK_LEN_BLAKE2_SAFE_INT64;
 
+	// thread scratch, every row is written before being read
 	size_t sz = (size_t)ROW_LEN_BYTES * nRows;
-	uint64_t *wholeMatrix = malloc(sz);
+	uint64_t *wholeMatrix = (uint64_t*) cpu_scratch(SCRATCH_LYRA2, sz);
 	if (wholeMatrix == NULL) {
 		return -1;
 	}
-	memset(wholeMatrix, 0, sz);
 
-	//Allocates pointers to each row of the matrix
-	uint64_t **memMatrix = malloc(sizeof(uint64_t*) * nRows);
+	//Pointers to each row of the matrix
+	uint64_t **memMatrix = (uint64_t**) cpu_scratch(SCRATCH_LYRA2_ROWS, sizeof(uint64_t*) * nRows);
 	if (memMatrix == NULL) {
 		return -1;
 	}
@@ -206,10 +208,6 @@ int LYRA2(void *K, int64_t kLen, const void *pwd, int32_t pwdlen, const void *sa
 	//Squeezes the key
 	squeeze(state, K, (unsigned int) kLen);
 
-	//========================= Freeing the memory =============================//
-	free(memMatrix);
-	free(wholeMatrix);
-
 	return 0;
 }
 
@@ -235,15 +233,16 @@ int LYRA2_old(void *K, int64_t kLen, const void *pwd, int32_t pwdlen, const void
 	const int64_t ROW_LEN_BYTES = ROW_LEN_INT64 * 8;
 	const int64_t BLOCK_LEN = BLOCK_LEN_BLAKE2_SAFE_BYTES;
 
+	// thread scratch, cleared: the input absorption steps over the padded blocks
 	size_t sz = (size_t)ROW_LEN_BYTES * nRows;
-	uint64_t *wholeMatrix = malloc(sz);
+	uint64_t *wholeMatrix = (uint64_t*) cpu_scratch(SCRATCH_LYRA2, sz);
 	if (wholeMatrix == NULL) {
 		return -1;
 	}
 	memset(wholeMatrix, 0, sz);
 
-	//Allocates pointers to each row of the matrix
-	uint64_t **memMatrix = malloc(sizeof(uint64_t*) * nRows);
+	//Pointers to each row of the matrix
+	uint64_t **memMatrix = (uint64_t**) cpu_scratch(SCRATCH_LYRA2_ROWS, sizeof(uint64_t*) * nRows);
 	if (memMatrix == NULL) {
 		return -1;
 	}
@@ -375,9 +374,5 @@ int LYRA2_old(void *K, int64_t kLen, const void *pwd, int32_t pwdlen, const void
 	//Squeezes the key
 	squeeze(state, K, (unsigned int)kLen);
 
-	//========================= Freeing the memory =============================//
-	free(memMatrix);
-	free(wholeMatrix);
-
 	return 0;
 }
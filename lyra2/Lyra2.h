@@ -40,4 +40,11 @@ typedef unsigned char byte;
 int LYRA2(void *K, int64_t kLen, const void *pwd, int32_t pwdlen, const void *salt, int32_t saltlen, int64_t timeCost, const int16_t nRows, const int16_t nCols);
 int LYRA2_old(void *K, int64_t kLen, const void *pwd, int32_t pwdlen, const void *salt, int32_t saltlen, int64_t timeCost, const int16_t nRows, const int16_t nCols);
 
+/* 4 if the AVX2 sponge and LYRA2_x4 lanes are used, 0 in lyra2_simd forces the scalar code */
+extern int lyra2_simd;
+int lyra2_simd_lanes(void);
+
+/* 4 LYRA2 with the password as salt, lanes contiguous (pwdlen bytes in, kLen bytes out) */
+int LYRA2_x4(void *K, int64_t kLen, const void *pwd, int32_t pwdlen, int64_t timeCost, const int16_t nRows, const int16_t nCols);
+
 #endif /* LYRA2_H_ */
@@ -0,0 +1,262 @@
+/**
+ * 4 lanes LYRA2 for the batched cpu checks (lyra2v2 and lyra2Z)
+ *
+ * Lane k of each AVX2 vector holds the word of the k-th hash: the sponge
+ * states are 16 vectors and the 4 memory matrices are interleaved word by
+ * word, so the rows visited by all the lanes (prev, row, and row* during
+ * the setup) are plain vector loads. Only the pseudorandom row* of the
+ * wandering phase differs from one lane to the other (gather/scatter).
+ *
+ * Same output as LYRA2 lane by lane, which is used without AVX2.
+ */
+#include <stdint.h>
+#include <string.h>
+
+#include "Lyra2.h"
+#include "Sponge.h"
+#include "scratch.h"
+
+#if defined(__x86_64__) || defined(_M_X64)
+#include <immintrin.h>
+#define LYRA2_HAVE_AVX2 1
+#endif
+
+#ifdef LYRA2_HAVE_AVX2
+
+#if defined(__GNUC__) || defined(__clang__)
+#define X4_TARGET __attribute__((target("avx2")))
+#else
+#define X4_TARGET
+#endif
+
+#define ROR32_X4(x) _mm256_shuffle_epi32(x, _MM_SHUFFLE(2, 3, 0, 1))
+#define ROR24_X4(x) _mm256_shuffle_epi8(x, _mm256_setr_epi8( \
+	3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10, \
+	3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10))
+#define ROR16_X4(x) _mm256_shuffle_epi8(x, _mm256_setr_epi8( \
+	2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9, \
+	2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9))
+#define ROR63_X4(x) _mm256_or_si256(_mm256_add_epi64(x, x), _mm256_srli_epi64(x, 63))
+
+#define G_X4(a, b, c, d) do { \
+	a = _mm256_add_epi64(a, b); d = ROR32_X4(_mm256_xor_si256(d, a)); \
+	c = _mm256_add_epi64(c, d); b = ROR24_X4(_mm256_xor_si256(b, c)); \
+	a = _mm256_add_epi64(a, b); d = ROR16_X4(_mm256_xor_si256(d, a)); \
+	c = _mm256_add_epi64(c, d); b = ROR63_X4(_mm256_xor_si256(b, c)); \
+} while (0)
+
+#define ROUND_LYRA_X4(v) do { \
+	G_X4(v[0], v[4], v[ 8], v[12]); \
+	G_X4(v[1], v[5], v[ 9], v[13]); \
+	G_X4(v[2], v[6], v[10], v[14]); \
+	G_X4(v[3], v[7], v[11], v[15]); \
+	G_X4(v[0], v[5], v[10], v[15]); \
+	G_X4(v[1], v[6], v[11], v[12]); \
+	G_X4(v[2], v[7], v[ 8], v[13]); \
+	G_X4(v[3], v[4], v[ 9], v[14]); \
+} while (0)
+
+#define LOAD_X4(p) _mm256_loadu_si256((const __m256i *)(p))
+#define STORE_X4(p, v) _mm256_storeu_si256((__m256i *)(p), v)
+
+/* word w of the block (column) col of the row, for the 4 lanes */
+#define WORD_X4(M, row, col, w) (&(M)[((((size_t)(row) * nCols) + (col)) * BLOCK_LEN_INT64 + (w)) * 4])
+
+X4_TARGET static inline void blake2bLyra_x4(__m256i *v)
+{
+	int r;
+	for (r = 0; r < 12; r++)
+		ROUND_LYRA_X4(v);
+}
+
+/* the offsets of block col of the lanes rows (row* of the wandering phase) */
+X4_TARGET static inline __m256i rows_x4(const int64_t *rows, int16_t nCols, int col)
+{
+	return _mm256_setr_epi64x(
+		((rows[0] * nCols + col) * BLOCK_LEN_INT64) * 4 + 0,
+		((rows[1] * nCols + col) * BLOCK_LEN_INT64) * 4 + 1,
+		((rows[2] * nCols + col) * BLOCK_LEN_INT64) * 4 + 2,
+		((rows[3] * nCols + col) * BLOCK_LEN_INT64) * 4 + 3);
+}
+
+#define GATHER_X4(M, idx, w) _mm256_i64gather_epi64((const long long *)(M), \
+	_mm256_add_epi64(idx, _mm256_set1_epi64x((w) * 4)), 8)
+
+X4_TARGET static inline void scatter_x4(uint64_t *M, __m256i idx, int w, __m256i v)
+{
+	int64_t i[4];
+	uint64_t x[4];
+	STORE_X4(i, idx);
+	STORE_X4(x, v);
+	M[i[0] + w * 4] = x[0];
+	M[i[1] + w * 4] = x[1];
+	M[i[2] + w * 4] = x[2];
+	M[i[3] + w * 4] = x[3];
+}
+
+X4_TARGET static int LYRA2_x4_avx2(void *K, int64_t kLen, const void *pwd, int32_t pwdlen, int64_t timeCost,
+	const int16_t nRows, const int16_t nCols)
+{
+	int64_t row = 2, prev = 1, rowa = 0, tau, step = 1, window = 2, gap = 1, i;
+	int64_t rowas[4];
+	uint64_t in[4][4 * BLOCK_LEN_BLAKE2_SAFE_INT64];
+	__m256i v[16];
+	int l, w;
+
+	const int64_t nBlocksInput = ((pwdlen + pwdlen + 6 * sizeof(uint64_t)) / BLOCK_LEN_BLAKE2_SAFE_BYTES) + 1;
+	uint64_t *M = (uint64_t*) cpu_scratch(SCRATCH_LYRA2_X4, (size_t) 4 * nRows * nCols * BLOCK_LEN_BYTES);
+	if (M == NULL)
+		return -1;
+
+	//pad(pwd || salt || basil) of each lane, as in LYRA2
+	for (l = 0; l < 4; l++) {
+		const byte *p = (const byte*) pwd + l * pwdlen;
+		byte *ptrByte = (byte*) in[l];
+		int64_t basil[6] = { kLen, pwdlen, pwdlen, timeCost, nRows, nCols };
+		memset(in[l], 0, sizeof(in[l]));
+		memcpy(ptrByte, p, pwdlen);
+		memcpy(ptrByte + pwdlen, p, pwdlen);
+		memcpy(ptrByte + 2 * pwdlen, basil, sizeof(basil));
+		ptrByte[2 * pwdlen + sizeof(basil)] = 0x80;
+		ptrByte[nBlocksInput * BLOCK_LEN_BLAKE2_SAFE_BYTES - 1] ^= 0x01;
+	}
+
+	for (w = 0; w < 8; w++)
+		v[w] = _mm256_setzero_si256();
+	for (w = 0; w < 8; w++)
+		v[8 + w] = _mm256_set1_epi64x((int64_t) blake2b_IV[w]);
+
+	//Setup phase: absorbs the input blocks, then M[0] and M[1]
+	for (i = 0; i < nBlocksInput; i++) {
+		for (w = 0; w < BLOCK_LEN_BLAKE2_SAFE_INT64; w++) {
+			const int64_t k = i * BLOCK_LEN_BLAKE2_SAFE_INT64 + w;
+			v[w] = _mm256_xor_si256(v[w], _mm256_setr_epi64x(in[0][k], in[1][k], in[2][k], in[3][k]));
+		}
+		blake2bLyra_x4(v);
+	}
+
+	for (i = 0; i < nCols; i++) {
+		for (w = 0; w < BLOCK_LEN_INT64; w++)
+			STORE_X4(WORD_X4(M, 0, nCols - 1 - i, w), v[w]);
+		ROUND_LYRA_X4(v);
+	}
+
+	for (i = 0; i < nCols; i++) {
+		__m256i c[BLOCK_LEN_INT64];
+		for (w = 0; w < BLOCK_LEN_INT64; w++) {
+			c[w] = LOAD_X4(WORD_X4(M, 0, i, w));
+			v[w] = _mm256_xor_si256(v[w], c[w]);
+		}
+		ROUND_LYRA_X4(v);
+		for (w = 0; w < BLOCK_LEN_INT64; w++)
+			STORE_X4(WORD_X4(M, 1, nCols - 1 - i, w), _mm256_xor_si256(c[w], v[w]));
+	}
+
+	//the setup rows are the same for all the lanes
+	do {
+		for (i = 0; i < nCols; i++) {
+			__m256i c[BLOCK_LEN_INT64];
+			for (w = 0; w < BLOCK_LEN_INT64; w++) {
+				c[w] = LOAD_X4(WORD_X4(M, prev, i, w));
+				v[w] = _mm256_xor_si256(v[w], _mm256_add_epi64(c[w], LOAD_X4(WORD_X4(M, rowa, i, w))));
+			}
+			ROUND_LYRA_X4(v);
+			for (w = 0; w < BLOCK_LEN_INT64; w++)
+				STORE_X4(WORD_X4(M, row, nCols - 1 - i, w), _mm256_xor_si256(c[w], v[w]));
+			for (w = 0; w < BLOCK_LEN_INT64; w++) {
+				__m256i *io = (__m256i*) WORD_X4(M, rowa, i, w);
+				STORE_X4(io, _mm256_xor_si256(LOAD_X4(io), v[(w + BLOCK_LEN_INT64 - 1) % BLOCK_LEN_INT64]));
+			}
+		}
+
+		rowa = (rowa + step) & (window - 1);
+		prev = row;
+		row++;
+		if (rowa == 0) {
+			step = window + gap;
+			window *= 2;
+			gap = -gap;
+		}
+	} while (row < nRows);
+
+	//Wandering phase: row* is picked by each lane state
+	for (l = 0; l < 4; l++)
+		rowas[l] = rowa;
+	row = 0;
+	for (tau = 1; tau <= timeCost; tau++) {
+		step = (tau % 2 == 0) ? -1 : nRows / 2 - 1;
+		do {
+			uint64_t s0[4];
+			__m256i idx, same;
+			STORE_X4(s0, v[0]);
+			for (l = 0; l < 4; l++)
+				rowas[l] = s0[l] & (unsigned int)(nRows-1);
+
+			// lanes whose row* is row: M[row*] also gets the M[row] update
+			same = _mm256_cmpeq_epi64(_mm256_loadu_si256((const __m256i *)rowas), _mm256_set1_epi64x(row));
+
+			for (i = 0; i < nCols; i++) {
+				__m256i io[BLOCK_LEN_INT64];
+				idx = rows_x4(rowas, nCols, (int) i);
+				for (w = 0; w < BLOCK_LEN_INT64; w++) {
+					io[w] = GATHER_X4(M, idx, w);
+					v[w] = _mm256_xor_si256(v[w], _mm256_add_epi64(LOAD_X4(WORD_X4(M, prev, i, w)), io[w]));
+				}
+				ROUND_LYRA_X4(v);
+				for (w = 0; w < BLOCK_LEN_INT64; w++) {
+					__m256i *o = (__m256i*) WORD_X4(M, row, i, w);
+					STORE_X4(o, _mm256_xor_si256(LOAD_X4(o), v[w]));
+				}
+				for (w = 0; w < BLOCK_LEN_INT64; w++) {
+					io[w] = _mm256_xor_si256(io[w], _mm256_and_si256(same, v[w]));
+					scatter_x4(M, idx, w, _mm256_xor_si256(io[w], v[(w + BLOCK_LEN_INT64 - 1) % BLOCK_LEN_INT64]));
+				}
+			}
+
+			prev = row;
+			row = (row + step) & (unsigned int)(nRows-1);
+		} while (row != 0);
+	}
+
+	//Wrap-up phase: absorbs M[row*][0] and squeezes the keys
+	{
+		__m256i idx = rows_x4(rowas, nCols, 0);
+		for (w = 0; w < BLOCK_LEN_INT64; w++)
+			v[w] = _mm256_xor_si256(v[w], GATHER_X4(M, idx, w));
+		blake2bLyra_x4(v);
+	}
+
+	for (i = 0; i < kLen; i += BLOCK_LEN_BYTES) {
+		const int64_t len = (kLen - i < BLOCK_LEN_BYTES) ? kLen - i : BLOCK_LEN_BYTES;
+		uint64_t out[BLOCK_LEN_INT64][4];
+		for (w = 0; w < BLOCK_LEN_INT64; w++)
+			STORE_X4(out[w], v[w]);
+		for (l = 0; l < 4; l++) {
+			uint64_t block[BLOCK_LEN_INT64];
+			for (w = 0; w < BLOCK_LEN_INT64; w++)
+				block[w] = out[w][l];
+			memcpy((byte*) K + l * kLen + i, block, (size_t) len);
+		}
+		if (len == BLOCK_LEN_BYTES)
+			blake2bLyra_x4(v);
+	}
+
+	return 0;
+}
+
+#endif /* LYRA2_HAVE_AVX2 */
+
+int LYRA2_x4(void *K, int64_t kLen, const void *pwd, int32_t pwdlen, int64_t timeCost, const int16_t nRows, const int16_t nCols)
+{
+	int l, res = 0;
+#ifdef LYRA2_HAVE_AVX2
+	// the input buffers hold up to 4 blocks
+	if (lyra2_simd_lanes() == 4 && 2 * pwdlen + 6 * sizeof(uint64_t) < 4 * BLOCK_LEN_BLAKE2_SAFE_BYTES)
+		return LYRA2_x4_avx2(K, kLen, pwd, pwdlen, timeCost, nRows, nCols);
+#endif
+	for (l = 0; l < 4; l++) {
+		const byte *p = (const byte*) pwd + l * pwdlen;
+		res |= LYRA2((byte*) K + l * kLen, kLen, p, pwdlen, p, pwdlen, timeCost, nRows, nCols);
+	}
+	return res;
+}
@@ -23,6 +23,177 @@
 #include <time.h>
 #include "Sponge.h"
 #include "Lyra2.h"
+#include "sph/sph_x4.h"
+
+#if defined(__x86_64__) || defined(_M_X64)
+#include <immintrin.h>
+#define SPONGE_HAVE_AVX2 1
+#endif
+
+int lyra2_simd = -1;
+
+/**
+ * 4 when the cpu has AVX2 (same check as the sph 4 lanes hashes),
+ * unless lyra2_simd is 0
+ */
+int lyra2_simd_lanes(void)
+{
+	if (lyra2_simd < 0)
+		lyra2_simd = (sph_x4_lanes() == 4);
+	return lyra2_simd ? 4 : 1;
+}
+
+#ifdef SPONGE_HAVE_AVX2
+
+#if defined(__GNUC__) || defined(__clang__)
+#define SPONGE_TARGET __attribute__((target("avx2")))
+#else
+#define SPONGE_TARGET
+#endif
+
+/* Blake2b's rotations of the 64-bit lanes */
+#define ROR32_AVX2(x) _mm256_shuffle_epi32(x, _MM_SHUFFLE(2, 3, 0, 1))
+#define ROR24_AVX2(x) _mm256_shuffle_epi8(x, _mm256_setr_epi8( \
+	3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10, \
+	3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10))
+#define ROR16_AVX2(x) _mm256_shuffle_epi8(x, _mm256_setr_epi8( \
+	2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9, \
+	2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9))
+#define ROR63_AVX2(x) _mm256_or_si256(_mm256_add_epi64(x, x), _mm256_srli_epi64(x, 63))
+
+/* G on the 4 columns (or diagonals) at once, a = v[0..3], b = v[4..7]... */
+#define G_AVX2(a, b, c, d) do { \
+	a = _mm256_add_epi64(a, b); d = ROR32_AVX2(_mm256_xor_si256(d, a)); \
+	c = _mm256_add_epi64(c, d); b = ROR24_AVX2(_mm256_xor_si256(b, c)); \
+	a = _mm256_add_epi64(a, b); d = ROR16_AVX2(_mm256_xor_si256(d, a)); \
+	c = _mm256_add_epi64(c, d); b = ROR63_AVX2(_mm256_xor_si256(b, c)); \
+} while (0)
+
+/* ROUND_LYRA: the diagonals are moved to the columns and back */
+#define ROUND_LYRA_AVX2(a, b, c, d) do { \
+	G_AVX2(a, b, c, d); \
+	b = _mm256_permute4x64_epi64(b, _MM_SHUFFLE(0, 3, 2, 1)); \
+	c = _mm256_permute4x64_epi64(c, _MM_SHUFFLE(1, 0, 3, 2)); \
+	d = _mm256_permute4x64_epi64(d, _MM_SHUFFLE(2, 1, 0, 3)); \
+	G_AVX2(a, b, c, d); \
+	b = _mm256_permute4x64_epi64(b, _MM_SHUFFLE(2, 1, 0, 3)); \
+	c = _mm256_permute4x64_epi64(c, _MM_SHUFFLE(1, 0, 3, 2)); \
+	d = _mm256_permute4x64_epi64(d, _MM_SHUFFLE(0, 3, 2, 1)); \
+} while (0)
+
+/* rotW of the 12 words (s0, s1, s2): t = { s[11], s[0] .. s[10] } */
+#define ROTW_AVX2(t0, t1, t2, s0, s1, s2) do { \
+	__m256i r0_ = _mm256_permute4x64_epi64(s0, _MM_SHUFFLE(2, 1, 0, 3)); \
+	__m256i r1_ = _mm256_permute4x64_epi64(s1, _MM_SHUFFLE(2, 1, 0, 3)); \
+	__m256i r2_ = _mm256_permute4x64_epi64(s2, _MM_SHUFFLE(2, 1, 0, 3)); \
+	t0 = _mm256_blend_epi32(r0_, r2_, 0x03); \
+	t1 = _mm256_blend_epi32(r1_, r0_, 0x03); \
+	t2 = _mm256_blend_epi32(r2_, r1_, 0x03); \
+} while (0)
+
+#define LOAD_AVX2(p) _mm256_loadu_si256((const __m256i *)(p))
+#define STORE_AVX2(p, v) _mm256_storeu_si256((__m256i *)(p), v)
+
+#define LOAD_STATE_AVX2(state) \
+	__m256i s0 = LOAD_AVX2(&state[0]), s1 = LOAD_AVX2(&state[4]); \
+	__m256i s2 = LOAD_AVX2(&state[8]), s3 = LOAD_AVX2(&state[12])
+
+#define STORE_STATE_AVX2(state) do { \
+	STORE_AVX2(&state[0], s0); STORE_AVX2(&state[4], s1); \
+	STORE_AVX2(&state[8], s2); STORE_AVX2(&state[12], s3); \
+} while (0)
+
+SPONGE_TARGET static void absorbBlock_avx2(uint64_t *state, const uint64_t *in, int words)
+{
+	int r;
+	LOAD_STATE_AVX2(state);
+	s0 = _mm256_xor_si256(s0, LOAD_AVX2(&in[0]));
+	s1 = _mm256_xor_si256(s1, LOAD_AVX2(&in[4]));
+	if (words == BLOCK_LEN_INT64)
+		s2 = _mm256_xor_si256(s2, LOAD_AVX2(&in[8]));
+	for (r = 0; r < 12; r++)
+		ROUND_LYRA_AVX2(s0, s1, s2, s3);
+	STORE_STATE_AVX2(state);
+}
+
+SPONGE_TARGET static void reducedSqueezeRow0_avx2(uint64_t* state, uint64_t* rowOut, const uint32_t nCols)
+{
+	uint64_t* ptrWord = rowOut + (nCols-1)*BLOCK_LEN_INT64;
+	unsigned int i;
+	LOAD_STATE_AVX2(state);
+	for (i = 0; i < nCols; i++) {
+		STORE_AVX2(&ptrWord[0], s0);
+		STORE_AVX2(&ptrWord[4], s1);
+		STORE_AVX2(&ptrWord[8], s2);
+		ptrWord -= BLOCK_LEN_INT64;
+		ROUND_LYRA_AVX2(s0, s1, s2, s3);
+	}
+	STORE_STATE_AVX2(state);
+}
+
+SPONGE_TARGET static void reducedDuplexRow1_avx2(uint64_t *state, uint64_t *rowIn, uint64_t *rowOut, const uint32_t nCols)
+{
+	uint64_t* ptrWordIn = rowIn;
+	uint64_t* ptrWordOut = rowOut + (nCols-1)*BLOCK_LEN_INT64;
+	unsigned int i;
+	LOAD_STATE_AVX2(state);
+	for (i = 0; i < nCols; i++) {
+		__m256i in0 = LOAD_AVX2(&ptrWordIn[0]), in1 = LOAD_AVX2(&ptrWordIn[4]), in2 = LOAD_AVX2(&ptrWordIn[8]);
+		s0 = _mm256_xor_si256(s0, in0);
+		s1 = _mm256_xor_si256(s1, in1);
+		s2 = _mm256_xor_si256(s2, in2);
+		ROUND_LYRA_AVX2(s0, s1, s2, s3);
+		STORE_AVX2(&ptrWordOut[0], _mm256_xor_si256(in0, s0));
+		STORE_AVX2(&ptrWordOut[4], _mm256_xor_si256(in1, s1));
+		STORE_AVX2(&ptrWordOut[8], _mm256_xor_si256(in2, s2));
+		ptrWordIn += BLOCK_LEN_INT64;
+		ptrWordOut -= BLOCK_LEN_INT64;
+	}
+	STORE_STATE_AVX2(state);
+}
+
+/* rowOut is the reversed column (setup) or the same one, rowInOut is reloaded after it */
+SPONGE_TARGET static void reducedDuplexRow_avx2(uint64_t *state, uint64_t *rowIn, uint64_t *rowInOut, uint64_t *rowOut,
+	const uint32_t nCols, int setup)
+{
+	uint64_t* ptrWordIn = rowIn;
+	uint64_t* ptrWordInOut = rowInOut;
+	uint64_t* ptrWordOut = setup ? rowOut + (nCols-1)*BLOCK_LEN_INT64 : rowOut;
+	const int outStep = setup ? -BLOCK_LEN_INT64 : BLOCK_LEN_INT64;
+	unsigned int i;
+	LOAD_STATE_AVX2(state);
+	for (i = 0; i < nCols; i++) {
+		__m256i in0 = LOAD_AVX2(&ptrWordIn[0]), in1 = LOAD_AVX2(&ptrWordIn[4]), in2 = LOAD_AVX2(&ptrWordIn[8]);
+		__m256i t0, t1, t2;
+		s0 = _mm256_xor_si256(s0, _mm256_add_epi64(in0, LOAD_AVX2(&ptrWordInOut[0])));
+		s1 = _mm256_xor_si256(s1, _mm256_add_epi64(in1, LOAD_AVX2(&ptrWordInOut[4])));
+		s2 = _mm256_xor_si256(s2, _mm256_add_epi64(in2, LOAD_AVX2(&ptrWordInOut[8])));
+		ROUND_LYRA_AVX2(s0, s1, s2, s3);
+		if (setup) {
+			STORE_AVX2(&ptrWordOut[0], _mm256_xor_si256(in0, s0));
+			STORE_AVX2(&ptrWordOut[4], _mm256_xor_si256(in1, s1));
+			STORE_AVX2(&ptrWordOut[8], _mm256_xor_si256(in2, s2));
+		} else {
+			STORE_AVX2(&ptrWordOut[0], _mm256_xor_si256(LOAD_AVX2(&ptrWordOut[0]), s0));
+			STORE_AVX2(&ptrWordOut[4], _mm256_xor_si256(LOAD_AVX2(&ptrWordOut[4]), s1));
+			STORE_AVX2(&ptrWordOut[8], _mm256_xor_si256(LOAD_AVX2(&ptrWordOut[8]), s2));
+		}
+		ROTW_AVX2(t0, t1, t2, s0, s1, s2);
+		STORE_AVX2(&ptrWordInOut[0], _mm256_xor_si256(LOAD_AVX2(&ptrWordInOut[0]), t0));
+		STORE_AVX2(&ptrWordInOut[4], _mm256_xor_si256(LOAD_AVX2(&ptrWordInOut[4]), t1));
+		STORE_AVX2(&ptrWordInOut[8], _mm256_xor_si256(LOAD_AVX2(&ptrWordInOut[8]), t2));
+		ptrWordIn += BLOCK_LEN_INT64;
+		ptrWordInOut += BLOCK_LEN_INT64;
+		ptrWordOut += outStep;
+	}
+	STORE_STATE_AVX2(state);
+}
+
+#define SPONGE_AVX2(call) do { if (lyra2_simd_lanes() == 4) { call; return; } } while (0)
+#else
+#define SPONGE_AVX2(call) do { } while (0)
+#endif /* SPONGE_HAVE_AVX2 */
+
 
 
 /**
@@ -111,6 +282,8 @@ void squeeze(uint64_t *state, byte *out, unsigned int len)
  */
 void absorbBlock(uint64_t *state, const uint64_t *in)
 {
+	SPONGE_AVX2(absorbBlock_avx2(state, in, BLOCK_LEN_INT64));
+
 	//XORs the first BLOCK_LEN_INT64 words of "in" with the current state
 	state[0] ^= in[0];
 	state[1] ^= in[1];
@@ -138,6 +311,8 @@ void absorbBlock(uint64_t *state, const uint64_t *in)
  */
 void absorbBlockBlake2Safe(uint64_t *state, const uint64_t *in)
 {
+	SPONGE_AVX2(absorbBlock_avx2(state, in, BLOCK_LEN_BLAKE2_SAFE_INT64));
+
 	//XORs the first BLOCK_LEN_BLAKE2_SAFE_INT64 words of "in" with the current state
 
 	state[0] ^= in[0];
@@ -163,6 +338,8 @@ void absorbBlockBlake2Safe(uint64_t *state, const uint64_t *in)
  */
 void reducedSqueezeRow0(uint64_t* state, uint64_t* rowOut, const uint32_t nCols)
 {
+	SPONGE_AVX2(reducedSqueezeRow0_avx2(state, rowOut, nCols));
+
 	uint64_t* ptrWord = rowOut + (nCols-1)*BLOCK_LEN_INT64; //In Lyra2: pointer to M[0][C-1]
 	unsigned int i;
 	//M[row][C-1-col] = H.reduced_squeeze()
@@ -199,6 +376,8 @@ void reducedSqueezeRow0(uint64_t* state, uint64_t* rowOut, const uint32_t nCols)
  */
 void reducedDuplexRow1(uint64_t *state, uint64_t *rowIn, uint64_t *rowOut, const uint32_t nCols)
 {
+	SPONGE_AVX2(reducedDuplexRow1_avx2(state, rowIn, rowOut, nCols));
+
 	uint64_t* ptrWordIn = rowIn;				//In Lyra2: pointer to prev
 	uint64_t* ptrWordOut = rowOut + (nCols-1)*BLOCK_LEN_INT64; //In Lyra2: pointer to row
 	unsigned int i;
@@ -259,6 +438,8 @@ void reducedDuplexRow1(uint64_t *state, uint64_t *rowIn, uint64_t *rowOut, const
  */
 void reducedDuplexRowSetup(uint64_t *state, uint64_t *rowIn, uint64_t *rowInOut, uint64_t *rowOut, const uint32_t nCols)
 {
+	SPONGE_AVX2(reducedDuplexRow_avx2(state, rowIn, rowInOut, rowOut, nCols, 1));
+
 	uint64_t* ptrWordIn = rowIn;				//In Lyra2: pointer to prev
 	uint64_t* ptrWordInOut = rowInOut;				//In Lyra2: pointer to row*
 	uint64_t* ptrWordOut = rowOut + (nCols-1)*BLOCK_LEN_INT64; //In Lyra2: pointer to row
@@ -335,6 +516,8 @@ void reducedDuplexRowSetup(uint64_t *state, uint64_t *rowIn, uint64_t *rowInOut,
  */
 void reducedDuplexRow(uint64_t *state, uint64_t *rowIn, uint64_t *rowInOut, uint64_t *rowOut, const uint32_t nCols)
 {
+	SPONGE_AVX2(reducedDuplexRow_avx2(state, rowIn, rowInOut, rowOut, nCols, 0));
+
 	uint64_t* ptrWordInOut = rowInOut; //In Lyra2: pointer to row*
 	uint64_t* ptrWordIn = rowIn; //In Lyra2: pointer to prev
 	uint64_t* ptrWordOut = rowOut; //In Lyra2: pointer to row
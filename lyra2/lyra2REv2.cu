@@ -73,6 +73,52 @@ void lyra2v2_hash(void *state, const void *input)
 	memcpy(state, hashA, 32);
 }
 
+/* 4 lanes of lyra2v2_hash, the inputs (80 bytes) and outputs (32 bytes) contiguous */
+void lyra2v2_hash_x4(void *state, const void *input)
+{
+	uint32_t hashA[4][8], hashB[4][8];
+
+	sph_blake256_context      ctx_blake;
+	sph_keccak256_context     ctx_keccak;
+	sph_skein256_context      ctx_skein;
+	sph_bmw256_context        ctx_bmw;
+	sph_cubehash256_context   ctx_cube;
+
+	sph_blake256_set_rounds(14);
+
+	for (int l = 0; l < 4; l++) {
+		sph_blake256_init(&ctx_blake);
+		sph_blake256(&ctx_blake, (const uint8_t*) input + l * 80, 80);
+		sph_blake256_close(&ctx_blake, hashA[l]);
+
+		sph_keccak256_init(&ctx_keccak);
+		sph_keccak256(&ctx_keccak, hashA[l], 32);
+		sph_keccak256_close(&ctx_keccak, hashB[l]);
+
+		sph_cubehash256_init(&ctx_cube);
+		sph_cubehash256(&ctx_cube, hashB[l], 32);
+		sph_cubehash256_close(&ctx_cube, hashA[l]);
+	}
+
+	LYRA2_x4(hashB, 32, hashA, 32, 1, 4, 4);
+
+	for (int l = 0; l < 4; l++) {
+		sph_skein256_init(&ctx_skein);
+		sph_skein256(&ctx_skein, hashB[l], 32);
+		sph_skein256_close(&ctx_skein, hashA[l]);
+
+		sph_cubehash256_init(&ctx_cube);
+		sph_cubehash256(&ctx_cube, hashA[l], 32);
+		sph_cubehash256_close(&ctx_cube, hashB[l]);
+
+		sph_bmw256_init(&ctx_bmw);
+		sph_bmw256(&ctx_bmw, hashB[l], 32);
+		sph_bmw256_close(&ctx_bmw, hashA[l]);
+	}
+
+	memcpy(state, hashA, sizeof(hashA));
+}
+
 #ifdef _DEBUG
 #define TRACE(algo) { \
 	if (max_nonce == 1 && pdata[19] <= 1) { \
@@ -60,6 +60,23 @@ extern "C" void lyra2Z_hash(void *state, const void *input)
 	memcpy(state, hashB, 32);
 }
 
+/* 4 lanes of lyra2Z_hash, the inputs (80 bytes) and outputs (32 bytes) contiguous */
+extern "C" void lyra2Z_hash_x4(void *state, const void *input)
+{
+	uint32_t hashA[4][8];
+
+	sph_blake256_context     ctx_blake;
+	sph_blake256_set_rounds(14);
+
+	for (int l = 0; l < 4; l++) {
+		sph_blake256_init(&ctx_blake);
+		sph_blake256(&ctx_blake, (const uint8_t*) input + l * 80, 80);
+		sph_blake256_close(&ctx_blake, hashA[l]);
+	}
+
+	LYRA2_x4(state, 32, hashA, 32, 8, 8, 8);
+}
+
 static bool init[MAX_GPUS] = { 0 };
 static __thread uint32_t throughput = 0;
 
@@ -3,6 +3,8 @@
 #include <iomanip>
 #include <algorithm>
 #include <iterator>
+#include <cstring>
+#include <thread>
 //#include "blake2/blake2.h"
 #include "../argon2ref/blake2.h"
 
@@ -17,84 +19,102 @@ std::ostream& operator<<(std::ostream& os, const MerkleTree::Buffer& buffer)
 }
 
 MerkleTree::MerkleTree(uint8_t * elements, bool preserveOrder)
-    : preserveOrder_(preserveOrder) /*, elements_(elements)*/
+    : preserveOrder_(preserveOrder), elements_(elements), arena_(NULL)
 {
-
-	elements_ = new uint8_t[sizeof(elements)];
-	elements_ = elements;
-	mem.push_back(elements_);
-
     getLayers();
-
 }
 
 MerkleTree::MerkleTree()
+    : preserveOrder_(true), elements_(NULL), arena_(NULL)
 {
+    std::fill(layers_, layers_ + MERKLE_TREE_LAYER_COUNT, (uint8_t*)NULL);
 }
-MerkleTree::~MerkleTree()
-{
-
 
-
-}
-void MerkleTree::Destructor()
+MerkleTree::MerkleTree(MerkleTree&& other)
+    : preserveOrder_(other.preserveOrder_), elements_(other.elements_),
+      arena_(other.arena_)
 {
+    std::copy(other.layers_, other.layers_ + MERKLE_TREE_LAYER_COUNT, layers_);
+    other.elements_ = NULL;
+    other.arena_ = NULL;
+    std::fill(other.layers_, other.layers_ + MERKLE_TREE_LAYER_COUNT, (uint8_t*)NULL);
+}
 
-	uint32_t memsize = mem.size();
-	for (int i = memsize-1; i>=1; i--) { // element 0 is.... aaahh !!!
-//		free(this->mem[i]);
-		delete[] mem[i];
-		mem.pop_back(); 
-	};
-	delete this;
-//	mem.clear();
-//	mem.shrink_to_fit();
+MerkleTree& MerkleTree::operator=(MerkleTree&& other)
+{
+    if (this != &other) {
+        delete[] arena_;
+        preserveOrder_ = other.preserveOrder_;
+        elements_ = other.elements_;
+        arena_ = other.arena_;
+        std::copy(other.layers_, other.layers_ + MERKLE_TREE_LAYER_COUNT, layers_);
+        other.elements_ = NULL;
+        other.arena_ = NULL;
+        std::fill(other.layers_, other.layers_ + MERKLE_TREE_LAYER_COUNT, (uint8_t*)NULL);
+    }
+    return *this;
+}
 
+MerkleTree::~MerkleTree()
+{
+    // the leaves belong to the caller, only the upper layers are ours
+    delete[] arena_;
 }
 
 MerkleTree::Buffer MerkleTree::hash(const Buffer& data)
 {
-    ablake2b_state state;
-    ablake2b_init(&state, MERKLE_TREE_ELEMENT_SIZE_B);
-  //  printf("%x %x %x %x\n",state.t[0],state.t[1],state.f[0],state.f[1]);
-    for (Buffer::const_iterator it = data.begin(); it != data.end(); ++it) {
-        ablake2b4rounds_update(&state, &(*it), sizeof(*it));
-    }
     uint8_t digest[MERKLE_TREE_ELEMENT_SIZE_B];
-    ablake2b4rounds_final(&state, digest, sizeof(digest));
+    if (data.size() == 2 * MERKLE_TREE_ELEMENT_SIZE_B) {
+        blake2b4r_32to16(digest, data.data());
+    } else if (data.size() == 1024) { // an argon2 block, i.e. a leaf
+        blake2b4r_1024to16(digest, data.data());
+    } else {
+        ablake2b_state state;
+        ablake2b_init(&state, MERKLE_TREE_ELEMENT_SIZE_B);
+        ablake2b4rounds_update(&state, data.data(), data.size());
+        ablake2b4rounds_final(&state, digest, sizeof(digest));
+    }
     return Buffer(digest, digest + sizeof(digest));
 }
 
 void gen_layer(uint8_t* o, uint8_t* n, int size){
-	for(int i=0;i<size;i++){
-		ablake2b_state state;
-	        ablake2b_init(&state, MERKLE_TREE_ELEMENT_SIZE_B);
-		ablake2b4rounds_update(&state, &o[32*i], 32);
-		ablake2b4rounds_final(&state, &n[16*i], 16);
-	}
+	// nodes are contiguous: hash them 2 or 4 at a time when the cpu allows
+	blake2b4r_32to16_n(n, o, (size_t)size);
+}
+
+static unsigned merkle_build_threads = 0; /* 0 = one per cpu */
+
+void MerkleTree::setBuildThreads(unsigned threads)
+{
+    merkle_build_threads = threads;
+}
+
+unsigned MerkleTree::getBuildThreads()
+{
+    unsigned threads = merkle_build_threads;
+    if (threads == 0)
+        threads = std::thread::hardware_concurrency();
+    if (threads > MERKLE_TREE_MAX_BUILD_THREADS)
+        threads = MERKLE_TREE_MAX_BUILD_THREADS;
+    // slices must split every layer evenly: keep a power of two
+    unsigned pow2 = 1;
+    while (pow2 * 2 <= threads)
+        pow2 *= 2;
+    return pow2;
 }
 
 MerkleTree::Buffer MerkleTree::combinedHash(const Buffer& first,
         const Buffer& second, bool preserveOrder)
 {
     Buffer buffer;
-//	if(first > second)
-//		printf("%x > %x\n", first[0],second[0]);
+    buffer.reserve(first.size() + second.size());
     if (preserveOrder || (first > second)) {
-        std::copy(first.begin(), first.end(), std::back_inserter(buffer));
-        std::copy(second.begin(), second.end(), std::back_inserter(buffer));
+        buffer.insert(buffer.end(), first.begin(), first.end());
+        buffer.insert(buffer.end(), second.begin(), second.end());
     } else {
-        std::copy(second.begin(), second.end(), std::back_inserter(buffer));
-        std::copy(first.begin(), first.end(), std::back_inserter(buffer));
+        buffer.insert(buffer.end(), second.begin(), second.end());
+        buffer.insert(buffer.end(), first.begin(), first.end());
     }
-//    printf("buf %lx\n",buffer[0]);
-
-        Buffer x = hash(buffer);
-
-//	for(int i=0;i<32;i++)
-//		printf("%x ",x[i]);
-//	printf("%d \n", preserveOrder);
-//    for(;;);
     return hash(buffer);
 }
 /*
@@ -220,122 +240,85 @@ bool MerkleTree::checkProofOrdered(const Elements& proof,
 
 void MerkleTree::getLayers()
 {
+    // layer l holds (leaves >> l) elements, the root layer holds one
+    size_t arena_size = 0;
+    for (size_t l = 1; l < MERKLE_TREE_LAYER_COUNT; l++)
+        arena_size += layerSize(l) * MERKLE_TREE_ELEMENT_SIZE_B;
+
+    arena_ = new uint8_t[arena_size];
+
+    layers_[0] = elements_;
+    size_t offset = 0;
+    for (size_t l = 1; l < MERKLE_TREE_LAYER_COUNT; l++) {
+        layers_[l] = arena_ + offset;
+        offset += layerSize(l) * MERKLE_TREE_ELEMENT_SIZE_B;
+    }
 
-	while (mem.size() < 23){
-		getNextLayer();
-	}
-
-//for(;;);
-/*
-    layers_.clear();
-
-    // The first layer is the elements themselves
-    layers_.push_back(elements_);
-
-    if (elements_.empty()) {
-        return; // nothing left to do
+    // Each worker owns 1/threads of the leaves and builds the subtree above
+    // them, up to the layer where its slice is a single node. Only the few
+    // layers above that are left to this thread.
+    const unsigned threads = getBuildThreads();
+    size_t shared = MERKLE_TREE_LAYER_COUNT - 1;
+    for (unsigned t = threads; t > 1; t /= 2)
+        shared--;
+
+    if (threads > 1) {
+        std::vector<std::thread> workers;
+        for (unsigned t = 0; t < threads; t++)
+            workers.push_back(std::thread(&MerkleTree::buildSlice, this,
+                t, threads, shared));
+        for (size_t t = 0; t < workers.size(); t++)
+            workers[t].join();
+    } else {
+        buildSlice(0, 1, shared);
     }
 
-    // For subsequent layers, combine each pair of hashes in the previous
-    // layer to build the current layer. Repeat until the current layer has
-    // only one hash (this will be the root of the tree).
-    while (layers_.back().size() > 1) {
-        getNextLayer();
-    }*/
+    for (size_t l = shared + 1; l < MERKLE_TREE_LAYER_COUNT; l++)
+        getNextLayer(l);
 }
 
-void MerkleTree::getNextLayer()
+void MerkleTree::buildSlice(unsigned slice, unsigned slices, size_t top)
 {
-
-uint8_t *prev_mem= mem.back();
-
-int size=1024*1024*4*16;
-for(int i=0;i<mem.size();i++)
-	size/=2;
-//printf("size %d %d %d\n",size, mem.size(), 1024*1024*4*16);
-//uint8_t *new_mem=(uint8_t *)malloc(size);
-	uint8_t *new_mem = new uint8_t[size];
-gen_layer(prev_mem, new_mem, size/16);
-mem.push_back(new_mem);
-
-
-//for(;;);
-/*
-    const Elements& previous_layer = layers_.back();
-
-    // Create a new empty layer
-    layers_.push_back(Elements());
-    Elements& current_layer = layers_.back();
-
-    // For each pair of elements in the previous layer
-    // NB: If there is an odd number of elements, we ignore the last one for now
-    for (size_t i = 0; i < (previous_layer.size() / 2); ++i) {
-        current_layer.push_back(combinedHash(previous_layer[2*i],
-                    previous_layer[2*i + 1], preserveOrder_));
+    for (size_t l = 1; l <= top; l++) {
+        const size_t count = layerSize(l) / slices;
+        const size_t first = count * slice;
+        gen_layer(layers_[l - 1] + 2 * first * MERKLE_TREE_ELEMENT_SIZE_B,
+            layers_[l] + first * MERKLE_TREE_ELEMENT_SIZE_B, (int)count);
     }
+}
 
-//	printf("size %d %d\n",sizeof(current_layer.back()), sizeof(current_layer));
-//for(;;);
-    // If there is an odd one out at the end, process it
-    // NB: It's on its own, so we don't combine it with anything
-    if (previous_layer.size() & 1) {
-        current_layer.push_back(previous_layer.back());
-    }*/
+void MerkleTree::getNextLayer(size_t layer)
+{
+    gen_layer(layers_[layer - 1], layers_[layer], (int)layerSize(layer));
 }
 
 MerkleTree::Elements MerkleTree::getProof(size_t index) const
 {
     Elements proof;
-/*
-    for (   Layers::const_iterator it = layers_.begin();
-            it != layers_.end();
-            ++it) {
+    for (size_t l = 0; l < MERKLE_TREE_LAYER_COUNT; l++) {
         Buffer pair;
-        if (getPair(*it, index, pair)) {
+        if (getPair(l, index, pair)) {
             proof.push_back(pair);
         }
         index = index / 2; // point to correct hash in next layer
-    } // for each layer
-*/
-	for(int i=0;i<mem.size();i++){
-		Buffer pair;
-		if (getPair2(mem, i, index, pair)) {
-            proof.push_back(pair);
-	//	printf("proof %d %d\n",index,i);
-	//	for(int i=0;i<16;i++)printf("%x ",pair[i]);
-	//	printf("\n");
-	        index = index / 2; // point to correct hash in next layer
-
-//		for(;;);
-        }
-	}
+    }
     return proof;
 }
-/*
-bool MerkleTree::getPair(const Elements& layer, size_t index, Buffer& pair)
+
+void MerkleTree::getProofInto(size_t index, uint8_t* out) const
 {
-    size_t pairIndex;
-    if (index & 1) {
-        pairIndex = index - 1;
-    } else {
-        pairIndex = index + 1;
+    out[0] = (uint8_t)(MERKLE_TREE_LAYER_COUNT - 1);
+    uint8_t* dst = out + 1;
+    // every layer but the root has an even size, so the peer always exists
+    for (size_t l = 0; l < MERKLE_TREE_LAYER_COUNT - 1; l++) {
+        memcpy(dst, layers_[l] + (index ^ 1) * MERKLE_TREE_ELEMENT_SIZE_B,
+            MERKLE_TREE_ELEMENT_SIZE_B);
+        dst += MERKLE_TREE_ELEMENT_SIZE_B;
+        index >>= 1;
     }
-    if (pairIndex >= layer.size()) {
-        return false;
-    }
-    pair = layer[pairIndex];
-    return true;
-}*/
-
-size_t get_chunk_size(size_t index){
-size_t  size=1024*1024*4*16;
-for(int i=0;i<index;i++)
-        size/=2;
-size/=16;
-return size;
 }
 
-bool MerkleTree::getPair2(std::vector<uint8_t*> m, size_t chunk_index, size_t index, Buffer& pair)
+bool MerkleTree::getPair(size_t layer, size_t index, Buffer& pair) const
 {
     size_t pairIndex;
     if (index & 1) {
@@ -343,12 +326,11 @@ bool MerkleTree::getPair2(std::vector<uint8_t*> m, size_t chunk_index, size_t in
     } else {
         pairIndex = index + 1;
     }
-    if (pairIndex >= get_chunk_size(chunk_index)) {
+    if (pairIndex >= layerSize(layer)) {
         return false;
     }
-//	printf("layer %d size %d addr %lx, ele %d\n",chunk_index,get_chunk_size(chunk_index), m[chunk_index], pairIndex);
-    pair = MerkleTree::Buffer(&m[chunk_index][16*pairIndex], &m[chunk_index][16*pairIndex] + MERKLE_TREE_ELEMENT_SIZE_B);
-//    pair = layer[pairIndex];
+    const uint8_t* p = layers_[layer] + pairIndex * MERKLE_TREE_ELEMENT_SIZE_B;
+    pair = Buffer(p, p + MERKLE_TREE_ELEMENT_SIZE_B);
     return true;
 }
 
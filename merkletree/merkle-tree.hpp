@@ -17,6 +17,22 @@ extern "C" {
  */
 #define MERKLE_TREE_ELEMENT_SIZE_B 16
 
+/** Number of leaves of the MTP Merkle Tree (one per Argon2 memory block) */
+#define MERKLE_TREE_ELEMENT_COUNT (4 * 1024 * 1024)
+
+/** Number of layers, leaves and root included (log2(leaves) + 1) */
+#define MERKLE_TREE_LAYER_COUNT 23
+
+/** Size of a serialized proof, in bytes
+ *
+ * One length byte followed by one sibling hash per layer below the root.
+ */
+#define MERKLE_TREE_PROOF_SIZE_B \
+    (1 + (MERKLE_TREE_LAYER_COUNT - 1) * MERKLE_TREE_ELEMENT_SIZE_B)
+
+/** Upper bound of the worker threads used to build a tree */
+#define MERKLE_TREE_MAX_BUILD_THREADS 16
+
 class MerkleTree
 {
 public :
@@ -55,11 +71,36 @@ public :
      *        not of the right size, \see MERKLE_TREE_ELEMENT_SIZE_B.
      */
     MerkleTree(uint8_t* elements, bool preserveOrder = true);
-	MerkleTree();
-	void Destructor();
-    /** Destructor */
+
+    /** Construct an empty tree, to be move-assigned later */
+    MerkleTree();
+
+    /** Move constructor
+     *
+     * The layers are handed over to the new tree, `other` is left empty.
+     */
+    MerkleTree(MerkleTree&& other);
+
+    /** Move assignment
+     *
+     * Releases the layers of this tree, then takes over those of `other`.
+     */
+    MerkleTree& operator=(MerkleTree&& other);
+
+    /** Destructor, releases the layers (the leaves belong to the caller) */
     virtual ~MerkleTree();
 
+    /** Set the number of worker threads used to build the layers
+     *
+     * \param threads [in] Worker count, 0 for one per cpu. It is rounded
+     *                     down to a power of two, at most
+     *                     `MERKLE_TREE_MAX_BUILD_THREADS`.
+     */
+    static void setBuildThreads(unsigned threads);
+
+    /** Number of worker threads the next tree will be built with */
+    static unsigned getBuildThreads();
+
     /** Compute a hash
      *
      * \param data [in] Data to hash (can be any size)
@@ -82,16 +123,9 @@ public :
     /** Get the root hash of the Merkle Tree */
     Buffer getRoot() const
     {
-	  MerkleTree::Buffer ret = MerkleTree::Buffer(mem.back(),mem.back() + MERKLE_TREE_ELEMENT_SIZE_B);
-	return ret;
-//        return layers_.back()[0];
+        const uint8_t* root = layers_[MERKLE_TREE_LAYER_COUNT - 1];
+        return Buffer(root, root + MERKLE_TREE_ELEMENT_SIZE_B);
     }
-/*
-    std::vector<uint8_t*> getMem() const
-	{
-	return mem;
-	}
-*/
     /** Compute a root hash given a set of hashes
      *
      * This function builds a temporary Merkle Tree and extracts its root
@@ -174,8 +208,19 @@ public :
      * \throw `std::runtime_error` if `index` does not point to `element`
      */
     std::string getProofOrderedHex(const Buffer& element, size_t index) const;
-	
-	
+
+    /** Write the serialized proof of an element into a caller buffer
+     *
+     * This is the allocation-free counterpart of `getProofOrdered()`: the
+     * proof is written as one length byte followed by the sibling hash of
+     * each layer, lowest first, which is the layout expected in
+     * `nProofMTP`.
+     *
+     * \param index [in]  Index of the element, starting at 0
+     * \param out   [out] Destination, at least `MERKLE_TREE_PROOF_SIZE_B`
+     *                    bytes long
+     */
+    void getProofInto(size_t index, uint8_t* out) const;
 
     /** Check the given proof for the given element
      *
@@ -213,6 +258,10 @@ public :
             const Buffer& element, size_t index);
 
 private :
+    /** A tree owns 64 MB of layers: it can be moved, never copied */
+    MerkleTree(const MerkleTree&);
+    MerkleTree& operator=(const MerkleTree&);
+
     /** Layers data structure
      *
      * This data structure represents the various layers of the Merkle Tree.
@@ -225,17 +274,38 @@ private :
     typedef std::deque<Elements> Layers;
 
     bool     preserveOrder_; /**< Whether to preserve the initial order */
-    uint8_t* elements_;      /**< Leaves of the Merkle Tree */
-//    Layers   layers_;        /**< The various layers of the Merkle Tree */
+    uint8_t* elements_;      /**< Leaves of the Merkle Tree (not owned) */
+
+    /** Storage of every layer above the leaves, in a single allocation
+     *
+     * Layer 1 starts at offset 0 and each following layer is packed right
+     * after the previous one, so the whole tree costs one `new[]`.
+     */
+    uint8_t* arena_;
 
+    /** Start of each layer, `layers_[0]` being the leaves */
+    uint8_t* layers_[MERKLE_TREE_LAYER_COUNT];
+
+    /** Number of elements of a layer */
+    static size_t layerSize(size_t layer)
+    {
+        return (size_t)MERKLE_TREE_ELEMENT_COUNT >> layer;
+    }
 
-     std::vector<uint8_t*> mem;
-//    uint8_t *mem[64];
     /** Build the Merkle Tree layers */
     void getLayers();
 
-    /** Build the next Merkle Tree layer */
-    void getNextLayer();
+    /** Build a Merkle Tree layer from the one below it */
+    void getNextLayer(size_t layer);
+
+    /** Build layers 1 to `top` of one slice of the leaves
+     *
+     * \param slice  [in] Slice index, run by one worker
+     * \param slices [in] Number of slices, a power of two
+     * \param top    [in] Last layer to build, must hold at least `slices`
+     *                    elements
+     */
+    void buildSlice(unsigned slice, unsigned slices, size_t top);
 
     /** Get proof given the index of the element
      *
@@ -255,8 +325,7 @@ private :
      *         the `layer` has an odd number of elements, and you are asking
      *         for the last one, which obviously has no peer)
      */
-//    static bool getPair(const Elements& layer, size_t index, Buffer& pair);
-    static bool getPair2(std::vector<uint8_t*> m, size_t chunk_index, size_t index, Buffer& pair);
+    bool getPair(size_t layer, size_t index, Buffer& pair) const;
 
     /** Converts a list of hashes into a hexadecimal string */
     static std::string elementsToHex(const Elements& elements);
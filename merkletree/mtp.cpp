@@ -7,10 +7,25 @@
 #include <windows.h>
 #include <winbase.h> /* For SecureZeroMemory */
 #endif
+#ifdef WIN32
+#include <malloc.h>
+#else
+#include <sys/mman.h>
+#endif
+#include <pthread.h>
 
 #include <ios>
 #include <stdio.h>
 #include <iostream>
+
+// miner.h min/max macros break the std headers, only the logger is needed here
+#include <ccminer-config.h>
+#ifdef HAVE_SYSLOG_H
+#include <syslog.h>
+#else
+#define LOG_ERR 0 /* first of the miner.h log levels */
+#endif
+extern "C" void applog(int prio, const char *fmt, ...);
 #if defined __STDC_LIB_EXT1__
 #define __STDC_WANT_LIB_EXT1__ 1
 #endif
@@ -24,6 +39,7 @@ extern void get_tree(int thr_id,uint8_t *d);
 extern uint8_t* get_tree2(int thr_id);
 extern void get_block(int thr_id, void* d, uint32_t index);
 extern void get_block_test(int thr_id, void* d, uint32_t index, cudaStream_t s0);
+extern const uint64_t* get_blocks_batch(int thr_id, const uint32_t *index, int count, cudaStream_t s0);
 
 uint32_t index_beta(const argon2_instance_t *instance,
 	const argon2_position_t *position, uint32_t pseudo_rand,
@@ -92,7 +108,8 @@ uint32_t index_beta(const argon2_instance_t *instance,
 
 
 
-void getblockindex_orig(uint32_t ij, argon2_instance_t *instance, uint32_t *out_ij_prev, uint32_t *out_computed_ref_block)
+/* previous block of ij in its lane */
+static uint32_t mtp_prev_index(uint32_t ij, const argon2_instance_t *instance)
 {
 	uint32_t ij_prev = 0;
 	if (ij%instance->lane_length == 0)
@@ -103,7 +120,12 @@ void getblockindex_orig(uint32_t ij, argon2_instance_t *instance, uint32_t *out_
 	if (ij % instance->lane_length == 1)
 		ij_prev = ij - 1;
 
-	uint64_t prev_block_opening = instance->memory[ij_prev].v[0];
+	return ij_prev;
+}
+
+/* reference block of ij, picked from the first word of its previous block */
+static uint32_t mtp_ref_index(uint32_t ij, const argon2_instance_t *instance, uint64_t prev_block_opening)
+{
 	uint32_t ref_lane = (uint32_t)((prev_block_opening >> 32) % instance->lanes);
 
 	uint32_t pseudo_rand = (uint32_t)(prev_block_opening & 0xFFFFFFFF);
@@ -112,101 +134,97 @@ void getblockindex_orig(uint32_t ij, argon2_instance_t *instance, uint32_t *out_
 	uint32_t Slice = (ij - (Lane * instance->lane_length)) / instance->segment_length;
 	uint32_t posIndex = ij - Lane * instance->lane_length - Slice * instance->segment_length;
 
-
-	uint32_t rec_ij = Slice*instance->segment_length + Lane *instance->lane_length + (ij % instance->segment_length);
-
 	if (Slice == 0)
 		ref_lane = Lane;
 
-
 	argon2_position_t position = { 0, Lane , (uint8_t)Slice, posIndex };
 
 	uint32_t ref_index = index_beta(instance, &position, pseudo_rand, ref_lane == position.lane);
 
-	uint32_t computed_ref_block = instance->lane_length * ref_lane + ref_index;
+	return instance->lane_length * ref_lane + ref_index;
+}
+
+void getblockindex_orig(uint32_t ij, argon2_instance_t *instance, uint32_t *out_ij_prev, uint32_t *out_computed_ref_block)
+{
+	uint32_t ij_prev = mtp_prev_index(ij, instance);
 
 	*out_ij_prev = ij_prev;
-	*out_computed_ref_block = computed_ref_block;
+	*out_computed_ref_block = mtp_ref_index(ij, instance, instance->memory[ij_prev].v[0]);
 }
 
 
 void getblockindex(int thr_id, uint32_t ij, argon2_instance_t *instance, uint32_t *out_ij_prev, uint32_t *out_computed_ref_block)
 {
-	uint32_t ij_prev = 0;
-	if (ij%instance->lane_length == 0)
-		ij_prev = ij + instance->lane_length - 1;
-	else
-		ij_prev = ij - 1;
-
-	if (ij % instance->lane_length == 1)
-		ij_prev = ij - 1;
+	uint32_t ij_prev = mtp_prev_index(ij, instance);
 
 	block b;
 	get_block(thr_id, &b, ij_prev);
-	uint64_t prev_block_opening = b.v[0];//instance->memory[ij_prev].v[0];
-	uint32_t ref_lane = (uint32_t)((prev_block_opening >> 32) % instance->lanes);
-
-	uint32_t pseudo_rand = (uint32_t)(prev_block_opening & 0xFFFFFFFF);
-
-	uint32_t Lane = ((ij) / instance->lane_length);
-	uint32_t Slice = (ij - (Lane * instance->lane_length)) / instance->segment_length;
-	uint32_t posIndex = ij - Lane * instance->lane_length - Slice * instance->segment_length;
-
-
-	uint32_t rec_ij = Slice*instance->segment_length + Lane *instance->lane_length + (ij % instance->segment_length);
-
-	if (Slice == 0)
-		ref_lane = Lane;
-
-
-	argon2_position_t position = { 0, Lane , (uint8_t)Slice, posIndex };
-
-	uint32_t ref_index = index_beta(instance, &position, pseudo_rand, ref_lane == position.lane);
-
-	uint32_t computed_ref_block = instance->lane_length * ref_lane + ref_index;
 
 	*out_ij_prev = ij_prev;
-	*out_computed_ref_block = computed_ref_block;
+	*out_computed_ref_block = mtp_ref_index(ij, instance, b.v[0]);
 }
 
 
 void getblockindex_test(int thr_id, uint32_t ij, argon2_instance_t *instance, uint32_t *out_ij_prev, uint32_t *out_computed_ref_block,cudaStream_t s0)
 {
-	uint32_t ij_prev = 0;
-	if (ij%instance->lane_length == 0)
-		ij_prev = ij + instance->lane_length - 1;
-	else
-		ij_prev = ij - 1;
-
-	if (ij % instance->lane_length == 1)
-		ij_prev = ij - 1;
+	uint32_t ij_prev = mtp_prev_index(ij, instance);
 
 	block b;
 	get_block_test(thr_id, &b, ij_prev,s0);
-	uint64_t prev_block_opening = b.v[0];//instance->memory[ij_prev].v[0];
-	uint32_t ref_lane = (uint32_t)((prev_block_opening >> 32) % instance->lanes);
-
-	uint32_t pseudo_rand = (uint32_t)(prev_block_opening & 0xFFFFFFFF);
-
-	uint32_t Lane = ((ij) / instance->lane_length);
-	uint32_t Slice = (ij - (Lane * instance->lane_length)) / instance->segment_length;
-	uint32_t posIndex = ij - Lane * instance->lane_length - Slice * instance->segment_length;
 
+	*out_ij_prev = ij_prev;
+	*out_computed_ref_block = mtp_ref_index(ij, instance, b.v[0]);
+}
 
-	uint32_t rec_ij = Slice*instance->segment_length + Lane *instance->lane_length + (ij % instance->segment_length);
-
-	if (Slice == 0)
-		ref_lane = Lane;
+/* block sources of the solver */
 
+static void gpu_gather(const mtp_block_source *src, const uint32_t *index, int count, block *out)
+{
+	for (int n = 0; n < count; n += MTP_GATHER_MAX) {
+		int chunk = count - n < MTP_GATHER_MAX ? count - n : MTP_GATHER_MAX;
+		const uint64_t *staged = get_blocks_batch(src->thr_id, &index[n], chunk, src->stream);
+		for (int i = 0; i < chunk; i++)
+			memcpy(out[n + i].v, &staged[i * ARGON2_QWORDS_IN_BLOCK], ARGON2_BLOCK_SIZE);
+	}
+}
 
-	argon2_position_t position = { 0, Lane , (uint8_t)Slice, posIndex };
+static void host_gather(const mtp_block_source *src, const uint32_t *index, int count, block *out)
+{
+	for (int i = 0; i < count; i++)
+		memcpy(&out[i], &src->memory[index[i]], sizeof(block));
+}
 
-	uint32_t ref_index = index_beta(instance, &position, pseudo_rand, ref_lane == position.lane);
+mtp_block_source mtp_gpu_blocks(int thr_id, cudaStream_t s0)
+{
+	mtp_block_source src = { gpu_gather, thr_id, s0, NULL };
+	return src;
+}
 
-	uint32_t computed_ref_block = instance->lane_length * ref_lane + ref_index;
+mtp_block_source mtp_host_blocks(const block *memory)
+{
+	mtp_block_source src = { host_gather, -1, 0, memory };
+	return src;
+}
 
-	*out_ij_prev = ij_prev;
-	*out_computed_ref_block = computed_ref_block;
+block* mtp_cpu_memory(const argon2_instance_t *instance, uint32_t threads)
+{
+	argon2_instance_t full = *instance;
+	block *memory = (block*)malloc((size_t)instance->memory_blocks * sizeof(block));
+	if (!memory)
+		return NULL;
+
+	// the instance only keeps the first two blocks of each lane
+	for (uint32_t l = 0; l < instance->lanes; l++) {
+		memory[l * instance->lane_length + 0] = instance->memory[l * 2 + 0];
+		memory[l * instance->lane_length + 1] = instance->memory[l * 2 + 1];
+	}
+	full.memory = memory;
+	full.threads = (threads && threads < instance->lanes) ? threads : instance->lanes;
+	if (fill_memory_blocks_mtp(&full) != ARGON2_OK) {
+		free(memory);
+		return NULL;
+	}
+	return memory;
 }
 
 
@@ -223,10 +241,7 @@ void StoreBlock(void *output, const block *src)
 void compute_blake2b(const block& input,
 	uint8_t digest[MERKLE_TREE_ELEMENT_SIZE_B])
 {
-	ablake2b_state state;
-	ablake2b_init(&state, MERKLE_TREE_ELEMENT_SIZE_B);
-	ablake2b4rounds_update(&state, input.v, ARGON2_BLOCK_SIZE);
-	ablake2b4rounds_final(&state, digest, MERKLE_TREE_ELEMENT_SIZE_B);
+	blake2b4r_1024to16(digest, input.v);
 }
 
 
@@ -437,11 +452,117 @@ void clear_internal_memory(void *v, size_t n) {
 }
 
 
+/*
+ * Instance memory arena: argon2_ctx_from_mtp only keeps the first two blocks
+ * of each lane, so instances get fixed chunks carved from mapped regions
+ * (hugepages when available) which are reused from one job to the next.
+ * The chunks hold public header data only and are not wiped on release.
+ */
+#define MTP_ARENA_CHUNK (128 * 8 * 2 * 4 * 2)
+#define MTP_ARENA_REGION (2 * 1024 * 1024)
+#define MTP_ARENA_LANES 4
+// the size argon2 asks for, the m_cost the chunks are made for
+#define MTP_ARENA_REQUEST ((size_t) memcost * ARGON2_BLOCK_SIZE)
+
+static_assert(MTP_ARENA_LANES * 2 * ARGON2_BLOCK_SIZE <= MTP_ARENA_CHUNK, "mtp arena chunk too small");
+
+static pthread_mutex_t arena_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint8_t *arena_free = NULL; // free chunks, linked through their first bytes
+static uint32_t arena_chunks = 0;
+static uint32_t arena_used = 0;
+static uint32_t arena_regions = 0;
+static uint32_t arena_huge = 0;
+
+static uint8_t* mtp_arena_map(bool *huge)
+{
+	*huge = false;
+#ifdef WIN32
+	return (uint8_t*) _aligned_malloc(MTP_ARENA_REGION, 4096);
+#else
+	void *p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+	p = mmap(NULL, MTP_ARENA_REGION, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	*huge = (p != MAP_FAILED);
+#endif
+	if (p == MAP_FAILED) {
+		p = mmap(NULL, MTP_ARENA_REGION, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p == MAP_FAILED)
+			return NULL;
+#ifdef MADV_HUGEPAGE
+		madvise(p, MTP_ARENA_REGION, MADV_HUGEPAGE);
+#endif
+	}
+	return (uint8_t*) p;
+#endif
+}
+
+// the requested size is the full m_cost, only one chunk of it is ever used
+static int mtp_arena_alloc(uint8_t **memory, size_t bytes_to_allocate)
+{
+	if (bytes_to_allocate != MTP_ARENA_REQUEST) {
+		applog(LOG_ERR, "mtp arena: unexpected request of %zu bytes (m_cost changed?)", bytes_to_allocate);
+		*memory = NULL;
+		return ARGON2_MEMORY_ALLOCATION_ERROR;
+	}
+
+	pthread_mutex_lock(&arena_lock);
+	if (!arena_free) {
+		bool huge;
+		uint8_t *region = mtp_arena_map(&huge);
+		if (region) {
+			for (size_t off = 0; off < MTP_ARENA_REGION; off += MTP_ARENA_CHUNK) {
+				*(uint8_t**) (region + off) = arena_free;
+				arena_free = region + off;
+			}
+			arena_chunks += MTP_ARENA_REGION / MTP_ARENA_CHUNK;
+			arena_regions++;
+			if (huge)
+				arena_huge++;
+		}
+	}
+	*memory = arena_free;
+	if (arena_free) {
+		arena_free = *(uint8_t**) arena_free;
+		arena_used++;
+	}
+	pthread_mutex_unlock(&arena_lock);
+
+	return *memory ? ARGON2_OK : ARGON2_MEMORY_ALLOCATION_ERROR;
+}
+
+static void mtp_arena_release(uint8_t *memory, size_t bytes_to_allocate)
+{
+	if (!memory)
+		return;
+	if (bytes_to_allocate > MTP_ARENA_CHUNK) {
+		applog(LOG_ERR, "mtp arena: release of %zu bytes, chunks are %u", bytes_to_allocate, MTP_ARENA_CHUNK);
+		return;
+	}
+	pthread_mutex_lock(&arena_lock);
+	*(uint8_t**) memory = arena_free;
+	arena_free = memory;
+	arena_used--;
+	pthread_mutex_unlock(&arena_lock);
+}
+
+extern "C" void mtp_arena_getmeminfo(uint64_t *mem, uint32_t *chunks, uint32_t *used, uint32_t *huge)
+{
+	pthread_mutex_lock(&arena_lock);
+	(*mem) = (uint64_t) arena_regions * MTP_ARENA_REGION;
+	(*chunks) = arena_chunks;
+	(*used) = arena_used;
+	(*huge) = arena_huge;
+	pthread_mutex_unlock(&arena_lock);
+}
+
 void free_memory(const argon2_context *context, uint8_t *memory,
 	size_t num, size_t size) {
 //	size_t memory_size = num*size;
-	size_t memory_size = 128 * 8 * 2 * 4 * 2;
-	clear_internal_memory(memory, memory_size);
+	size_t memory_size = MTP_ARENA_CHUNK;
+	if (context->free_cbk != mtp_arena_release)
+		clear_internal_memory(memory, memory_size);
 	if (context->free_cbk) {
 		(context->free_cbk)(memory, memory_size);
 	}
@@ -465,13 +586,13 @@ argon2_context init_argon2d_param(const char* input) {
     //unsigned char salt[TEST_SALTLEN]; 
 	//    unsigned char secret[TEST_SECRETLEN];
 	//   unsigned char ad[TEST_ADLEN];
-    const allocate_fptr myown_allocator = NULL;
-    const deallocate_fptr myown_deallocator = NULL;
+    const allocate_fptr myown_allocator = mtp_arena_alloc;
+    const deallocate_fptr myown_deallocator = mtp_arena_release;
 
     unsigned t_cost = 1;
     unsigned m_cost =  memcost; //2*1024*1024; //*1024; //+896*1024; //32768*1;
 	
-    unsigned lanes = 4;
+    unsigned lanes = MTP_ARENA_LANES;
 
     memset(pContext,0,sizeof(argon2_context));
     memset(&out[0], 0, sizeof(out));
@@ -512,7 +633,7 @@ argon2_context init_argon2d_param(const char* input) {
 
 int mtp_solver_orig(uint32_t TheNonce, argon2_instance_t *instance,
 	blockS *nBlockMTP /*[72 * 2][128]*/,unsigned char* nProofMTP, unsigned char* resultMerkleRoot, unsigned char* mtpHashValue,
-MerkleTree TheTree,uint32_t* input, uint256 hashTarget) {
+const MerkleTree& TheTree,uint32_t* input, uint256 hashTarget) {
 
 	const uint8_t L = 16;
 
@@ -576,87 +697,10 @@ MerkleTree TheTree,uint32_t* input, uint256 hashTarget) {
 			ablake2b_update(&BlakeHash2, blockhash_bytes, ARGON2_BLOCK_SIZE);
 			ablake2b_final(&BlakeHash2, (unsigned char*)&Y[j], 32);
 ////////////////////////////////////////////////////////////////
-// current block
-
-			unsigned char curr[32] = { 0 };
-			block blockhash_curr;
-			uint8_t blockhash_curr_bytes[ARGON2_BLOCK_SIZE];
-			copy_block(&blockhash_curr, &instance->memory[ij]);
-			store_block(&blockhash_curr_bytes, &blockhash_curr);
-			ablake2b_state state_curr;
-			ablake2b_init(&state_curr, MERKLE_TREE_ELEMENT_SIZE_B);
-			ablake2b4rounds_update(&state_curr, blockhash_curr_bytes, ARGON2_BLOCK_SIZE);
-			uint8_t digest_curr[MERKLE_TREE_ELEMENT_SIZE_B];
-			ablake2b4rounds_final(&state_curr, digest_curr, sizeof(digest_curr));
-			MerkleTree::Buffer hash_curr = MerkleTree::Buffer(digest_curr, digest_curr + sizeof(digest_curr));
-			clear_internal_memory(blockhash_curr.v, ARGON2_BLOCK_SIZE);
-			clear_internal_memory(blockhash_curr_bytes, ARGON2_BLOCK_SIZE);
-
-
-			std::deque<std::vector<uint8_t>> zProofMTP = TheTree.getProofOrdered(hash_curr, ij + 1);
-
-			nProofMTP[(j * 3 - 3) * 353] = (unsigned char)(zProofMTP.size());
-
-			int k1=0;
-			for (const std::vector<uint8_t> &mtpData : zProofMTP) {	
-			std::copy(mtpData.begin(),mtpData.end(), nProofMTP +((j * 3 - 3) * 353 + 1 + k1 * mtpData.size()));
-			k1++;
-			}
-
-			//prev proof
-			unsigned char prev[32]={0};
-			block blockhash_prev;
-			uint8_t blockhash_prev_bytes[ARGON2_BLOCK_SIZE];
-			copy_block(&blockhash_prev, &instance->memory[prev_index]);
-			store_block(&blockhash_prev_bytes, &blockhash_prev);
-			ablake2b_state state_prev;
-			ablake2b_init(&state_prev, MERKLE_TREE_ELEMENT_SIZE_B);
-			ablake2b4rounds_update(&state_prev, blockhash_prev_bytes, ARGON2_BLOCK_SIZE);
-			uint8_t digest_prev[MERKLE_TREE_ELEMENT_SIZE_B];
-
-
-			ablake2b4rounds_final(&state_prev, digest_prev, sizeof(digest_prev));
-
- 
-			MerkleTree::Buffer hash_prev = MerkleTree::Buffer(digest_prev, digest_prev + sizeof(digest_prev));
-			clear_internal_memory(blockhash_prev.v, ARGON2_BLOCK_SIZE);
-			clear_internal_memory(blockhash_prev_bytes, ARGON2_BLOCK_SIZE);
-
-			std::deque<std::vector<uint8_t>> zProofMTP2 = TheTree.getProofOrdered(hash_prev, prev_index + 1);
-
-			nProofMTP[(j * 3 - 2) * 353] = (unsigned char)(zProofMTP2.size());
-
-			int k2 = 0;
-			for (const std::vector<uint8_t> &mtpData : zProofMTP2) {
-				std::copy(mtpData.begin(), mtpData.end(), nProofMTP + ((j * 3 - 2) * 353 + 1 + k2 * mtpData.size()));
-				k2++;
-			}
-
-
-			//ref proof
-			unsigned char ref[32] = { 0 };
-			block blockhash_ref;
-			uint8_t blockhash_ref_bytes[ARGON2_BLOCK_SIZE];
-			copy_block(&blockhash_ref, &instance->memory[ref_index]);
-			store_block(&blockhash_ref_bytes, &blockhash_ref);
-			ablake2b_state state_ref;
-			ablake2b_init(&state_ref, MERKLE_TREE_ELEMENT_SIZE_B);
-			ablake2b4rounds_update(&state_ref, blockhash_ref_bytes, ARGON2_BLOCK_SIZE);
-			uint8_t digest_ref[MERKLE_TREE_ELEMENT_SIZE_B];
-			ablake2b4rounds_final(&state_ref, digest_ref, sizeof(digest_ref));
-			MerkleTree::Buffer hash_ref = MerkleTree::Buffer(digest_ref, digest_ref + sizeof(digest_ref));
-			clear_internal_memory(blockhash_ref.v, ARGON2_BLOCK_SIZE);
-			clear_internal_memory(blockhash_ref_bytes, ARGON2_BLOCK_SIZE);
-
-			std::deque<std::vector<uint8_t>> zProofMTP3 = TheTree.getProofOrdered(hash_ref, ref_index + 1);
-
-			nProofMTP[(j * 3 - 1) * 353] = (unsigned char)(zProofMTP3.size());
-
-			int k3 = 0;
-			for (const std::vector<uint8_t> &mtpData : zProofMTP3) {
-				std::copy(mtpData.begin(), mtpData.end(), nProofMTP + ((j * 3 - 1) * 353 + 1 + k3 * mtpData.size()));
-				k3++;
-			}
+// proofs of the current, previous and reference blocks
+			TheTree.getProofInto(ij, nProofMTP + (j * 3 - 3) * MERKLE_TREE_PROOF_SIZE_B);
+			TheTree.getProofInto(prev_index, nProofMTP + (j * 3 - 2) * MERKLE_TREE_PROOF_SIZE_B);
+			TheTree.getProofInto(ref_index, nProofMTP + (j * 3 - 1) * MERKLE_TREE_PROOF_SIZE_B);
 
 
 /////////////////////////////////////////////////////////////////////
@@ -699,7 +743,7 @@ MerkleTree TheTree,uint32_t* input, uint256 hashTarget) {
 
 int mtp_solver_old(int thr_id, uint32_t TheNonce, argon2_instance_t *instance,
 	blockS *nBlockMTP /*[72 * 2][128]*/, unsigned char* nProofMTP, unsigned char* resultMerkleRoot, unsigned char* mtpHashValue,
-	MerkleTree TheTree, uint32_t* input, uint256 hashTarget) {
+	const MerkleTree& TheTree, uint32_t* input, uint256 hashTarget) {
 
 	const uint8_t L = 64;
 
@@ -765,88 +809,9 @@ int mtp_solver_old(int thr_id, uint32_t TheNonce, argon2_instance_t *instance,
 			clear_internal_memory(blockhash.v, ARGON2_BLOCK_SIZE);
 			clear_internal_memory(blockhash_bytes, ARGON2_BLOCK_SIZE);
 
-			unsigned char curr[32] = { 0 };
-			block blockhash_curr;
-			uint8_t blockhash_curr_bytes[ARGON2_BLOCK_SIZE];
-			//			copy_block(&blockhash_curr, &instance->memory[ij]);
-			get_block(thr_id, /*(uint8_t*)*/&blockhash_curr.v, ij);
-			store_block(&blockhash_curr_bytes, &blockhash_curr);
-			ablake2b_state state_curr;
-			ablake2b_init(&state_curr, MERKLE_TREE_ELEMENT_SIZE_B);
-			ablake2b4rounds_update(&state_curr, blockhash_curr_bytes, ARGON2_BLOCK_SIZE);
-			uint8_t digest_curr[MERKLE_TREE_ELEMENT_SIZE_B];
-			ablake2b4rounds_final(&state_curr, digest_curr, sizeof(digest_curr));
-			MerkleTree::Buffer hash_curr = MerkleTree::Buffer(digest_curr, digest_curr + sizeof(digest_curr));
-			clear_internal_memory(blockhash_curr.v, ARGON2_BLOCK_SIZE);
-			clear_internal_memory(blockhash_curr_bytes, ARGON2_BLOCK_SIZE);
-
-
-			std::deque<std::vector<uint8_t>> zProofMTP = TheTree.getProofOrdered(hash_curr, ij + 1);
-
-			nProofMTP[(j * 3 - 3) * 353] = (unsigned char)(zProofMTP.size());
-
-			int k1 = 0;
-			for (const std::vector<uint8_t> &mtpData : zProofMTP) {
-				std::copy(mtpData.begin(), mtpData.end(), nProofMTP + ((j * 3 - 3) * 353 + 1 + k1 * mtpData.size()));
-				k1++;
-			}
-
-			//prev proof
-			unsigned char prev[32] = { 0 };
-			block blockhash_prev;
-			uint8_t blockhash_prev_bytes[ARGON2_BLOCK_SIZE];
-			//			copy_block(&blockhash_prev, &instance->memory[prev_index]);
-			get_block(thr_id, /*(uint8_t*)*/&blockhash_prev.v, prev_index);
-			store_block(&blockhash_prev_bytes, &blockhash_prev);
-			ablake2b_state state_prev;
-			ablake2b_init(&state_prev, MERKLE_TREE_ELEMENT_SIZE_B);
-			ablake2b4rounds_update(&state_prev, blockhash_prev_bytes, ARGON2_BLOCK_SIZE);
-			uint8_t digest_prev[MERKLE_TREE_ELEMENT_SIZE_B];
-
-
-			ablake2b4rounds_final(&state_prev, digest_prev, sizeof(digest_prev));
-
-
-			MerkleTree::Buffer hash_prev = MerkleTree::Buffer(digest_prev, digest_prev + sizeof(digest_prev));
-			clear_internal_memory(blockhash_prev.v, ARGON2_BLOCK_SIZE);
-			clear_internal_memory(blockhash_prev_bytes, ARGON2_BLOCK_SIZE);
-
-			std::deque<std::vector<uint8_t>> zProofMTP2 = TheTree.getProofOrdered(hash_prev, prev_index + 1);
-
-			nProofMTP[(j * 3 - 2) * 353] = (unsigned char)(zProofMTP2.size());
-
-			int k2 = 0;
-			for (const std::vector<uint8_t> &mtpData : zProofMTP2) {
-				std::copy(mtpData.begin(), mtpData.end(), nProofMTP + ((j * 3 - 2) * 353 + 1 + k2 * mtpData.size()));
-				k2++;
-			}
-
-
-			//ref proof
-			unsigned char ref[32] = { 0 };
-			block blockhash_ref;
-			uint8_t blockhash_ref_bytes[ARGON2_BLOCK_SIZE];
-			//			copy_block(&blockhash_ref, &instance->memory[ref_index]);
-			get_block(thr_id, /*(uint8_t*)*/&blockhash_ref.v, ref_index);
-			store_block(&blockhash_ref_bytes, &blockhash_ref);
-			ablake2b_state state_ref;
-			ablake2b_init(&state_ref, MERKLE_TREE_ELEMENT_SIZE_B);
-			ablake2b4rounds_update(&state_ref, blockhash_ref_bytes, ARGON2_BLOCK_SIZE);
-			uint8_t digest_ref[MERKLE_TREE_ELEMENT_SIZE_B];
-			ablake2b4rounds_final(&state_ref, digest_ref, sizeof(digest_ref));
-			MerkleTree::Buffer hash_ref = MerkleTree::Buffer(digest_ref, digest_ref + sizeof(digest_ref));
-			clear_internal_memory(blockhash_ref.v, ARGON2_BLOCK_SIZE);
-			clear_internal_memory(blockhash_ref_bytes, ARGON2_BLOCK_SIZE);
-
-			std::deque<std::vector<uint8_t>> zProofMTP3 = TheTree.getProofOrdered(hash_ref, ref_index + 1);
-
-			nProofMTP[(j * 3 - 1) * 353] = (unsigned char)(zProofMTP3.size());
-
-			int k3 = 0;
-			for (const std::vector<uint8_t> &mtpData : zProofMTP3) {
-				std::copy(mtpData.begin(), mtpData.end(), nProofMTP + ((j * 3 - 1) * 353 + 1 + k3 * mtpData.size()));
-				k3++;
-			}
+			TheTree.getProofInto(ij, nProofMTP + (j * 3 - 3) * MERKLE_TREE_PROOF_SIZE_B);
+			TheTree.getProofInto(prev_index, nProofMTP + (j * 3 - 2) * MERKLE_TREE_PROOF_SIZE_B);
+			TheTree.getProofInto(ref_index, nProofMTP + (j * 3 - 1) * MERKLE_TREE_PROOF_SIZE_B);
 
 
 			/////////////////////////////////////////////////////////////////////
@@ -897,7 +862,7 @@ int mtp_solver_old(int thr_id, uint32_t TheNonce, argon2_instance_t *instance,
 
 int mtptcr_solver_old(int thr_id, uint32_t TheNonce, argon2_instance_t *instance,
 	blockS *nBlockMTP /*[72 * 2][128]*/, unsigned char* nProofMTP, unsigned char* resultMerkleRoot, unsigned char* mtpHashValue,
-	MerkleTree TheTree, uint32_t* input, uint256 hashTarget) {
+	const MerkleTree& TheTree, uint32_t* input, uint256 hashTarget) {
 
 	static const uint8_t L = 16;
 
@@ -963,88 +928,9 @@ int mtptcr_solver_old(int thr_id, uint32_t TheNonce, argon2_instance_t *instance
 			clear_internal_memory(blockhash.v, ARGON2_BLOCK_SIZE);
 			clear_internal_memory(blockhash_bytes, ARGON2_BLOCK_SIZE);
 
-			unsigned char curr[32] = { 0 };
-			block blockhash_curr;
-			uint8_t blockhash_curr_bytes[ARGON2_BLOCK_SIZE];
-			//			copy_block(&blockhash_curr, &instance->memory[ij]);
-			get_block(thr_id, /*(uint8_t*)*/&blockhash_curr.v, ij);
-			store_block(&blockhash_curr_bytes, &blockhash_curr);
-			ablake2b_state state_curr;
-			ablake2b_init(&state_curr, MERKLE_TREE_ELEMENT_SIZE_B);
-			ablake2b4rounds_update(&state_curr, blockhash_curr_bytes, ARGON2_BLOCK_SIZE);
-			uint8_t digest_curr[MERKLE_TREE_ELEMENT_SIZE_B];
-			ablake2b4rounds_final(&state_curr, digest_curr, sizeof(digest_curr));
-			MerkleTree::Buffer hash_curr = MerkleTree::Buffer(digest_curr, digest_curr + sizeof(digest_curr));
-			clear_internal_memory(blockhash_curr.v, ARGON2_BLOCK_SIZE);
-			clear_internal_memory(blockhash_curr_bytes, ARGON2_BLOCK_SIZE);
-
-
-			std::deque<std::vector<uint8_t>> zProofMTP = TheTree.getProofOrdered(hash_curr, ij + 1);
-
-			nProofMTP[(j * 3 - 3) * 353] = (unsigned char)(zProofMTP.size());
-
-			int k1 = 0;
-			for (const std::vector<uint8_t> &mtpData : zProofMTP) {
-				std::copy(mtpData.begin(), mtpData.end(), nProofMTP + ((j * 3 - 3) * 353 + 1 + k1 * mtpData.size()));
-				k1++;
-			}
-
-			//prev proof
-			unsigned char prev[32] = { 0 };
-			block blockhash_prev;
-			uint8_t blockhash_prev_bytes[ARGON2_BLOCK_SIZE];
-			//			copy_block(&blockhash_prev, &instance->memory[prev_index]);
-			get_block(thr_id, /*(uint8_t*)*/&blockhash_prev.v, prev_index);
-			store_block(&blockhash_prev_bytes, &blockhash_prev);
-			ablake2b_state state_prev;
-			ablake2b_init(&state_prev, MERKLE_TREE_ELEMENT_SIZE_B);
-			ablake2b4rounds_update(&state_prev, blockhash_prev_bytes, ARGON2_BLOCK_SIZE);
-			uint8_t digest_prev[MERKLE_TREE_ELEMENT_SIZE_B];
-
-
-			ablake2b4rounds_final(&state_prev, digest_prev, sizeof(digest_prev));
-
-
-			MerkleTree::Buffer hash_prev = MerkleTree::Buffer(digest_prev, digest_prev + sizeof(digest_prev));
-			clear_internal_memory(blockhash_prev.v, ARGON2_BLOCK_SIZE);
-			clear_internal_memory(blockhash_prev_bytes, ARGON2_BLOCK_SIZE);
-
-			std::deque<std::vector<uint8_t>> zProofMTP2 = TheTree.getProofOrdered(hash_prev, prev_index + 1);
-
-			nProofMTP[(j * 3 - 2) * 353] = (unsigned char)(zProofMTP2.size());
-
-			int k2 = 0;
-			for (const std::vector<uint8_t> &mtpData : zProofMTP2) {
-				std::copy(mtpData.begin(), mtpData.end(), nProofMTP + ((j * 3 - 2) * 353 + 1 + k2 * mtpData.size()));
-				k2++;
-			}
-
-
-			//ref proof
-			unsigned char ref[32] = { 0 };
-			block blockhash_ref;
-			uint8_t blockhash_ref_bytes[ARGON2_BLOCK_SIZE];
-			//			copy_block(&blockhash_ref, &instance->memory[ref_index]);
-			get_block(thr_id, /*(uint8_t*)*/&blockhash_ref.v, ref_index);
-			store_block(&blockhash_ref_bytes, &blockhash_ref);
-			ablake2b_state state_ref;
-			ablake2b_init(&state_ref, MERKLE_TREE_ELEMENT_SIZE_B);
-			ablake2b4rounds_update(&state_ref, blockhash_ref_bytes, ARGON2_BLOCK_SIZE);
-			uint8_t digest_ref[MERKLE_TREE_ELEMENT_SIZE_B];
-			ablake2b4rounds_final(&state_ref, digest_ref, sizeof(digest_ref));
-			MerkleTree::Buffer hash_ref = MerkleTree::Buffer(digest_ref, digest_ref + sizeof(digest_ref));
-			clear_internal_memory(blockhash_ref.v, ARGON2_BLOCK_SIZE);
-			clear_internal_memory(blockhash_ref_bytes, ARGON2_BLOCK_SIZE);
-
-			std::deque<std::vector<uint8_t>> zProofMTP3 = TheTree.getProofOrdered(hash_ref, ref_index + 1);
-
-			nProofMTP[(j * 3 - 1) * 353] = (unsigned char)(zProofMTP3.size());
-
-			int k3 = 0;
-			for (const std::vector<uint8_t> &mtpData : zProofMTP3) {
-				std::copy(mtpData.begin(), mtpData.end(), nProofMTP + ((j * 3 - 1) * 353 + 1 + k3 * mtpData.size()));
-				k3++;
-			}
+			TheTree.getProofInto(ij, nProofMTP + (j * 3 - 3) * MERKLE_TREE_PROOF_SIZE_B);
+			TheTree.getProofInto(prev_index, nProofMTP + (j * 3 - 2) * MERKLE_TREE_PROOF_SIZE_B);
+			TheTree.getProofInto(ref_index, nProofMTP + (j * 3 - 1) * MERKLE_TREE_PROOF_SIZE_B);
 
 
 			/////////////////////////////////////////////////////////////////////
@@ -1090,395 +976,263 @@ int mtptcr_solver_old(int thr_id, uint32_t TheNonce, argon2_instance_t *instance
 	return 0;
 }
 
-int mtp_solver(int thr_id, uint32_t TheNonce, argon2_instance_t *instance,
+int mtp_solver_blocks(const mtp_block_source *src, uint8_t L, uint32_t TheNonce, argon2_instance_t *instance,
 	blockS *nBlockMTP /*[72 * 2][128]*/, unsigned char* nProofMTP, unsigned char* resultMerkleRoot, unsigned char* mtpHashValue,
-	MerkleTree TheTree, uint32_t* input, uint256 hashTarget, cudaStream_t s0) {
-
-	const uint8_t L = 64;
-
-	if (instance != NULL) {
-		//		input[19]=0x01000000;
-		uint256 Y[L + 1];
-		//		std::string proof_blocks[L * 3];
-		memset(&Y, 0, sizeof(Y));
-		uint8_t zero[32] = { 0 };
-		ablake2b_state BlakeHash;
-		ablake2b_init(&BlakeHash, 32);
-
-
-
-
-		ablake2b_update(&BlakeHash, (unsigned char*)&input[0], 80);
-		ablake2b_update(&BlakeHash, (unsigned char*)&resultMerkleRoot[0], 16);
-		ablake2b_update(&BlakeHash, &TheNonce, sizeof(unsigned int));
-		ablake2b_final(&BlakeHash, (unsigned char*)&Y[0], 32);
-
-
-
-		blockS blocks[L * 2];
-
-		///////////////////////////////
-		bool init_blocks = false;
-		bool unmatch_block = false;
-		unsigned char proof_ser[1000] = { 0 };
-		unsigned int proof_size;
-		for (uint8_t j = 1; j <= L; j++) {
-
-			uint32_t ij = (((uint32_t*)(&Y[j - 1]))[0]) % (instance->context_ptr->m_cost);
-			uint32_t except_index = (uint32_t)(instance->context_ptr->m_cost / instance->context_ptr->lanes);
-			if (ij %except_index == 0 || ij%except_index == 1) {
-				init_blocks = true;
-				break;
-			}
-
-			uint32_t prev_index;
-			uint32_t ref_index;
-			getblockindex_test(thr_id, ij, instance, &prev_index, &ref_index,s0);
-
-			//			copy_blockS(&nBlockMTP[j * 2 - 2], &instance->memory[prev_index]);
-			get_block_test(thr_id, /*(uint8_t*)*/nBlockMTP[j * 2 - 2].v, prev_index,s0);
-			//ref block
-			//			copy_blockS(&nBlockMTP[j * 2 - 1], &instance->memory[ref_index]);
-			get_block_test(thr_id, /*(uint8_t*)*/nBlockMTP[j * 2 - 1].v, ref_index,s0);
-			block blockhash;
-			uint8_t blockhash_bytes[ARGON2_BLOCK_SIZE];
-			//			copy_block(&blockhash, &instance->memory[ij]);
-			get_block_test(thr_id, /*(uint8_t*)*/&blockhash.v, ij,s0);
-
-
-			store_block(&blockhash_bytes, &blockhash);
-
-			ablake2b_state BlakeHash2;
-			ablake2b_init(&BlakeHash2, 32);
-			ablake2b_update(&BlakeHash2, &Y[j - 1], sizeof(uint256));
-			ablake2b_update(&BlakeHash2, blockhash_bytes, ARGON2_BLOCK_SIZE);
-			ablake2b_final(&BlakeHash2, (unsigned char*)&Y[j], 32);
-			////////////////////////////////////////////////////////////////
-			// current block
-			clear_internal_memory(blockhash.v, ARGON2_BLOCK_SIZE);
-			clear_internal_memory(blockhash_bytes, ARGON2_BLOCK_SIZE);
-
-			unsigned char curr[32] = { 0 };
-			block blockhash_curr;
-			uint8_t blockhash_curr_bytes[ARGON2_BLOCK_SIZE];
-			//			copy_block(&blockhash_curr, &instance->memory[ij]);
-			get_block_test(thr_id, /*(uint8_t*)*/&blockhash_curr.v, ij,s0);
-			store_block(&blockhash_curr_bytes, &blockhash_curr);
-			ablake2b_state state_curr;
-			ablake2b_init(&state_curr, MERKLE_TREE_ELEMENT_SIZE_B);
-			ablake2b4rounds_update(&state_curr, blockhash_curr_bytes, ARGON2_BLOCK_SIZE);
-			uint8_t digest_curr[MERKLE_TREE_ELEMENT_SIZE_B];
-			ablake2b4rounds_final(&state_curr, digest_curr, sizeof(digest_curr));
-			MerkleTree::Buffer hash_curr = MerkleTree::Buffer(digest_curr, digest_curr + sizeof(digest_curr));
-			clear_internal_memory(blockhash_curr.v, ARGON2_BLOCK_SIZE);
-			clear_internal_memory(blockhash_curr_bytes, ARGON2_BLOCK_SIZE);
-
-
-			std::deque<std::vector<uint8_t>> zProofMTP = TheTree.getProofOrdered(hash_curr, ij + 1);
-
-			nProofMTP[(j * 3 - 3) * 353] = (unsigned char)(zProofMTP.size());
-
-			int k1 = 0;
-			for (const std::vector<uint8_t> &mtpData : zProofMTP) {
-				std::copy(mtpData.begin(), mtpData.end(), nProofMTP + ((j * 3 - 3) * 353 + 1 + k1 * mtpData.size()));
-				k1++;
-			}
-
-			//prev proof
-			unsigned char prev[32] = { 0 };
-			block blockhash_prev;
-			uint8_t blockhash_prev_bytes[ARGON2_BLOCK_SIZE];
-			//			copy_block(&blockhash_prev, &instance->memory[prev_index]);
-			get_block_test(thr_id, /*(uint8_t*)*/&blockhash_prev.v, prev_index,s0);
-			store_block(&blockhash_prev_bytes, &blockhash_prev);
-			ablake2b_state state_prev;
-			ablake2b_init(&state_prev, MERKLE_TREE_ELEMENT_SIZE_B);
-			ablake2b4rounds_update(&state_prev, blockhash_prev_bytes, ARGON2_BLOCK_SIZE);
-			uint8_t digest_prev[MERKLE_TREE_ELEMENT_SIZE_B];
-
-
-			ablake2b4rounds_final(&state_prev, digest_prev, sizeof(digest_prev));
+	const MerkleTree& TheTree, uint32_t* input, uint256 hashTarget) {
 
+	if (instance == NULL || L > MTP_L_MAX)
+		return 0;
 
-			MerkleTree::Buffer hash_prev = MerkleTree::Buffer(digest_prev, digest_prev + sizeof(digest_prev));
-			clear_internal_memory(blockhash_prev.v, ARGON2_BLOCK_SIZE);
-			clear_internal_memory(blockhash_prev_bytes, ARGON2_BLOCK_SIZE);
+	uint256 Y[MTP_L_MAX + 1];
+	uint32_t ij_index[MTP_L_MAX];
+	uint32_t prev_index[MTP_L_MAX];
+	uint32_t ref_index[MTP_L_MAX];
 
-			std::deque<std::vector<uint8_t>> zProofMTP2 = TheTree.getProofOrdered(hash_prev, prev_index + 1);
+	ablake2b_state BlakeHash;
+	ablake2b_init(&BlakeHash, 32);
+	ablake2b_update(&BlakeHash, (unsigned char*)&input[0], 80);
+	ablake2b_update(&BlakeHash, (unsigned char*)&resultMerkleRoot[0], 16);
+	ablake2b_update(&BlakeHash, &TheNonce, sizeof(unsigned int));
+	ablake2b_final(&BlakeHash, (unsigned char*)&Y[0], 32);
 
-			nProofMTP[(j * 3 - 2) * 353] = (unsigned char)(zProofMTP2.size());
+	const uint32_t except_index = (uint32_t)(instance->context_ptr->m_cost / instance->context_ptr->lanes);
 
-			int k2 = 0;
-			for (const std::vector<uint8_t> &mtpData : zProofMTP2) {
-				std::copy(mtpData.begin(), mtpData.end(), nProofMTP + ((j * 3 - 2) * 353 + 1 + k2 * mtpData.size()));
-				k2++;
-			}
-
-
-			//ref proof
-			unsigned char ref[32] = { 0 };
-			block blockhash_ref;
-			uint8_t blockhash_ref_bytes[ARGON2_BLOCK_SIZE];
-			//			copy_block(&blockhash_ref, &instance->memory[ref_index]);
-			get_block_test(thr_id, /*(uint8_t*)*/&blockhash_ref.v, ref_index,s0);
-			store_block(&blockhash_ref_bytes, &blockhash_ref);
-			ablake2b_state state_ref;
-			ablake2b_init(&state_ref, MERKLE_TREE_ELEMENT_SIZE_B);
-			ablake2b4rounds_update(&state_ref, blockhash_ref_bytes, ARGON2_BLOCK_SIZE);
-			uint8_t digest_ref[MERKLE_TREE_ELEMENT_SIZE_B];
-			ablake2b4rounds_final(&state_ref, digest_ref, sizeof(digest_ref));
-			MerkleTree::Buffer hash_ref = MerkleTree::Buffer(digest_ref, digest_ref + sizeof(digest_ref));
-			clear_internal_memory(blockhash_ref.v, ARGON2_BLOCK_SIZE);
-			clear_internal_memory(blockhash_ref_bytes, ARGON2_BLOCK_SIZE);
-
-			std::deque<std::vector<uint8_t>> zProofMTP3 = TheTree.getProofOrdered(hash_ref, ref_index + 1);
-
-			nProofMTP[(j * 3 - 1) * 353] = (unsigned char)(zProofMTP3.size());
-
-			int k3 = 0;
-			for (const std::vector<uint8_t> &mtpData : zProofMTP3) {
-				std::copy(mtpData.begin(), mtpData.end(), nProofMTP + ((j * 3 - 1) * 353 + 1 + k3 * mtpData.size()));
-				k3++;
-			}
-
-
-			/////////////////////////////////////////////////////////////////////
-			/////////////////////////////////////////////////////////////////////
-		}
-
-		if (init_blocks) {
+	// Y[j] hashes the block ij picked by Y[j-1], so each round fetches the
+	// current and previous blocks in one go. The reference blocks are only
+	// part of the proof and are fetched together once Y[L] is checked.
+	for (uint8_t j = 1; j <= L; j++) {
 
+		uint32_t ij = (((uint32_t*)(&Y[j - 1]))[0]) % (instance->context_ptr->m_cost);
+		if (ij %except_index == 0 || ij%except_index == 1)
 			return 0;
-		}
-
 
-		char hex_tmp[64];
+		block round[2];
+		uint32_t index[2] = { mtp_prev_index(ij, instance), ij };
+		src->gather(src, index, 2, round);
 
-		if (Y[L] > hashTarget) {
-			// Found a solution
-			printf("False positive. Nonce=%08x Hash:", TheNonce);
-			for (int n = 0; n < 32; n++) {
-				printf("%02x", ((unsigned char*)&Y[0])[n]);
-			}
-			printf("\n");
-		}
-		else {
-			for (int i = 0; i<32; i++)
-				mtpHashValue[i] = (((unsigned char*)(&Y[L]))[i]);
+		ij_index[j - 1] = ij;
+		prev_index[j - 1] = index[0];
+		ref_index[j - 1] = mtp_ref_index(ij, instance, round[0].v[0]);
+		copy_blockS(&nBlockMTP[j * 2 - 2], &round[0]);
 
-			// Found a solution
-			/*
-			printf("Found a solution. Nonce=%08x Hash:", TheNonce);
-			for (int n = 0; n < 32; n++) {
-			printf("%02x", ((unsigned char*)&Y[L])[n]);
-			}
-			printf("\n");
-			*/
-			return 1;
+		// the block words are little endian, as store_block() would write them
+		blake2b_1056to32(&Y[j], &Y[j - 1], round[1].v);
 
+		clear_internal_memory(round, sizeof(round));
+	}
 
+	if (Y[L] > hashTarget) {
+		printf("False positive. Nonce=%08x Hash:", TheNonce);
+		for (int n = 0; n < 32; n++) {
+			printf("%02x", ((unsigned char*)&Y[0])[n]);
 		}
+		printf("\n");
+		return 0;
+	}
 
+	// reference blocks, each distinct index fetched once
+	uint32_t fetch[MTP_L_MAX];
+	uint8_t slot[MTP_L_MAX];
+	int count = 0;
+	for (int j = 0; j < L; j++) {
+		int k = 0;
+		while (k < count && fetch[k] != ref_index[j])
+			k++;
+		if (k == count)
+			fetch[count++] = ref_index[j];
+		slot[j] = (uint8_t)k;
 	}
 
+	block *refs = (block*)malloc(count * sizeof(block));
+	if (refs == NULL)
+		return 0;
+	src->gather(src, fetch, count, refs);
+	for (int j = 0; j < L; j++)
+		copy_blockS(&nBlockMTP[j * 2 + 1], &refs[slot[j]]);
+	free(refs);
+
+	// proofs of the current, previous and reference blocks
+	for (int j = 0; j < L; j++) {
+		TheTree.getProofInto(ij_index[j], nProofMTP + (j * 3 + 0) * MERKLE_TREE_PROOF_SIZE_B);
+		TheTree.getProofInto(prev_index[j], nProofMTP + (j * 3 + 1) * MERKLE_TREE_PROOF_SIZE_B);
+		TheTree.getProofInto(ref_index[j], nProofMTP + (j * 3 + 2) * MERKLE_TREE_PROOF_SIZE_B);
+	}
 
-	return 0;
-}
+	for (int i = 0; i<32; i++)
+		mtpHashValue[i] = (((unsigned char*)(&Y[L]))[i]);
 
+	return 1;
+}
 
-int mtptcr_solver(int thr_id, uint32_t TheNonce, argon2_instance_t *instance,
+int mtp_solver(int thr_id, uint32_t TheNonce, argon2_instance_t *instance,
 	blockS *nBlockMTP /*[72 * 2][128]*/, unsigned char* nProofMTP, unsigned char* resultMerkleRoot, unsigned char* mtpHashValue,
-	MerkleTree TheTree, uint32_t* input, uint256 hashTarget,cudaStream_t s0 ) {
-
-	static const uint8_t L = 16;
-
-	if (instance != NULL) {
-		//		input[19]=0x01000000;
-		uint256 Y[L + 1];
-		//		std::string proof_blocks[L * 3];
-		memset(&Y, 0, sizeof(Y));
-		uint8_t zero[32] = { 0 };
-		ablake2b_state BlakeHash;
-		ablake2b_init(&BlakeHash, 32);
-
-
+	const MerkleTree& TheTree, uint32_t* input, uint256 hashTarget, cudaStream_t s0) {
 
-
-		ablake2b_update(&BlakeHash, (unsigned char*)&input[0], 80);
-		ablake2b_update(&BlakeHash, (unsigned char*)&resultMerkleRoot[0], 16);
-		ablake2b_update(&BlakeHash, &TheNonce, sizeof(unsigned int));
-		ablake2b_final(&BlakeHash, (unsigned char*)&Y[0], 32);
-
-
-
-		blockS blocks[L * 2];
-
-		///////////////////////////////
-		bool init_blocks = false;
-		bool unmatch_block = false;
-		unsigned char proof_ser[1000] = { 0 };
-		unsigned int proof_size;
-		for (uint8_t j = 1; j <= L; j++) {
-
-			uint32_t ij = (((uint32_t*)(&Y[j - 1]))[0]) % (instance->context_ptr->m_cost);
-			uint32_t except_index = (uint32_t)(instance->context_ptr->m_cost / instance->context_ptr->lanes);
-			if (ij %except_index == 0 || ij%except_index == 1) {
-				init_blocks = true;
-				break;
-			}
-
-			uint32_t prev_index;
-			uint32_t ref_index;
-			getblockindex_test(thr_id, ij, instance, &prev_index, &ref_index,s0);
-
-			//			copy_blockS(&nBlockMTP[j * 2 - 2], &instance->memory[prev_index]);
-			get_block_test(thr_id, /*(uint8_t*)*/nBlockMTP[j * 2 - 2].v, prev_index,s0);
-			//ref block
-			//			copy_blockS(&nBlockMTP[j * 2 - 1], &instance->memory[ref_index]);
-			get_block_test(thr_id, /*(uint8_t*)*/nBlockMTP[j * 2 - 1].v, ref_index,s0);
-			block blockhash;
-			uint8_t blockhash_bytes[ARGON2_BLOCK_SIZE];
-			//			copy_block(&blockhash, &instance->memory[ij]);
-			get_block_test(thr_id, /*(uint8_t*)*/&blockhash.v, ij,s0);
+	mtp_block_source src = mtp_gpu_blocks(thr_id, s0);
+	return mtp_solver_blocks(&src, 64, TheNonce, instance, nBlockMTP, nProofMTP,
+		resultMerkleRoot, mtpHashValue, TheTree, input, hashTarget);
+}
 
 
-			store_block(&blockhash_bytes, &blockhash);
+int mtptcr_solver(int thr_id, uint32_t TheNonce, argon2_instance_t *instance,
+	blockS *nBlockMTP /*[72 * 2][128]*/, unsigned char* nProofMTP, unsigned char* resultMerkleRoot, unsigned char* mtpHashValue,
+	const MerkleTree& TheTree, uint32_t* input, uint256 hashTarget,cudaStream_t s0 ) {
 
-			ablake2b_state BlakeHash2;
-			ablake2b_init(&BlakeHash2, 32);
-			ablake2b_update(&BlakeHash2, &Y[j - 1], sizeof(uint256));
-			ablake2b_update(&BlakeHash2, blockhash_bytes, ARGON2_BLOCK_SIZE);
-			ablake2b_final(&BlakeHash2, (unsigned char*)&Y[j], 32);
-			////////////////////////////////////////////////////////////////
-			// current block
-			clear_internal_memory(blockhash.v, ARGON2_BLOCK_SIZE);
-			clear_internal_memory(blockhash_bytes, ARGON2_BLOCK_SIZE);
+	mtp_block_source src = mtp_gpu_blocks(thr_id, s0);
+	return mtp_solver_blocks(&src, 16, TheNonce, instance, nBlockMTP, nProofMTP,
+		resultMerkleRoot, mtpHashValue, TheTree, input, hashTarget);
+}
 
-			unsigned char curr[32] = { 0 };
-			block blockhash_curr;
-			uint8_t blockhash_curr_bytes[ARGON2_BLOCK_SIZE];
-			//			copy_block(&blockhash_curr, &instance->memory[ij]);
-			get_block_test(thr_id, /*(uint8_t*)*/&blockhash_curr.v, ij,s0);
-			store_block(&blockhash_curr_bytes, &blockhash_curr);
-			ablake2b_state state_curr;
-			ablake2b_init(&state_curr, MERKLE_TREE_ELEMENT_SIZE_B);
-			ablake2b4rounds_update(&state_curr, blockhash_curr_bytes, ARGON2_BLOCK_SIZE);
-			uint8_t digest_curr[MERKLE_TREE_ELEMENT_SIZE_B];
-			ablake2b4rounds_final(&state_curr, digest_curr, sizeof(digest_curr));
-			MerkleTree::Buffer hash_curr = MerkleTree::Buffer(digest_curr, digest_curr + sizeof(digest_curr));
-			clear_internal_memory(blockhash_curr.v, ARGON2_BLOCK_SIZE);
-			clear_internal_memory(blockhash_curr_bytes, ARGON2_BLOCK_SIZE);
-
-
-			std::deque<std::vector<uint8_t>> zProofMTP = TheTree.getProofOrdered(hash_curr, ij + 1);
-
-			nProofMTP[(j * 3 - 3) * 353] = (unsigned char)(zProofMTP.size());
-
-			int k1 = 0;
-			for (const std::vector<uint8_t> &mtpData : zProofMTP) {
-				std::copy(mtpData.begin(), mtpData.end(), nProofMTP + ((j * 3 - 3) * 353 + 1 + k1 * mtpData.size()));
-				k1++;
-			}
 
-			//prev proof
-			unsigned char prev[32] = { 0 };
-			block blockhash_prev;
-			uint8_t blockhash_prev_bytes[ARGON2_BLOCK_SIZE];
-			//			copy_block(&blockhash_prev, &instance->memory[prev_index]);
-			get_block_test(thr_id, /*(uint8_t*)*/&blockhash_prev.v, prev_index,s0);
-			store_block(&blockhash_prev_bytes, &blockhash_prev);
-			ablake2b_state state_prev;
-			ablake2b_init(&state_prev, MERKLE_TREE_ELEMENT_SIZE_B);
-			ablake2b4rounds_update(&state_prev, blockhash_prev_bytes, ARGON2_BLOCK_SIZE);
-			uint8_t digest_prev[MERKLE_TREE_ELEMENT_SIZE_B];
 
+/* share verification on the cpu */
 
-			ablake2b4rounds_final(&state_prev, digest_prev, sizeof(digest_prev));
+/* The 3*L proofs of a share climb to the same root: once a node of the upper
+   layers is checked, the next proofs through it stop there and only compare
+   their remaining siblings with the ones already hashed. */
+#define MTP_NODE_CACHE_BITS 12
+#define MTP_NODE_CACHE_LAYER 8
 
+typedef struct mtp_node_cache_ {
+	uint32_t key[1 << MTP_NODE_CACHE_BITS];
+	uint8_t node[1 << MTP_NODE_CACHE_BITS][MERKLE_TREE_ELEMENT_SIZE_B];
+	const unsigned char *path[1 << MTP_NODE_CACHE_BITS]; // siblings from the node to the root
+} mtp_node_cache;
 
-			MerkleTree::Buffer hash_prev = MerkleTree::Buffer(digest_prev, digest_prev + sizeof(digest_prev));
-			clear_internal_memory(blockhash_prev.v, ARGON2_BLOCK_SIZE);
-			clear_internal_memory(blockhash_prev_bytes, ARGON2_BLOCK_SIZE);
+/* slot of a node, or the free slot to insert it */
+static uint32_t mtp_node_slot(const mtp_node_cache *cache, uint32_t key)
+{
+	const uint32_t mask = (1 << MTP_NODE_CACHE_BITS) - 1;
+	uint32_t slot = (key * 0x9E3779B1U) >> (32 - MTP_NODE_CACHE_BITS);
+	while (cache->key[slot] && cache->key[slot] != key)
+		slot = (slot + 1) & mask;
+	return slot;
+}
 
-			std::deque<std::vector<uint8_t>> zProofMTP2 = TheTree.getProofOrdered(hash_prev, prev_index + 1);
+/* per call state of the verifier */
+typedef struct mtp_verify_scratch_ {
+	mtp_node_cache cache;
+	blockS X_IJ[MTP_L_MAX];
+	uint32_t index[MTP_L_MAX * 3];
+	const void *leaf_block[MTP_L_MAX * 3];
+	uint8_t node[MTP_L_MAX * 3][MERKLE_TREE_ELEMENT_SIZE_B];
+	uint8_t pair[MTP_L_MAX * 3][2 * MERKLE_TREE_ELEMENT_SIZE_B];
+	int active[MTP_L_MAX * 3];
+} mtp_verify_scratch;
+
+/* Climbs the n proofs from their leaves in node[], one layer at a time so
+   that the pairs of all the proofs still going are hashed together. */
+static bool mtp_check_proofs(mtp_verify_scratch *scratch, const unsigned char *root, int n,
+	const unsigned char *proofs)
+{
+	mtp_node_cache *cache = &scratch->cache;
+	int count = 0;
 
-			nProofMTP[(j * 3 - 2) * 353] = (unsigned char)(zProofMTP2.size());
+	for (int i = 0; i < n; i++) {
+		if (proofs[i * MERKLE_TREE_PROOF_SIZE_B] != MERKLE_TREE_LAYER_COUNT - 1)
+			return false;
+		scratch->active[count++] = i;
+	}
 
-			int k2 = 0;
-			for (const std::vector<uint8_t> &mtpData : zProofMTP2) {
-				std::copy(mtpData.begin(), mtpData.end(), nProofMTP + ((j * 3 - 2) * 353 + 1 + k2 * mtpData.size()));
-				k2++;
+	for (uint32_t layer = 0; layer < MERKLE_TREE_LAYER_COUNT - 1; layer++) {
+		int going = 0;
+		for (int a = 0; a < count; a++) {
+			const int i = scratch->active[a];
+			const uint32_t index = scratch->index[i] >> layer;
+			const uint8_t *node = scratch->node[i];
+			const unsigned char *sibling = proofs + i * MERKLE_TREE_PROOF_SIZE_B + 1 + layer * MERKLE_TREE_ELEMENT_SIZE_B;
+			if (layer >= MTP_NODE_CACHE_LAYER) {
+				// at most 3 * MTP_L_MAX * (22 - 8) keys, the table never fills up
+				const uint32_t key = (layer << 24) | index;
+				const uint32_t slot = mtp_node_slot(cache, key);
+				if (cache->key[slot]) {
+					if (memcmp(cache->node[slot], node, MERKLE_TREE_ELEMENT_SIZE_B) ||
+						memcmp(cache->path[slot], sibling, (MERKLE_TREE_LAYER_COUNT - 1 - layer) * MERKLE_TREE_ELEMENT_SIZE_B))
+						return false;
+					continue;
+				}
+				cache->key[slot] = key;
+				cache->path[slot] = sibling;
+				memcpy(cache->node[slot], node, MERKLE_TREE_ELEMENT_SIZE_B);
 			}
+			uint8_t *pair = scratch->pair[going];
+			memcpy(pair + ((index & 1) ? MERKLE_TREE_ELEMENT_SIZE_B : 0), node, MERKLE_TREE_ELEMENT_SIZE_B);
+			memcpy(pair + ((index & 1) ? 0 : MERKLE_TREE_ELEMENT_SIZE_B), sibling, MERKLE_TREE_ELEMENT_SIZE_B);
+			scratch->active[going++] = i;
+		}
+		count = going;
+		// the parents land packed at the start of pair[], then go back to their proofs
+		blake2b4r_32to16_n(scratch->pair, scratch->pair, count);
+		for (int a = 0; a < count; a++)
+			memcpy(scratch->node[scratch->active[a]], scratch->pair[0] + a * MERKLE_TREE_ELEMENT_SIZE_B, MERKLE_TREE_ELEMENT_SIZE_B);
+	}
 
+	for (int a = 0; a < count; a++)
+		if (memcmp(scratch->node[scratch->active[a]], root, MERKLE_TREE_ELEMENT_SIZE_B))
+			return false;
+	return true;
+}
 
-			//ref proof
-			unsigned char ref[32] = { 0 };
-			block blockhash_ref;
-			uint8_t blockhash_ref_bytes[ARGON2_BLOCK_SIZE];
-			//			copy_block(&blockhash_ref, &instance->memory[ref_index]);
-			get_block_test(thr_id, /*(uint8_t*)*/&blockhash_ref.v, ref_index,s0);
-			store_block(&blockhash_ref_bytes, &blockhash_ref);
-			ablake2b_state state_ref;
-			ablake2b_init(&state_ref, MERKLE_TREE_ELEMENT_SIZE_B);
-			ablake2b4rounds_update(&state_ref, blockhash_ref_bytes, ARGON2_BLOCK_SIZE);
-			uint8_t digest_ref[MERKLE_TREE_ELEMENT_SIZE_B];
-			ablake2b4rounds_final(&state_ref, digest_ref, sizeof(digest_ref));
-			MerkleTree::Buffer hash_ref = MerkleTree::Buffer(digest_ref, digest_ref + sizeof(digest_ref));
-			clear_internal_memory(blockhash_ref.v, ARGON2_BLOCK_SIZE);
-			clear_internal_memory(blockhash_ref_bytes, ARGON2_BLOCK_SIZE);
-
-			std::deque<std::vector<uint8_t>> zProofMTP3 = TheTree.getProofOrdered(hash_ref, ref_index + 1);
-
-			nProofMTP[(j * 3 - 1) * 353] = (unsigned char)(zProofMTP3.size());
-
-			int k3 = 0;
-			for (const std::vector<uint8_t> &mtpData : zProofMTP3) {
-				std::copy(mtpData.begin(), mtpData.end(), nProofMTP + ((j * 3 - 1) * 353 + 1 + k3 * mtpData.size()));
-				k3++;
-			}
-
+bool mtp_verify_share(uint8_t L, uint32_t TheNonce, const argon2_instance_t *instance,
+	const blockS *nBlockMTP, const unsigned char* nProofMTP, const unsigned char* resultMerkleRoot,
+	const unsigned char* mtpHashValue, const uint32_t* input, uint256 hashTarget) {
 
-			/////////////////////////////////////////////////////////////////////
-			/////////////////////////////////////////////////////////////////////
-		}
+	if (instance == NULL || L > MTP_L_MAX)
+		return false;
 
-		if (init_blocks) {
+	mtp_verify_scratch *scratch = (mtp_verify_scratch*)calloc(1, sizeof(mtp_verify_scratch));
+	if (scratch == NULL)
+		return false;
 
-			return 0;
-		}
+	uint256 Y[MTP_L_MAX + 1];
+	ablake2b_state BlakeHash;
+	ablake2b_init(&BlakeHash, 32);
+	ablake2b_update(&BlakeHash, (const unsigned char*)&input[0], 80);
+	ablake2b_update(&BlakeHash, &resultMerkleRoot[0], 16);
+	ablake2b_update(&BlakeHash, &TheNonce, sizeof(unsigned int));
+	ablake2b_final(&BlakeHash, (unsigned char*)&Y[0], 32);
 
+	const uint32_t except_index = (uint32_t)(instance->context_ptr->m_cost / instance->context_ptr->lanes);
+	bool valid = true;
 
-		char hex_tmp[64];
+	// the chain first: each X[ij] is rebuilt from its previous and reference blocks
+	for (uint8_t j = 1; j <= L; j++) {
 
-		if (Y[L] > hashTarget) {
-			// Found a solution
-			printf("False positive. Nonce=%08x Hash:", TheNonce);
-			for (int n = 0; n < 32; n++) {
-				printf("%02x", ((unsigned char*)&Y[0])[n]);
-			}
-			printf("\n");
+		uint32_t ij = (((uint32_t*)(&Y[j - 1]))[0]) % (instance->context_ptr->m_cost);
+		if (ij %except_index == 0 || ij%except_index == 1) {
+			valid = false;
+			break;
 		}
-		else {
-			for (int i = 0; i<32; i++)
-				mtpHashValue[i] = (((unsigned char*)(&Y[L]))[i]);
-
-			// Found a solution
-			/*
-			printf("Found a solution. Nonce=%08x Hash:", TheNonce);
-			for (int n = 0; n < 32; n++) {
-			printf("%02x", ((unsigned char*)&Y[L])[n]);
-			}
-			printf("\n");
-			*/
-			return 1;
 
+		const blockS *prev_block = &nBlockMTP[j * 2 - 2];
+		const blockS *ref_block = &nBlockMTP[j * 2 - 1];
+		uint32_t ref_index = mtp_ref_index(ij, instance, prev_block->v[0]);
+		blockS *X_IJ = &scratch->X_IJ[j - 1];
+		// block ij rebuilt from its previous and reference blocks, as the gpu fills it
+		fill_block_mtp((const block*)prev_block, (const block*)ref_block, (block*)X_IJ,
+			instance->block_header, ref_index);
+
+		scratch->index[j * 3 - 3] = ij;
+		scratch->index[j * 3 - 2] = mtp_prev_index(ij, instance);
+		scratch->index[j * 3 - 1] = ref_index;
+		scratch->leaf_block[j * 3 - 3] = X_IJ->v;
+		scratch->leaf_block[j * 3 - 2] = prev_block->v;
+		scratch->leaf_block[j * 3 - 1] = ref_block->v;
+
+		blake2b_1056to32(&Y[j], &Y[j - 1], X_IJ->v);
+	}
 
-		}
+	valid = valid && !memcmp(&Y[L], mtpHashValue, 32) && !(Y[L] > hashTarget);
 
+	// then the 3*L leaves, hashed several at a time, and their proofs
+	if (valid) {
+		blake2b4r_1024to16_n(scratch->node, scratch->leaf_block, L * 3);
+		valid = mtp_check_proofs(scratch, resultMerkleRoot, L * 3, nProofMTP);
 	}
 
+	free(scratch);
 
-	return 0;
+	return valid;
 }
 
 
@@ -35,6 +35,10 @@ const unsigned int MTP_PROOF_SIZE = 1471;// 1431;
 const unsigned int MTP_BLOCK_PROOF_SIZE = 64;
 /* Size of MTP block */
 const unsigned int MTP_BLOCK_SIZE = 140;
+/* Max number of rounds of the solver */
+const unsigned int MTP_L_MAX = 64;
+/* Max number of blocks of one gpu gather */
+const int MTP_GATHER_MAX = 64;
 
 typedef struct block_with_offset_ {
 	block memory;
@@ -60,28 +64,57 @@ void getblockindex_orig(uint32_t ij, argon2_instance_t *instance, uint32_t *out_
 void getblockindex(int thr_id, uint32_t ij, argon2_instance_t *instance, uint32_t *out_ij_prev, uint32_t *out_computed_ref_block);
 
 void getblockindex_test(int thr_id, uint32_t ij, argon2_instance_t *instance, uint32_t *out_ij_prev, uint32_t *out_computed_ref_block,cudaStream_t s0);
+/* Where the solver reads the Argon2 blocks from: the gpu memory of a miner
+   thread, or a host copy (unit tests and benchmarks without a gpu). gather()
+   copies the blocks index[0..count-1] to out[] in one batched transfer. */
+typedef struct mtp_block_source_ {
+	void (*gather)(const struct mtp_block_source_ *src, const uint32_t *index, int count, block *out);
+	int thr_id;
+	cudaStream_t stream;
+	const block *memory;
+} mtp_block_source;
+
+mtp_block_source mtp_gpu_blocks(int thr_id, cudaStream_t s0);
+mtp_block_source mtp_host_blocks(const block *memory);
+
+/* Fills the whole argon2 memory of an instance (from argon2_ctx_from_mtp) on
+   the cpu, as the gpu does, with up to `threads` lanes at once. The result is
+   released with free(), NULL if it could not be allocated. */
+block* mtp_cpu_memory(const argon2_instance_t *instance, uint32_t threads);
+
+int mtp_solver_blocks(const mtp_block_source *src, uint8_t L, uint32_t TheNonce, argon2_instance_t *instance,
+	blockS *nBlockMTP /*[72 * 2][128]*/, unsigned char *nProofMTP, unsigned char* resultMerkleRoot, unsigned char* mtpHashValue,
+	const MerkleTree& TheTree, uint32_t* input, uint256 hashTarget);
+
+/* Checks a share on the cpu before it is submitted: recomputes Y[0..L] and
+   the L blocks ij from their previous and reference blocks, and checks the
+   3*L proofs against the merkle root. */
+bool mtp_verify_share(uint8_t L, uint32_t TheNonce, const argon2_instance_t *instance,
+	const blockS *nBlockMTP, const unsigned char* nProofMTP, const unsigned char* resultMerkleRoot,
+	const unsigned char* mtpHashValue, const uint32_t* input, uint256 hashTarget);
+
 //int mtp_solver_withblock(uint32_t TheNonce, argon2_instance_t *instance, unsigned int d, block_mtpProof *output,
-// uint8_t *resultMerkleRoot, MerkleTree TheTree,uint32_t* input, uint256 hashTarget);
+// uint8_t *resultMerkleRoot, const MerkleTree& TheTree,uint32_t* input, uint256 hashTarget);
 
 int mtp_solver_orig(uint32_t TheNonce, argon2_instance_t *instance,
 	blockS *nBlockMTP /*[72 * 2][128]*/, unsigned char *nProofMTP, unsigned char* resultMerkleRoot, unsigned char* mtpHashValue,
-	MerkleTree TheTree, uint32_t* input, uint256 hashTarget);
+	const MerkleTree& TheTree, uint32_t* input, uint256 hashTarget);
 
 int mtp_solver(int thr_id, uint32_t TheNonce, argon2_instance_t *instance,
 	blockS *nBlockMTP /*[72 * 2][128]*/, unsigned char *nProofMTP, unsigned char* resultMerkleRoot, unsigned char* mtpHashValue,
-	MerkleTree TheTree, uint32_t* input, uint256 hashTarget,cudaStream_t s0);
+	const MerkleTree& TheTree, uint32_t* input, uint256 hashTarget,cudaStream_t s0);
 
 //int mtp_solver_test(int thr_id, uint32_t TheNonce, argon2_instance_t *instance,
 //	blockS *nBlockMTP /*[72 * 2][128]*/, unsigned char *nProofMTP, unsigned char* resultMerkleRoot, unsigned char* mtpHashValue,
-//	MerkleTree TheTree, uint32_t* input, uint256 hashTarget);
+//	const MerkleTree& TheTree, uint32_t* input, uint256 hashTarget);
 
 int mtptcr_solver_old(int thr_id, uint32_t TheNonce, argon2_instance_t *instance,
 	blockS *nBlockMTP /*[72 * 2][128]*/, unsigned char* nProofMTP, unsigned char* resultMerkleRoot, unsigned char* mtpHashValue,
-	MerkleTree TheTree, uint32_t* input, uint256 hashTarget);
+	const MerkleTree& TheTree, uint32_t* input, uint256 hashTarget);
 
 int mtptcr_solver(int thr_id, uint32_t TheNonce, argon2_instance_t *instance,
 	blockS *nBlockMTP /*[72 * 2][128]*/, unsigned char* nProofMTP, unsigned char* resultMerkleRoot, unsigned char* mtpHashValue,
-	MerkleTree TheTree, uint32_t* input, uint256 hashTarget,cudaStream_t s0);
+	const MerkleTree& TheTree, uint32_t* input, uint256 hashTarget,cudaStream_t s0);
 
 
 MerkleTree::Elements mtp_init(argon2_instance_t *instance);
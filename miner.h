@@ -272,6 +272,8 @@ static inline void le16enc(void *pp, uint16_t x)
 void *aligned_calloc(int size);
 void aligned_free(void *ptr);
 
+#include "scratch.h"
+
 #if JANSSON_MAJOR_VERSION >= 2
 #define JSON_LOADS(str, err_ptr) json_loads((str), 0, (err_ptr))
 #define JSON_LOADF(str, err_ptr) json_load_file((str), 0, (err_ptr))
@@ -287,6 +289,9 @@ json_t * json_load_url(char* cfg_url, json_error_t *err);
 void sha256_init(uint32_t *state);
 void sha256_transform(uint32_t *state, const uint32_t *block, int swap);
 void sha256d(unsigned char *hash, const unsigned char *data, int len);
+void sha256d_64x4(unsigned char *hash, const unsigned char *data);
+void sha256d_midstate(unsigned char *hash, const uint32_t *midstate,
+	const unsigned char *data, int len, int total);
 
 #define HAVE_SHA256_4WAY 0
 #define HAVE_SHA256_8WAY 0
@@ -421,6 +426,11 @@ struct cgpu_info {
 	char gpu_desc[64];
 	double intensity;
 	uint32_t throughput;
+
+	// time spent without hashing on job changes (mtp)
+	uint32_t job_switches;
+	uint32_t job_switch_ms;
+	uint64_t job_switch_ms_total;
 };
 
 struct thr_api {
@@ -517,14 +527,20 @@ extern struct thr_info *thr_info;
 extern int longpoll_thr_id;
 extern int stratum_thr_id;
 extern int api_thr_id;
+extern int submit_thr_id;
 extern volatile bool abort_flag;
 extern struct work_restart *work_restart;
 extern bool opt_trust_pool;
 extern uint16_t opt_vote;
+extern bool opt_cpu_mining;
+extern int opt_cpu_threads;
+extern int64_t opt_affinity;
+extern int num_cpus;
 
 extern uint64_t global_hashrate;
 extern uint64_t net_hashrate;
 extern double net_diff;
+extern double gbt_decode_ms;
 extern double stratum_diff;
 
 #define MAX_GPUS 16
@@ -625,6 +641,7 @@ void bench_free();
 bool bench_algo_switch_next(int thr_id);
 void bench_set_throughput(int thr_id, uint32_t throughput);
 void bench_display_results();
+bool cpu_bench(const char *name);
 
 struct stratum_job {
 	char *job_id;
@@ -645,6 +662,11 @@ struct stratum_job {
 	uint32_t height;
 	double diff;
 
+	// sha256 state of the coinbase blocks before xnonce2, see stratum_coinbase_hash() in util.cpp
+	uint32_t coinbase_midstate[8];
+	uint32_t coinbase_midsize;
+	bool midstate_valid;
+
 	unsigned char m7prevblock[32];
 	unsigned char m7accroot[32];
 	unsigned char m7merkleroot[32];
@@ -661,13 +683,15 @@ struct stratum_ctx {
 	char curl_err_str[CURL_ERROR_SIZE];
 	curl_socket_t sock;
 	size_t sockbuf_size;
-	size_t sockbuf_bossize; // redundant
-	size_t sum_bossize;
+	size_t sockbuf_head; // first unread byte
+	size_t sockbuf_tail; // end of the received bytes
+	size_t sockbuf_scan; // no newline before it (text lines)
 	char *sockbuf;
 
 	double next_diff;
 	double sharediff;
-	uchar* next_target;
+	uchar next_target[32];
+	uint32_t target_gen; // bumped by each mining.set_target
 	char *session_id;
 	size_t xnonce1_size;
 	unsigned char *xnonce1;
@@ -830,13 +854,36 @@ bool stratum_handle_method(struct stratum_ctx *sctx, const char *s);
 bool stratum_handle_method_bos(struct stratum_ctx *sctx, const char *s);
 bool stratum_handle_method_m7(struct stratum_ctx *sctx, const char *s);
 void stratum_free_job(struct stratum_ctx *sctx);
+void stratum_coinbase_hash(struct stratum_job *job, uchar *hash);
+void merkle_tree_root(uchar (*tree)[32], int count);
+int merkle_tree_branch(uchar (*branch)[32], uchar (*tree)[32], int count);
 bool stratum_handle_method_bos_json(struct stratum_ctx *sctx, json_t *val);
+bool stratum_handle_notify_bos(struct stratum_ctx *sctx, const char *frame);
 
 json_t *stratum_recv_line_bos(struct stratum_ctx *sctx);
 bool stratum_recv_line_compact(struct stratum_ctx *sctx);
 
-void stratum_bos_fillbuffer(struct stratum_ctx *sctx);
-void stratum_bos_resizebuffer(struct stratum_ctx *sctx);
+/* reusable output of the direct share encoders (no json_t tree) */
+struct submit_buf {
+	uchar *data;
+	size_t size;
+	size_t alloc;
+};
+bool submit_buf_reserve(struct submit_buf *buf, size_t len);
+void submit_buf_free(struct submit_buf *buf);
+/* mining.submit bos frame with request id, ready for stratum_send_line_bos */
+bool mtp_submit_bos(struct submit_buf *buf, uint32_t id, const char *user, const uchar *job_id, const uchar *xnonce2,
+	uint32_t ntime, uint32_t nonce, const struct mtp *mtp, uint32_t mtp_l);
+/* submitblock request (zero terminated), data is the 84 bytes header already encoded */
+bool mtp_submit_gbt(struct submit_buf *buf, const uint32_t *data, const struct mtp *mtp, uint32_t mtp_l,
+	const char *txs, const char *params);
+
+/* next complete bos message in the receive buffer, waits up to timeout for it */
+const char* stratum_recv_bos(struct stratum_ctx *sctx, int timeout);
+void stratum_consume_bos(struct stratum_ctx *sctx, const char *frame);
+/* interrupts the stratum thread wait on its socket */
+void stratum_wakeup();
+bool stratum_capture_open(const char *filename);
 json_t* recode_message(json_t *MyObject2);
 void hashlog_remember_submit(struct work* work, uint32_t nonce);
 void hashlog_remember_scan_range(struct work* work);
@@ -852,21 +899,42 @@ void hashlog_getmeminfo(uint64_t *mem, uint32_t *records);
 
 void stats_remember_speed(int thr_id, uint32_t hashcount, double hashrate, uint8_t found, uint32_t height);
 double stats_get_speed(int thr_id, double def_speed);
+double stats_get_ewma(int thr_id, double def_speed);
 double stats_get_gpu_speed(int gpu_id);
 int  stats_get_history(int thr_id, struct stats_data *data, int max_records);
 void stats_purge_old(void);
 void stats_purge_all(void);
 void stats_getmeminfo(uint64_t *mem, uint32_t *records);
 
+bool verify_batch(int algo, const uint32_t *header, const uint32_t *nonces, int n, uint32_t *out_hashes);
+
+int scanhash_cpu(int thr_id, struct work *work, uint32_t max_nonce, unsigned long *hashes_done);
+void affine_to_cpu_mask(int id, unsigned long mask);
+void affine_to_cpu(int cpu);
+
+void mtp_arena_getmeminfo(uint64_t *mem, uint32_t *chunks, uint32_t *used, uint32_t *huge);
+
 struct thread_q;
 
 extern struct thread_q *tq_new(void);
 extern void tq_free(struct thread_q *tq);
 extern bool tq_push(struct thread_q *tq, void *data);
+extern bool tq_push_nowait(struct thread_q *tq, void *data);
 extern void *tq_pop(struct thread_q *tq, const struct timespec *abstime);
+extern int tq_pop_batch(struct thread_q *tq, void **data, int max, const struct timespec *abstime);
 extern void tq_freeze(struct thread_q *tq);
 extern void tq_thaw(struct thread_q *tq);
 
+struct tq_stats {
+	uint32_t depth;
+	uint32_t max_depth;
+	uint32_t size;
+	uint64_t pushed;
+	uint64_t popped;
+	uint64_t wait_us; /* time spent in the queue by the popped entries */
+};
+extern void tq_getstats(struct thread_q *tq, struct tq_stats *stats);
+
 #define EXIT_CODE_OK            0
 #define EXIT_CODE_USAGE         1
 #define EXIT_CODE_POOL_TIMEOUT  2
@@ -875,6 +943,7 @@ extern void tq_thaw(struct thread_q *tq);
 #define EXIT_CODE_CUDA_ERROR    5
 #define EXIT_CODE_TIME_LIMIT    0
 #define EXIT_CODE_KILLED        7
+#define EXIT_CODE_CPU_BENCH     8 /* a --cpu-bench check failed */
 
 void parse_arg(int key, char *arg);
 void proper_exit(int reason);
@@ -906,6 +975,8 @@ void lbry_hash(void *output, const void *input);
 void lyra2re_hash(void *state, const void *input);
 void lyra2v2_hash(void *state, const void *input);
 void lyra2Z_hash(void *state, const void *input);
+void lyra2v2_hash_x4(void *state, const void *input);
+void lyra2Z_hash_x4(void *state, const void *input);
 void myriadhash(void *state, const void *input);
 void neoscrypt(uchar *output, const uchar *input, uint32_t profile);
 void nist5hash(void *state, const void *input);
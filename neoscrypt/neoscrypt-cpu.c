@@ -33,6 +33,7 @@
 #include <string.h>
 
 #include "neoscrypt.h"
+#include "scratch.h"
 
 #ifdef WIN32
 /* sizeof(unsigned long) = 4 for MinGW64 */
@@ -696,7 +697,7 @@ static void neoscrypt_fastkdf(const uchar *password, uint password_len, const uc
 	uint bufptr, a, b, i, j;
 	uchar *A, *B, *prf_input, *prf_key, *prf_output;
 	uchar *stack;
-	stack = (uchar*)malloc(sizeof(uchar) * 2 * kdf_buf_size + prf_input_size + prf_key_size + prf_output_size + stack_align);
+	stack = (uchar*) cpu_scratch(SCRATCH_NEOSCRYPT_KDF, 2 * kdf_buf_size + prf_input_size + prf_key_size + prf_output_size + stack_align);
 	/* Align and set up the buffers in stack */
 	//uchar stack[2 * kdf_buf_size + prf_input_size + prf_key_size + prf_output_size + stack_align];
 
@@ -896,7 +897,7 @@ void neoscrypt(unsigned char *output, const unsigned char *input, unsigned int p
 		r = (1 << ((profile >> 5) & 0x7));
 	}
 	uchar *stack;
-	stack = (uchar*)malloc(((N + 3) * r * 2 * SCRYPT_BLOCK_SIZE + stack_align)*sizeof(uchar));
+	stack = (uchar*) cpu_scratch(SCRATCH_NEOSCRYPT, (N + 3) * r * 2 * SCRYPT_BLOCK_SIZE + stack_align);
 	/* X = r * 2 * SCRYPT_BLOCK_SIZE */
 	X = (uint *) &stack[stack_align & ~(stack_align - 1)];
 	/* Z is a copy of X for ChaCha */
@@ -307,6 +307,7 @@ bool pool_switch(int thr_id, int pooln)
 		opt_algo = (enum sha_algos) p->algo;
 	}
 	stratum_need_reset = true;
+	stratum_wakeup();
 	if (prevn != cur_pooln) {
 
 //		pool_switch_count++;
@@ -428,6 +429,7 @@ bool pool_switch_dn(int thr_id, int pooln)
 		opt_algo = (enum sha_algos) p->algo;
 	}
 	stratum_need_reset = true;
+	stratum_wakeup();
 	if (prevn != cur_pooln) {
 
 //		pool_switch_count++;
@@ -2,13 +2,7 @@
  * qubit algorithm
  *
  */
-extern "C" {
-#include "sph/sph_luffa.h"
-#include "sph/sph_cubehash.h"
-#include "sph/sph_shavite.h"
-#include "sph/sph_simd.h"
-#include "sph/sph_echo.h"
-}
+#include "sph/sph_chain.h"
 
 #include "miner.h"
 
@@ -23,37 +17,9 @@ extern void qubit_luffa512_cpu_hash_80(int thr_id, uint32_t threads, uint32_t st
 
 extern "C" void qubithash(void *state, const void *input)
 {
-	uint8_t _ALIGN(128) hash[64];
-
 	// luffa1-cubehash2-shavite3-simd4-echo5
-
-	sph_luffa512_context ctx_luffa;
-	sph_cubehash512_context ctx_cubehash;
-	sph_shavite512_context ctx_shavite;
-	sph_simd512_context ctx_simd;
-	sph_echo512_context ctx_echo;
-
-	sph_luffa512_init(&ctx_luffa);
-	sph_luffa512 (&ctx_luffa, input, 80);
-	sph_luffa512_close(&ctx_luffa, (void*) hash);
-
-	sph_cubehash512_init(&ctx_cubehash);
-	sph_cubehash512 (&ctx_cubehash, (const void*) hash, 64);
-	sph_cubehash512_close(&ctx_cubehash, (void*) hash);
-
-	sph_shavite512_init(&ctx_shavite);
-	sph_shavite512 (&ctx_shavite, (const void*) hash, 64);
-	sph_shavite512_close(&ctx_shavite, (void*) hash);
-
-	sph_simd512_init(&ctx_simd);
-	sph_simd512 (&ctx_simd, (const void*) hash, 64);
-	sph_simd512_close(&ctx_simd, (void*) hash);
-
-	sph_echo512_init(&ctx_echo);
-	sph_echo512 (&ctx_echo, (const void*) hash, 64);
-	sph_echo512_close(&ctx_echo, (void*) hash);
-
-	memcpy(state, hash, 32);
+	sph_chain<sph::luffa512, sph::cubehash512, sph::shavite512, sph::simd512,
+		sph::echo512>::hash(state, input);
 }
 
 static bool init[MAX_GPUS] = { 0 };
@@ -0,0 +1,30 @@
+#ifndef SCRATCH_H
+#define SCRATCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* per thread scratch buffers of the cpu hashes (util.cpp), kept from one hash to the next */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum cpu_scratch_id {
+	SCRATCH_LYRA2 = 0,
+	SCRATCH_LYRA2_ROWS,
+	SCRATCH_LYRA2_X4,
+	SCRATCH_NEOSCRYPT,
+	SCRATCH_NEOSCRYPT_KDF,
+	SCRATCH_COUNT
+};
+
+void *cpu_scratch(int id, size_t size);
+void cpu_scratch_free(void);
+void cpu_scratch_getmeminfo(uint64_t *mem, uint32_t *buffers);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
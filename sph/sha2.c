@@ -195,12 +195,17 @@ static void sha256d_80_swap(uint32_t *hash, const uint32_t *data)
 		hash[i] = swab32(hash[i]);
 }
 
-void sha256d(unsigned char *hash, const unsigned char *data, int len)
+/*
+ * Double SHA256 of a message whose first blocks are already compressed in
+ * midstate, data holds the remaining len bytes and total is the full size.
+ */
+void sha256d_midstate(unsigned char *hash, const uint32_t *midstate,
+	const unsigned char *data, int len, int total)
 {
 	uint32_t S[16], T[16];
 	int i, r;
 
-	sha256_init(S);
+	memcpy(S, midstate, 32);
 	for (r = len; r > -9; r -= 64) {
 		if (r < 64)
 			memset(T, 0, 64);
@@ -210,7 +215,7 @@ void sha256d(unsigned char *hash, const unsigned char *data, int len)
 		for (i = 0; i < 16; i++)
 			T[i] = be32dec(T + i);
 		if (r < 56)
-			T[15] = 8 * len;
+			T[15] = 8 * total;
 		sha256_transform(S, T, 0);
 	}
 	memcpy(S + 8, sha256d_hash1 + 8, 32);
@@ -220,6 +225,144 @@ void sha256d(unsigned char *hash, const unsigned char *data, int len)
 		be32enc((uint32_t *)hash + i, T[i]);
 }
 
+void sha256d(unsigned char *hash, const unsigned char *data, int len)
+{
+	sha256d_midstate(hash, sha256_h, data, len, len);
+}
+
+/* rounds of the 4 lanes, the state rotation is resolved at compile time */
+#define RNDr_4way(S, W, i) \
+	for (l = 0; l < 4; l++) \
+		RND(S[(64 - i) % 8][l], S[(65 - i) % 8][l], \
+		    S[(66 - i) % 8][l], S[(67 - i) % 8][l], \
+		    S[(68 - i) % 8][l], S[(69 - i) % 8][l], \
+		    S[(70 - i) % 8][l], S[(71 - i) % 8][l], \
+		    W[i][l] + sha256_k[i])
+
+/* 4 interleaved sha256 compressions, [word][lane] so the lanes vectorize */
+static void sha256_transform_4way(uint32_t state[8][4], const uint32_t block[16][4])
+{
+	uint32_t W[64][4], S[8][4];
+	uint32_t t0, t1;
+	int i, l;
+
+	memcpy(W, block, sizeof(W[0]) * 16);
+	for (i = 16; i < 64; i++)
+		for (l = 0; l < 4; l++)
+			W[i][l] = s1(W[i - 2][l]) + W[i - 7][l] + s0(W[i - 15][l]) + W[i - 16][l];
+
+	memcpy(S, state, sizeof(S));
+	RNDr_4way(S, W,  0);
+	RNDr_4way(S, W,  1);
+	RNDr_4way(S, W,  2);
+	RNDr_4way(S, W,  3);
+	RNDr_4way(S, W,  4);
+	RNDr_4way(S, W,  5);
+	RNDr_4way(S, W,  6);
+	RNDr_4way(S, W,  7);
+	RNDr_4way(S, W,  8);
+	RNDr_4way(S, W,  9);
+	RNDr_4way(S, W, 10);
+	RNDr_4way(S, W, 11);
+	RNDr_4way(S, W, 12);
+	RNDr_4way(S, W, 13);
+	RNDr_4way(S, W, 14);
+	RNDr_4way(S, W, 15);
+	RNDr_4way(S, W, 16);
+	RNDr_4way(S, W, 17);
+	RNDr_4way(S, W, 18);
+	RNDr_4way(S, W, 19);
+	RNDr_4way(S, W, 20);
+	RNDr_4way(S, W, 21);
+	RNDr_4way(S, W, 22);
+	RNDr_4way(S, W, 23);
+	RNDr_4way(S, W, 24);
+	RNDr_4way(S, W, 25);
+	RNDr_4way(S, W, 26);
+	RNDr_4way(S, W, 27);
+	RNDr_4way(S, W, 28);
+	RNDr_4way(S, W, 29);
+	RNDr_4way(S, W, 30);
+	RNDr_4way(S, W, 31);
+	RNDr_4way(S, W, 32);
+	RNDr_4way(S, W, 33);
+	RNDr_4way(S, W, 34);
+	RNDr_4way(S, W, 35);
+	RNDr_4way(S, W, 36);
+	RNDr_4way(S, W, 37);
+	RNDr_4way(S, W, 38);
+	RNDr_4way(S, W, 39);
+	RNDr_4way(S, W, 40);
+	RNDr_4way(S, W, 41);
+	RNDr_4way(S, W, 42);
+	RNDr_4way(S, W, 43);
+	RNDr_4way(S, W, 44);
+	RNDr_4way(S, W, 45);
+	RNDr_4way(S, W, 46);
+	RNDr_4way(S, W, 47);
+	RNDr_4way(S, W, 48);
+	RNDr_4way(S, W, 49);
+	RNDr_4way(S, W, 50);
+	RNDr_4way(S, W, 51);
+	RNDr_4way(S, W, 52);
+	RNDr_4way(S, W, 53);
+	RNDr_4way(S, W, 54);
+	RNDr_4way(S, W, 55);
+	RNDr_4way(S, W, 56);
+	RNDr_4way(S, W, 57);
+	RNDr_4way(S, W, 58);
+	RNDr_4way(S, W, 59);
+	RNDr_4way(S, W, 60);
+	RNDr_4way(S, W, 61);
+	RNDr_4way(S, W, 62);
+	RNDr_4way(S, W, 63);
+
+	for (i = 0; i < 8; i++)
+		for (l = 0; l < 4; l++)
+			state[i][l] += S[i][l];
+}
+
+static void sha256_init_4way(uint32_t state[8][4])
+{
+	int i, l;
+	for (i = 0; i < 8; i++)
+		for (l = 0; l < 4; l++)
+			state[i][l] = sha256_h[i];
+}
+
+/* four sha256d of 64 bytes messages (merkle nodes), same as sha256d(hash, data, 64) */
+void sha256d_64x4(unsigned char *hash, const unsigned char *data)
+{
+	uint32_t S[8][4], W[16][4];
+	int i, l;
+
+	sha256_init_4way(S);
+	for (i = 0; i < 16; i++)
+		for (l = 0; l < 4; l++)
+			W[i][l] = be32dec(data + 64 * l + 4 * i);
+	sha256_transform_4way(S, W);
+
+	// padding block of a 512 bits message
+	memset(W, 0, sizeof(W));
+	for (l = 0; l < 4; l++) {
+		W[0][l] = 0x80000000;
+		W[15][l] = 0x00000200;
+	}
+	sha256_transform_4way(S, W);
+
+	// second hash of the 32 bytes digest
+	memcpy(W, S, sizeof(S));
+	for (i = 8; i < 16; i++)
+		for (l = 0; l < 4; l++)
+			W[i][l] = sha256d_hash1[i];
+	sha256_init_4way(S);
+	sha256_transform_4way(S, W);
+
+	for (l = 0; l < 4; l++)
+		for (i = 0; i < 8; i++)
+			be32enc((uint32_t *)(hash + 32 * l) + i, S[i][l]);
+}
+
 static inline void sha256d_preextend(uint32_t *W)
 {
 	W[16] = s1(W[14]) + W[ 9] + s0(W[ 1]) + W[ 0];
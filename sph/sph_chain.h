@@ -0,0 +1,141 @@
+/*
+ * Chains of sph hashes for the cpu checks (C++ only)
+ *
+ * A stage is a type with a static hash(out, in, len), a chain the list of
+ * its stages: the first one hashes the 80 bytes header, the next ones the
+ * previous 64 bytes hash, in place. The chains are expanded at compile time,
+ * one context at a time on the stack:
+ *
+ *   sph_chain<sph::luffa512, sph::cubehash512, sph::shavite512>::hash(out, in);
+ *
+ * The orders only known at runtime (x11evo) use the stage functions table.
+ */
+#ifndef SPH_CHAIN_H__
+#define SPH_CHAIN_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+extern "C" {
+#include "sph_blake.h"
+#include "sph_bmw.h"
+#include "sph_groestl.h"
+#include "sph_skein.h"
+#include "sph_jh.h"
+#include "sph_keccak.h"
+#include "sph_luffa.h"
+#include "sph_cubehash.h"
+#include "sph_shavite.h"
+#include "sph_simd.h"
+#include "sph_echo.h"
+#include "sph_hamsi.h"
+#include "sph_fugue.h"
+#include "sph_shabal.h"
+#include "sph_whirlpool.h"
+#include "sph_sha2.h"
+#include "sph_haval.h"
+}
+
+#define SPH_CHAIN_STAGE(type, name) \
+	struct type { \
+		static inline void hash(void *out, const void *in, size_t len) { \
+			name ## _context ctx; \
+			name ## _init(&ctx); \
+			name(&ctx, in, len); \
+			name ## _close(&ctx, out); \
+		} \
+	}
+
+namespace sph {
+	SPH_CHAIN_STAGE(blake512, sph_blake512);
+	SPH_CHAIN_STAGE(bmw512, sph_bmw512);
+	SPH_CHAIN_STAGE(groestl512, sph_groestl512);
+	SPH_CHAIN_STAGE(skein512, sph_skein512);
+	SPH_CHAIN_STAGE(jh512, sph_jh512);
+	SPH_CHAIN_STAGE(keccak512, sph_keccak512);
+	SPH_CHAIN_STAGE(luffa512, sph_luffa512);
+	SPH_CHAIN_STAGE(cubehash512, sph_cubehash512);
+	SPH_CHAIN_STAGE(shavite512, sph_shavite512);
+	SPH_CHAIN_STAGE(simd512, sph_simd512);
+	SPH_CHAIN_STAGE(echo512, sph_echo512);
+	SPH_CHAIN_STAGE(hamsi512, sph_hamsi512);
+	SPH_CHAIN_STAGE(fugue512, sph_fugue512);
+	SPH_CHAIN_STAGE(shabal512, sph_shabal512);
+	SPH_CHAIN_STAGE(whirlpool, sph_whirlpool);
+	SPH_CHAIN_STAGE(sha512, sph_sha512);
+	SPH_CHAIN_STAGE(haval256_5, sph_haval256_5); // 32 bytes output
+}
+
+#undef SPH_CHAIN_STAGE
+
+#define SPH_X11_STAGES sph::blake512, sph::bmw512, sph::groestl512, sph::skein512, \
+	sph::jh512, sph::keccak512, sph::luffa512, sph::cubehash512, \
+	sph::shavite512, sph::simd512, sph::echo512
+
+template <typename... Stages> struct sph_stages;
+
+template <> struct sph_stages<> {
+	static inline void run(void *hash) { }
+};
+
+template <typename Stage, typename... Next> struct sph_stages<Stage, Next...> {
+	static inline void run(void *hash) {
+		Stage::hash(hash, hash, 64);
+		sph_stages<Next...>::run(hash);
+	}
+};
+
+template <typename First, typename... Next> struct sph_chain {
+	/* hash of the 80 bytes header, 32 bytes output like the algo hash functions */
+	static void hash(void *output, const void *input) {
+		uint64_t hash[8];
+		First::hash(hash, input, 80);
+		sph_stages<Next...>::run(hash);
+		memcpy(output, hash, 32);
+	}
+};
+
+/* index of the stages in sph_stage_fns, the x11 ones in the x11evo order */
+enum sph_stage {
+	SPH_BLAKE512 = 0,
+	SPH_BMW512,
+	SPH_GROESTL512,
+	SPH_SKEIN512,
+	SPH_JH512,
+	SPH_KECCAK512,
+	SPH_LUFFA512,
+	SPH_CUBEHASH512,
+	SPH_SHAVITE512,
+	SPH_SIMD512,
+	SPH_ECHO512,
+	SPH_HAMSI512,
+	SPH_FUGUE512,
+	SPH_SHABAL512,
+	SPH_WHIRLPOOL,
+	SPH_SHA512,
+	SPH_HAVAL256_5,
+	SPH_STAGES
+};
+
+typedef void (*sph_stage_fn)(void *out, const void *in, size_t len);
+
+static const sph_stage_fn sph_stage_fns[SPH_STAGES] = {
+	sph::blake512::hash, sph::bmw512::hash, sph::groestl512::hash, sph::skein512::hash,
+	sph::jh512::hash, sph::keccak512::hash, sph::luffa512::hash, sph::cubehash512::hash,
+	sph::shavite512::hash, sph::simd512::hash, sph::echo512::hash, sph::hamsi512::hash,
+	sph::fugue512::hash, sph::shabal512::hash, sph::whirlpool::hash, sph::sha512::hash,
+	sph::haval256_5::hash
+};
+
+/* chain of count stages ordered at runtime, same output as sph_chain */
+static inline void sph_chain_run(void *output, const void *input, const uint8_t *order, int count)
+{
+	uint64_t hash[8];
+	sph_stage_fns[order[0]](hash, input, 80);
+	for (int i = 1; i < count; i++)
+		sph_stage_fns[order[i]](hash, hash, 64);
+	memcpy(output, hash, 32);
+}
+
+#endif
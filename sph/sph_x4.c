@@ -0,0 +1,555 @@
+/*
+ * 4 lanes AVX2 versions of blake512, bmw512, skein512 and keccak512 for
+ * the short messages of the X chains: a single block (80 bytes header or
+ * 64 bytes hash), so the padding, lengths and tweaks are constants and
+ * lane k of each vector holds word i of the k-th message.
+ *
+ * Without AVX2 the same entry points run the sph functions lane by lane.
+ */
+#include <stdint.h>
+#include <string.h>
+
+#include "sph_blake.h"
+#include "sph_bmw.h"
+#include "sph_skein.h"
+#include "sph_keccak.h"
+#include "sph_x4.h"
+
+#if defined(__x86_64__) || defined(_M_X64)
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#define X4_HAVE_AVX2 1
+#endif
+
+#ifdef X4_HAVE_AVX2
+
+#if defined(__GNUC__) || defined(__clang__)
+#define X4_TARGET __attribute__((target("avx2")))
+#else
+#define X4_TARGET
+#endif
+
+#define ADD(a, b) _mm256_add_epi64(a, b)
+#define SUB(a, b) _mm256_sub_epi64(a, b)
+#define XOR(a, b) _mm256_xor_si256(a, b)
+#define ROL(x, n) _mm256_or_si256(_mm256_slli_epi64(x, n), _mm256_srli_epi64(x, 64 - (n)))
+#define SHL(x, n) _mm256_slli_epi64(x, n)
+#define SHR(x, n) _mm256_srli_epi64(x, n)
+#define SET1(x) _mm256_set1_epi64x((int64_t)(x))
+
+/* word off (bytes) of the 4 lanes, lanes are stride bytes apart */
+#define LOAD4(p, stride, off) _mm256_set_epi64x( \
+	(int64_t)ld64((p) + 3 * (stride) + (off)), (int64_t)ld64((p) + 2 * (stride) + (off)), \
+	(int64_t)ld64((p) + (stride) + (off)), (int64_t)ld64((p) + (off)))
+
+static inline uint64_t ld64(const uint8_t *p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+#define STORE4(p, stride, off, v) do { \
+	uint64_t w_[4]; \
+	_mm256_storeu_si256((__m256i *)w_, v); \
+	memcpy((p) + (off), &w_[0], 8); \
+	memcpy((p) + (stride) + (off), &w_[1], 8); \
+	memcpy((p) + 2 * (stride) + (off), &w_[2], 8); \
+	memcpy((p) + 3 * (stride) + (off), &w_[3], 8); \
+} while (0)
+
+/* ---- blake512 ---- */
+
+static const uint64_t blake_iv[8] = {
+	0x6A09E667F3BCC908ULL, 0xBB67AE8584CAA73BULL, 0x3C6EF372FE94F82BULL, 0xA54FF53A5F1D36F1ULL,
+	0x510E527FADE682D1ULL, 0x9B05688C2B3E6C1FULL, 0x1F83D9ABFB41BD6BULL, 0x5BE0CD19137E2179ULL
+};
+
+static const uint64_t blake_cb[16] = {
+	0x243F6A8885A308D3ULL, 0x13198A2E03707344ULL, 0xA4093822299F31D0ULL, 0x082EFA98EC4E6C89ULL,
+	0x452821E638D01377ULL, 0xBE5466CF34E90C6CULL, 0xC0AC29B7C97C50DDULL, 0x3F84D5B5B5470917ULL,
+	0x9216D5D98979FB1BULL, 0xD1310BA698DFB5ACULL, 0x2FFD72DBD01ADFB7ULL, 0xB8E1AFED6A267E96ULL,
+	0xBA7C9045F12C7F99ULL, 0x24A19947B3916CF7ULL, 0x0801F2E2858EFC16ULL, 0x636920D871574E69ULL
+};
+
+static const uint8_t blake_sigma[10][16] = {
+	{  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },
+	{ 14, 10,  4,  8,  9, 15, 13,  6,  1, 12,  0,  2, 11,  7,  5,  3 },
+	{ 11,  8, 12,  0,  5,  2, 15, 13, 10, 14,  3,  6,  7,  1,  9,  4 },
+	{  7,  9,  3,  1, 13, 12, 11, 14,  2,  6,  5, 10,  4,  0, 15,  8 },
+	{  9,  0,  5,  7,  2,  4, 10, 15, 14,  1, 11, 12,  6,  8,  3, 13 },
+	{  2, 12,  6, 10,  0, 11,  8,  3,  4, 13,  7,  5, 15, 14,  1,  9 },
+	{ 12,  5,  1, 15, 14, 13,  4, 10,  0,  7,  6,  3,  9,  2,  8, 11 },
+	{ 13, 11,  7, 14, 12,  1,  3,  9,  5,  0, 15,  4,  8,  6,  2, 10 },
+	{  6, 15, 14,  9, 11,  3,  0,  8, 12,  2, 13,  7,  1,  4, 10,  5 },
+	{ 10,  2,  8,  4,  7,  6,  1,  5, 15, 11,  9, 14,  3, 12, 13,  0 }
+};
+
+#define BLAKE_G(r, i, a, b, c, d) do { \
+	const uint8_t s0_ = blake_sigma[r][2 * (i)], s1_ = blake_sigma[r][2 * (i) + 1]; \
+	a = ADD(ADD(a, b), XOR(m[s0_], SET1(blake_cb[s1_]))); \
+	d = _mm256_shuffle_epi32(XOR(d, a), _MM_SHUFFLE(2, 3, 0, 1)); \
+	c = ADD(c, d); \
+	b = ROL(XOR(b, c), 39); \
+	a = ADD(ADD(a, b), XOR(m[s1_], SET1(blake_cb[s0_]))); \
+	d = _mm256_shuffle_epi8(XOR(d, a), r16); \
+	c = ADD(c, d); \
+	b = ROL(XOR(b, c), 53); \
+} while (0)
+
+X4_TARGET static void blake512_x4(void *out, const void *in, size_t len)
+{
+	const uint8_t *p = (const uint8_t *)in;
+	uint8_t *o = (uint8_t *)out;
+	const __m256i bswap = _mm256_setr_epi8(
+		7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+		7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+	const __m256i r16 = _mm256_setr_epi8(
+		2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9,
+		2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9);
+	const uint64_t bits = (uint64_t)len << 3;
+	const int words = (int)(len >> 3);
+	__m256i m[16], v[16];
+	int i, r;
+
+	/* single block: 0x80 after the data, the 1 bit of blake512 before the length */
+	for (i = 0; i < words; i++)
+		m[i] = _mm256_shuffle_epi8(LOAD4(p, len, 8 * i), bswap);
+	m[words] = SET1(0x8000000000000000ULL);
+	for (i = words + 1; i < 16; i++)
+		m[i] = _mm256_setzero_si256();
+	m[13] = XOR(m[13], SET1(1));
+	m[15] = SET1(bits);
+
+	for (i = 0; i < 8; i++)
+		v[i] = SET1(blake_iv[i]);
+	for (i = 0; i < 4; i++)
+		v[8 + i] = SET1(blake_cb[i]);
+	v[12] = SET1(bits ^ blake_cb[4]);
+	v[13] = SET1(bits ^ blake_cb[5]);
+	v[14] = SET1(blake_cb[6]);
+	v[15] = SET1(blake_cb[7]);
+
+	for (r = 0; r < 16; r++) {
+		const int s = r % 10;
+		BLAKE_G(s, 0, v[0], v[4], v[ 8], v[12]);
+		BLAKE_G(s, 1, v[1], v[5], v[ 9], v[13]);
+		BLAKE_G(s, 2, v[2], v[6], v[10], v[14]);
+		BLAKE_G(s, 3, v[3], v[7], v[11], v[15]);
+		BLAKE_G(s, 4, v[0], v[5], v[10], v[15]);
+		BLAKE_G(s, 5, v[1], v[6], v[11], v[12]);
+		BLAKE_G(s, 6, v[2], v[7], v[ 8], v[13]);
+		BLAKE_G(s, 7, v[3], v[4], v[ 9], v[14]);
+	}
+
+	for (i = 0; i < 8; i++) {
+		__m256i h = XOR(SET1(blake_iv[i]), XOR(v[i], v[i + 8]));
+		STORE4(o, 64, 8 * i, _mm256_shuffle_epi8(h, bswap));
+	}
+}
+
+#undef BLAKE_G
+
+/* ---- bmw512 ---- */
+
+static const uint64_t bmw_iv[16] = {
+	0x8081828384858687ULL, 0x88898A8B8C8D8E8FULL, 0x9091929394959697ULL, 0x98999A9B9C9D9E9FULL,
+	0xA0A1A2A3A4A5A6A7ULL, 0xA8A9AAABACADAEAFULL, 0xB0B1B2B3B4B5B6B7ULL, 0xB8B9BABBBCBDBEBFULL,
+	0xC0C1C2C3C4C5C6C7ULL, 0xC8C9CACBCCCDCECFULL, 0xD0D1D2D3D4D5D6D7ULL, 0xD8D9DADBDCDDDEDFULL,
+	0xE0E1E2E3E4E5E6E7ULL, 0xE8E9EAEBECEDEEEFULL, 0xF0F1F2F3F4F5F6F7ULL, 0xF8F9FAFBFCFDFEFFULL
+};
+
+#define BMW_S0(x) XOR(XOR(SHR(x, 1), SHL(x, 3)), XOR(ROL(x,  4), ROL(x, 37)))
+#define BMW_S1(x) XOR(XOR(SHR(x, 1), SHL(x, 2)), XOR(ROL(x, 13), ROL(x, 43)))
+#define BMW_S2(x) XOR(XOR(SHR(x, 2), SHL(x, 1)), XOR(ROL(x, 19), ROL(x, 53)))
+#define BMW_S3(x) XOR(XOR(SHR(x, 2), SHL(x, 2)), XOR(ROL(x, 28), ROL(x, 59)))
+#define BMW_S4(x) XOR(SHR(x, 1), x)
+#define BMW_S5(x) XOR(SHR(x, 2), x)
+
+/* variable rotation, for the message words of the expansion */
+#define ROLV(x, n) _mm256_or_si256(_mm256_sll_epi64(x, _mm_cvtsi32_si128(n)), \
+	_mm256_srl_epi64(x, _mm_cvtsi32_si128(64 - (n))))
+
+X4_TARGET static void bmw512_compress(__m256i dh[16], const __m256i m[16], const __m256i h[16])
+{
+	__m256i x[16], q[32], w, xl, xh;
+	int i, j;
+
+	for (i = 0; i < 16; i++)
+		x[i] = XOR(m[i], h[i]);
+
+#define W5(a, op1, b, op2, c, op3, d, op4, e) op4(op3(op2(op1(x[a], x[b]), x[c]), x[d]), x[e])
+	w = W5( 5, SUB,  7, ADD, 10, ADD, 13, ADD, 14); q[ 0] = ADD(BMW_S0(w), h[ 1]);
+	w = W5( 6, SUB,  8, ADD, 11, ADD, 14, SUB, 15); q[ 1] = ADD(BMW_S1(w), h[ 2]);
+	w = W5( 0, ADD,  7, ADD,  9, SUB, 12, ADD, 15); q[ 2] = ADD(BMW_S2(w), h[ 3]);
+	w = W5( 0, SUB,  1, ADD,  8, SUB, 10, ADD, 13); q[ 3] = ADD(BMW_S3(w), h[ 4]);
+	w = W5( 1, ADD,  2, ADD,  9, SUB, 11, SUB, 14); q[ 4] = ADD(BMW_S4(w), h[ 5]);
+	w = W5( 3, SUB,  2, ADD, 10, SUB, 12, ADD, 15); q[ 5] = ADD(BMW_S0(w), h[ 6]);
+	w = W5( 4, SUB,  0, SUB,  3, SUB, 11, ADD, 13); q[ 6] = ADD(BMW_S1(w), h[ 7]);
+	w = W5( 1, SUB,  4, SUB,  5, SUB, 12, SUB, 14); q[ 7] = ADD(BMW_S2(w), h[ 8]);
+	w = W5( 2, SUB,  5, SUB,  6, ADD, 13, SUB, 15); q[ 8] = ADD(BMW_S3(w), h[ 9]);
+	w = W5( 0, SUB,  3, ADD,  6, SUB,  7, ADD, 14); q[ 9] = ADD(BMW_S4(w), h[10]);
+	w = W5( 8, SUB,  1, SUB,  4, SUB,  7, ADD, 15); q[10] = ADD(BMW_S0(w), h[11]);
+	w = W5( 8, SUB,  0, SUB,  2, SUB,  5, ADD,  9); q[11] = ADD(BMW_S1(w), h[12]);
+	w = W5( 1, ADD,  3, SUB,  6, SUB,  9, ADD, 10); q[12] = ADD(BMW_S2(w), h[13]);
+	w = W5( 2, ADD,  4, ADD,  7, ADD, 10, ADD, 11); q[13] = ADD(BMW_S3(w), h[14]);
+	w = W5( 3, SUB,  5, ADD,  8, SUB, 11, SUB, 12); q[14] = ADD(BMW_S4(w), h[15]);
+	w = W5(12, SUB,  4, SUB,  6, SUB,  9, ADD, 13); q[15] = ADD(BMW_S0(w), h[ 0]);
+#undef W5
+
+	for (i = 16; i < 32; i++) {
+		const int k = i - 16;
+		const int k3 = (k + 3) & 15, k10 = (k + 10) & 15;
+		__m256i sum = XOR(ADD(SUB(ADD(ROLV(m[k], k + 1), ROLV(m[k3], k3 + 1)),
+			ROLV(m[k10], k10 + 1)), SET1((uint64_t)i * 0x0555555555555555ULL)), h[(k + 7) & 15]);
+		if (i < 18) {
+			for (j = 0; j < 16; j += 4) {
+				sum = ADD(sum, BMW_S1(q[k + j]));
+				sum = ADD(sum, BMW_S2(q[k + j + 1]));
+				sum = ADD(sum, BMW_S3(q[k + j + 2]));
+				sum = ADD(sum, BMW_S0(q[k + j + 3]));
+			}
+		} else {
+			sum = ADD(sum, ADD(q[k +  0], ROL(q[k +  1],  5)));
+			sum = ADD(sum, ADD(q[k +  2], ROL(q[k +  3], 11)));
+			sum = ADD(sum, ADD(q[k +  4], ROL(q[k +  5], 27)));
+			sum = ADD(sum, ADD(q[k +  6], ROL(q[k +  7], 32)));
+			sum = ADD(sum, ADD(q[k +  8], ROL(q[k +  9], 37)));
+			sum = ADD(sum, ADD(q[k + 10], ROL(q[k + 11], 43)));
+			sum = ADD(sum, ADD(q[k + 12], ROL(q[k + 13], 53)));
+			sum = ADD(sum, ADD(BMW_S4(q[k + 14]), BMW_S5(q[k + 15])));
+		}
+		q[i] = sum;
+	}
+
+	xl = XOR(XOR(XOR(q[16], q[17]), XOR(q[18], q[19])), XOR(XOR(q[20], q[21]), XOR(q[22], q[23])));
+	xh = XOR(XOR(XOR(xl, q[24]), XOR(q[25], q[26])), XOR(XOR(q[27], q[28]), XOR(XOR(q[29], q[30]), q[31])));
+
+	dh[ 0] = ADD(XOR(XOR(SHL(xh,  5), SHR(q[16],  5)), m[ 0]), XOR(XOR(xl, q[24]), q[ 0]));
+	dh[ 1] = ADD(XOR(XOR(SHR(xh,  7), SHL(q[17],  8)), m[ 1]), XOR(XOR(xl, q[25]), q[ 1]));
+	dh[ 2] = ADD(XOR(XOR(SHR(xh,  5), SHL(q[18],  5)), m[ 2]), XOR(XOR(xl, q[26]), q[ 2]));
+	dh[ 3] = ADD(XOR(XOR(SHR(xh,  1), SHL(q[19],  5)), m[ 3]), XOR(XOR(xl, q[27]), q[ 3]));
+	dh[ 4] = ADD(XOR(XOR(SHR(xh,  3), q[20]), m[ 4]), XOR(XOR(xl, q[28]), q[ 4]));
+	dh[ 5] = ADD(XOR(XOR(SHL(xh,  6), SHR(q[21],  6)), m[ 5]), XOR(XOR(xl, q[29]), q[ 5]));
+	dh[ 6] = ADD(XOR(XOR(SHR(xh,  4), SHL(q[22],  6)), m[ 6]), XOR(XOR(xl, q[30]), q[ 6]));
+	dh[ 7] = ADD(XOR(XOR(SHR(xh, 11), SHL(q[23],  2)), m[ 7]), XOR(XOR(xl, q[31]), q[ 7]));
+	dh[ 8] = ADD(ADD(ROL(dh[4],  9), XOR(XOR(xh, q[24]), m[ 8])), XOR(XOR(SHL(xl, 8), q[23]), q[ 8]));
+	dh[ 9] = ADD(ADD(ROL(dh[5], 10), XOR(XOR(xh, q[25]), m[ 9])), XOR(XOR(SHR(xl, 6), q[16]), q[ 9]));
+	dh[10] = ADD(ADD(ROL(dh[6], 11), XOR(XOR(xh, q[26]), m[10])), XOR(XOR(SHL(xl, 6), q[17]), q[10]));
+	dh[11] = ADD(ADD(ROL(dh[7], 12), XOR(XOR(xh, q[27]), m[11])), XOR(XOR(SHL(xl, 4), q[18]), q[11]));
+	dh[12] = ADD(ADD(ROL(dh[0], 13), XOR(XOR(xh, q[28]), m[12])), XOR(XOR(SHR(xl, 3), q[19]), q[12]));
+	dh[13] = ADD(ADD(ROL(dh[1], 14), XOR(XOR(xh, q[29]), m[13])), XOR(XOR(SHR(xl, 4), q[20]), q[13]));
+	dh[14] = ADD(ADD(ROL(dh[2], 15), XOR(XOR(xh, q[30]), m[14])), XOR(XOR(SHR(xl, 7), q[21]), q[14]));
+	dh[15] = ADD(ADD(ROL(dh[3], 16), XOR(XOR(xh, q[31]), m[15])), XOR(XOR(SHR(xl, 2), q[22]), q[15]));
+}
+
+X4_TARGET static void bmw512_x4(void *out, const void *in)
+{
+	const uint8_t *p = (const uint8_t *)in;
+	uint8_t *o = (uint8_t *)out;
+	__m256i m[16], h[16], dh[16];
+	int i;
+
+	for (i = 0; i < 8; i++)
+		m[i] = LOAD4(p, 64, 8 * i);
+	m[8] = SET1(0x80);
+	for (i = 9; i < 15; i++)
+		m[i] = _mm256_setzero_si256();
+	m[15] = SET1(512);
+	for (i = 0; i < 16; i++)
+		h[i] = SET1(bmw_iv[i]);
+	bmw512_compress(dh, m, h);
+
+	/* final compression, the chaining value is the message */
+	for (i = 0; i < 16; i++)
+		h[i] = SET1(0xaaaaaaaaaaaaaaa0ULL + i);
+	bmw512_compress(m, dh, h);
+
+	for (i = 0; i < 8; i++)
+		STORE4(o, 64, 8 * i, m[8 + i]);
+}
+
+#undef ROLV
+#undef BMW_S0
+#undef BMW_S1
+#undef BMW_S2
+#undef BMW_S3
+#undef BMW_S4
+#undef BMW_S5
+
+/* ---- skein512 ---- */
+
+static const uint64_t skein_iv[8] = {
+	0x4903ADFF749C51CEULL, 0x0D95DE399746DF03ULL, 0x8FD1934127C79BCEULL, 0x9A255629FF352CB1ULL,
+	0x5DB62599DF6CA7B0ULL, 0xEABE394CA9D5C3F4ULL, 0x991112C71A75B523ULL, 0xAE18A40B660FCC33ULL
+};
+
+#define TF_MIX(x0, x1, rc) do { \
+	x0 = ADD(x0, x1); \
+	x1 = XOR(ROL(x1, rc), x0); \
+} while (0)
+
+#define TF_MIX8(w0, w1, w2, w3, w4, w5, w6, w7, rc0, rc1, rc2, rc3) do { \
+	TF_MIX(w0, w1, rc0); \
+	TF_MIX(w2, w3, rc1); \
+	TF_MIX(w4, w5, rc2); \
+	TF_MIX(w6, w7, rc3); \
+} while (0)
+
+#define TF_ADDKEY(s) do { \
+	for (i = 0; i < 8; i++) \
+		p[i] = ADD(p[i], k[((s) + i) % 9]); \
+	p[5] = ADD(p[5], SET1(t[(s) % 3])); \
+	p[6] = ADD(p[6], SET1(t[((s) + 1) % 3])); \
+	p[7] = ADD(p[7], SET1((uint64_t)(s))); \
+} while (0)
+
+/* UBI of one block with the tweak words t0/t1, h is updated */
+X4_TARGET static void skein512_ubi(__m256i h[8], const __m256i m[8], uint64_t t0, uint64_t t1)
+{
+	__m256i k[9], p[8];
+	uint64_t t[3];
+	int i, s;
+
+	k[8] = SET1(0x1BD11BDAA9FC1A22ULL);
+	for (i = 0; i < 8; i++) {
+		k[i] = h[i];
+		k[8] = XOR(k[8], h[i]);
+		p[i] = m[i];
+	}
+	t[0] = t0;
+	t[1] = t1;
+	t[2] = t0 ^ t1;
+
+	for (s = 0; s < 18; s += 2) {
+		TF_ADDKEY(s);
+		TF_MIX8(p[0], p[1], p[2], p[3], p[4], p[5], p[6], p[7], 46, 36, 19, 37);
+		TF_MIX8(p[2], p[1], p[4], p[7], p[6], p[5], p[0], p[3], 33, 27, 14, 42);
+		TF_MIX8(p[4], p[1], p[6], p[3], p[0], p[5], p[2], p[7], 17, 49, 36, 39);
+		TF_MIX8(p[6], p[1], p[0], p[7], p[2], p[5], p[4], p[3], 44,  9, 54, 56);
+		TF_ADDKEY(s + 1);
+		TF_MIX8(p[0], p[1], p[2], p[3], p[4], p[5], p[6], p[7], 39, 30, 34, 24);
+		TF_MIX8(p[2], p[1], p[4], p[7], p[6], p[5], p[0], p[3], 13, 50, 10, 17);
+		TF_MIX8(p[4], p[1], p[6], p[3], p[0], p[5], p[2], p[7], 25, 29, 39, 43);
+		TF_MIX8(p[6], p[1], p[0], p[7], p[2], p[5], p[4], p[3],  8, 35, 56, 22);
+	}
+	TF_ADDKEY(18);
+
+	for (i = 0; i < 8; i++)
+		h[i] = XOR(m[i], p[i]);
+}
+
+#undef TF_ADDKEY
+#undef TF_MIX8
+#undef TF_MIX
+
+X4_TARGET static void skein512_x4(void *out, const void *in)
+{
+	const uint8_t *p = (const uint8_t *)in;
+	uint8_t *o = (uint8_t *)out;
+	__m256i h[8], m[8];
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		h[i] = SET1(skein_iv[i]);
+		m[i] = LOAD4(p, 64, 8 * i);
+	}
+	/* message block: first + final, type 48, 64 bytes */
+	skein512_ubi(h, m, 64, 0xF000000000000000ULL);
+
+	/* output block: first + final, type 63, 8 bytes counter 0 */
+	for (i = 0; i < 8; i++)
+		m[i] = _mm256_setzero_si256();
+	skein512_ubi(h, m, 8, 0xFF00000000000000ULL);
+
+	for (i = 0; i < 8; i++)
+		STORE4(o, 64, 8 * i, h[i]);
+}
+
+/* ---- keccak512 ---- */
+
+static const uint64_t keccak_rc[24] = {
+	0x0000000000000001ULL, 0x0000000000008082ULL, 0x800000000000808AULL, 0x8000000080008000ULL,
+	0x000000000000808BULL, 0x0000000080000001ULL, 0x8000000080008081ULL, 0x8000000000008009ULL,
+	0x000000000000008AULL, 0x0000000000000088ULL, 0x0000000080008009ULL, 0x000000008000000AULL,
+	0x000000008000808BULL, 0x800000000000008BULL, 0x8000000000008089ULL, 0x8000000000008003ULL,
+	0x8000000000008002ULL, 0x8000000000000080ULL, 0x000000000000800AULL, 0x800000008000000AULL,
+	0x8000000080008081ULL, 0x8000000000008080ULL, 0x0000000080000001ULL, 0x8000000080008008ULL
+};
+
+/* rho offsets along the pi walk starting at lane 1 */
+#define KECCAK_RHO_PI(a) do { \
+	__m256i t_ = a[1], u_; \
+	u_ = a[10]; a[10] = ROL(t_,  1); t_ = u_; \
+	u_ = a[ 7]; a[ 7] = ROL(t_,  3); t_ = u_; \
+	u_ = a[11]; a[11] = ROL(t_,  6); t_ = u_; \
+	u_ = a[17]; a[17] = ROL(t_, 10); t_ = u_; \
+	u_ = a[18]; a[18] = ROL(t_, 15); t_ = u_; \
+	u_ = a[ 3]; a[ 3] = ROL(t_, 21); t_ = u_; \
+	u_ = a[ 5]; a[ 5] = ROL(t_, 28); t_ = u_; \
+	u_ = a[16]; a[16] = ROL(t_, 36); t_ = u_; \
+	u_ = a[ 8]; a[ 8] = ROL(t_, 45); t_ = u_; \
+	u_ = a[21]; a[21] = ROL(t_, 55); t_ = u_; \
+	u_ = a[24]; a[24] = ROL(t_,  2); t_ = u_; \
+	u_ = a[ 4]; a[ 4] = ROL(t_, 14); t_ = u_; \
+	u_ = a[15]; a[15] = ROL(t_, 27); t_ = u_; \
+	u_ = a[23]; a[23] = ROL(t_, 41); t_ = u_; \
+	u_ = a[19]; a[19] = ROL(t_, 56); t_ = u_; \
+	u_ = a[13]; a[13] = ROL(t_,  8); t_ = u_; \
+	u_ = a[12]; a[12] = ROL(t_, 25); t_ = u_; \
+	u_ = a[ 2]; a[ 2] = ROL(t_, 43); t_ = u_; \
+	u_ = a[20]; a[20] = ROL(t_, 62); t_ = u_; \
+	u_ = a[14]; a[14] = ROL(t_, 18); t_ = u_; \
+	u_ = a[22]; a[22] = ROL(t_, 39); t_ = u_; \
+	u_ = a[ 9]; a[ 9] = ROL(t_, 61); t_ = u_; \
+	u_ = a[ 6]; a[ 6] = ROL(t_, 20); t_ = u_; \
+	a[ 1] = ROL(t_, 44); \
+} while (0)
+
+X4_TARGET static void keccak512_x4(void *out, const void *in)
+{
+	const uint8_t *p = (const uint8_t *)in;
+	uint8_t *o = (uint8_t *)out;
+	__m256i a[25], c[5], d;
+	int i, x, y, r;
+
+	/* rate 72 bytes: the 64 bytes, then 0x01 ... 0x80 */
+	for (i = 0; i < 8; i++)
+		a[i] = LOAD4(p, 64, 8 * i);
+	a[8] = SET1(0x8000000000000001ULL);
+	for (i = 9; i < 25; i++)
+		a[i] = _mm256_setzero_si256();
+
+	for (r = 0; r < 24; r++) {
+		for (x = 0; x < 5; x++)
+			c[x] = XOR(XOR(XOR(a[x], a[x + 5]), XOR(a[x + 10], a[x + 15])), a[x + 20]);
+		for (x = 0; x < 5; x++) {
+			d = XOR(c[(x + 4) % 5], ROL(c[(x + 1) % 5], 1));
+			for (y = 0; y < 25; y += 5)
+				a[y + x] = XOR(a[y + x], d);
+		}
+		KECCAK_RHO_PI(a);
+		for (y = 0; y < 25; y += 5) {
+			for (x = 0; x < 5; x++)
+				c[x] = a[y + x];
+			for (x = 0; x < 5; x++)
+				a[y + x] = XOR(c[x], _mm256_andnot_si256(c[(x + 1) % 5], c[(x + 2) % 5]));
+		}
+		a[0] = XOR(a[0], SET1(keccak_rc[r]));
+	}
+
+	for (i = 0; i < 8; i++)
+		STORE4(o, 64, 8 * i, a[i]);
+}
+
+#undef KECCAK_RHO_PI
+
+static int x4_cpu_has_avx2(void)
+{
+#if defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 1);
+	/* OSXSAVE and AVX, then the OS must save the ymm registers */
+	if ((info[2] & (1 << 27)) == 0 || (info[2] & (1 << 28)) == 0)
+		return 0;
+	if ((_xgetbv(0) & 6) != 6)
+		return 0;
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;
+#elif defined(__GNUC__) || defined(__clang__)
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+#else
+	return 0;
+#endif
+}
+
+#undef ADD
+#undef SUB
+#undef XOR
+#undef ROL
+#undef SHL
+#undef SHR
+#undef SET1
+#undef LOAD4
+#undef STORE4
+
+#endif /* X4_HAVE_AVX2 */
+
+int sph_x4_lanes(void)
+{
+#ifdef X4_HAVE_AVX2
+	static int lanes = 0;
+	if (!lanes)
+		lanes = x4_cpu_has_avx2() ? 4 : 1;
+	return lanes;
+#else
+	return 1;
+#endif
+}
+
+/* lane by lane with sph, the output may be the input */
+#define X4_SPH(name, ctx_type, out, in, len) do { \
+	ctx_type ctx_; \
+	int l_; \
+	for (l_ = 0; l_ < 4; l_++) { \
+		name ## _init(&ctx_); \
+		name(&ctx_, (const unsigned char *)(in) + l_ * (len), len); \
+		name ## _close(&ctx_, (unsigned char *)(out) + 64 * l_); \
+	} \
+} while (0)
+
+void sph_blake512_x4(void *out, const void *in, size_t len)
+{
+#ifdef X4_HAVE_AVX2
+	if (sph_x4_lanes() == 4 && (len == 64 || len == 80)) {
+		blake512_x4(out, in, len);
+		return;
+	}
+#endif
+	if (out == in && len != 64) {
+		/* the 80 bytes lanes would be overwritten */
+		unsigned char tmp[4 * 80];
+		memcpy(tmp, in, 4 * len);
+		X4_SPH(sph_blake512, sph_blake512_context, out, tmp, len);
+		return;
+	}
+	X4_SPH(sph_blake512, sph_blake512_context, out, in, len);
+}
+
+void sph_bmw512_x4(void *out, const void *in)
+{
+#ifdef X4_HAVE_AVX2
+	if (sph_x4_lanes() == 4) {
+		bmw512_x4(out, in);
+		return;
+	}
+#endif
+	X4_SPH(sph_bmw512, sph_bmw512_context, out, in, 64);
+}
+
+void sph_skein512_x4(void *out, const void *in)
+{
+#ifdef X4_HAVE_AVX2
+	if (sph_x4_lanes() == 4) {
+		skein512_x4(out, in);
+		return;
+	}
+#endif
+	X4_SPH(sph_skein512, sph_skein512_context, out, in, 64);
+}
+
+void sph_keccak512_x4(void *out, const void *in)
+{
+#ifdef X4_HAVE_AVX2
+	if (sph_x4_lanes() == 4) {
+		keccak512_x4(out, in);
+		return;
+	}
+#endif
+	X4_SPH(sph_keccak512, sph_keccak512_context, out, in, 64);
+}
+
+#undef X4_SPH
@@ -0,0 +1,31 @@
+/*
+ * 4 lanes versions of the 64-bit sph hashes of the X chains, used to
+ * verify several gpu candidates at once. Each lane gives the same bytes
+ * as the sph init/update/close sequence, the lanes are contiguous in the
+ * input and output buffers (which may be the same).
+ */
+#ifndef SPH_X4_H__
+#define SPH_X4_H__
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+/* 4 if the AVX2 versions can run on this cpu, else 1 */
+int sph_x4_lanes(void);
+
+/* len is 64 or 80 bytes (block header) per lane, the output 64 bytes */
+void sph_blake512_x4(void *out, const void *in, size_t len);
+
+/* 64 bytes per lane */
+void sph_bmw512_x4(void *out, const void *in);
+void sph_skein512_x4(void *out, const void *in);
+void sph_keccak512_x4(void *out, const void *in);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
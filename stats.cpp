@@ -1,31 +1,167 @@
 /**
  * Stats place holder
  *
- * Note: this source is C++ (requires std::map)
+ * Note: this source is C++ (requires std::atomic)
  *
  * tpruvot@github 2014
  */
 #include <stdlib.h>
 #include <memory.h>
-#include <map>
+#include <atomic>
+#include <vector>
+#include <algorithm>
 
 #include "miner.h"
 
-static std::map<uint64_t, stats_data> tlastscans;
-static uint64_t uid = 0;
+/**
+ * Each miner thread writes its samples in its own ring with the running sum
+ * of the last opt_statsavg ones and an exponential average. The readers (api,
+ * other threads) copy what they need while the ring sequence is even and
+ * unchanged, the owner keeps it odd during its updates.
+ */
+#define STATS_RING_SIZE 256
+#define STATS_MAX_THREADS 256
+
+struct stats_ring {
+	std::atomic<uint32_t> seq;
+	std::atomic<uint32_t> reset; // purge requests
+	uint32_t reset_done;
+	uint32_t head;   // samples written
+	uint32_t count;  // samples since the last purge
+	uint32_t window; // samples in the sum
+	double sum;
+	double ewma;
+	struct stats_data samples[STATS_RING_SIZE];
+};
+
+static std::atomic<struct stats_ring*> rings[STATS_MAX_THREADS];
+static std::atomic<uint32_t> uid(0);
 
-#define STATS_AVG_SAMPLES 30
 #define STATS_PURGE_TIMEOUT 120*60 /* 120 mn */
 
 extern uint64_t global_hashrate;
 extern int opt_statsavg;
 
+static struct stats_ring* ring_get(int thr_id, bool create)
+{
+	struct stats_ring *ring;
+	if (thr_id < 0 || thr_id >= STATS_MAX_THREADS)
+		return NULL;
+	ring = rings[thr_id].load(std::memory_order_acquire);
+	if (!ring && create) {
+		struct stats_ring *fresh = new stats_ring();
+		if (rings[thr_id].compare_exchange_strong(ring, fresh))
+			ring = fresh;
+		else
+			delete fresh;
+	}
+	return ring;
+}
+
+static inline uint32_t stats_window()
+{
+	return (uint32_t) max(1, min(opt_statsavg, STATS_RING_SIZE));
+}
+
+/**
+ * Append a sample, only called by the ring owner
+ */
+static void ring_push(struct stats_ring *ring, const struct stats_data *data)
+{
+	const uint32_t seq = ring->seq.load(std::memory_order_relaxed);
+	const uint32_t window = stats_window();
+
+	ring->seq.store(seq + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	const uint32_t reset = ring->reset.load(std::memory_order_acquire);
+	if (reset != ring->reset_done) {
+		ring->reset_done = reset;
+		ring->count = ring->window = 0;
+		ring->sum = ring->ewma = 0.;
+	}
+
+	// the oldest samples leave the mean
+	while (ring->window >= window) {
+		ring->sum -= ring->samples[(ring->head - ring->window) % STATS_RING_SIZE].hashrate;
+		ring->window--;
+	}
+
+	ring->samples[ring->head % STATS_RING_SIZE] = *data;
+	ring->head++;
+	ring->window++;
+	ring->sum += data->hashrate;
+	if (ring->count < STATS_RING_SIZE)
+		ring->count++;
+
+	// drop the rounding errors of the running sum once per turn
+	if (ring->head % STATS_RING_SIZE == 0) {
+		ring->sum = 0.;
+		for (uint32_t n = 1; n <= ring->window; n++)
+			ring->sum += ring->samples[(ring->head - n) % STATS_RING_SIZE].hashrate;
+	}
+
+	if (ring->window == 1)
+		ring->ewma = data->hashrate;
+	else
+		ring->ewma += (data->hashrate - ring->ewma) * 2.0 / (window + 1);
+
+	ring->seq.store(seq + 2, std::memory_order_release);
+}
+
+/**
+ * Consistent copy of the ring averages and samples count
+ * @return samples in the mean, 0 if none (or purged)
+ */
+static uint32_t ring_averages(struct stats_ring *ring, double *mean, double *ewma, uint32_t *records)
+{
+	uint32_t seq, window, count;
+	double sum, avg;
+	bool purged;
+	do {
+		seq = ring->seq.load(std::memory_order_acquire);
+		window = ring->window;
+		count = ring->count;
+		sum = ring->sum;
+		avg = ring->ewma;
+		purged = ring->reset.load(std::memory_order_relaxed) != ring->reset_done;
+		std::atomic_thread_fence(std::memory_order_acquire);
+	} while ((seq & 1) || seq != ring->seq.load(std::memory_order_relaxed));
+
+	if (purged || !window)
+		return 0;
+	if (mean) *mean = sum / window;
+	if (ewma) *ewma = avg;
+	if (records) *records = count;
+	return window;
+}
+
+/**
+ * Consistent copy of the last samples of a ring, newest first
+ */
+static uint32_t ring_samples(struct stats_ring *ring, struct stats_data *data, uint32_t max_records)
+{
+	uint32_t seq, count, head;
+	bool purged;
+	do {
+		seq = ring->seq.load(std::memory_order_acquire);
+		head = ring->head;
+		count = min(ring->count, max_records);
+		purged = ring->reset.load(std::memory_order_relaxed) != ring->reset_done;
+		for (uint32_t n = 0; n < count; n++)
+			memcpy(&data[n], &ring->samples[(head - 1 - n) % STATS_RING_SIZE], sizeof(struct stats_data));
+		std::atomic_thread_fence(std::memory_order_acquire);
+	} while ((seq & 1) || seq != ring->seq.load(std::memory_order_relaxed));
+
+	return purged ? 0 : count;
+}
+
 /**
  * Store speed per thread
  */
 void stats_remember_speed(int thr_id, uint32_t hashcount, double hashrate, uint8_t found, uint32_t height)
 {
-	const uint64_t key = uid++;
+	struct stats_ring *ring;
 	stats_data data;
 	// to enough hashes to give right stats
 	if (hashcount < 1000 || hashrate < 0.01)
@@ -35,8 +171,20 @@ void stats_remember_speed(int thr_id, uint32_t hashcount, double hashrate, uint8
 	//if (uid < opt_n_threads * 2)
 	//	return;
 
+	const uint32_t id = ++uid;
+	if (opt_n_threads == 1 && global_hashrate && id > 10) {
+		// prevent stats on too high vardiff (erroneous rates)
+		double ratio = (hashrate / (1.0 * global_hashrate));
+		if (ratio < 0.4 || ratio > 1.6)
+			return;
+	}
+
+	ring = ring_get(thr_id, true);
+	if (!ring)
+		return;
+
 	memset(&data, 0, sizeof(data));
-	data.uid = (uint32_t) uid;
+	data.uid = id;
 	data.gpu_id = (uint8_t) device_map[thr_id];
 	data.thr_id = (uint8_t) thr_id;
 	data.tm_stat = (uint32_t) time(NULL);
@@ -47,17 +195,11 @@ void stats_remember_speed(int thr_id, uint32_t hashcount, double hashrate, uint8
 	data.hashfound = found;
 	data.hashrate = hashrate;
 	data.difficulty = net_diff ? net_diff : stratum_diff;
-	if (opt_n_threads == 1 && global_hashrate && uid > 10) {
-		// prevent stats on too high vardiff (erroneous rates)
-		double ratio = (hashrate / (1.0 * global_hashrate));
-		if (ratio < 0.4 || ratio > 1.6)
-			data.ignored = 1;
-	}
-	tlastscans[key] = data;
+	ring_push(ring, &data);
 }
 
 /**
- * Get the computed average speed
+ * Get the computed average speed (mean of the last opt_statsavg samples)
  * @param thr_id int (-1 for all threads)
  */
 double stats_get_speed(int thr_id, double def_speed)
@@ -65,17 +207,15 @@ double stats_get_speed(int thr_id, double def_speed)
 	double speed = 0.0;
 	int records = 0;
 
-	std::map<uint64_t, stats_data>::reverse_iterator i = tlastscans.rbegin();
-	while (i != tlastscans.rend() && records < opt_statsavg) {
-		if (!i->second.ignored)
-		if (thr_id == -1 || i->second.thr_id == thr_id) {
-			if (i->second.hashcount > 1000) {
-				speed += i->second.hashrate;
-				records++;
-			//	 applog(LOG_BLUE, "%d %x %.1f", thr_id, i->second.thr_id, i->second.hashrate);
-			}
+	for (int t = 0; t < STATS_MAX_THREADS; t++) {
+		if (thr_id != -1 && t != thr_id)
+			continue;
+		struct stats_ring *ring = ring_get(t, false);
+		double mean;
+		if (ring && ring_averages(ring, &mean, NULL, NULL)) {
+			speed += mean;
+			records++;
 		}
-		++i;
 	}
 
 	if (records)
@@ -89,6 +229,18 @@ double stats_get_speed(int thr_id, double def_speed)
 	return speed;
 }
 
+/**
+ * Get the exponential moving average of a thread speed
+ */
+double stats_get_ewma(int thr_id, double def_speed)
+{
+	struct stats_ring *ring = ring_get(thr_id, false);
+	double ewma;
+	if (ring && ring_averages(ring, NULL, &ewma, NULL))
+		return ewma;
+	return def_speed;
+}
+
 /**
  * Get the gpu average speed
  * @param gpu_id int (-1 for all threads)
@@ -106,43 +258,59 @@ double stats_get_gpu_speed(int gpu_id)
 	return speed;
 }
 
+static bool history_cmp(const stats_data &a, const stats_data &b)
+{
+	return a.uid > b.uid;
+}
+
 /**
  * Export data for api calls
  */
 int stats_get_history(int thr_id, struct stats_data *data, int max_records)
 {
-	int records = 0;
+	std::vector<stats_data> records;
+	const uint32_t max_ring = (uint32_t) max(0, min(max_records, STATS_RING_SIZE));
+	if (!max_ring)
+		return 0;
 
-	std::map<uint64_t, stats_data>::reverse_iterator i = tlastscans.rbegin();
-	while (i != tlastscans.rend() && records < max_records) {
-		if (!i->second.ignored)
-			if (thr_id == -1 || i->second.thr_id == thr_id) {
-				memcpy(&data[records], &(i->second), sizeof(struct stats_data));
-				records++;
-			}
-		++i;
+	for (int t = 0; t < STATS_MAX_THREADS; t++) {
+		if (thr_id != -1 && t != thr_id)
+			continue;
+		struct stats_ring *ring = ring_get(t, false);
+		if (!ring)
+			continue;
+		size_t pos = records.size();
+		records.resize(pos + max_ring);
+		records.resize(pos + ring_samples(ring, &records[pos], max_ring));
 	}
-	return records;
+
+	int count = min((int) records.size(), max_records);
+	std::partial_sort(records.begin(), records.begin() + count, records.end(), history_cmp);
+	for (int i = 0; i < count; i++)
+		memcpy(&data[i], &records[i], sizeof(struct stats_data));
+	return count;
 }
 
 /**
- * Remove old entries to reduce memory usage
+ * Drop the samples of the threads without recent stats
  */
 void stats_purge_old(void)
 {
 	int deleted = 0;
 	uint32_t now = (uint32_t) time(NULL);
-	uint32_t sz = (uint32_t) tlastscans.size();
-	std::map<uint64_t, stats_data>::iterator i = tlastscans.begin();
-	while (i != tlastscans.end()) {
-		if (i->second.ignored || (now - i->second.tm_stat) > STATS_PURGE_TIMEOUT) {
-			deleted++;
-			tlastscans.erase(i++);
+	struct stats_data last;
+	uint32_t count;
+	for (int t = 0; t < STATS_MAX_THREADS; t++) {
+		struct stats_ring *ring = ring_get(t, false);
+		if (!ring || !ring_averages(ring, NULL, NULL, &count) || !ring_samples(ring, &last, 1))
+			continue;
+		if ((now - last.tm_stat) > STATS_PURGE_TIMEOUT) {
+			deleted += count;
+			ring->reset++;
 		}
-		else ++i;
 	}
 	if (opt_debug && deleted) {
-		applog(LOG_DEBUG, "stats: %d/%d records purged", deleted, sz);
+		applog(LOG_DEBUG, "stats: %d records purged", deleted);
 	}
 }
 
@@ -151,7 +319,11 @@ void stats_purge_old(void)
  */
 void stats_purge_all(void)
 {
-	tlastscans.clear();
+	for (int t = 0; t < STATS_MAX_THREADS; t++) {
+		struct stats_ring *ring = ring_get(t, false);
+		if (ring)
+			ring->reset++;
+	}
 }
 
 /**
@@ -159,6 +331,16 @@ void stats_purge_all(void)
  */
 void stats_getmeminfo(uint64_t *mem, uint32_t *records)
 {
-	(*records) = (uint32_t) tlastscans.size();
-	(*mem) = (*records) * sizeof(stats_data);
+	(*records) = 0;
+	(*mem) = 0;
+	for (int t = 0; t < STATS_MAX_THREADS; t++) {
+		struct stats_ring *ring = ring_get(t, false);
+		uint32_t count;
+		if (!ring)
+			continue;
+		// the purged rings are only cleared by their next sample
+		if (ring_averages(ring, NULL, NULL, &count))
+			(*records) += count;
+		(*mem) += sizeof(struct stats_ring);
+	}
 }
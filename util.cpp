@@ -23,6 +23,7 @@
 #include <curl/curl.h>
 #include <sys/stat.h>
 #include <time.h>
+#include <atomic>
 #ifdef WIN32
 #include "compat/winansi.h"
 #include <winsock2.h>
@@ -32,9 +33,10 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <poll.h>
+#include <fcntl.h>
 #endif
 #include "miner.h"
-#include "elist.h"
 
 extern pthread_mutex_t stratum_sock_lock;
 extern pthread_mutex_t stratum_work_lock;
@@ -59,18 +61,36 @@ struct header_info {
 	char		*stratum_url;
 };
 
+#define TQ_SIZE 1024 /* entries of a thread queue, power of 2 */
+
 struct tq_ent {
-	void			*data;
-	struct list_head	q_node;
+	std::atomic<uint32_t> seq;
+	void *data;
+	uint64_t pushed_us;
 };
 
+/* bounded multi producer/consumer ring, the mutex is only taken to sleep
+ * on an empty (pop) or full (push) queue */
 struct thread_q {
-	struct list_head	q;
+	struct tq_ent ent[TQ_SIZE];
+
+	std::atomic<uint32_t> _ALIGN(64) head; /* next push */
+	std::atomic<uint32_t> _ALIGN(64) tail; /* next pop */
 
-	bool frozen;
+	std::atomic<bool> frozen;
+	std::atomic<uint32_t> wakeups;
+	std::atomic<int> waiting_pop;
+	std::atomic<int> waiting_push;
 
-	pthread_mutex_t		mutex;
-	pthread_cond_t		cond;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;  /* not empty */
+	pthread_cond_t space; /* not full */
+
+	/* api counters */
+	std::atomic<uint32_t> max_depth;
+	std::atomic<uint64_t> pushed;
+	std::atomic<uint64_t> popped;
+	std::atomic<uint64_t> wait_us;
 };
 
 void applog(int prio, const char *fmt, ...)
@@ -711,24 +731,101 @@ void aligned_free(void *ptr)
 #endif
 }
 
+/**
+ * Scratch buffers of the cpu hashes (lyra2 matrix, neoscrypt and scrypt pads),
+ * allocated once per thread and grown on demand. cpu_scratch_free() releases
+ * those of the calling thread, the other threads drop theirs on next use.
+ */
+struct cpu_scratch_buf {
+	void *ptr;
+	size_t size;
+};
 
+static __thread struct cpu_scratch_buf scratch_bufs[SCRATCH_COUNT];
+static __thread uint32_t scratch_gen_seen = 0;
+static std::atomic<uint32_t> scratch_gen(0);
+static std::atomic<uint64_t> scratch_mem(0);
+static std::atomic<uint32_t> scratch_count(0);
 
+static void scratch_release()
+{
+	for (int id = 0; id < SCRATCH_COUNT; id++) {
+		struct cpu_scratch_buf *buf = &scratch_bufs[id];
+		if (!buf->ptr)
+			continue;
+		aligned_free(buf->ptr);
+		scratch_mem -= buf->size;
+		scratch_count--;
+		buf->ptr = NULL;
+		buf->size = 0;
+	}
+}
 
+/* 64 bytes aligned buffer of at least size bytes, its content is undefined */
+void *cpu_scratch(int id, size_t size)
+{
+	struct cpu_scratch_buf *buf = &scratch_bufs[id];
+
+	uint32_t gen = scratch_gen.load(std::memory_order_acquire);
+	if (scratch_gen_seen != gen) {
+		scratch_release();
+		scratch_gen_seen = gen;
+	}
+	if (buf->size < size) {
+		if (buf->ptr) {
+			aligned_free(buf->ptr);
+			scratch_mem -= buf->size;
+			scratch_count--;
+		}
+		buf->ptr = aligned_calloc((int) size);
+		buf->size = buf->ptr ? size : 0;
+		if (buf->ptr) {
+			scratch_mem += size;
+			scratch_count++;
+		}
+	}
+	return buf->ptr;
+}
 
+// algo_free_all hook
+void cpu_scratch_free(void)
+{
+	scratch_gen_seen = scratch_gen.fetch_add(1, std::memory_order_release) + 1;
+	scratch_release();
+}
 
-void cbin2hex(char *out, const char *in, size_t len)
+void cpu_scratch_getmeminfo(uint64_t *mem, uint32_t *buffers)
+{
+	(*mem) = scratch_mem;
+	(*buffers) = scratch_count;
+}
+
+
+
+
+
+
+static const char hex_digits[] = "0123456789abcdef";
+
+// table driven, returns the end of the (not terminated) output
+static inline char* hex_encode(char *out, const uchar *in, size_t len)
 {
-	if (out) {
-		unsigned int i;
-		for (i = 0; i < len; i++)
-			sprintf(out + (i * 2), "%02x", (uint8_t)in[i]);
+	for (size_t i = 0; i < len; i++) {
+		*out++ = hex_digits[in[i] >> 4];
+		*out++ = hex_digits[in[i] & 0xf];
 	}
+	return out;
+}
+
+void cbin2hex(char *out, const char *in, size_t len)
+{
+	if (out)
+		*hex_encode(out, (const uchar*) in, len) = '\0';
 }
 
 void dbin2hex(char *s, const unsigned char *p, size_t len)
 {
-	for (size_t i = 0; i < len; i++)
-		sprintf(s + (i * 2), "%02x", (unsigned int)p[i]);
+	*hex_encode(s, p, len) = '\0';
 }
 
 char *bin2hex(const uchar *in, size_t len)
@@ -1157,6 +1254,130 @@ bool stratum_send_line_bos(struct stratum_ctx *sctx, bos_t *s)
 	return ret;
 }
 
+bool submit_buf_reserve(struct submit_buf *buf, size_t len)
+{
+	if (buf->alloc < len) {
+		uchar *data = (uchar*) realloc(buf->data, len);
+		if (!data)
+			return false;
+		buf->data = data;
+		buf->alloc = len;
+	}
+	return true;
+}
+
+void submit_buf_free(struct submit_buf *buf)
+{
+	free(buf->data);
+	memset(buf, 0, sizeof(*buf));
+}
+
+static inline uchar* bos_put_uvarint(uchar *p, uint32_t value)
+{
+	if (value < 0xFD) {
+		*p++ = (uchar) value;
+	} else if (value <= 0xFFFF) {
+		uint16_t v16 = (uint16_t) value;
+		*p++ = 0xFD;
+		memcpy(p, &v16, 2);
+		p += 2;
+	} else {
+		*p++ = 0xFE;
+		memcpy(p, &value, 4);
+		p += 4;
+	}
+	return p;
+}
+
+static inline uchar* bos_put_data(uchar *p, uchar tag, const void *data, uint32_t len)
+{
+	if (tag)
+		*p++ = tag;
+	p = bos_put_uvarint(p, len);
+	memcpy(p, data, len);
+	return p + len;
+}
+
+// same frame as bos_serialize() of {"id":id, "method":"mining.submit", "params":[...]}
+bool mtp_submit_bos(struct submit_buf *buf, uint32_t id, const char *user, const uchar *job_id, const uchar *xnonce2,
+	uint32_t ntime, uint32_t nonce, const struct mtp *mtp, uint32_t mtp_l)
+{
+	const uint32_t user_len = (uint32_t) strlen(user);
+	const uint32_t block_size = mtp_l * 2 * 128 * 8;
+	const uint32_t proof_size = mtp_l * 3 * 353;
+	// 5 bytes per tag and length at most
+	if (!submit_buf_reserve(buf, 64 + 5 * 8 + user_len + 4 + 8 + 4 + 4 + 16 + block_size + proof_size))
+		return false;
+
+	uchar *p = buf->data + 4;
+	*p++ = BOS_OBJ;
+	p = bos_put_uvarint(p, 3);
+	p = bos_put_data(p, 0, "id", 2);
+	// smallest unsigned type holding the id, as bos_serialize() does
+	if (id <= 0xFF) {
+		*p++ = BOS_UINT8;
+		*p++ = (uchar) id;
+	} else if (id <= 0xFFFF) {
+		uint16_t id16 = (uint16_t) id;
+		*p++ = BOS_UINT16;
+		memcpy(p, &id16, 2);
+		p += 2;
+	} else {
+		*p++ = BOS_UINT32;
+		memcpy(p, &id, 4);
+		p += 4;
+	}
+	p = bos_put_data(p, 0, "method", 6);
+	p = bos_put_data(p, BOS_STRING, "mining.submit", 13);
+	p = bos_put_data(p, 0, "params", 6);
+	*p++ = BOS_ARRAY;
+	p = bos_put_uvarint(p, 8);
+	p = bos_put_data(p, BOS_STRING, user, user_len);
+	p = bos_put_data(p, BOS_BYTES, job_id, 4);
+	p = bos_put_data(p, BOS_BYTES, xnonce2, 8);
+	p = bos_put_data(p, BOS_BYTES, &ntime, 4);
+	p = bos_put_data(p, BOS_BYTES, &nonce, 4);
+	p = bos_put_data(p, BOS_BYTES, mtp->MerkleRoot, 16);
+	p = bos_put_data(p, BOS_BYTES, mtp->nBlockMTP, block_size);
+	p = bos_put_data(p, BOS_BYTES, mtp->nProofMTP, proof_size);
+
+	uint32_t size = (uint32_t) (p - buf->data);
+	memcpy(buf->data, &size, 4);
+	buf->size = size;
+	return true;
+}
+
+bool mtp_submit_gbt(struct submit_buf *buf, const uint32_t *data, const struct mtp *mtp, uint32_t mtp_l,
+	const char *txs, const char *params)
+{
+	static const char head[] = "{\"method\": \"submitblock\", \"params\": [\"";
+	const uint32_t block_size = mtp_l * 2 * 128 * 8;
+	const uint32_t proof_size = mtp_l * 3 * 353;
+	const size_t txs_len = strlen(txs);
+	const size_t params_len = params ? strlen(params) : 0;
+	if (!submit_buf_reserve(buf, 128 + 2 * (84 + 32 + 64 + 16 + block_size + proof_size) + txs_len + params_len))
+		return false;
+
+	char *p = (char*) buf->data;
+	memcpy(p, head, sizeof(head) - 1);
+	p += sizeof(head) - 1;
+	p = hex_encode(p, (const uchar*) data, 84);
+	p = hex_encode(p, mtp->mtpHashValue, 32);
+	memset(p, '0', 2 * 64); // reserved
+	p += 2 * 64;
+	p = hex_encode(p, mtp->MerkleRoot, 16);
+	p = hex_encode(p, (const uchar*) mtp->nBlockMTP, block_size);
+	p = hex_encode(p, mtp->nProofMTP, proof_size);
+	memcpy(p, txs, txs_len);
+	p += txs_len;
+	if (params)
+		p += sprintf(p, "\", %s], \"id\":4}\r\n", params);
+	else
+		p += sprintf(p, "\"], \"id\":4}\r\n");
+	buf->size = (size_t) (p - (char*) buf->data);
+	return true;
+}
+
 
 
 static bool socket_full(curl_socket_t sock, int timeout)
@@ -1173,107 +1394,211 @@ static bool socket_full(curl_socket_t sock, int timeout)
 	return false;
 }
 
-bool stratum_socket_full(struct stratum_ctx *sctx, int timeout)
+#ifndef WIN32
+// pipe used to interrupt the stratum thread wait (pool switch, exit)
+static int stratum_wakeup_fd[2] = { -1, -1 };
+
+static void stratum_wakeup_init()
 {
-	if (!sctx->sockbuf) return false;
-	return strlen(sctx->sockbuf) || socket_full(sctx->sock, timeout);
+	if (stratum_wakeup_fd[0] >= 0 || pipe(stratum_wakeup_fd))
+		return;
+	fcntl(stratum_wakeup_fd[0], F_SETFL, O_NONBLOCK);
+	fcntl(stratum_wakeup_fd[1], F_SETFL, O_NONBLOCK);
 }
+#endif
 
-#define RBUFSIZE 2048
-#define RECVSIZE (RBUFSIZE - 4)
-
-static void stratum_buffer_append(struct stratum_ctx *sctx, const char *s)
+void stratum_wakeup()
 {
-	size_t old, snew;
+#ifndef WIN32
+	char c = 1;
+	if (stratum_wakeup_fd[1] >= 0 && write(stratum_wakeup_fd[1], &c, 1) < 0)
+		return;
+#endif
+}
 
-	old = strlen(sctx->sockbuf);
-	snew = old + strlen(s) + 1;
-	if (snew >= sctx->sockbuf_size) {
-		sctx->sockbuf_size = snew + (RBUFSIZE - (snew % RBUFSIZE));
-		sctx->sockbuf = (char*)realloc(sctx->sockbuf, sctx->sockbuf_size);
+// wait for data on the socket, false on timeout or stratum_wakeup()
+static bool stratum_wait(curl_socket_t sock, int timeout)
+{
+#ifndef WIN32
+	struct pollfd fds[2];
+	int rc, nfds = 1;
+
+	fds[0].fd = sock;
+	fds[0].events = POLLIN;
+	fds[0].revents = 0;
+	if (stratum_wakeup_fd[0] >= 0) {
+		fds[1].fd = stratum_wakeup_fd[0];
+		fds[1].events = POLLIN;
+		fds[1].revents = 0;
+		nfds = 2;
+	}
+	do {
+		rc = poll(fds, nfds, timeout * 1000);
+	} while (rc < 0 && errno == EINTR);
+	if (rc <= 0)
+		return false;
+	if (nfds == 2 && fds[1].revents) {
+		char drain[64];
+		while (read(stratum_wakeup_fd[0], drain, sizeof(drain)) > 0);
 	}
-	strcpy(sctx->sockbuf + old, s);
+	return fds[0].revents != 0;
+#else
+	return socket_full(sock, timeout);
+#endif
 }
 
-static void stratum_buffer_append_bos(struct stratum_ctx *sctx, const char *s,size_t size_mess)
+/* The receive buffer is filled at its tail straight by recv() and consumed
+ * from its head. Unread bytes are only moved back to the start when the tail
+ * reaches the end, so a message is always contiguous for the line split and
+ * bos_deserialize(). It only grows for a single message larger than itself. */
+#define SOCKBUF_SIZE (256 * 1024)
+#define SOCKBUF_MAX  (64 * 1024 * 1024)
+#define RECV_MIN     2048
+
+static inline size_t sockbuf_used(const struct stratum_ctx *sctx)
 {
+	return sctx->sockbuf_tail - sctx->sockbuf_head;
+}
+
+static void sockbuf_reset(struct stratum_ctx *sctx)
+{
+	sctx->sockbuf_head = sctx->sockbuf_tail = sctx->sockbuf_scan = 0;
+}
 
-	size_t old, snew;
+static FILE *stratum_capture = NULL;
 
-	old = strlen(sctx->sockbuf);
-	snew = old + strlen(s) + 1;
+bool stratum_capture_open(const char *filename)
+{
+	if (stratum_capture)
+		fclose(stratum_capture);
+	stratum_capture = fopen(filename, "wb");
+	return stratum_capture != NULL;
+}
 
-	if (snew >= sctx->sockbuf_size) {
-		sctx->sockbuf_size = snew + (RBUFSIZE - (snew % RBUFSIZE));
+// read what is pending on the socket, 0 when closed
+static ssize_t sockbuf_recv(struct stratum_ctx *sctx)
+{
+	ssize_t n;
+
+	if (!sockbuf_used(sctx)) {
+		sockbuf_reset(sctx);
+	} else if (sctx->sockbuf_size - sctx->sockbuf_tail < RECV_MIN && sctx->sockbuf_head) {
+		memmove(sctx->sockbuf, sctx->sockbuf + sctx->sockbuf_head, sockbuf_used(sctx));
+		sctx->sockbuf_tail -= sctx->sockbuf_head;
+		sctx->sockbuf_scan -= sctx->sockbuf_head;
+		sctx->sockbuf_head = 0;
+	}
+	if (sctx->sockbuf_size - sctx->sockbuf_tail < RECV_MIN) {
+		char *buf = (char*)realloc(sctx->sockbuf, sctx->sockbuf_size * 2);
+		if (!buf)
+			return -1;
+		sctx->sockbuf = buf;
+		sctx->sockbuf_size *= 2;
+	}
+
+	n = recv(sctx->sock, sctx->sockbuf + sctx->sockbuf_tail, (int)(sctx->sockbuf_size - sctx->sockbuf_tail), 0);
+	if (n > 0) {
+		if (stratum_capture) {
+			fwrite(sctx->sockbuf + sctx->sockbuf_tail, 1, n, stratum_capture);
+			fflush(stratum_capture);
+		}
+		sctx->sockbuf_tail += n;
 	}
+	return n;
+}
+
+// wait for more bytes until rstart + timeout, false when closed, failed or timed out
+static bool sockbuf_fill(struct stratum_ctx *sctx, time_t rstart, int timeout)
+{
+	while (1) {
+		int left = timeout - (int)(time(NULL) - rstart);
+		ssize_t n;
 
-	sctx->sockbuf = (char*)realloc(sctx->sockbuf, sctx->sockbuf_bossize + size_mess);
-	memcpy(sctx->sockbuf + sctx->sockbuf_bossize , s,size_mess);
-	sctx->sockbuf_bossize += size_mess; 
+		if (left < 0 || !stratum_wait(sctx->sock, left))
+			return false;
+		n = sockbuf_recv(sctx);
+		if (n > 0)
+			return true;
+		if (!n || !socket_blocks())
+			return false;
+	}
+}
 
+bool stratum_socket_full(struct stratum_ctx *sctx, int timeout)
+{
+	if (!sctx->sockbuf) return false;
+	return sockbuf_used(sctx) || stratum_wait(sctx->sock, timeout);
 }
 
 char *stratum_recv_line(struct stratum_ctx *sctx)
 {
-	ssize_t len, buflen;
-	char *tok, *sret = NULL;
-	int timeout = opt_timeout;
+	char *line, *nl, *sret = NULL;
+	time_t rstart = time(NULL);
+	size_t len;
 
 	if (!sctx->sockbuf)
 		return NULL;
 
-	if (!strstr(sctx->sockbuf, "\n")) {
-		bool ret = true;
-		time_t rstart = time(NULL);
-		if (!socket_full(sctx->sock, timeout)) {
-			applog(LOG_ERR, "stratum_recv_line timed out");
-			goto out;
-		}
-		do {
-			char s[RBUFSIZE];
-			ssize_t n;
-
-			memset(s, 0, RBUFSIZE);
-			n = recv(sctx->sock, s, RECVSIZE, 0);
-			if (!n) {
-				ret = false;
-				break;
+	while (!sret) {
+		// only the bytes received since the previous scan are searched
+		line = sctx->sockbuf + sctx->sockbuf_head;
+		nl = (char*)memchr(sctx->sockbuf + sctx->sockbuf_scan, '\n', sctx->sockbuf_tail - sctx->sockbuf_scan);
+		if (!nl) {
+			sctx->sockbuf_scan = sctx->sockbuf_tail;
+			if (!sockbuf_fill(sctx, rstart, opt_timeout)) {
+				if (time(NULL) - rstart >= opt_timeout)
+					applog(LOG_ERR, "stratum_recv_line timed out");
+				else if (opt_debug)
+					applog(LOG_ERR, "stratum_recv_line failed");
+				goto out;
 			}
-			if (n < 0) {
-				if (!socket_blocks() || !socket_full(sctx->sock, 1)) {
-					ret = false;
-					break;
-				}
-			} else
-				stratum_buffer_append(sctx, s);
-		} while (time(NULL) - rstart < timeout && !strstr(sctx->sockbuf, "\n"));
-
-		if (!ret) {
-			if (opt_debug) applog(LOG_ERR, "stratum_recv_line failed");
-			goto out;
+			continue;
 		}
+		len = (size_t)(nl - line);
+		sctx->sockbuf_head += len + 1;
+		sctx->sockbuf_scan = sctx->sockbuf_head;
+		if (!len)
+			continue; // empty line
+		sret = (char*)malloc(len + 1);
+		memcpy(sret, line, len);
+		sret[len] = '\0';
 	}
 
-	buflen = (ssize_t)strlen(sctx->sockbuf);
-	tok = strtok(sctx->sockbuf, "\n");
-	if (!tok) {
-		applog(LOG_ERR, "stratum_recv_line failed to parse a newline-terminated string");
-		goto out;
-	}
-	sret = strdup(tok);
-	len = (ssize_t)strlen(sret);
-
-	if (buflen > len + 1)
-		memmove(sctx->sockbuf, sctx->sockbuf + len + 1, buflen - len + 1);
-	else
-		sctx->sockbuf[0] = '\0';
-
 out:
 	if (sret && opt_protocol)
 		applog(LOG_DEBUG, "< %s", sret);
 	return sret;
 }
 
+const char* stratum_recv_bos(struct stratum_ctx *sctx, int timeout)
+{
+	time_t rstart = time(NULL);
+
+	if (!sctx->sockbuf)
+		return NULL;
+
+	while (1) {
+		if (sockbuf_used(sctx) >= sizeof(uint32_t)) {
+			const char *frame = sctx->sockbuf + sctx->sockbuf_head;
+			uint32_t size = bos_sizeof(frame);
+			if (size <= sizeof(uint32_t) || size > SOCKBUF_MAX) {
+				applog(LOG_ERR, "stratum_recv_bos: invalid message size %u", size);
+				return NULL;
+			}
+			if (sockbuf_used(sctx) >= size)
+				return frame;
+		}
+		if (!sockbuf_fill(sctx, rstart, timeout))
+			return NULL;
+	}
+}
+
+void stratum_consume_bos(struct stratum_ctx *sctx, const char *frame)
+{
+	sctx->sockbuf_head += bos_sizeof(frame);
+	sctx->sockbuf_scan = sctx->sockbuf_head;
+}
+
 
 
 json_t* recode_message(json_t *MyObject2)
@@ -1317,8 +1642,7 @@ json_t* recode_message(json_t *MyObject2)
 						int zsize = json_bytes_size(value2);
 						uchar* zbyte = (uchar*)json_bytes_value(value2);
 						char* strval = (char*)malloc(zsize * 2 + 1);
-						for (int k = 0; k<zsize; k++)
-							sprintf(&strval[2 * k], "%02x", zbyte[k]);
+						cbin2hex(strval, (const char*)zbyte, zsize);
 
 						json_array_append(json_arr, json_string(strval));
 						free(strval);
@@ -1349,8 +1673,7 @@ json_t* recode_message(json_t *MyObject2)
 								char* strval = (char*)malloc(zsize * 2 + 1);
 								//	  for (int k = 0; k<zsize; k++)
 								//		sprintf(&strval[2 * k], "%02x", zbyte[zsize - 1 - k]);
-								for (int k = 0; k<zsize; k++)
-									sprintf(&strval[2 * k], "%02x", zbyte[k]);
+								cbin2hex(strval, (const char*)zbyte, zsize);
 
 								json_array_append(json_arr2, json_string(strval));
 								free(strval);
@@ -1374,71 +1697,6 @@ json_t* recode_message(json_t *MyObject2)
 	return MyObject;
 }
 
-void stratum_bos_fillbuffer(struct stratum_ctx *sctx)
-{
-
-	int timeout = 300; //opt_timeout;
-	bool ret = true;
-	time_t rstart = time(NULL);
-	uint32_t TotalSize = sctx->sum_bossize;
-/*
-	if (!socket_full(sctx->sock, 1)) {
-		applog(LOG_ERR, "Fillbuffer stratum_recv_line timed out");
-		return;
-	}
-*/
-	do {
-		char s[RBUFSIZE];
-		ssize_t n;
-
-		memset(s, 0, RBUFSIZE);
-		n = recv(sctx->sock, s, RECVSIZE, 0);
-
-		if (!n) {
-			ret = false;
-			break;
-		}
-		 if (n < 0) {
-			if (!socket_blocks() || !socket_full(sctx->sock, 1)) {
-				ret = false;
-				break;
-			}
-		}
-		else {
-			stratum_buffer_append_bos(sctx, s, n);
-			while (TotalSize + bos_sizeof(sctx->sockbuf + TotalSize) <= sctx->sockbuf_bossize) {
-			
-				TotalSize += bos_sizeof(sctx->sockbuf + TotalSize);
-				if (TotalSize + bos_sizeof(sctx->sockbuf + TotalSize) == sctx->sockbuf_bossize) break;
-			}; 
-//			printf("bossize of buffer %d len buf %d TotalSize %d\n", bos_sizeof(sctx->sockbuf), (ssize_t)sctx->sockbuf_bossize,TotalSize);
-		}
-	} while (time(NULL) - rstart < timeout &&  !strstr(sctx->sockbuf, "\n"));
-	sctx->sum_bossize = TotalSize;
-
-}
-
-void stratum_bos_resizebuffer(struct stratum_ctx *sctx)
-{
-
-	if (bos_sizeof(sctx->sockbuf)<sctx->sockbuf_bossize) {
-		uint32_t totsize = sctx->sockbuf_bossize;
-		uint32_t remsize = sctx->sockbuf_bossize - bos_sizeof(sctx->sockbuf);
-		uint32_t currsize = bos_sizeof(sctx->sockbuf);
-		memmove(sctx->sockbuf, sctx->sockbuf + currsize, remsize);
-		sctx->sockbuf_bossize = remsize;
-		sctx->sum_bossize -= currsize;
-	}
-
-	else if (bos_sizeof(sctx->sockbuf)==sctx->sockbuf_bossize){
-		sctx->sockbuf[0] = '\0';
-		sctx->sockbuf_bossize = 0;
-		sctx->sum_bossize = 0;
-	}
-
-}
-
-
 json_t *stratum_recv_line_bos(struct stratum_ctx *sctx)
 {
 
@@ -1450,12 +1708,15 @@ json_t *stratum_recv_line_bos(struct stratum_ctx *sctx)
 	char *tok;
 	int timeout = opt_timeout;
 		bool ret = true;
-
-		stratum_bos_fillbuffer(sctx);
-
+		const char *frame = stratum_recv_bos(sctx, timeout);
+		if (!frame) {
+			applog(LOG_ERR, "stratum_recv_line failed");
+			return MyObject;
+		}
 
 					json_error_t *boserror = (json_error_t *)malloc(sizeof(json_error_t));
-					MyObject2 = bos_deserialize(sctx->sockbuf, boserror);
+					MyObject2 = bos_deserialize(frame, boserror);
+					stratum_consume_bos(sctx, frame);
 					json_t *json_arr = json_array();
 					size_t size;
 					const char *key;
@@ -1479,8 +1740,7 @@ json_t *stratum_recv_line_bos(struct stratum_ctx *sctx)
 									int zsize = json_bytes_size(value2);
 									uchar* zbyte = (uchar*)json_bytes_value(value2);
 									char* strval = (char*)malloc(zsize * 2 + 1);
-									for (int k = 0; k<zsize; k++)
-										sprintf(&strval[2 * k], "%02x", zbyte[k]);
+									cbin2hex(strval, (const char*)zbyte, zsize);
 									json_array_append(json_arr, json_string(strval));
 									free(strval);
 								}
@@ -1488,7 +1748,6 @@ json_t *stratum_recv_line_bos(struct stratum_ctx *sctx)
 						}
 					}
 					free(boserror);
-					stratum_bos_resizebuffer(sctx);
 					goto out;
 				
 
@@ -1523,18 +1782,15 @@ char *  stratum_recv_line_boschar(struct stratum_ctx *sctx)
 
 
 
-			stratum_bos_fillbuffer(sctx);
-			
-			json_error_t *boserror = (json_error_t *)malloc(sizeof(json_error_t));
-			if (bos_sizeof(sctx->sockbuf) < sctx->sockbuf_bossize) {
-//				MyObject2 = bos_deserialize(s + bos_sizeof(s), boserror);
-				MyObject2 = bos_deserialize(sctx->sockbuf, boserror);
+			const char *frame = stratum_recv_bos(sctx, opt_timeout);
+			if (!frame) {
+				applog(LOG_ERR, "stratum_recv_line_boschar failed");
+				return NULL;
 			}
-			else if (bos_sizeof(sctx->sockbuf) > sctx->sockbuf_bossize) {
-				printf("stratum_recv_line_boschar missing something in message \n");
-				return 0; }
-			else 
-				MyObject2 = bos_deserialize(sctx->sockbuf, boserror);
+
+			json_error_t *boserror = (json_error_t *)malloc(sizeof(json_error_t));
+			MyObject2 = bos_deserialize(frame, boserror);
+			stratum_consume_bos(sctx, frame);
 
 			json_t *json_arr = json_array();
 			size_t size;
@@ -1565,8 +1821,7 @@ char *  stratum_recv_line_boschar(struct stratum_ctx *sctx)
 								int zsize = json_bytes_size(value2);
 								uchar* zbyte = (uchar*)json_bytes_value(value2);
 								char* strval = (char*)malloc(zsize * 2 + 1);
-								for (int k = 0; k<zsize; k++)
-									sprintf(&strval[2 * k], "%02x", zbyte[k]);
+								cbin2hex(strval, (const char*)zbyte, zsize);
 
 								json_array_append(json_arr, json_string(strval));
 								free(strval);
@@ -1592,7 +1847,6 @@ char *  stratum_recv_line_boschar(struct stratum_ctx *sctx)
 				}
 			}
 			free(boserror);
-			stratum_bos_resizebuffer(sctx);
 			goto out;
 
 out:
@@ -1604,63 +1858,36 @@ out:
 
 bool    stratum_recv_line_compact(struct stratum_ctx *sctx)
 {
-
-	json_t *MyObject2 = json_object();
-	json_t *MyObject = json_object();
-	ssize_t len, buflen;
-	ssize_t mess;
-	uint32_t bossize = 0;
-	uint32_t Nmissing_packet = 0;
-	bool istarget = false;
+	json_t *MyObject2, *MyObject;
 	bool isok = false;
-	char *sret = NULL;
-	char *tok;
 
-	bool ret = true;
-	time_t rstart = time(NULL);
-
-			stratum_bos_fillbuffer(sctx);
-			// this should empty the buffer whatever its content
+	// handle all the messages already received
+	const char *frame = stratum_recv_bos(sctx, opt_timeout);
 
-			json_error_t *boserror = (json_error_t *)malloc(sizeof(json_error_t));
+	json_error_t *boserror = (json_error_t *)malloc(sizeof(json_error_t));
 
-			do {
-				if (bos_sizeof(sctx->sockbuf) > 100000) break;
-				if (bos_sizeof(sctx->sockbuf) == 0) break;
-				MyObject2 = bos_deserialize(sctx->sockbuf, boserror);
-//				bossize += bos_sizeof(sctx->sockbuf + bossize);
-
-				MyObject = recode_message(MyObject2);
-
-				isok = stratum_handle_method_bos_json(sctx, MyObject);
-				json_decref(MyObject2);
-				json_decref(MyObject);
-				if (sctx->sum_bossize>sctx->sockbuf_bossize) {
-					Nmissing_packet++;
-					stratum_bos_fillbuffer(sctx);
-					printf("stratum_recv_line_compact missing packet\n");
-					if (Nmissing_packet>5) { ret = false; goto out; }
-				}
+	while (frame) {
+		if (stratum_handle_notify_bos(sctx, frame)) {
+			stratum_consume_bos(sctx, frame);
+			isok = true;
+			frame = sockbuf_used(sctx) ? stratum_recv_bos(sctx, opt_timeout) : NULL;
+			continue;
+		}
+		MyObject2 = bos_deserialize(frame, boserror);
+		stratum_consume_bos(sctx, frame);
+		if (!MyObject2) break;
 
-				stratum_bos_resizebuffer(sctx);
-			} while (sctx->sum_bossize != 0);
-			free(boserror);
-//			sctx->sockbuf[0] = '\0';
-//			sctx->sockbuf_bossize = 0;
-//			sctx->sum_bossize = 0;
-			goto out;
+		MyObject = recode_message(MyObject2);
 
+		isok = stratum_handle_method_bos_json(sctx, MyObject);
+		json_decref(MyObject2);
+		json_decref(MyObject);
 
-	if (!ret) {
-		applog(LOG_ERR, "stratum_recv_line failed");
-		goto out;
+		frame = sockbuf_used(sctx) ? stratum_recv_bos(sctx, opt_timeout) : NULL;
 	}
+	free(boserror);
 
-out:
-
-	//	if (sret && opt_protocol)
-	//		applog(LOG_DEBUG, "< %s", sret);
-	return isok;//json_dumps(MyObject, 0);
+	return isok;
 }
 
 
@@ -1690,13 +1917,13 @@ bool stratum_connect(struct stratum_ctx *sctx, const char *url)
 	}
 	curl = sctx->curl;
 	if (!sctx->sockbuf) {
-		sctx->sockbuf = (char*)calloc(RBUFSIZE, 1);
-		sctx->sockbuf_size = RBUFSIZE;
+		sctx->sockbuf = (char*)malloc(SOCKBUF_SIZE);
+		sctx->sockbuf_size = SOCKBUF_SIZE;
 	}
-	sctx->sockbuf[0] = '\0';
-/* to watch */
-	sctx->sockbuf_bossize = 0;	
-	sctx->sum_bossize = 0;
+	sockbuf_reset(sctx);
+#ifndef WIN32
+	stratum_wakeup_init();
+#endif
 	pthread_mutex_unlock(&stratum_sock_lock);
 
 	if (url != sctx->url) {
@@ -1770,6 +1997,76 @@ void stratum_free_job(struct stratum_ctx *sctx)
 	pthread_mutex_unlock(&stratum_work_lock);
 }
 
+/* sha256d of the job coinbase for its current xnonce2, the blocks before the
+ * extranonce are compressed once per job (stratum_work_lock must be held) */
+void stratum_coinbase_hash(struct stratum_job *job, uchar *hash)
+{
+	if (!job->midstate_valid) {
+		size_t prefix = (size_t) (job->xnonce2 - job->coinbase) & ~(size_t) 63;
+		uint32_t block[16];
+		sha256_init(job->coinbase_midstate);
+		for (size_t off = 0; off < prefix; off += 64) {
+			memcpy(block, job->coinbase + off, 64);
+			sha256_transform(job->coinbase_midstate, block, 1);
+		}
+		job->coinbase_midsize = (uint32_t) prefix;
+		job->midstate_valid = true;
+	}
+	sha256d_midstate(hash, job->coinbase_midstate, job->coinbase + job->coinbase_midsize,
+		(int) (job->coinbase_size - job->coinbase_midsize), (int) job->coinbase_size);
+}
+
+/* fold the count leaves of a merkle tree, the tree needs room for count + 1
+ * hashes. Nodes are hashed four at a time and the levels of big templates are
+ * shared by the openmp threads. The sibling of the first node at each level is
+ * stored in branch if not NULL, returns the number of levels */
+#define MERKLE_OMP_QUADS 256
+static int merkle_tree_fold(uchar (*tree)[32], int count, uchar (*branch)[32])
+{
+	uchar (*level)[32] = tree;
+	uchar (*next)[32], (*out)[32];
+	int n = count, steps = 0;
+
+	if (n <= 1)
+		return 0;
+
+	next = (uchar (*)[32]) malloc(((n + 1) / 2 + 1) * 32);
+	while (n > 1) {
+		if (n % 2) {
+			memcpy(level[n], level[n - 1], 32);
+			++n;
+		}
+		if (branch)
+			memcpy(branch[steps], level[1], 32);
+		steps++;
+		n /= 2;
+		out = (level == tree) ? next : tree;
+		const int quads = n / 4;
+		#pragma omp parallel for if (quads >= MERKLE_OMP_QUADS)
+		for (int q = 0; q < quads; q++)
+			sha256d_64x4(out[4 * q], level[8 * q]);
+		for (int i = 4 * quads; i < n; i++)
+			sha256d(out[i], level[2 * i], 64);
+		level = out;
+	}
+	if (level != tree)
+		memcpy(tree[0], level[0], 32);
+	free(next);
+	return steps;
+}
+
+/* the root is left in tree[0] */
+void merkle_tree_root(uchar (*tree)[32], int count)
+{
+	merkle_tree_fold(tree, count, NULL);
+}
+
+/* branch of the first leaf (the coinbase), 32 hashes at most, the tree is overwritten */
+int merkle_tree_branch(uchar (*branch)[32], uchar (*tree)[32], int count)
+{
+	return merkle_tree_fold(tree, count, branch);
+}
+
 void stratum_disconnect(struct stratum_ctx *sctx)
 {
 	pthread_mutex_lock(&stratum_sock_lock);
@@ -1777,8 +2074,7 @@ void stratum_disconnect(struct stratum_ctx *sctx)
 		pools[sctx->pooln].disconnects++;
 		curl_easy_cleanup(sctx->curl);
 		sctx->curl = NULL;
-		if (sctx->sockbuf)
-			sctx->sockbuf[0] = '\0';
+		sockbuf_reset(sctx);
 		// free(sctx->sockbuf);
 		// sctx->sockbuf = NULL;
 	}
@@ -2200,6 +2496,8 @@ bool stratum_authorize_bos(struct stratum_ctx *sctx, const char *user, const cha
 		goto out;
 
 	sret = stratum_recv_line_boschar(sctx);
+	if (!sret)
+		goto out;
 
 	val = JSON_LOADS(sret, &err);
 	free(sret);
@@ -2346,6 +2644,7 @@ static bool stratum_notify(struct stratum_ctx *sctx, json_t *params)
 	                          sctx->xnonce2_size + coinb2_size;
 
 	sctx->job.coinbase = (uchar*) realloc(sctx->job.coinbase, sctx->job.coinbase_size);
+	sctx->job.midstate_valid = false;
 	sctx->job.xnonce2 = sctx->job.coinbase + coinb1_size + sctx->xnonce1_size;
 	hex2bin(sctx->job.coinbase, coinb1, coinb1_size);
 
@@ -2389,112 +2688,77 @@ out:
 }
 
 
-static bool stratum_notify_bos(struct stratum_ctx *sctx, json_t *params)
+static bool stratum_notify_bos(struct stratum_ctx *sctx, const bos_view_t *params)
 {
-
-	char algo[64] = { 0 };
-	const uchar *job_id, *prevhash, *coinb1, *coinb2, *version, *nbits, *ntime;
-	const uchar *extradata = NULL;
-	size_t coinb1_size, coinb2_size, job_idsize;
-	bool clean, ret = false;
-	int merkle_count, i, p = 0;
-	bool has_claim, has_roots;
-	json_t *merkle_arr;
+	// job_id, prevhash, coinb1, coinb2, merkle, version, nbits, ntime, clean
+	bos_view_t v[9], entry;
+	size_t coinb1_size, coinb2_size;
+	int merkle_count, i, n = 0;
 	uchar **merkle;
-	char* JobID = (char*)malloc(2 * 4 + 1);
-
-	get_currentalgo(algo, sizeof(algo));
-	/*
-	has_claim = strcmp(algo, "lbry") == 0 && json_array_size(params) == 10;
-	has_roots = strcmp(algo, "phi2") == 0 && json_array_size(params) == 10;
-	*/
-	//	printf("before merkle count\n");
-	job_idsize = json_bytes_size(json_array_get(params, p));
-
-	job_id = (const uchar*)json_bytes_value(json_array_get(params, p++));
-
-	//	memcpy(sctx->job.ucjob_id, job_id, job_idsize);
-
-	prevhash = (const uchar*)json_bytes_value(json_array_get(params, p++));
-
-	coinb1 = (const uchar*)json_bytes_value(json_array_get(params, p));
-	coinb1_size = json_bytes_size(json_array_get(params, p++));
-
-
-	coinb2 = (const uchar*)json_bytes_value(json_array_get(params, p));
-	coinb2_size = json_bytes_size(json_array_get(params, p++));
-
-	merkle_arr = json_array_get(params, p++);
-
-	if (!merkle_arr || !json_is_array(merkle_arr))
-		goto out;
+	char *job_id;
 
-	merkle_count = (int)json_array_size(merkle_arr);
-	version = (const uchar*)json_bytes_value(json_array_get(params, p++));
-
-	nbits = (const uchar*)json_bytes_value(json_array_get(params, p++));
-
-	ntime = (const uchar*)json_bytes_value(json_array_get(params, p++));
-
-	clean = json_is_true(json_array_get(params, p));
-
-	
+	if (bos_view_first(params, &v[0])) {
+		for (n = 1; n < 9; n++) {
+			v[n] = v[n - 1];
+			if (!bos_view_next(&v[n]))
+				break;
+		}
+	}
 
-	if (!job_id || !prevhash || !coinb1 || !coinb2 || !version || !nbits || !ntime /*||
-																				   strlen(prevhash) != 64 || strlen(version) != 8 ||
-																				   strlen(nbits) != 8 || strlen(ntime) != 8 */) {
+	if (n < 8 || v[4].type != BOS_ARRAY || v[1].size < 32) {
 		applog(LOG_ERR, "Stratum notify: invalid parameters");
-		goto out;
+		return false;
 	}
-
-	merkle = (uchar**)malloc(merkle_count * sizeof(uchar *));
-	for (i = 0; i < merkle_count; i++) {
-		const uchar  *s = (const uchar*)json_bytes_value(json_array_get(merkle_arr, i));
-		if (!s /*|| strlen(s) != 64*/) {
-			while (i--)
-				free(merkle[i]);
-			free(merkle);
-			applog(LOG_ERR, "Stratum notify: invalid Merkle branch");
-			goto out;
+	for (i = 0; i < 8; i++) {
+		if (i != 4 && v[i].type != BOS_BYTES) {
+			applog(LOG_ERR, "Stratum notify: invalid parameters");
+			return false;
 		}
-		merkle[i] = (uchar*)malloc(32);
-		memcpy(merkle[i], s, 32);
 	}
 
+	// the bytes are still in the socket buffer, keep what the job needs
+	merkle_count = (int) v[4].size;
+	merkle = (uchar**) malloc(merkle_count * sizeof(uchar *));
+	i = 0;
+	if (bos_view_first(&v[4], &entry)) do {
+		if (entry.type != BOS_BYTES || entry.size < 32)
+			break;
+		merkle[i] = (uchar*) malloc(32);
+		memcpy(merkle[i++], entry.data, 32);
+	} while (bos_view_next(&entry));
+	if (i != merkle_count) {
+		while (i--)
+			free(merkle[i]);
+		free(merkle);
+		applog(LOG_ERR, "Stratum notify: invalid Merkle branch");
+		return false;
+	}
+
+	job_id = abin2hex(v[0].data, v[0].size);
+	coinb1_size = v[2].size;
+	coinb2_size = v[3].size;
+
 	pthread_mutex_lock(&stratum_work_lock);
 
 	sctx->job.coinbase_size = coinb1_size + sctx->xnonce1_size +
 		sctx->xnonce2_size + coinb2_size;
 
 	sctx->job.coinbase = (uchar*)realloc(sctx->job.coinbase, sctx->job.coinbase_size);
+	sctx->job.midstate_valid = false;
 	sctx->job.xnonce2 = sctx->job.coinbase + coinb1_size + sctx->xnonce1_size;
-	memcpy(sctx->job.coinbase, coinb1, coinb1_size);
+	memcpy(sctx->job.coinbase, v[2].data, coinb1_size);
 	memcpy(sctx->job.coinbase + coinb1_size, sctx->xnonce1, sctx->xnonce1_size);
 
-	//
-
-	JobID = abin2hex(job_id, job_idsize);
-
-	if (!sctx->job.job_id || strcmp(sctx->job.job_id, JobID)) {
+	if (!sctx->job.job_id || strcmp(sctx->job.job_id, job_id)) {
 		memset(sctx->job.xnonce2, 0, sctx->xnonce2_size);
 		sctx->job.IncXtra = false;
 	}
-	//	memset(sctx->job.xnonce2, 1, 1);
-	memcpy(sctx->job.xnonce2 + sctx->xnonce2_size, coinb2, coinb2_size);
-
+	memcpy(sctx->job.xnonce2 + sctx->xnonce2_size, v[3].data, coinb2_size);
 
-	//printf("before job_id\n");
 	free(sctx->job.job_id);
-	//	sctx->job.job_id = job_id;
-	sctx->job.job_id = (char*)malloc(2 * job_idsize + 1);
-	sctx->job.job_id = abin2hex(job_id, job_idsize);
-	free(JobID);
-	memcpy(sctx->job.prevhash, prevhash, 32);
+	sctx->job.job_id = job_id;
+	memcpy(sctx->job.prevhash, v[1].data, 32);
 
-	/*
-	if (has_claim) memcpy(sctx->job.extra, extradata, 32);
-	if (has_roots) memcpy(sctx->job.extra, extradata, 64);
-	*/
 	sctx->job.height = getblocheight(sctx);
 
 	for (i = 0; i < sctx->job.merkle_count; i++)
@@ -2502,22 +2766,42 @@ static bool stratum_notify_bos(struct stratum_ctx *sctx, json_t *params)
 	free(sctx->job.merkle);
 	sctx->job.merkle = merkle;
 	sctx->job.merkle_count = merkle_count;
-	//	sctx->job.version = malloc(sizeof(uint32_t*));
-	memcpy(sctx->job.version, version, 8);
-	memcpy(sctx->job.nbits, nbits, 8);
-	memcpy(sctx->job.ntime, ntime, 8);
 
-	sctx->job.clean = clean;
+	// the pool sends 4 bytes for each of them
+	memset(sctx->job.version, 0, sizeof(sctx->job.version));
+	memset(sctx->job.nbits, 0, sizeof(sctx->job.nbits));
+	memset(sctx->job.ntime, 0, sizeof(sctx->job.ntime));
+	memcpy(sctx->job.version, v[5].data, min(v[5].size, (uint32_t) sizeof(sctx->job.version)));
+	memcpy(sctx->job.nbits, v[6].data, min(v[6].size, (uint32_t) sizeof(sctx->job.nbits)));
+	memcpy(sctx->job.ntime, v[7].data, min(v[7].size, (uint32_t) sizeof(sctx->job.ntime)));
+
+	sctx->job.clean = n > 8 && bos_view_is_true(&v[8]);
 
 	sctx->job.diff = sctx->next_diff;
 
 	pthread_mutex_unlock(&stratum_work_lock);
 
-	ret = true;
+	return true;
+}
 
-out:
+/* job notifications are read in place from the receive buffer,
+ * returns false when the frame is another message */
+bool stratum_handle_notify_bos(struct stratum_ctx *sctx, const char *frame)
+{
+	bos_view_t msg, method, params;
 
-	return ret;
+	if (!bos_view_init(&msg, frame, bos_sizeof(frame)))
+		return false;
+	if (!bos_view_get(&msg, "method", &method) || !bos_view_strcaseeq(&method, "mining.notify"))
+		return false;
+
+	if (!bos_view_get(&msg, "params", &params) || params.type != BOS_ARRAY) {
+		applog(LOG_ERR, "Stratum notify: invalid parameters");
+		return true;
+	}
+
+	stratum_notify_bos(sctx, &params);
+	return true;
 }
 
 
@@ -2602,6 +2886,7 @@ static bool stratum_notify_bos_old(struct stratum_ctx *sctx, json_t *params)
 		sctx->xnonce2_size + coinb2_size;
 
 	sctx->job.coinbase = (uchar*)realloc(sctx->job.coinbase, sctx->job.coinbase_size);
+	sctx->job.midstate_valid = false;
 	sctx->job.xnonce2 = sctx->job.coinbase + coinb1_size + sctx->xnonce1_size;
 	memcpy(sctx->job.coinbase, coinb1, coinb1_size);
 	memcpy(sctx->job.coinbase + coinb1_size, sctx->xnonce1, sctx->xnonce1_size);
@@ -2721,12 +3006,19 @@ static double le256todouble(unsigned char* target)
 static bool stratum_set_target(struct stratum_ctx *sctx, json_t *params)
 {
 	unsigned char* target;
+	json_t *val = json_array_get(params, 0);
 	double truediffone = 26959535291011309493156476344723991336010898738574164086137773096960.0;
-	target = (unsigned char*)json_bytes_value(json_array_get(params, 0));
+	target = (unsigned char*)json_bytes_value(val);
+	if (!target || json_bytes_size(val) != sizeof(sctx->next_target)) {
+		applog(LOG_ERR, "Stratum set_target: invalid target");
+		return false;
+	}
 	double diff = (truediffone * 1) / le256todouble(target);
 	pthread_mutex_lock(&stratum_work_lock);
-	sctx->next_target = target;
+	// the json buffer is freed with the message
+	memcpy(sctx->next_target, target, sizeof(sctx->next_target));
 	sctx->next_diff = diff;
+	sctx->target_gen++;
 	pthread_mutex_unlock(&stratum_work_lock);
 
 	return true;
@@ -3285,12 +3577,7 @@ bool stratum_handle_method_bos_json(struct stratum_ctx *sctx, json_t *val)
 //	printf("stratum_handle_method_bos_json The method  %s\n",method);
 
 
-	if (!strcasecmp(method, "mining.notify")) {
-//		printf("mining.notify\n");
-		ret = stratum_notify_bos(sctx, params);
-//		printf("end mining.notify\n");
-		goto out;
-	}
+	// mining.notify is handled before, see stratum_handle_notify_bos()
 	if (!strcasecmp(method, "mining.set_target")) {
 		ret = stratum_set_target(sctx, params);
 		goto out;
@@ -3353,34 +3640,106 @@ struct thread_q *tq_new(void)
 {
 	struct thread_q *tq;
 
-	tq = (struct thread_q *)calloc(1, sizeof(*tq));
+	/* the head and tail cache lines need an aligned block */
+	tq = (struct thread_q *)aligned_calloc((int) sizeof(*tq));
 	if (!tq)
 		return NULL;
 
-	INIT_LIST_HEAD(&tq->q);
+	for (uint32_t i = 0; i < TQ_SIZE; i++)
+		tq->ent[i].seq.store(i, std::memory_order_relaxed);
 	pthread_mutex_init(&tq->mutex, NULL);
 	pthread_cond_init(&tq->cond, NULL);
+	pthread_cond_init(&tq->space, NULL);
 
 	return tq;
 }
 
 void tq_free(struct thread_q *tq)
 {
-	struct tq_ent *ent, *iter;
-
 	if (!tq)
 		return;
 
-	list_for_each_entry_safe(ent, iter, &tq->q, q_node, struct tq_ent, struct tq_ent) {
-		list_del(&ent->q_node);
-		free(ent);
-	}
-
+	pthread_cond_destroy(&tq->space);
 	pthread_cond_destroy(&tq->cond);
 	pthread_mutex_destroy(&tq->mutex);
 
-	memset(tq, 0, sizeof(*tq));	/* poison */
-	free(tq);
+	memset((void*)tq, 0, sizeof(*tq));	/* poison */
+	aligned_free(tq);
+}
+
+static inline uint64_t tq_now_us()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static bool tq_try_push(struct thread_q *tq, void *data)
+{
+	uint32_t pos = tq->head.load(std::memory_order_relaxed);
+	struct tq_ent *ent;
+
+	for (;;) {
+		ent = &tq->ent[pos & (TQ_SIZE - 1)];
+		int32_t diff = (int32_t) (ent->seq.load(std::memory_order_acquire) - pos);
+		if (diff == 0) {
+			if (tq->head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+				break;
+		} else if (diff < 0) {
+			return false; /* full */
+		} else {
+			pos = tq->head.load(std::memory_order_relaxed);
+		}
+	}
+
+	ent->data = data;
+	ent->pushed_us = tq_now_us();
+	ent->seq.store(pos + 1, std::memory_order_release);
+
+	uint32_t depth = pos + 1 - tq->tail.load(std::memory_order_relaxed);
+	uint32_t max_depth = tq->max_depth.load(std::memory_order_relaxed);
+	while (depth <= TQ_SIZE && depth > max_depth &&
+		!tq->max_depth.compare_exchange_weak(max_depth, depth, std::memory_order_relaxed));
+	tq->pushed.fetch_add(1, std::memory_order_relaxed);
+	return true;
+}
+
+static bool tq_try_pop(struct thread_q *tq, void **data)
+{
+	uint32_t pos = tq->tail.load(std::memory_order_relaxed);
+	struct tq_ent *ent;
+
+	for (;;) {
+		ent = &tq->ent[pos & (TQ_SIZE - 1)];
+		int32_t diff = (int32_t) (ent->seq.load(std::memory_order_acquire) - (pos + 1));
+		if (diff == 0) {
+			if (tq->tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+				break;
+		} else if (diff < 0) {
+			return false; /* empty */
+		} else {
+			pos = tq->tail.load(std::memory_order_relaxed);
+		}
+	}
+
+	*data = ent->data;
+	uint64_t pushed_us = ent->pushed_us;
+	ent->seq.store(pos + TQ_SIZE, std::memory_order_release);
+
+	tq->wait_us.fetch_add(tq_now_us() - pushed_us, std::memory_order_relaxed);
+	tq->popped.fetch_add(1, std::memory_order_relaxed);
+	return true;
+}
+
+/* wake a sleeping thread, the fence pairs with the one in tq_sleep() */
+static void tq_wake(struct thread_q *tq, std::atomic<int> *waiting, pthread_cond_t *cond)
+{
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (waiting->load(std::memory_order_relaxed)) {
+		pthread_mutex_lock(&tq->mutex);
+		pthread_cond_signal(cond);
+		pthread_mutex_unlock(&tq->mutex);
+	}
 }
 
 static void tq_freezethaw(struct thread_q *tq, bool frozen)
@@ -3388,8 +3747,10 @@ static void tq_freezethaw(struct thread_q *tq, bool frozen)
 	pthread_mutex_lock(&tq->mutex);
 
 	tq->frozen = frozen;
+	tq->wakeups++;
 
-	pthread_cond_signal(&tq->cond);
+	pthread_cond_broadcast(&tq->cond);
+	pthread_cond_broadcast(&tq->space);
 	pthread_mutex_unlock(&tq->mutex);
 }
 
@@ -3405,66 +3766,98 @@ void tq_thaw(struct thread_q *tq)
 
 bool tq_push(struct thread_q *tq, void *data)
 {
-	struct tq_ent *ent;
 	bool rc = true;
 
-	ent = (struct tq_ent *)calloc(1, sizeof(*ent));
-	if (!ent)
+	if (tq->frozen)
 		return false;
 
-	ent->data = data;
-	INIT_LIST_HEAD(&ent->q_node);
-
-	pthread_mutex_lock(&tq->mutex);
-
-	if (!tq->frozen) {
-		list_add_tail(&ent->q_node, &tq->q);
-	} else {
-		free(ent);
-		rc = false;
+	if (!tq_try_push(tq, data)) {
+		/* full, wait for a consumer unless the queue gets frozen */
+		pthread_mutex_lock(&tq->mutex);
+		tq->waiting_push++;
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		while (!(rc = tq_try_push(tq, data))) {
+			if (tq->frozen)
+				break;
+			pthread_cond_wait(&tq->space, &tq->mutex);
+		}
+		tq->waiting_push--;
+		pthread_mutex_unlock(&tq->mutex);
+		if (!rc)
+			return false;
 	}
 
-	pthread_cond_signal(&tq->cond);
-	pthread_mutex_unlock(&tq->mutex);
-
-	return rc;
+	tq_wake(tq, &tq->waiting_pop, &tq->cond);
+	return true;
 }
 
-void *tq_pop(struct thread_q *tq, const struct timespec *abstime)
+/* push without waiting, false if the queue is full or frozen */
+bool tq_push_nowait(struct thread_q *tq, void *data)
 {
+	if (tq->frozen || !tq_try_push(tq, data))
+		return false;
 
+	tq_wake(tq, &tq->waiting_pop, &tq->cond);
+	return true;
+}
 
-	struct tq_ent *ent;
-	void *rval = NULL;
-	int rc;
-
-	pthread_mutex_lock(&tq->mutex);
+/* wait for at least one entry (or a freeze/thaw, or abstime), then take up
+ * to max of them without waiting again. returns the number of entries,
+ * a frozen queue only returns what is left in it */
+int tq_pop_batch(struct thread_q *tq, void **data, int max, const struct timespec *abstime)
+{
+	int n = 0;
 
-	if (!list_empty(&tq->q))
-		goto pop;
+	if (max <= 0)
+		return 0;
 
-	if (abstime) {
-		rc = pthread_cond_timedwait(&tq->cond, &tq->mutex, abstime);
-	} else {
-		rc = pthread_cond_wait(&tq->cond, &tq->mutex);
+	if (!tq_try_pop(tq, &data[0])) {
+		bool got;
+		int rc = 0;
+
+		pthread_mutex_lock(&tq->mutex);
+		uint32_t wakeups = tq->wakeups;
+		tq->waiting_pop++;
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		while (!(got = tq_try_pop(tq, &data[0])) && !rc && !tq->frozen && tq->wakeups == wakeups) {
+			if (abstime)
+				rc = pthread_cond_timedwait(&tq->cond, &tq->mutex, abstime);
+			else
+				rc = pthread_cond_wait(&tq->cond, &tq->mutex);
+		}
+		tq->waiting_pop--;
+		pthread_mutex_unlock(&tq->mutex);
+		if (!got)
+			return 0;
 	}
-	if (rc)
-		goto out;
-	if (list_empty(&tq->q))
-		goto out;
 
-pop:
-	ent = list_entry(tq->q.next, struct tq_ent, q_node);
-	rval = ent->data;
+	for (n = 1; n < max && tq_try_pop(tq, &data[n]); n++);
 
-	list_del(&ent->q_node);
-	free(ent);
+	tq_wake(tq, &tq->waiting_push, &tq->space);
+	return n;
+}
 
-out:
-	pthread_mutex_unlock(&tq->mutex);
+void *tq_pop(struct thread_q *tq, const struct timespec *abstime)
+{
+	void *rval = NULL;
+
+	tq_pop_batch(tq, &rval, 1, abstime);
 	return rval;
 }
 
+void tq_getstats(struct thread_q *tq, struct tq_stats *stats)
+{
+	uint32_t tail = tq->tail.load(std::memory_order_relaxed);
+	uint32_t depth = tq->head.load(std::memory_order_relaxed) - tail;
+
+	stats->depth = depth <= TQ_SIZE ? depth : 0;
+	stats->max_depth = tq->max_depth.load(std::memory_order_relaxed);
+	stats->size = TQ_SIZE;
+	stats->pushed = tq->pushed.load(std::memory_order_relaxed);
+	stats->popped = tq->popped.load(std::memory_order_relaxed);
+	stats->wait_us = tq->wait_us.load(std::memory_order_relaxed);
+}
+
 /**
  * @param buf char[9] mini
  * @param time_t timer to convert
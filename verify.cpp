@@ -0,0 +1,109 @@
+/**
+ * Batched cpu check of the X chains candidates
+ *
+ * The nonces are hashed by groups of 4: the 64-bit ARX stages (blake, bmw,
+ * skein, keccak) run on the 4 lanes at once when the cpu has AVX2, the
+ * other sph_chain stages lane by lane on the same buffers. The lyra2 algos
+ * have their own 4 lanes hash, built around LYRA2_x4.
+ */
+#include <string.h>
+
+#include "sph/sph_chain.h"
+#include "sph/sph_x4.h"
+
+#include "miner.h"
+#include "algos.h"
+
+#define VERIFY_LANES 4
+
+#define VERIFY_X11 SPH_BLAKE512, SPH_BMW512, SPH_GROESTL512, SPH_SKEIN512, SPH_JH512, SPH_KECCAK512, \
+	SPH_LUFFA512, SPH_CUBEHASH512, SPH_SHAVITE512, SPH_SIMD512, SPH_ECHO512
+
+static const uint8_t chain_x11[] = { VERIFY_X11, SPH_STAGES };
+static const uint8_t chain_x13[] = { VERIFY_X11, SPH_HAMSI512, SPH_FUGUE512, SPH_STAGES };
+static const uint8_t chain_x14[] = { VERIFY_X11, SPH_HAMSI512, SPH_FUGUE512, SPH_SHABAL512, SPH_STAGES };
+static const uint8_t chain_x15[] = { VERIFY_X11, SPH_HAMSI512, SPH_FUGUE512, SPH_SHABAL512, SPH_WHIRLPOOL, SPH_STAGES };
+static const uint8_t chain_x17[] = { VERIFY_X11, SPH_HAMSI512, SPH_FUGUE512, SPH_SHABAL512, SPH_WHIRLPOOL,
+	SPH_SHA512, SPH_HAVAL256_5, SPH_STAGES };
+
+static const uint8_t* verify_chain(int algo)
+{
+	switch (algo) {
+	case ALGO_X11: return chain_x11;
+	case ALGO_X13: return chain_x13;
+	case ALGO_X14: return chain_x14;
+	case ALGO_X15: return chain_x15;
+	case ALGO_X17: return chain_x17;
+	}
+	return NULL;
+}
+
+/* the stages with a 4 lanes version, false for the others */
+static bool stage_x4(int stage, unsigned char *hash)
+{
+	switch (stage) {
+	case SPH_BLAKE512:  sph_blake512_x4(hash, hash, 64); return true;
+	case SPH_BMW512:    sph_bmw512_x4(hash, hash); return true;
+	case SPH_SKEIN512:  sph_skein512_x4(hash, hash); return true;
+	case SPH_KECCAK512: sph_keccak512_x4(hash, hash); return true;
+	}
+	return false;
+}
+
+/* the algos hashed 4 nonces at once by a single function */
+static void (*verify_hash_x4(int algo))(void *output, const void *input)
+{
+	switch (algo) {
+	case ALGO_LYRA2v2: return lyra2v2_hash_x4;
+	case ALGO_LYRA2Z:  return lyra2Z_hash_x4;
+	}
+	return NULL;
+}
+
+/**
+ * Hash n nonces of a block header (the work data, 20 words) with the algo chain
+ * @param out_hashes 8 words per nonce, like the xNNhash functions
+ * @return false if the algo has no batched chain
+ */
+bool verify_batch(int algo, const uint32_t *header, const uint32_t *nonces, int n, uint32_t *out_hashes)
+{
+	const uint8_t *chain = verify_chain(algo);
+	void (*hash_x4)(void *output, const void *input) = verify_hash_x4(algo);
+	uint32_t _ALIGN(64) endiandata[VERIFY_LANES][20];
+	unsigned char _ALIGN(64) hash[VERIFY_LANES * 64];
+
+	if (!chain && !hash_x4)
+		return false;
+
+	for (int k = 0; k < 20; k++)
+		be32enc(&endiandata[0][k], header[k]);
+	for (int l = 1; l < VERIFY_LANES; l++)
+		memcpy(endiandata[l], endiandata[0], sizeof(endiandata[0]));
+
+	for (int i = 0; i < n; i += VERIFY_LANES) {
+		const int lanes = min(VERIFY_LANES, n - i);
+
+		// the unused lanes of the last group repeat its last nonce
+		for (int l = 0; l < VERIFY_LANES; l++)
+			be32enc(&endiandata[l][19], nonces[i + min(l, lanes - 1)]);
+
+		if (hash_x4) {
+			hash_x4(hash, endiandata);
+			memcpy(&out_hashes[i * 8], hash, lanes * 32);
+			continue;
+		}
+
+		sph_blake512_x4(hash, endiandata, 80);
+
+		for (const uint8_t *stage = &chain[1]; *stage != SPH_STAGES; stage++) {
+			if (lanes > 1 && stage_x4(*stage, hash))
+				continue;
+			for (int l = 0; l < lanes; l++)
+				sph_stage_fns[*stage](&hash[l * 64], &hash[l * 64], 64);
+		}
+
+		for (int l = 0; l < lanes; l++)
+			memcpy(&out_hashes[(i + l) * 8], &hash[l * 64], 32);
+	}
+	return true;
+}
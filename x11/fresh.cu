@@ -1,11 +1,7 @@
 /**
  * Fresh algorithm
  */
-extern "C" {
-#include "sph/sph_shavite.h"
-#include "sph/sph_simd.h"
-#include "sph/sph_echo.h"
-}
+#include "sph/sph_chain.h"
 #include "miner.h"
 #include "cuda_helper.h"
 
@@ -31,38 +27,8 @@ extern void x11_echo512_cpu_hash_64(int thr_id, uint32_t threads, uint32_t start
 extern "C" void fresh_hash(void *state, const void *input)
 {
 	// shavite-simd-shavite-simd-echo
-
-	sph_shavite512_context ctx_shavite;
-	sph_simd512_context ctx_simd;
-	sph_echo512_context ctx_echo;
-
-	unsigned char hash[128]; // uint32_t hashA[16], hashB[16];
-	#define hashA hash
-	#define hashB hash+64
-
-	memset(hash, 0, sizeof hash);
-
-	sph_shavite512_init(&ctx_shavite);
-	sph_shavite512(&ctx_shavite, input, 80);
-	sph_shavite512_close(&ctx_shavite, hashA);
-
-	sph_simd512_init(&ctx_simd);
-	sph_simd512(&ctx_simd, hashA, 64);
-	sph_simd512_close(&ctx_simd, hashB);
-
-	sph_shavite512_init(&ctx_shavite);
-	sph_shavite512(&ctx_shavite, hashB, 64);
-	sph_shavite512_close(&ctx_shavite, hashA);
-
-	sph_simd512_init(&ctx_simd);
-	sph_simd512(&ctx_simd, hashA, 64);
-	sph_simd512_close(&ctx_simd, hashB);
-
-	sph_echo512_init(&ctx_echo);
-	sph_echo512(&ctx_echo, hashB, 64);
-	sph_echo512_close(&ctx_echo, hashA);
-
-	memcpy(state, hash, 32);
+	sph_chain<sph::shavite512, sph::simd512, sph::shavite512, sph::simd512,
+		sph::echo512>::hash(state, input);
 }
 
 static bool init[MAX_GPUS] = { 0 };
@@ -5,19 +5,7 @@
 #include <stdio.h>
 #include <memory.h>
 
-extern "C" {
-#include "sph/sph_blake.h"
-#include "sph/sph_bmw.h"
-#include "sph/sph_groestl.h"
-#include "sph/sph_skein.h"
-#include "sph/sph_jh.h"
-#include "sph/sph_keccak.h"
-#include "sph/sph_luffa.h"
-#include "sph/sph_cubehash.h"
-#include "sph/sph_shavite.h"
-#include "sph/sph_simd.h"
-#include "sph/sph_echo.h"
-}
+#include "sph/sph_chain.h"
 
 #include "miner.h"
 #include "cuda_helper.h"
@@ -25,6 +13,7 @@ extern "C" {
 
 static uint32_t *d_hash[MAX_GPUS];
 
+// same values as the sph_stage ones
 enum Algo {
 	BLAKE = 0,
 	BMW,
@@ -74,31 +63,30 @@ static int nextPerm(uint8_t n[], int count)
 	return (tail != 0);
 }
 
-static void getAlgoString(char *str, int seq)
+static void getAlgoOrder(uint8_t *order, int seq)
 {
-	uint8_t algoList[HASH_FUNC_COUNT];
-	char *sptr;
-
-	initPerm(algoList, HASH_FUNC_COUNT);
+	initPerm(order, HASH_FUNC_COUNT);
 
 	for (int k = 0; k < seq; k++) {
-		nextPerm(algoList, HASH_FUNC_COUNT);
+		nextPerm(order, HASH_FUNC_COUNT);
 	}
+}
 
-	sptr = str;
+static void getAlgoString(char *str, const uint8_t *order)
+{
+	char *sptr = str;
 	for (int j = 0; j < HASH_FUNC_COUNT; j++) {
-		if (algoList[j] >= 10)
-			sprintf(sptr, "%c", 'A' + (algoList[j] - 10));
+		if (order[j] >= 10)
+			sprintf(sptr, "%c", 'A' + (order[j] - 10));
 		else
-			sprintf(sptr, "%u", (uint32_t) algoList[j]);
+			sprintf(sptr, "%u", (uint32_t) order[j]);
 		sptr++;
 	}
 	*sptr = '\0';
-	//applog(LOG_DEBUG, "nextPerm %s", str);
 }
 
 static __thread uint32_t s_ntime = 0;
-static char hashOrder[HASH_FUNC_COUNT + 1] = { 0 };
+static uint8_t hashOrder[HASH_FUNC_COUNT] = { 0 };
 static int  s_sequence = -1;
 
 #define INITIAL_DATE 0x57254700
@@ -108,11 +96,11 @@ static inline int getCurrentAlgoSeq(uint32_t current_time)
 	return (int) (current_time - INITIAL_DATE) / (60 * 60 * 24);
 }
 
-static void evo_twisted_code(uint32_t ntime, char *permstr)
+static void evo_twisted_code(uint32_t ntime, uint8_t *order)
 {
 	int seq = getCurrentAlgoSeq(ntime);
 	if (s_sequence != seq) {
-		getAlgoString(permstr, seq);
+		getAlgoOrder(order, seq);
 		s_sequence = seq;
 	}
 }
@@ -120,101 +108,13 @@ static void evo_twisted_code(uint32_t ntime, char *permstr)
 // X11evo CPU Hash
 extern "C" void x11evo_hash(void *output, const void *input)
 {
-	uint32_t _ALIGN(64) hash[64/4] = { 0 };
-
-	sph_blake512_context     ctx_blake;
-	sph_bmw512_context       ctx_bmw;
-	sph_groestl512_context   ctx_groestl;
-	sph_skein512_context     ctx_skein;
-	sph_jh512_context        ctx_jh;
-	sph_keccak512_context    ctx_keccak;
-	sph_luffa512_context     ctx_luffa1;
-	sph_cubehash512_context  ctx_cubehash1;
-	sph_shavite512_context   ctx_shavite1;
-	sph_simd512_context      ctx_simd1;
-	sph_echo512_context      ctx_echo1;
-
 	if (s_sequence == -1) {
 		uint32_t *data = (uint32_t*) input;
 		const uint32_t ntime = data[17];
 		evo_twisted_code(ntime, hashOrder);
 	}
 
-	void *in = (void*) input;
-	int size = 80;
-
-	const int hashes = (int) strlen(hashOrder);
-
-	for (int i = 0; i < hashes; i++)
-	{
-		const char elem = hashOrder[i];
-		uint8_t algo = elem >= 'A' ? elem - 'A' + 10 : elem - '0';
-
-		if (i > 0) {
-			in = (void*) hash;
-			size = 64;
-		}
-
-		switch (algo) {
-		case BLAKE:
-			sph_blake512_init(&ctx_blake);
-			sph_blake512(&ctx_blake, in, size);
-			sph_blake512_close(&ctx_blake, hash);
-			break;
-		case BMW:
-			sph_bmw512_init(&ctx_bmw);
-			sph_bmw512(&ctx_bmw, in, size);
-			sph_bmw512_close(&ctx_bmw, hash);
-			break;
-		case GROESTL:
-			sph_groestl512_init(&ctx_groestl);
-			sph_groestl512(&ctx_groestl, in, size);
-			sph_groestl512_close(&ctx_groestl, hash);
-			break;
-		case SKEIN:
-			sph_skein512_init(&ctx_skein);
-			sph_skein512(&ctx_skein, in, size);
-			sph_skein512_close(&ctx_skein, hash);
-			break;
-		case JH:
-			sph_jh512_init(&ctx_jh);
-			sph_jh512(&ctx_jh, in, size);
-			sph_jh512_close(&ctx_jh, hash);
-			break;
-		case KECCAK:
-			sph_keccak512_init(&ctx_keccak);
-			sph_keccak512(&ctx_keccak, in, size);
-			sph_keccak512_close(&ctx_keccak, hash);
-			break;
-		case LUFFA:
-			sph_luffa512_init(&ctx_luffa1);
-			sph_luffa512(&ctx_luffa1, in, size);
-			sph_luffa512_close(&ctx_luffa1, hash);
-			break;
-		case CUBEHASH:
-			sph_cubehash512_init(&ctx_cubehash1);
-			sph_cubehash512(&ctx_cubehash1, in, size);
-			sph_cubehash512_close(&ctx_cubehash1, hash);
-			break;
-		case SHAVITE:
-			sph_shavite512_init(&ctx_shavite1);
-			sph_shavite512(&ctx_shavite1, in, size);
-			sph_shavite512_close(&ctx_shavite1, hash);
-			break;
-		case SIMD:
-			sph_simd512_init(&ctx_simd1);
-			sph_simd512(&ctx_simd1, in, size);
-			sph_simd512_close(&ctx_simd1, hash);
-			break;
-		case ECHO:
-			sph_echo512_init(&ctx_echo1);
-			sph_echo512(&ctx_echo1, in, size);
-			sph_echo512_close(&ctx_echo1, hash);
-			break;
-		}
-	}
-
-	memcpy(output, hash, 32);
+	sph_chain_run(output, input, hashOrder, HASH_FUNC_COUNT);
 }
 
 //#define _DEBUG
@@ -239,9 +139,11 @@ extern "C" int scanhash_x11evo(int thr_id, struct work* work, uint32_t max_nonce
 		evo_twisted_code(ntime, hashOrder);
 		s_ntime = pdata[17];
 		if (opt_debug) {
+			char orderStr[HASH_FUNC_COUNT + 1];
 			int secs = (int) (ntime - INITIAL_DATE) % (60 * 60 * 24);
 			secs = (60 * 60 * 24) - secs;
-			applog(LOG_DEBUG, "evo hash order %s, next in %d mn", hashOrder, secs/60);
+			getAlgoString(orderStr, hashOrder);
+			applog(LOG_DEBUG, "evo hash order %s, next in %d mn", orderStr, secs/60);
 		}
 	}
 
@@ -286,7 +188,7 @@ extern "C" int scanhash_x11evo(int thr_id, struct work* work, uint32_t max_nonce
 	cuda_check_cpu_setTarget(ptarget);
 	quark_blake512_cpu_setBlock_80(thr_id, endiandata);
 
-	const int hashes = (int) strlen(hashOrder);
+	const int hashes = HASH_FUNC_COUNT;
 
 	do {
 		int order = 1;
@@ -298,8 +200,7 @@ extern "C" int scanhash_x11evo(int thr_id, struct work* work, uint32_t max_nonce
 
 		for (int i = 1; i < hashes; i++)
 		{
-			const char elem = hashOrder[i];
-			const uint8_t algo64 = elem >= 'A' ? elem - 'A' + 10 : elem - '0';
+			const uint8_t algo64 = hashOrder[i];
 
 			switch (algo64) {
 			case BLAKE:
@@ -1,25 +1,9 @@
 /*
  * X13 algorithm
  */
-extern "C"
-{
-#include "sph/sph_blake.h"
-#include "sph/sph_bmw.h"
-#include "sph/sph_groestl.h"
-#include "sph/sph_skein.h"
-#include "sph/sph_jh.h"
-#include "sph/sph_keccak.h"
-
-#include "sph/sph_luffa.h"
-#include "sph/sph_cubehash.h"
-#include "sph/sph_shavite.h"
-#include "sph/sph_simd.h"
-#include "sph/sph_echo.h"
-
-#include "sph/sph_hamsi.h"
-#include "sph/sph_fugue.h"
-}
+#include "sph/sph_chain.h"
 #include "miner.h"
+#include "algos.h"
 
 #include "cuda_helper.h"
 #include "x11/cuda_x11.h"
@@ -36,78 +20,7 @@ extern void x13_fugue512_cpu_free(int thr_id);
 // X13 CPU Hash
 extern "C" void x13hash(void *output, const void *input)
 {
-	// blake1-bmw2-grs3-skein4-jh5-keccak6-luffa7-cubehash8-shavite9-simd10-echo11-hamsi12-fugue13
-
-	sph_blake512_context ctx_blake;
-	sph_bmw512_context ctx_bmw;
-	sph_groestl512_context ctx_groestl;
-	sph_jh512_context ctx_jh;
-	sph_keccak512_context ctx_keccak;
-	sph_skein512_context ctx_skein;
-	sph_luffa512_context ctx_luffa;
-	sph_cubehash512_context ctx_cubehash;
-	sph_shavite512_context ctx_shavite;
-	sph_simd512_context ctx_simd;
-	sph_echo512_context ctx_echo;
-	sph_hamsi512_context ctx_hamsi;
-	sph_fugue512_context ctx_fugue;
-
-	uint32_t hash[32];
-	memset(hash, 0, sizeof hash);
-
-	sph_blake512_init(&ctx_blake);
-	sph_blake512 (&ctx_blake, input, 80);
-	sph_blake512_close(&ctx_blake, (void*) hash);
-
-	sph_bmw512_init(&ctx_bmw);
-	sph_bmw512 (&ctx_bmw, (const void*) hash, 64);
-	sph_bmw512_close(&ctx_bmw, (void*) hash);
-
-	sph_groestl512_init(&ctx_groestl);
-	sph_groestl512 (&ctx_groestl, (const void*) hash, 64);
-	sph_groestl512_close(&ctx_groestl, (void*) hash);
-
-	sph_skein512_init(&ctx_skein);
-	sph_skein512 (&ctx_skein, (const void*) hash, 64);
-	sph_skein512_close(&ctx_skein, (void*) hash);
-
-	sph_jh512_init(&ctx_jh);
-	sph_jh512 (&ctx_jh, (const void*) hash, 64);
-	sph_jh512_close(&ctx_jh, (void*) hash);
-
-	sph_keccak512_init(&ctx_keccak);
-	sph_keccak512 (&ctx_keccak, (const void*) hash, 64);
-	sph_keccak512_close(&ctx_keccak, (void*) hash);
-
-	sph_luffa512_init(&ctx_luffa);
-	sph_luffa512 (&ctx_luffa, (const void*) hash, 64);
-	sph_luffa512_close (&ctx_luffa, (void*) hash);
-
-	sph_cubehash512_init(&ctx_cubehash);
-	sph_cubehash512 (&ctx_cubehash, (const void*) hash, 64);
-	sph_cubehash512_close(&ctx_cubehash, (void*) hash);
-
-	sph_shavite512_init(&ctx_shavite);
-	sph_shavite512 (&ctx_shavite, (const void*) hash, 64);
-	sph_shavite512_close(&ctx_shavite, (void*) hash);
-
-	sph_simd512_init(&ctx_simd);
-	sph_simd512 (&ctx_simd, (const void*) hash, 64);
-	sph_simd512_close(&ctx_simd, (void*) hash);
-
-	sph_echo512_init(&ctx_echo);
-	sph_echo512 (&ctx_echo, (const void*) hash, 64);
-	sph_echo512_close(&ctx_echo, (void*) hash);
-
-	sph_hamsi512_init(&ctx_hamsi);
-	sph_hamsi512 (&ctx_hamsi, (const void*) hash, 64);
-	sph_hamsi512_close(&ctx_hamsi, (void*) hash);
-
-	sph_fugue512_init(&ctx_fugue);
-	sph_fugue512 (&ctx_fugue, (const void*) hash, 64);
-	sph_fugue512_close(&ctx_fugue, (void*) hash);
-
-	memcpy(output, hash, 32);
+	sph_chain<SPH_X11_STAGES, sph::hamsi512, sph::fugue512>::hash(output, input);
 }
 
 static bool init[MAX_GPUS] = { 0 };
@@ -188,9 +101,8 @@ extern "C" int scanhash_x13(int thr_id, struct work* work, uint32_t max_nonce, u
 		foundNonce = cuda_check_hash(thr_id, throughput, pdata[19], d_hash[thr_id]);
 		if (foundNonce != UINT32_MAX)
 		{
-			uint32_t vhash[8];
-			be32enc(&endiandata[19], foundNonce);
-			x13hash(vhash, endiandata);
+			uint32_t _ALIGN(64) vhash[8];
+			verify_batch(ALGO_X13, pdata, &foundNonce, 1, vhash);
 
 			if (vhash[7] <= ptarget[7] && fulltest(vhash, ptarget)) {
 				int res = 1;
@@ -198,8 +110,7 @@ extern "C" int scanhash_x13(int thr_id, struct work* work, uint32_t max_nonce, u
 				work_set_target_ratio(work, vhash);
 				pdata[19] = foundNonce;
 				if (secNonce != 0) {
-					be32enc(&endiandata[19], secNonce);
-					x13hash(vhash, endiandata);
+					verify_batch(ALGO_X13, pdata, &secNonce, 1, vhash);
 					pdata[21] = secNonce;
 					if (bn_hash_target_ratio(vhash, ptarget) > work->shareratio[0]) {
 						work_set_target_ratio(work, vhash);
@@ -3,26 +3,10 @@
  * Added in ccminer by Tanguy Pruvot - 2014
  */
 
-extern "C" {
-#include "sph/sph_blake.h"
-#include "sph/sph_bmw.h"
-#include "sph/sph_groestl.h"
-#include "sph/sph_skein.h"
-#include "sph/sph_jh.h"
-#include "sph/sph_keccak.h"
-
-#include "sph/sph_luffa.h"
-#include "sph/sph_cubehash.h"
-#include "sph/sph_shavite.h"
-#include "sph/sph_simd.h"
-#include "sph/sph_echo.h"
-
-#include "sph/sph_hamsi.h"
-#include "sph/sph_fugue.h"
-#include "sph/sph_shabal.h"
-}
+#include "sph/sph_chain.h"
 
 #include "miner.h"
+#include "algos.h"
 
 #include "cuda_helper.h"
 #include "x11/cuda_x11.h"
@@ -44,83 +28,7 @@ extern void x14_shabal512_cpu_hash_64(int thr_id, uint32_t threads, uint32_t sta
 // X14 CPU Hash function
 extern "C" void x14hash(void *output, const void *input)
 {
-	unsigned char hash[128]; // uint32_t hashA[16], hashB[16];
-	#define hashB hash+64
-
-	memset(hash, 0, sizeof hash);
-
-	sph_blake512_context ctx_blake;
-	sph_bmw512_context ctx_bmw;
-	sph_groestl512_context ctx_groestl;
-	sph_jh512_context ctx_jh;
-	sph_keccak512_context ctx_keccak;
-	sph_skein512_context ctx_skein;
-	sph_luffa512_context ctx_luffa;
-	sph_cubehash512_context ctx_cubehash;
-	sph_shavite512_context ctx_shavite;
-	sph_simd512_context ctx_simd;
-	sph_echo512_context ctx_echo;
-	sph_hamsi512_context ctx_hamsi;
-	sph_fugue512_context ctx_fugue;
-	sph_shabal512_context ctx_shabal;
-
-	sph_blake512_init(&ctx_blake);
-	sph_blake512(&ctx_blake, input, 80);
-	sph_blake512_close(&ctx_blake, hash);
-
-	sph_bmw512_init(&ctx_bmw);
-	sph_bmw512(&ctx_bmw, hash, 64);
-	sph_bmw512_close(&ctx_bmw, hashB);
-
-	sph_groestl512_init(&ctx_groestl);
-	sph_groestl512(&ctx_groestl, hashB, 64);
-	sph_groestl512_close(&ctx_groestl, hash);
-
-	sph_skein512_init(&ctx_skein);
-	sph_skein512(&ctx_skein, hash, 64);
-	sph_skein512_close(&ctx_skein, hashB);
-
-	sph_jh512_init(&ctx_jh);
-	sph_jh512(&ctx_jh, hashB, 64);
-	sph_jh512_close(&ctx_jh, hash);
-
-	sph_keccak512_init(&ctx_keccak);
-	sph_keccak512(&ctx_keccak, hash, 64);
-	sph_keccak512_close(&ctx_keccak, hashB);
-
-	sph_luffa512_init(&ctx_luffa);
-	sph_luffa512(&ctx_luffa, hashB, 64);
-	sph_luffa512_close(&ctx_luffa, hash);
-
-	sph_cubehash512_init(&ctx_cubehash);
-	sph_cubehash512(&ctx_cubehash, hash, 64);
-	sph_cubehash512_close(&ctx_cubehash, hashB);
-
-	sph_shavite512_init(&ctx_shavite);
-	sph_shavite512(&ctx_shavite, hashB, 64);
-	sph_shavite512_close(&ctx_shavite, hash);
-
-	sph_simd512_init(&ctx_simd);
-	sph_simd512(&ctx_simd, hash, 64);
-	sph_simd512_close(&ctx_simd, hashB);
-
-	sph_echo512_init(&ctx_echo);
-	sph_echo512(&ctx_echo, hashB, 64);
-	sph_echo512_close(&ctx_echo, hash);
-
-	sph_hamsi512_init(&ctx_hamsi);
-	sph_hamsi512(&ctx_hamsi, hash, 64);
-	sph_hamsi512_close(&ctx_hamsi, hashB);
-
-	sph_fugue512_init(&ctx_fugue);
-	sph_fugue512(&ctx_fugue, hashB, 64);
-	sph_fugue512_close(&ctx_fugue, hash);
-
-	sph_shabal512_init(&ctx_shabal);
-	sph_shabal512(&ctx_shabal, hash, 64);
-	sph_shabal512_close(&ctx_shabal, hash);
-
-	memcpy(output, hash, 32);
+	sph_chain<SPH_X11_STAGES, sph::hamsi512, sph::fugue512, sph::shabal512>::hash(output, input);
 }
 
 static bool init[MAX_GPUS] = { 0 };
@@ -203,18 +111,16 @@ extern "C" int scanhash_x14(int thr_id,  struct work* work, uint32_t max_nonce,
 		if (foundNonce != UINT32_MAX)
 		{
 			const uint32_t Htarg = ptarget[7];
-			uint32_t vhash64[8];
+			uint32_t _ALIGN(64) vhash64[8];
 			/* check now with the CPU to confirm */
-			be32enc(&endiandata[19], foundNonce);
-			x14hash(vhash64, endiandata);
+			verify_batch(ALGO_X14, pdata, &foundNonce, 1, vhash64);
 
 			if (vhash64[7] <= Htarg && fulltest(vhash64, ptarget)) {
 				int res = 1;
 				uint32_t secNonce = cuda_check_hash_suppl(thr_id, throughput, pdata[19], d_hash[thr_id], 1);
 				work_set_target_ratio(work, vhash64);
 				if (secNonce != 0) {
-					be32enc(&endiandata[19], secNonce);
-					x14hash(vhash64, endiandata);
+					verify_batch(ALGO_X14, pdata, &secNonce, 1, vhash64);
 					if (bn_hash_target_ratio(vhash64, ptarget) > work->shareratio[0])
 						work_set_target_ratio(work, vhash64);
 					pdata[21] = secNonce;
@@ -2,31 +2,10 @@
  * X17 algorithm (X15 + sha512 + haval256)
  */
 
-extern "C" {
-#include "sph/sph_blake.h"
-#include "sph/sph_bmw.h"
-#include "sph/sph_groestl.h"
-#include "sph/sph_skein.h"
-#include "sph/sph_jh.h"
-#include "sph/sph_keccak.h"
-
-#include "sph/sph_luffa.h"
-#include "sph/sph_cubehash.h"
-#include "sph/sph_shavite.h"
-#include "sph/sph_simd.h"
-#include "sph/sph_echo.h"
-
-#include "sph/sph_hamsi.h"
-#include "sph/sph_fugue.h"
-
-#include "sph/sph_shabal.h"
-#include "sph/sph_whirlpool.h"
-
-#include "sph/sph_sha2.h"
-#include "sph/sph_haval.h"
-}
+#include "sph/sph_chain.h"
 
 #include "miner.h"
+#include "algos.h"
 #include "cuda_helper.h"
 #include "x11/cuda_x11.h"
 
@@ -56,98 +35,9 @@ extern void x17_haval256_cpu_hash_64(int thr_id, uint32_t threads, uint32_t star
 // X17 CPU Hash (Validation)
 extern "C" void x17hash(void *output, const void *input)
 {
-	unsigned char _ALIGN(64) hash[128];
-
 	// x11 + hamsi12-fugue13-shabal14-whirlpool15-sha512-haval256
-
-	sph_blake512_context ctx_blake;
-	sph_bmw512_context ctx_bmw;
-	sph_groestl512_context ctx_groestl;
-	sph_jh512_context ctx_jh;
-	sph_keccak512_context ctx_keccak;
-	sph_skein512_context ctx_skein;
-	sph_luffa512_context ctx_luffa;
-	sph_cubehash512_context ctx_cubehash;
-	sph_shavite512_context ctx_shavite;
-	sph_simd512_context ctx_simd;
-	sph_echo512_context ctx_echo;
-	sph_hamsi512_context ctx_hamsi;
-	sph_fugue512_context ctx_fugue;
-	sph_shabal512_context ctx_shabal;
-	sph_whirlpool_context ctx_whirlpool;
-	sph_sha512_context ctx_sha512;
-	sph_haval256_5_context ctx_haval;
-
-
-	sph_blake512_init(&ctx_blake);
-	sph_blake512(&ctx_blake, input, 80);
-	sph_blake512_close(&ctx_blake, hash);
-
-	sph_bmw512_init(&ctx_bmw);
-	sph_bmw512(&ctx_bmw, (const void*) hash, 64);
-	sph_bmw512_close(&ctx_bmw, hash);
-
-	sph_groestl512_init(&ctx_groestl);
-	sph_groestl512(&ctx_groestl, (const void*) hash, 64);
-	sph_groestl512_close(&ctx_groestl, hash);
-
-	sph_skein512_init(&ctx_skein);
-	sph_skein512(&ctx_skein, (const void*) hash, 64);
-	sph_skein512_close(&ctx_skein, hash);
-
-	sph_jh512_init(&ctx_jh);
-	sph_jh512(&ctx_jh, (const void*) hash, 64);
-	sph_jh512_close(&ctx_jh, hash);
-
-	sph_keccak512_init(&ctx_keccak);
-	sph_keccak512(&ctx_keccak, (const void*) hash, 64);
-	sph_keccak512_close(&ctx_keccak, hash);
-
-	sph_luffa512_init(&ctx_luffa);
-	sph_luffa512(&ctx_luffa, (const void*) hash, 64);
-	sph_luffa512_close (&ctx_luffa, hash);
-
-	sph_cubehash512_init(&ctx_cubehash);
-	sph_cubehash512(&ctx_cubehash, (const void*) hash, 64);
-	sph_cubehash512_close(&ctx_cubehash, hash);
-
-	sph_shavite512_init(&ctx_shavite);
-	sph_shavite512(&ctx_shavite, (const void*) hash, 64);
-	sph_shavite512_close(&ctx_shavite, hash);
-
-	sph_simd512_init(&ctx_simd);
-	sph_simd512(&ctx_simd, (const void*) hash, 64);
-	sph_simd512_close(&ctx_simd, hash);
-
-	sph_echo512_init(&ctx_echo);
-	sph_echo512(&ctx_echo, (const void*) hash, 64);
-	sph_echo512_close(&ctx_echo, hash);
-
-	sph_hamsi512_init(&ctx_hamsi);
-	sph_hamsi512(&ctx_hamsi, (const void*) hash, 64);
-	sph_hamsi512_close(&ctx_hamsi, hash);
-
-	sph_fugue512_init(&ctx_fugue);
-	sph_fugue512(&ctx_fugue, (const void*) hash, 64);
-	sph_fugue512_close(&ctx_fugue, hash);
-
-	sph_shabal512_init(&ctx_shabal);
-	sph_shabal512(&ctx_shabal, (const void*) hash, 64);
-	sph_shabal512_close(&ctx_shabal, hash);
-
-	sph_whirlpool_init(&ctx_whirlpool);
-	sph_whirlpool (&ctx_whirlpool, (const void*) hash, 64);
-	sph_whirlpool_close(&ctx_whirlpool, hash);
-
-	sph_sha512_init(&ctx_sha512);
-	sph_sha512(&ctx_sha512,(const void*) hash, 64);
-	sph_sha512_close(&ctx_sha512,(void*) hash);
-
-	sph_haval256_5_init(&ctx_haval);
-	sph_haval256_5(&ctx_haval,(const void*) hash, 64);
-	sph_haval256_5_close(&ctx_haval,hash);
-
-	memcpy(output, hash, 32);
+	sph_chain<SPH_X11_STAGES, sph::hamsi512, sph::fugue512, sph::shabal512,
+		sph::whirlpool, sph::sha512, sph::haval256_5>::hash(output, input);
 }
 
 static bool init[MAX_GPUS] = { 0 };
@@ -235,16 +125,14 @@ extern "C" int scanhash_x17(int thr_id, struct work* work, uint32_t max_nonce, u
 		{
 			const uint32_t Htarg = ptarget[7];
 			uint32_t _ALIGN(64) vhash64[8];
-			be32enc(&endiandata[19], foundNonce);
-			x17hash(vhash64, endiandata);
+			verify_batch(ALGO_X17, pdata, &foundNonce, 1, vhash64);
 
 			if (vhash64[7] <= Htarg && fulltest(vhash64, ptarget)) {
 				int res = 1;
 				uint32_t secNonce = cuda_check_hash_suppl(thr_id, throughput, pdata[19], d_hash[thr_id], 1);
 				work_set_target_ratio(work, vhash64);
 				if (secNonce != 0) {
-					be32enc(&endiandata[19], secNonce);
-					x17hash(vhash64, endiandata);
+					verify_batch(ALGO_X17, pdata, &secNonce, 1, vhash64);
 					if (bn_hash_target_ratio(vhash64, ptarget) > work->shareratio[0])
 						work_set_target_ratio(work, vhash64);
 					pdata[21] = secNonce;